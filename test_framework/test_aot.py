@@ -0,0 +1,166 @@
+import os
+import tempfile
+import shutil
+import struct
+import re
+from subprocess import Popen, PIPE
+from nose.plugins.skip import Skip, SkipTest
+import ubpf.assembler
+import ubpf.aot
+import testdata
+VM_DIR = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "vm")
+CC = os.environ.get('CC', 'cc')
+
+# Mirrors the helpers registered by vm/test.c
+HELPERS = {
+    0: 'aot_gather_bytes',
+    1: 'aot_memfrob',
+    2: 'aot_trash_registers',
+    3: 'aot_sqrti',
+    4: 'aot_strcmp',
+    5: 'aot_unwind',
+    6: 'aot_array_map_lookup',
+}
+UNWIND = 5
+
+MAIN = """
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include "ubpf.h"
+
+uint64_t entry(void *mem, size_t mem_len);
+
+uint64_t aot_gather_bytes(uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e)
+{
+    return ((uint64_t)(uint8_t)a << 32) | ((uint32_t)(uint8_t)b << 24) |
+        ((uint32_t)(uint8_t)c << 16) | ((uint16_t)(uint8_t)d << 8) | (uint8_t)e;
+}
+uint64_t aot_memfrob(uint64_t a, uint64_t b) { return (uintptr_t)memfrob((void *)(uintptr_t)a, b); }
+uint64_t aot_trash_registers(void) { return 0; }
+uint64_t aot_sqrti(uint64_t x) { return (uint32_t)sqrt((uint32_t)x); }
+uint64_t aot_strcmp(uint64_t a, uint64_t b) { return strcmp((void *)(uintptr_t)a, (void *)(uintptr_t)b); }
+uint64_t aot_unwind(uint64_t i) { return i; }
+
+static uint64_t array_map_values[4] = { 0x11, 0x22, 0x33, 0x44 };
+uint64_t aot_array_map_lookup(uint64_t map, uint64_t key)
+{
+    uint32_t index = *(uint32_t *)(uintptr_t)key;
+    (void)map;
+    return index < 4 ? (uintptr_t)&array_map_values[index] : 0;
+}
+
+int main(int argc, char **argv)
+{
+    static char mem[1024*1024];
+    size_t mem_len = 0;
+    char *errmsg;
+
+    if (argc > 1) {
+        FILE *f = fopen(argv[1], "rb");
+        mem_len = fread(mem, 1, sizeof(mem), f);
+        fclose(f);
+    }
+
+    struct ubpf_vm *vm = ubpf_create();
+    if (ubpf_set_jitted(vm, entry) < 0) {
+        return 1;
+    }
+    ubpf_jit_fn fn = ubpf_compile(vm, &errmsg);
+    printf("0x%" PRIx64 "\\n", fn(mem_len ? mem : NULL, mem_len));
+    ubpf_destroy(vm);
+    return 0;
+}
+"""
+
+def check_datafile(filename):
+    """
+    Given assembly source code and an expected result, translate the eBPF
+    program to C, compile it and verify that the result matches.
+    """
+    data = testdata.read(filename)
+    if 'asm' not in data and 'raw' not in data:
+        raise SkipTest("no asm or raw section in datafile")
+    if 'result' not in data and 'error' not in data and 'error pattern' not in data:
+        raise SkipTest("no result or error section in datafile")
+    if not os.path.exists(os.path.join(VM_DIR, "libubpf.a")):
+        raise SkipTest("libubpf.a not found")
+    if 'no jit' in data:
+        raise SkipTest("JIT disabled for this testcase (%s)" % data['no jit'])
+    if 'no aot' in data:
+        raise SkipTest("AOT translation disabled for this testcase (%s)" % data['no aot'])
+    if 'options' in data:
+        raise SkipTest("testcase requires VM options")
+
+    if 'raw' in data:
+        code = b''.join(struct.pack("=Q", x) for x in data['raw'])
+    else:
+        code = ubpf.assembler.assemble(data['asm'])
+
+    try:
+        source = ubpf.aot.translate(code, helpers=HELPERS, unwind=UNWIND)
+    except ValueError as e:
+        stderr = "Failed to load code: %s" % e
+        if 'error' in data:
+            if data['error'] != stderr:
+                raise AssertionError("Expected error %r, got %r" % (data['error'], stderr))
+        elif 'error pattern' in data:
+            if not re.search(data['error pattern'], stderr):
+                raise AssertionError("Expected error matching %r, got %r" % (data['error pattern'], stderr))
+        else:
+            raise AssertionError("Unexpected error %r" % stderr)
+        return
+
+    tmpdir = tempfile.mkdtemp()
+    try:
+        with open(os.path.join(tmpdir, "prog.c"), "w") as f:
+            f.write(source)
+        with open(os.path.join(tmpdir, "main.c"), "w") as f:
+            f.write(MAIN)
+
+        binary = os.path.join(tmpdir, "prog")
+        cc = Popen([CC, "-O2", "-I", os.path.join(VM_DIR, "inc"),
+                    os.path.join(tmpdir, "prog.c"), os.path.join(tmpdir, "main.c"),
+                    os.path.join(VM_DIR, "libubpf.a"), "-lm", "-o", binary],
+                   stdout=PIPE, stderr=PIPE)
+        _, cc_stderr = cc.communicate()
+        if cc.returncode != 0:
+            raise AssertionError("Failed to compile translated code: %s" % cc_stderr.decode("utf-8"))
+
+        cmd = [binary]
+        if 'mem' in data:
+            with open(os.path.join(tmpdir, "mem"), "wb") as f:
+                f.write(data['mem'])
+            cmd.append(os.path.join(tmpdir, "mem"))
+
+        vm = Popen(cmd, stdout=PIPE, stderr=PIPE)
+        stdout, stderr = vm.communicate()
+        stdout = stdout.decode("utf-8")
+        stderr = stderr.decode("utf-8").strip()
+
+        if 'error' in data:
+            if data['error'] != stderr:
+                raise AssertionError("Expected error %r, got %r" % (data['error'], stderr))
+        elif 'error pattern' in data:
+            if not re.search(data['error pattern'], stderr):
+                raise AssertionError("Expected error matching %r, got %r" % (data['error pattern'], stderr))
+        else:
+            if stderr:
+                raise AssertionError("Unexpected error %r" % stderr)
+
+        if 'result' in data:
+            expected = int(data['result'], 0)
+            result = int(stdout, 0)
+            if expected != result:
+                raise AssertionError("Expected result 0x%x, got 0x%x, stderr=%r" % (expected, result, stderr))
+    finally:
+        shutil.rmtree(tmpdir)
+
+def test_datafiles():
+    # Nose test generator
+    # Creates a testcase for each datafile
+    for filename in testdata.list_files():
+        yield check_datafile, filename
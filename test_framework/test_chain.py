@@ -0,0 +1,111 @@
+import os
+import tempfile
+from subprocess import Popen, PIPE
+from nose.plugins.skip import Skip, SkipTest
+import ubpf.assembler
+import testdata
+VM = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "vm", "test")
+
+# Appends its number to a trace kept in the first 8 bytes of memory and returns the trace
+TRACE_ASM = """
+ldxdw r0, [r1]
+lsh r0, 4
+or r0, %d
+stxdw [r1], r0
+exit
+"""
+
+def datafile_stage(name):
+    data = testdata.read(name)
+    return (data['asm'], None, int(data['result'], 0))
+
+# Stages as (assembly, trace digit, result); the ones without a trace digit
+# ignore memory and always return their result
+STAGES = [
+    (TRACE_ASM % 1, 1, None),
+    datafile_stage("call-save.data"),
+    (TRACE_ASM % 2, 2, None),
+    datafile_stage("stack-slot-call.data"),
+    (TRACE_ASM % 3, 3, None),
+    ("lddw r0, 0x123456789\nexit", None, 0x123456789),
+    (TRACE_ASM % 4, 4, None),
+]
+
+POLICIES = [
+    "",
+    "0:*=drop",
+    "0:1=2,2:0x12=drop",
+    "0:1=4,4:0x13=6",
+    "1:*=5,5:0x123456789=drop",
+    "2:0x12=continue,2:*=drop,3:0x1239=6",
+    "5:0x123456789=6,5:*=drop",
+    "0:*=3,3:0x1239=drop",
+]
+
+def simulate(policy):
+    rules = {}
+    defaults = {}
+    for rule in filter(None, policy.split(",")):
+        stage, rest = rule.split(":")
+        value, action = rest.split("=")
+        if value == "*":
+            defaults[int(stage)] = action
+        else:
+            rules[(int(stage), int(value, 0))] = action
+
+    trace = 0
+    stage = 0
+    ret = 0
+    while stage < len(STAGES):
+        _, digit, ret = STAGES[stage]
+        if digit is not None:
+            trace = (trace << 4) | digit
+            ret = trace
+        action = rules.get((stage, ret), defaults.get(stage, "continue"))
+        if action == "continue":
+            stage += 1
+        elif action == "drop":
+            break
+        else:
+            stage = int(action)
+    return ret
+
+def write_temp(data):
+    f = tempfile.NamedTemporaryFile()
+    f.write(data)
+    f.flush()
+    return f
+
+def check_policy(policy, files, jit):
+    memfile = write_temp(b"\0" * 16)
+    try:
+        args = [VM, '-m', memfile.name, '-c', policy] + (['-j'] if jit else []) + [f.name for f in files]
+        vm = Popen(args, stdout=PIPE, stderr=PIPE)
+        stdout, stderr = vm.communicate()
+        if vm.returncode != 0:
+            raise AssertionError("VM exited with status %d, stderr=%r" % (vm.returncode, stderr.decode("utf-8")))
+        result = int(stdout.decode("utf-8"), 0)
+        expected = simulate(policy)
+        if result != expected:
+            raise AssertionError("Policy %r: expected 0x%x, got 0x%x" % (policy, expected, result))
+    finally:
+        memfile.close()
+
+def test_chain():
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    files = [write_temp(ubpf.assembler.assemble(asm)) for asm, _, _ in STAGES]
+    for policy in POLICIES:
+        for jit in [False, True]:
+            yield check_policy, policy, files, jit
+
+def test_chain_rejects_backward_goto():
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    prog = write_temp(ubpf.assembler.assemble("mov r0, 1\nexit"))
+    vm = Popen([VM, '-c', '1:1=0', prog.name, prog.name], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = vm.communicate()
+    stderr = stderr.decode("utf-8").strip()
+    expected = "Failed to set chain rule 1:1=0"
+    if vm.returncode == 0 or stderr != expected:
+        raise AssertionError("Expected error %r, got %r" % (expected, stderr))
@@ -0,0 +1,94 @@
+import os
+import glob
+import tempfile
+from subprocess import Popen, PIPE
+from nose.plugins.skip import Skip, SkipTest
+import ubpf.assembler
+import testdata
+VM = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "vm", "test")
+FILTER_DIR = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "tests", "fuse")
+PACKET_FILTER_DIR = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "tests", "fuse-packet")
+
+# Datafiles whose memory is used as packets
+PACKETS = [
+    "tcp-port-80/match.data",
+    "tcp-port-80/nomatch.data",
+    "tcp-port-80/nomatch-ethertype.data",
+    "tcp-port-80/nomatch-proto.data",
+    "tcp-sack/match.data",
+]
+
+def write_temp(data):
+    f = tempfile.NamedTemporaryFile()
+    f.write(data)
+    f.flush()
+    return f
+
+def run_vm(args):
+    vm = Popen([VM] + args, stdout=PIPE, stderr=PIPE)
+    stdout, stderr = vm.communicate()
+    if vm.returncode != 0:
+        raise AssertionError("VM exited with status %d, stderr=%r" % (vm.returncode, stderr.decode("utf-8")))
+    return int(stdout.decode("utf-8"), 0)
+
+def check_packet(packet, filters, jit, packet_access=False):
+    """
+    Check that the fused filters agree with running each filter on its own.
+    """
+    memfile = write_temp(testdata.read(packet)['mem'])
+    try:
+        mode = ['-p', '0'] if packet_access else []
+        results = [run_vm(mode + ['-m', memfile.name, f.name]) for f in filters]
+        names = [f.name for f in filters]
+        options = mode + ['-m', memfile.name] + (['-j'] if jit else [])
+
+        expected = sum(1 << i for i, r in enumerate(results) if r)
+        result = run_vm(['-f', 'bitmask'] + options + names)
+        if result != expected:
+            raise AssertionError("Expected bitmask 0x%x, got 0x%x" % (expected, result))
+
+        expected = next((i + 1 for i, r in enumerate(results) if r), 0)
+        result = run_vm(['-f', 'first'] + options + names)
+        if result != expected:
+            raise AssertionError("Expected first match %d, got %d" % (expected, result))
+    finally:
+        memfile.close()
+
+def assemble_filters(directory):
+    filters = []
+    for filename in sorted(glob.glob(os.path.join(directory, "*.asm"))):
+        with open(filename) as f:
+            filters.append(write_temp(ubpf.assembler.assemble(f.read())))
+    return filters
+
+def test_fuse():
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    filters = assemble_filters(FILTER_DIR)
+    for packet in PACKETS:
+        for jit in [False, True]:
+            yield check_packet, packet, filters, jit
+
+def test_fuse_packet_access():
+    """
+    Filters using direct packet access share the bounds check in their
+    common prefix, which the loader must verify again after fusion.
+    """
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    filters = assemble_filters(PACKET_FILTER_DIR)
+    for packet in PACKETS:
+        for jit in [False, True]:
+            yield check_packet, packet, filters, jit, True
+
+def test_fuse_rejects_helper_call():
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    pure = write_temp(ubpf.assembler.assemble("mov r0, 1\nexit"))
+    call = write_temp(ubpf.assembler.assemble("call 0\nexit"))
+    vm = Popen([VM, '-f', 'bitmask', pure.name, call.name], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = vm.communicate()
+    stderr = stderr.decode("utf-8").strip()
+    expected = "Failed to fuse programs: program 1 calls a helper at PC 0"
+    if vm.returncode == 0 or stderr != expected:
+        raise AssertionError("Expected error %r, got %r" % (expected, stderr))
@@ -0,0 +1,48 @@
+import os
+import re
+import tempfile
+from subprocess import Popen, PIPE
+from nose.plugins.skip import Skip, SkipTest
+import ubpf.assembler
+VM = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "vm", "test")
+
+# Calls sqrti three times from PC 3 and memfrob on nothing from PC 9
+HELPERS_ASM = """
+mov r6, 3
+mov r7, 0
+mov r1, 16
+call 3
+add r7, r0
+sub r6, 1
+jne r6, 0, -5
+mov r1, r10
+mov r2, 0
+call 1
+mov r0, r7
+exit
+"""
+
+def check_helper_profile(args):
+    prog = tempfile.NamedTemporaryFile()
+    prog.write(ubpf.assembler.assemble(HELPERS_ASM))
+    prog.flush()
+    vm = Popen([VM, '-H'] + args + [prog.name], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = vm.communicate()
+    stderr = stderr.decode("utf-8")
+    if vm.returncode != 0 and stderr.strip() == "Helper profiling is not built in":
+        raise SkipTest("vm/test not built with HELPER_PROFILE=1")
+    if vm.returncode != 0 and stderr.strip() == "JIT tier llvm is not available":
+        raise SkipTest("VM built without LLVM")
+    if vm.returncode != 0:
+        raise AssertionError("VM exited with status %d, stderr=%r" % (vm.returncode, stderr))
+
+    calls = re.findall(r"^(helper \d+|call at PC \d+): calls (\d+), cycles \d+$", stderr, re.M)
+    expected = [("helper 1", "1"), ("helper 3", "3"), ("call at PC 3", "3"), ("call at PC 9", "1")]
+    if calls != expected:
+        raise AssertionError("Expected %r, got %r" % (expected, calls))
+
+def test_helper_profile():
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    for args in [[], ['-j'], ['-j', '-t', 'llvm']]:
+        yield check_helper_profile, args
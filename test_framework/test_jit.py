@@ -47,6 +47,8 @@ def check_datafile(filename):
     try:
         for register_offset in xrange(0, num_register_offsets):
             cmd = [VM]
+            if 'options' in data:
+                cmd.extend(data['options'].split())
             if memfile:
                 cmd.extend(['-m', memfile.name])
             cmd.extend(['-j', '-r', str(register_offset), '-'])
@@ -0,0 +1,40 @@
+import os
+import tempfile
+from subprocess import Popen, PIPE
+from nose.plugins.skip import Skip, SkipTest
+import ubpf.assembler
+VM = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "vm", "test")
+
+# Divisions translate to more code than the JIT's first size estimate allows
+NUM_PAIRS = 50000
+LARGE_ASM = "mov r0, 0\nmov r2, 1\n" + "add r0, 1\ndiv r0, r2\n" * NUM_PAIRS + "exit\n"
+
+def run_vm(args):
+    prog = tempfile.NamedTemporaryFile()
+    prog.write(ubpf.assembler.assemble(LARGE_ASM))
+    prog.flush()
+    vm = Popen([VM] + args + [prog.name], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = vm.communicate()
+    return vm.returncode, stdout.decode("utf-8"), stderr.decode("utf-8")
+
+def check_result(args):
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    rc, stdout, stderr = run_vm(['-I', '200000'] + args)
+    if rc != 0:
+        raise AssertionError("VM exited with status %d, stderr=%r" % (rc, stderr))
+    if int(stdout, 0) != NUM_PAIRS:
+        raise AssertionError("Expected %d, got %r" % (NUM_PAIRS, stdout))
+
+def test_large_program():
+    check_result([])
+
+def test_large_program_jit():
+    check_result(['-j'])
+
+def test_default_limit():
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    rc, stdout, stderr = run_vm([])
+    if rc == 0 or stderr.strip() != "Failed to load code: too many instructions (max 65536)":
+        raise AssertionError("Expected the default limit, got %r" % stderr)
@@ -0,0 +1,56 @@
+import os
+import tempfile
+from subprocess import Popen, PIPE
+from nose.plugins.skip import Skip, SkipTest
+import ubpf.assembler
+import ubpf.disassembler
+VM = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "vm", "test")
+
+# Spends nearly all of its time in the loop at PCs 4 to 7
+HOT_LOOP_ASM = """
+mov r0, 0
+lddw r2, 0x100000000
+mov r1, 100000000
+add r0, r1
+mul r0, 3
+sub r1, 1
+jne r1, 0, -4
+add r0, r2
+exit
+"""
+
+def test_annotate():
+    program = ubpf.assembler.assemble(HOT_LOOP_ASM)
+    result = ubpf.disassembler.annotate(program, {5: 3, 6: 1})
+    expected = """\
+                    0: mov r0, 0x0
+                    1: lddw r2, 0x100000000
+                    3: mov r1, 0x5f5e100
+                    4: add r0, r1
+       3  75.0%     5: mul r0, 0x3
+       1  25.0%     6: sub r1, 0x1
+                    7: jne r1, 0x0, -4
+                    8: add r0, r2
+                    9: exit
+"""
+    if result != expected:
+        raise AssertionError("Expected %r, got %r" % (expected, result))
+
+def test_profile_jit():
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    prog = tempfile.NamedTemporaryFile()
+    prog.write(ubpf.assembler.assemble(HOT_LOOP_ASM))
+    prog.flush()
+    profile = tempfile.NamedTemporaryFile(mode='r')
+    vm = Popen([VM, '-j', '-P', profile.name, prog.name], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = vm.communicate()
+    if vm.returncode != 0:
+        raise AssertionError("VM exited with status %d, stderr=%r" % (vm.returncode, stderr.decode("utf-8")))
+
+    samples = dict(tuple(int(x) for x in line.split()) for line in profile)
+    if not samples:
+        raise AssertionError("No samples taken")
+    outside = [pc for pc in samples if not 4 <= pc <= 7]
+    if sum(samples[pc] for pc in outside) * 10 > sum(samples.values()):
+        raise AssertionError("Most samples outside the loop: %r" % samples)
@@ -0,0 +1,44 @@
+import os
+import tempfile
+from subprocess import Popen, PIPE
+from nose.plugins.skip import Skip, SkipTest
+import ubpf.assembler
+VM = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "vm", "test")
+
+# Stores through a wild pointer and loads it back, then reads the memory
+WILD_ASM = """
+lddw r2, 0x7fff12345678
+mov r0, 42
+stxdw [r2], r0
+ldxdw r0, [r2]
+ldxb r3, [r1]
+add r0, r3
+exit
+"""
+
+def run_vm(args):
+    prog = tempfile.NamedTemporaryFile()
+    prog.write(ubpf.assembler.assemble(WILD_ASM))
+    prog.flush()
+    mem = tempfile.NamedTemporaryFile()
+    mem.write(b"\x01" + b"\x00" * 15)
+    mem.flush()
+    vm = Popen([VM, '-m', mem.name] + args + [prog.name], stdout=PIPE, stderr=PIPE)
+    stdout, stderr = vm.communicate()
+    return vm.returncode, stdout.decode("utf-8"), stderr.decode("utf-8")
+
+def test_wild_store_is_confined():
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    rc, stdout, stderr = run_vm(['-j', '-W', '65536'])
+    if rc != 0:
+        raise AssertionError("VM exited with status %d, stderr=%r" % (rc, stderr))
+    if int(stdout, 0) != 43:
+        raise AssertionError("Expected 43, got %r" % stdout)
+
+def test_invalid_window():
+    if not os.path.exists(VM):
+        raise SkipTest("VM not found")
+    rc, stdout, stderr = run_vm(['-j', '-W', '100000'])
+    if rc == 0 or stderr.strip() != "Invalid sandbox window size 100000":
+        raise AssertionError("Expected an invalid window error, got %r" % stderr)
@@ -29,6 +29,8 @@ def check_datafile(filename):
     memfile = None
 
     cmd = [VM]
+    if 'options' in data:
+        cmd.extend(data['options'].split())
     if 'mem' in data:
         memfile = tempfile.NamedTemporaryFile()
         memfile.write(data['mem'])
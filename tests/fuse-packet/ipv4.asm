@@ -0,0 +1,11 @@
+# EtherType is IPv4, with direct packet access
+ldxdw r2, [r1+0]
+ldxdw r3, [r1+8]
+mov r4, r2
+add r4, 34
+mov r0, 0x0
+jgt r4, r3, +3
+ldxh r5, [r2+12]
+jne r5, 0x8, +1
+mov r0, 0x1
+exit
@@ -0,0 +1,13 @@
+# IPv4 TTL 64, with direct packet access
+ldxdw r2, [r1+0]
+ldxdw r3, [r1+8]
+mov r4, r2
+add r4, 34
+mov r0, 0x0
+jgt r4, r3, +5
+ldxh r5, [r2+12]
+jne r5, 0x8, +3
+ldxb r5, [r2+22]
+jne r5, 0x40, +1
+mov r0, 0x1
+exit
@@ -0,0 +1,11 @@
+# IPv4 destination 192.168.0.2
+ldxb r2, [r1+12]
+ldxb r3, [r1+13]
+lsh r3, 0x8
+or r3, r2
+mov r0, 0x0
+jne r3, 0x8, +3
+ldxw r2, [r1+30]
+jne r2, 0x0200a8c0, +1
+mov r0, 0x1
+exit
@@ -0,0 +1,20 @@
+# TCP source port 10000, keeping the header offset on the stack
+ldxb r2, [r1+12]
+ldxb r3, [r1+13]
+lsh r3, 0x8
+or r3, r2
+mov r0, 0x0
+jne r3, 0x8, +12
+ldxb r2, [r1+23]
+jne r2, 0x6, +10
+ldxb r2, [r1+14]
+and r2, 0xf
+lsh r2, 0x2
+add r2, 0xe
+stxdw [r10-8], r2
+ldxdw r4, [r10-8]
+add r1, r4
+ldxh r2, [r1]
+jne r2, 0x1027, +1
+mov r0, 0x1
+exit
@@ -0,0 +1,11 @@
+# IPv4 and TCP
+ldxb r2, [r1+12]
+ldxb r3, [r1+13]
+lsh r3, 0x8
+or r3, r2
+mov r0, 0x0
+jne r3, 0x8, +3
+ldxb r2, [r1+23]
+jne r2, 0x6, +1
+mov r0, 0x1
+exit
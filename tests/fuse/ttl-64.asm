@@ -0,0 +1,12 @@
+# IPv4 TTL of at least 64
+ldxb r2, [r1+12]
+ldxb r3, [r1+13]
+lsh r3, 0x8
+or r3, r2
+mov r0, 0x0
+jne r3, 0x8, +2
+ldxb r2, [r1+22]
+jgt r2, 0x3f, +1
+exit
+mov r0, 0x1
+exit
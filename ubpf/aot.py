@@ -0,0 +1,380 @@
+"""
+Ahead-of-time translation of eBPF bytecode to C
+
+The generated function has the same signature as a jitted program
+(uint64_t fn(void *mem, size_t mem_len)) and follows the semantics of the
+x86-64 JIT: immediates are sign-extended, shift counts are masked to the
+operand width and division by zero prints an error and returns
+UINT64_MAX.
+"""
+
+import struct
+try:
+    from StringIO import StringIO as io
+except ImportError:
+    from io import StringIO as io
+
+Inst = struct.Struct("<BBhi")
+
+STACK_SIZE = 512
+MAX_EXT_FUNCS = 64
+
+CLS_LD = 0
+CLS_LDX = 1
+CLS_ST = 2
+CLS_STX = 3
+CLS_ALU = 4
+CLS_JMP = 5
+CLS_JMP32 = 6
+CLS_ALU64 = 7
+
+OP_LDDW = 0x18
+OP_LE = 0xd4
+OP_BE = 0xdc
+OP_BSWAP = 0xd7
+OP_JA = 0x05
+OP_JA32 = 0x06
+OP_CALL = 0x85
+OP_EXIT = 0x95
+
+MODE_MEM = 0x60
+MODE_MEMSX = 0x80
+
+OFFSET_SDIV = 1
+
+ALU_OPS = {
+    0: '+',
+    1: '-',
+    2: '*',
+    3: '/',
+    4: '|',
+    5: '&',
+    6: '<<',
+    7: '>>',
+    8: 'neg',
+    9: '%',
+    10: '^',
+    11: 'mov',
+    12: 'arsh',
+}
+
+JMP_OPS = {
+    1: ('==', False),
+    2: ('>', False),
+    3: ('>=', False),
+    4: ('&', False),
+    5: ('!=', False),
+    6: ('>', True),
+    7: ('>=', True),
+    10: ('<', False),
+    11: ('<=', False),
+    12: ('<', True),
+    13: ('<=', True),
+}
+
+MEM_SIZES = {
+    0: 32,
+    1: 16,
+    2: 8,
+    3: 64,
+}
+
+PRELUDE = """\
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+static inline uint64_t load8(uint64_t addr) { uint8_t v; memcpy(&v, (void *)(uintptr_t)addr, sizeof(v)); return v; }
+static inline uint64_t load16(uint64_t addr) { uint16_t v; memcpy(&v, (void *)(uintptr_t)addr, sizeof(v)); return v; }
+static inline uint64_t load32(uint64_t addr) { uint32_t v; memcpy(&v, (void *)(uintptr_t)addr, sizeof(v)); return v; }
+static inline uint64_t load64(uint64_t addr) { uint64_t v; memcpy(&v, (void *)(uintptr_t)addr, sizeof(v)); return v; }
+static inline void store8(uint64_t addr, uint64_t x) { uint8_t v = x; memcpy((void *)(uintptr_t)addr, &v, sizeof(v)); }
+static inline void store16(uint64_t addr, uint64_t x) { uint16_t v = x; memcpy((void *)(uintptr_t)addr, &v, sizeof(v)); }
+static inline void store32(uint64_t addr, uint64_t x) { uint32_t v = x; memcpy((void *)(uintptr_t)addr, &v, sizeof(v)); }
+static inline void store64(uint64_t addr, uint64_t x) { uint64_t v = x; memcpy((void *)(uintptr_t)addr, &v, sizeof(v)); }
+
+/* Convert between host order and a fixed byte order without relying on endian.h */
+static inline uint64_t
+to_order(uint64_t x, int bits, int big)
+{
+    uint8_t b[8];
+    int i, n = bits / 8;
+    for (i = 0; i < n; i++) {
+        b[big ? n - 1 - i : i] = x >> (8 * i);
+    }
+    if (n == 2) { uint16_t v; memcpy(&v, b, 2); return v; }
+    if (n == 4) { uint32_t v; memcpy(&v, b, 4); return v; }
+    { uint64_t v; memcpy(&v, b, 8); return v; }
+}
+
+static inline uint64_t
+swap_bytes(uint64_t x, int bits)
+{
+    uint64_t v = 0;
+    int i;
+    for (i = 0; i < bits / 8; i++) {
+        v = (v << 8) | ((x >> (8 * i)) & 0xff);
+    }
+    return v;
+}
+
+/* Signed division by a nonzero divisor, wrapping on INT64_MIN / -1 */
+static inline uint64_t sdiv64(int64_t a, int64_t b) { return b == -1 ? -(uint64_t)a : (uint64_t)(a / b); }
+static inline uint64_t smod64(int64_t a, int64_t b) { return b == -1 ? 0 : (uint64_t)(a % b); }
+
+static uint64_t
+div_by_zero(unsigned int pc)
+{
+    fprintf(stderr, "uBPF error: division by zero at PC %u\\n", pc);
+    return UINT64_MAX;
+}
+"""
+
+def u64(x):
+    return "UINT64_C(%#x)" % (x & 0xffffffffffffffff)
+
+def u32(x):
+    return "UINT32_C(%#x)" % (x & 0xffffffff)
+
+def R(reg):
+    return "r%d" % reg
+
+def addr(reg, off):
+    if off < 0:
+        return "%s - %d" % (R(reg), -off)
+    elif off > 0:
+        return "%s + %d" % (R(reg), off)
+    else:
+        return R(reg)
+
+def decode(data):
+    if len(data) % 8 != 0:
+        raise ValueError("code length must be a multiple of 8")
+    return [Inst.unpack_from(data, i) for i in range(0, len(data), 8)]
+
+def is_jump(opcode):
+    return (opcode & 7) in (CLS_JMP, CLS_JMP32) and opcode not in (OP_CALL, OP_EXIT)
+
+def jump_offset(opcode, off, imm):
+    return imm if opcode == OP_JA32 else off
+
+def validate(insts, helpers):
+    """
+    Reject programs that ubpf_load would reject, with the same messages.
+    """
+    if len(insts) >= 65536:
+        raise ValueError("too many instructions (max 65536)")
+
+    i = 0
+    while i < len(insts):
+        opcode, regs, off, imm = insts[i]
+        dst, src = regs & 0xf, regs >> 4
+        cls = opcode & 7
+        store = cls in (CLS_ST, CLS_STX)
+
+        if cls in (CLS_ALU, CLS_ALU64):
+            op = opcode >> 4
+            if op == 13:
+                if opcode not in (OP_LE, OP_BE, OP_BSWAP):
+                    raise ValueError("unknown opcode %#04x at PC %d" % (opcode, i))
+                if imm not in (16, 32, 64):
+                    raise ValueError("invalid endian immediate at PC %d" % i)
+            elif op not in ALU_OPS or (op == 8 and opcode & 8):
+                raise ValueError("unknown opcode %#04x at PC %d" % (opcode, i))
+            elif op in (3, 9) and not opcode & 8 and imm == 0:
+                raise ValueError("division by zero at PC %d" % i)
+            elif op in (3, 9) and off not in (0, OFFSET_SDIV):
+                raise ValueError("invalid division offset at PC %d" % i)
+            elif op == 11 and opcode & 8 and off not in (0, 8, 16) and \
+                    not (off == 32 and cls == CLS_ALU64):
+                raise ValueError("invalid movsx offset at PC %d" % i)
+        elif cls in (CLS_LDX, CLS_ST, CLS_STX):
+            sx = cls == CLS_LDX and opcode & 0xe0 == MODE_MEMSX and opcode & 0x18 != 0x18
+            if opcode & 0xe0 != MODE_MEM and not sx:
+                raise ValueError("unknown opcode %#04x at PC %d" % (opcode, i))
+        elif opcode == OP_LDDW:
+            if i + 1 >= len(insts) or insts[i+1][0] != 0:
+                raise ValueError("incomplete lddw at PC %d" % i)
+            i += 1
+        elif opcode == OP_CALL:
+            if imm < 0 or imm >= MAX_EXT_FUNCS:
+                raise ValueError("invalid call immediate at PC %d" % i)
+            if imm not in helpers:
+                raise ValueError("call to nonexistent function %u at PC %d" % (imm, i))
+        elif opcode == OP_EXIT:
+            pass
+        elif opcode in (OP_JA, OP_JA32) or (cls in (CLS_JMP, CLS_JMP32) and (opcode >> 4) in JMP_OPS):
+            if jump_offset(opcode, off, imm) == -1:
+                raise ValueError("infinite loop at PC %d" % i)
+            target = i + 1 + jump_offset(opcode, off, imm)
+            if target < 0 or target >= len(insts):
+                raise ValueError("jump out of bounds at PC %d" % i)
+            elif insts[target][0] == 0:
+                raise ValueError("jump to middle of lddw at PC %d" % i)
+        else:
+            raise ValueError("unknown opcode %#04x at PC %d" % (opcode, i))
+
+        if src > 10:
+            raise ValueError("invalid source register at PC %d" % i)
+        if dst > 9 and not (store and dst == 10):
+            raise ValueError("invalid destination register at PC %d" % i)
+
+        i += 1
+
+def translate_alu(pc, opcode, dst, src, off, imm):
+    is64 = (opcode & 7) == CLS_ALU64
+    d = R(dst)
+
+    if opcode == OP_LE or opcode == OP_BE:
+        return "%s = to_order(%s, %d, %d);" % (d, d, imm, opcode == OP_BE)
+    elif opcode == OP_BSWAP:
+        return "%s = swap_bytes(%s, %d);" % (d, d, imm)
+
+    op = ALU_OPS[opcode >> 4]
+    signed = op in ('/', '%') and off == OFFSET_SDIV
+    sfn = op == '/' and "sdiv64" or "smod64"
+
+    if is64:
+        x = R(src) if opcode & 8 else u64(imm)
+        shift = "(%s & 63)" % x if opcode & 8 else "%d" % (imm & 63)
+        if op == 'neg':
+            return "%s = -%s;" % (d, d)
+        elif op == 'mov' and opcode & 8 and off:
+            return "%s = (uint64_t)(int%d_t)%s;" % (d, off, x)
+        elif op == 'mov':
+            return "%s = %s;" % (d, x)
+        elif signed and opcode & 8:
+            return "if (%s == 0) return div_by_zero(%d);\n    %s = %s(%s, %s);" % (x, pc, d, sfn, d, x)
+        elif signed:
+            return "%s = %s(%s, %d);" % (d, sfn, d, imm)
+        elif op in ('<<', '>>'):
+            return "%s = %s %s %s;" % (d, d, op, shift)
+        elif op == 'arsh':
+            return "%s = (uint64_t)((int64_t)%s >> %s);" % (d, d, shift)
+        elif op in ('/', '%') and opcode & 8:
+            return "if (%s == 0) return div_by_zero(%d);\n    %s = %s %s %s;" % (x, pc, d, d, op, x)
+        else:
+            return "%s = %s %s %s;" % (d, d, op, x)
+    else:
+        x = "(uint32_t)%s" % R(src) if opcode & 8 else u32(imm)
+        d32 = "(uint32_t)%s" % d
+        shift = "(%s & 31)" % x if opcode & 8 else "%d" % (imm & 31)
+        if op == 'neg':
+            return "%s = (uint32_t)-%s;" % (d, d32)
+        elif op == 'mov' and opcode & 8 and off:
+            return "%s = (uint32_t)(int%d_t)%s;" % (d, off, R(src))
+        elif op == 'mov':
+            return "%s = %s;" % (d, x)
+        elif signed and opcode & 8:
+            return "if (%s == 0) return div_by_zero(%d);\n    %s = (uint32_t)%s((int32_t)%s, (int32_t)%s);" % (x, pc, d, sfn, d32, x)
+        elif signed:
+            return "%s = (uint32_t)%s((int32_t)%s, %d);" % (d, sfn, d32, imm)
+        elif op in ('<<', '>>'):
+            return "%s = (uint32_t)(%s %s %s);" % (d, d32, op, shift)
+        elif op == 'arsh':
+            return "%s = (uint32_t)((int32_t)%s >> %s);" % (d, d32, shift)
+        elif op in ('/', '%') and opcode & 8:
+            return "if (%s == 0) return div_by_zero(%d);\n    %s = %s %s %s;" % (x, pc, d, d32, op, x)
+        else:
+            return "%s = (uint32_t)(%s %s %s);" % (d, d32, op, x)
+
+def translate_one(insts, pc, helpers, unwind):
+    opcode, regs, off, imm = insts[pc]
+    dst, src = regs & 0xf, regs >> 4
+    cls = opcode & 7
+
+    if cls in (CLS_ALU, CLS_ALU64):
+        return translate_alu(pc, opcode, dst, src, off, imm)
+    elif cls == CLS_LDX and opcode & 0xe0 == MODE_MEMSX:
+        size = MEM_SIZES[(opcode >> 3) & 3]
+        return "%s = (uint64_t)(int%d_t)load%d(%s);" % (R(dst), size, size, addr(src, off))
+    elif cls == CLS_LDX:
+        return "%s = load%d(%s);" % (R(dst), MEM_SIZES[(opcode >> 3) & 3], addr(src, off))
+    elif cls == CLS_ST:
+        return "store%d(%s, %s);" % (MEM_SIZES[(opcode >> 3) & 3], addr(dst, off), u64(imm))
+    elif cls == CLS_STX:
+        return "store%d(%s, %s);" % (MEM_SIZES[(opcode >> 3) & 3], addr(dst, off), R(src))
+    elif opcode == OP_LDDW:
+        value = (imm & 0xffffffff) | ((insts[pc+1][3] & 0xffffffff) << 32)
+        return "%s = %s;" % (R(dst), u64(value))
+    elif opcode == OP_JA:
+        return "goto pc_%d;" % (pc + 1 + off)
+    elif opcode == OP_JA32:
+        return "goto pc_%d;" % (pc + 1 + imm)
+    elif opcode == OP_EXIT:
+        return "return r0;"
+    elif opcode == OP_CALL:
+        s = "r0 = %s(r1, r2, r3, r4, r5);" % helpers[imm]
+        if imm == unwind:
+            s += "\n    if (r0 == 0) return r0;"
+        return s
+    else:
+        op, signed = JMP_OPS[opcode >> 4]
+        d = R(dst)
+        x = R(src) if opcode & 8 else u64(imm)
+        if cls == CLS_JMP32:
+            d, x = "(uint32_t)" + d, "(uint32_t)" + x
+        bits = 32 if cls == CLS_JMP32 else 64
+        if op == '&':
+            cond = "%s & %s" % (d, x)
+        elif signed:
+            cond = "(int%d_t)%s %s (int%d_t)%s" % (bits, d, op, bits, x)
+        else:
+            cond = "%s %s %s" % (d, op, x)
+        return "if (%s) goto pc_%d;" % (cond, pc + 1 + off)
+
+def translate(data, name="entry", helpers=None, unwind=None):
+    """
+    Translate raw eBPF bytecode to a C function called 'name'.
+
+    'helpers' maps call immediates to the C symbols implementing them. Each
+    symbol must have the signature
+    uint64_t fn(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t).
+    'unwind' is the index of the helper with unwind-on-success semantics,
+    as set by ubpf_set_unwind_function_index.
+    """
+    helpers = helpers or {}
+    insts = decode(data)
+    validate(insts, helpers)
+
+    targets = set()
+    used = set([0])
+    pc = 0
+    while pc < len(insts):
+        opcode, regs, off, imm = insts[pc]
+        if is_jump(opcode):
+            targets.add(pc + 1 + jump_offset(opcode, off, imm))
+        if opcode == OP_CALL:
+            used.update(range(6))
+        used.update([regs & 0xf, regs >> 4])
+        pc += 2 if opcode == OP_LDDW else 1
+
+    output = io()
+    output.write("/* Generated by ubpf-aot */\n")
+    output.write(PRELUDE)
+    output.write("\n")
+    for symbol in sorted(set(helpers[inst[3]] for inst in insts if inst[0] == OP_CALL)):
+        output.write("uint64_t %s(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);\n" % symbol)
+    output.write("uint64_t %s(void *mem, size_t mem_len);\n\n" % name)
+
+    output.write("uint64_t\n%s(void *mem, size_t mem_len)\n{\n" % name)
+    output.write("    uint64_t %s;\n" % ", ".join("r%d = 0" % r for r in sorted(used) if r != 10))
+    if 10 in used:
+        output.write("    uint64_t stack[%d];\n" % ((STACK_SIZE + 7) // 8))
+        output.write("    uint64_t r10 = (uintptr_t)stack + sizeof(stack);\n")
+    output.write("\n")
+    output.write("    r1 = (uintptr_t)mem;\n" if 1 in used else "    (void)mem;\n")
+    output.write("    r2 = mem_len;\n" if 2 in used else "    (void)mem_len;\n")
+
+    pc = 0
+    while pc < len(insts):
+        if pc in targets:
+            output.write("pc_%d:\n" % pc)
+        output.write("    %s\n" % translate_one(insts, pc, helpers, unwind))
+        pc += 2 if insts[pc][0] == OP_LDDW else 1
+
+    if insts and insts[-1][0] not in (OP_EXIT, OP_JA, OP_JA32):
+        output.write("    return r0;\n")
+    output.write("}\n")
+    return output.getvalue()
@@ -20,19 +20,23 @@ imm = (-CharIn("+-") + Exact(hexnum | decnum))[flatten]["".join][lambda x: int(x
 reg = Literal('r') + integer[int][Reg]
 memref = (Literal('[') + reg + Optional(offset, 0) + Literal(']'))[lambda x: MemRef(*x)]
 
-unary_alu_ops = ['neg', 'neg32', 'le16', 'le32', 'le64', 'be16', 'be32', 'be64']
-binary_alu_ops = ['add', 'sub', 'mul', 'div', 'or', 'and', 'lsh', 'rsh',
-                  'mod', 'xor', 'mov', 'arsh']
+unary_alu_ops = ['neg', 'neg32', 'le16', 'le32', 'le64', 'be16', 'be32', 'be64',
+                 'bswap16', 'bswap32', 'bswap64']
+binary_alu_ops = ['add', 'sub', 'mul', 'div', 'sdiv', 'or', 'and', 'lsh', 'rsh',
+                  'mod', 'smod', 'xor', 'mov', 'arsh']
 binary_alu_ops.extend([x + '32' for x in binary_alu_ops])
+movsx_ops = ['movsx832', 'movsx1632', 'movsx864', 'movsx1664', 'movsx3264']
 
 alu_instruction = \
     (keywords(unary_alu_ops) + reg) | \
-    (keywords(binary_alu_ops) + reg + "," + (reg | imm))
+    (keywords(binary_alu_ops) + reg + "," + (reg | imm)) | \
+    (keywords(movsx_ops) + reg + "," + reg)
 
 mem_sizes = ['w', 'h', 'b', 'dw']
 mem_store_reg_ops = ['stx' + s for s in mem_sizes]
 mem_store_imm_ops = ['st' + s for s in mem_sizes]
 mem_load_ops = ['ldx' + s for s in mem_sizes]
+mem_load_ops.extend(['ldxs' + s for s in mem_sizes if s != 'dw'])
 
 mem_instruction = \
     (keywords(mem_store_reg_ops) + memref + "," + reg) | \
@@ -41,9 +45,10 @@ mem_instruction = \
     (keywords(["lddw"]) + reg + "," + imm)
 
 jmp_cmp_ops = ['jeq', 'jgt', 'jge', 'jlt', 'jle', 'jset', 'jne', 'jsgt', 'jsge', 'jslt', 'jsle']
+jmp_cmp_ops.extend([x + '32' for x in jmp_cmp_ops])
 jmp_instruction = \
     (keywords(jmp_cmp_ops) + reg + "," + (reg | imm) + "," + offset) | \
-    (keywords(['ja']) + offset) | \
+    (keywords(['ja', 'ja32']) + offset) | \
     (keywords(['call']) + imm) | \
     (keywords(['exit'])[lambda x: (x, )])
 
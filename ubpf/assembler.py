@@ -15,6 +15,7 @@ MEM_SIZES = {
 }
 
 MEM_LOAD_OPS = { 'ldx' + k: (0x61 | (v << 3)) for k, v in list(MEM_SIZES.items()) }
+MEM_LOAD_SX_OPS = { 'ldxs' + k: (0x81 | (v << 3)) for k, v in list(MEM_SIZES.items()) if k != 'dw' }
 MEM_STORE_IMM_OPS = { 'st' + k: (0x62 | (v << 3))  for k, v in list(MEM_SIZES.items()) }
 MEM_STORE_REG_OPS = { 'stx' + k: (0x63 | (v << 3)) for k, v in list(MEM_SIZES.items()) }
 
@@ -37,8 +38,24 @@ BINARY_ALU_OPS = {
     'arsh': 12,
 }
 
+# Signed division and modulo are encoded as div and mod with an offset of 1
+SIGNED_ALU_OPS = {
+    'sdiv': 3,
+    'smod': 9,
+}
+
 UNARY_ALU32_OPS = { k + '32': v for k, v in list(UNARY_ALU_OPS.items()) }
 BINARY_ALU32_OPS = { k + '32': v for k, v in list(BINARY_ALU_OPS.items()) }
+SIGNED_ALU32_OPS = { k + '32': v for k, v in list(SIGNED_ALU_OPS.items()) }
+
+# movsx<source bits><destination bits>, encoded as mov with the source bits as offset
+MOVSX_OPS = {
+    'movsx832': (0xbc, 8),
+    'movsx1632': (0xbc, 16),
+    'movsx864': (0xbf, 8),
+    'movsx1664': (0xbf, 16),
+    'movsx3264': (0xbf, 32),
+}
 
 END_OPS = {
     'le16': (0xd4, 16),
@@ -47,6 +64,9 @@ END_OPS = {
     'be16': (0xdc, 16),
     'be32': (0xdc, 32),
     'be64': (0xdc, 64),
+    'bswap16': (0xd7, 16),
+    'bswap32': (0xd7, 32),
+    'bswap64': (0xd7, 64),
 }
 
 JMP_CMP_OPS = {
@@ -63,6 +83,8 @@ JMP_CMP_OPS = {
     'jsle': 13,
 }
 
+JMP32_CMP_OPS = { k + '32': v for k, v in list(JMP_CMP_OPS.items()) }
+
 JMP_MISC_OPS = {
     'ja': 0,
     'call': 8,
@@ -84,6 +106,9 @@ def assemble_one(inst):
     if op in MEM_LOAD_OPS:
         opcode = MEM_LOAD_OPS[op]
         return pack(opcode, inst[1].num, inst[2].reg.num, inst[2].offset, 0)
+    elif op in MEM_LOAD_SX_OPS:
+        opcode = MEM_LOAD_SX_OPS[op]
+        return pack(opcode, inst[1].num, inst[2].reg.num, inst[2].offset, 0)
     elif op == "lddw":
         a = pack(0x18, inst[1].num, 0, 0, inst[2].value)
         b = pack(0, 0, 0, 0, inst[2].value >> 32)
@@ -104,11 +129,23 @@ def assemble_one(inst):
         return assemble_binop(op, 0x07, BINARY_ALU_OPS, inst[1], inst[2], 0)
     elif op in BINARY_ALU32_OPS:
         return assemble_binop(op, 0x04, BINARY_ALU32_OPS, inst[1], inst[2], 0)
+    elif op in SIGNED_ALU_OPS:
+        return assemble_binop(op, 0x07, SIGNED_ALU_OPS, inst[1], inst[2], 1)
+    elif op in SIGNED_ALU32_OPS:
+        return assemble_binop(op, 0x04, SIGNED_ALU32_OPS, inst[1], inst[2], 1)
+    elif op in MOVSX_OPS:
+        opcode, bits = MOVSX_OPS[op]
+        return pack(opcode, inst[1].num, inst[2].num, bits, 0)
     elif op in END_OPS:
         opcode, imm = END_OPS[op]
         return pack(opcode, inst[1].num, 0, 0, imm)
     elif op in JMP_CMP_OPS:
         return assemble_binop(op, 0x05, JMP_CMP_OPS, inst[1], inst[2], inst[3])
+    elif op in JMP32_CMP_OPS:
+        return assemble_binop(op, 0x06, JMP32_CMP_OPS, inst[1], inst[2], inst[3])
+    elif op == 'ja32':
+        # gotol, with the offset in the immediate
+        return pack(0x06, 0, 0, 0, inst[1])
     elif op in JMP_MISC_OPS:
         opcode = 0x05 | (JMP_MISC_OPS[op] << 4)
         if op == 'ja':
@@ -13,6 +13,7 @@ CLASSES = {
     3: "stx",
     4: "alu",
     5: "jmp",
+    6: "jmp32",
     7: "alu64",
 }
 
@@ -55,6 +56,7 @@ MODES = {
     1: 'abs',
     2: 'ind',
     3: 'mem',
+    4: 'memsx',
     6: 'xadd',
 }
 
@@ -71,11 +73,17 @@ BPF_CLASS_ST = 2
 BPF_CLASS_STX = 3
 BPF_CLASS_ALU = 4
 BPF_CLASS_JMP = 5
+BPF_CLASS_JMP32 = 6
 BPF_CLASS_ALU64 = 7
 
+BPF_ALU_DIV = 3
 BPF_ALU_NEG = 8
+BPF_ALU_MOD = 9
+BPF_ALU_MOV = 11
 BPF_ALU_END = 13
 
+BPF_MODE_MEMSX = 4
+
 def R(reg):
     return "r" + str(reg)
 
@@ -88,11 +96,11 @@ def M(base, off):
     else:
         return "[%s]" % base
 
-def O(off):
-    if off <= 32767:
+def O(off, bits=16):
+    if off < (1 << (bits - 1)):
         return "+" + str(off)
     else:
-        return "-" + str(65536-off)
+        return "-" + str((1 << bits) - off)
 
 def disassemble_one(data, offset):
     code, regs, off, imm = Inst.unpack_from(data, offset)
@@ -106,22 +114,36 @@ def disassemble_one(data, offset):
         source = (code >> 3) & 1
         opcode = (code >> 4) & 0xf
         opcode_name = ALU_OPCODES.get(opcode)
+        if opcode in (BPF_ALU_DIV, BPF_ALU_MOD) and off == 1:
+            opcode_name = "s" + opcode_name
         if cls == BPF_CLASS_ALU:
             opcode_name += "32"
 
         if opcode == BPF_ALU_END:
-            opcode_name = source == 1 and "be" or "le"
+            if cls == BPF_CLASS_ALU64:
+                opcode_name = "bswap"
+            else:
+                opcode_name = source == 1 and "be" or "le"
             return "%s%d %s" % (opcode_name, imm, R(dst_reg))
+        elif opcode == BPF_ALU_MOV and source == 1 and off != 0:
+            width = cls == BPF_CLASS_ALU and 32 or 64
+            return "movsx%d%d %s, %s" % (off, width, R(dst_reg), R(src_reg))
         elif opcode == BPF_ALU_NEG:
             return "%s %s" % (opcode_name, R(dst_reg))
         elif source == 0:
             return "%s %s, %s" % (opcode_name, R(dst_reg), I(imm))
         else:
             return "%s %s, %s" % (opcode_name, R(dst_reg), R(src_reg))
-    elif cls == BPF_CLASS_JMP:
+    elif cls == BPF_CLASS_JMP or cls == BPF_CLASS_JMP32:
         source = (code >> 3) & 1
         opcode = (code >> 4) & 0xf
         opcode_name = JMP_OPCODES.get(opcode)
+        if cls == BPF_CLASS_JMP32:
+            if opcode_name == "ja":
+                return "ja32 %s" % O(imm, 32)
+            if opcode_name in ("call", "exit"):
+                return "unknown instruction %#x" % code
+            opcode_name += "32"
 
         if opcode_name == "exit":
             return opcode_name
@@ -146,6 +168,8 @@ def disassemble_one(data, offset):
         elif code == 0x00:
             # Second instruction of lddw
             return None
+        elif cls == BPF_CLASS_LDX and mode == BPF_MODE_MEMSX:
+            return "%s %s, %s" % ("ldxs" + size_name, R(dst_reg), M(R(src_reg), off))
         elif cls == BPF_CLASS_LDX:
             return "%s %s, %s" % (class_name + size_name, R(dst_reg), M(R(src_reg), off))
         elif cls == BPF_CLASS_ST:
@@ -166,3 +190,23 @@ def disassemble(data):
             output.write(s + "\n")
         offset += 8
     return output.getvalue()
+
+def annotate(data, samples):
+    """
+    Disassemble with the number and share of profiler samples of each
+    instruction, given as a dict from PC to count
+    """
+    total = sum(samples.values())
+    output = io()
+    offset = 0
+    while offset < len(data):
+        s = disassemble_one(data, offset)
+        pc = offset // 8
+        if s:
+            count = samples.get(pc, 0)
+            if count:
+                output.write("%8d %5.1f%%  %4d: %s\n" % (count, 100.0 * count / total, pc, s))
+            else:
+                output.write("%15s  %4d: %s\n" % ("", pc, s))
+        offset += 8
+    return output.getvalue()
@@ -0,0 +1,178 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compares a host loop calling each program's ubpf_jit_fn in turn with the
+ * dispatcher generated by ubpf_chain_compile, with every stage continuing
+ * to the next one.
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include "ubpf.h"
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-h] [-n ITERATIONS] PACKET PROGRAM...\n", name);
+    fprintf(stderr, "\nTimes the raw eBPF PROGRAMs on the PACKET file, one ubpf_jit_fn call\n");
+    fprintf(stderr, "per program, against a single call of the compiled chain.\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -n, --iterations NUM: Number of times the packet is processed (default 1000000)\n");
+}
+
+static void *
+readfile(const char *path, size_t *len)
+{
+    FILE *file = fopen(path, "r");
+    size_t maxlen = 1024 * 1024;
+    void *data;
+
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    data = calloc(maxlen, 1);
+    *len = fread(data, 1, maxlen, file);
+    fclose(file);
+    return data;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t
+run_separately(ubpf_jit_fn *fns, int num_fns, void *pkt, size_t pkt_len)
+{
+    uint64_t ret = 0;
+    int i;
+
+    for (i = 0; i < num_fns; i++) {
+        ret = fns[i](pkt, pkt_len);
+    }
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    struct option longopts[] = {
+        { .name = "help", .val = 'h', },
+        { .name = "iterations", .val = 'n', .has_arg=1 },
+        { }
+    };
+
+    long iterations = 1000000, n;
+    char *errmsg;
+    int opt, i;
+
+    while ((opt = getopt_long(argc, argv, "hn:", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc < optind + 2 || iterations < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t pkt_len;
+    void *pkt = readfile(argv[optind], &pkt_len);
+    if (!pkt) {
+        return 1;
+    }
+
+    int num_vms = argc - optind - 1;
+    struct ubpf_vm **vms = calloc(num_vms, sizeof(vms[0]));
+    ubpf_jit_fn *fns = calloc(num_vms, sizeof(fns[0]));
+    struct ubpf_chain *chain = ubpf_chain_create();
+
+    for (i = 0; i < num_vms; i++) {
+        size_t code_len;
+        void *code = readfile(argv[optind + 1 + i], &code_len);
+        if (!code) {
+            return 1;
+        }
+        vms[i] = ubpf_create();
+        if (ubpf_load(vms[i], code, code_len, &errmsg) < 0) {
+            fprintf(stderr, "Failed to load %s: %s\n", argv[optind + 1 + i], errmsg);
+            return 1;
+        }
+        free(code);
+        fns[i] = ubpf_compile(vms[i], &errmsg);
+        if (!fns[i]) {
+            fprintf(stderr, "Failed to compile: %s\n", errmsg);
+            return 1;
+        }
+        if (ubpf_chain_add(chain, vms[i]) < 0) {
+            fprintf(stderr, "Too many programs\n");
+            return 1;
+        }
+    }
+
+    ubpf_jit_fn chain_fn = ubpf_chain_compile(chain, &errmsg);
+    if (!chain_fn) {
+        fprintf(stderr, "Failed to compile chain: %s\n", errmsg);
+        return 1;
+    }
+
+    volatile uint64_t sink = 0;
+    double start = now();
+    for (n = 0; n < iterations; n++) {
+        sink += run_separately(fns, num_vms, pkt, pkt_len);
+    }
+    double separate = (now() - start) / iterations;
+
+    start = now();
+    for (n = 0; n < iterations; n++) {
+        sink += chain_fn(pkt, pkt_len);
+    }
+    double chained = (now() - start) / iterations;
+
+    printf("%d stages\n", num_vms);
+    printf("separate: %.1f ns/packet\n", separate * 1e9);
+    printf("chained:  %.1f ns/packet\n", chained * 1e9);
+    printf("speedup:  %.2fx\n", separate / chained);
+
+    ubpf_chain_destroy(chain);
+    for (i = 0; i < num_vms; i++) {
+        ubpf_destroy(vms[i]);
+    }
+    free(vms);
+    free(fns);
+    free(pkt);
+    return 0;
+}
@@ -31,6 +31,8 @@ struct ebpf_inst {
 
 #define EBPF_CLS_MASK 0x07
 #define EBPF_ALU_OP_MASK 0xf0
+#define EBPF_SIZE_MASK 0x18
+#define EBPF_MODE_MASK 0xe0
 
 #define EBPF_CLS_LD 0x00
 #define EBPF_CLS_LDX 0x01
@@ -38,6 +40,7 @@ struct ebpf_inst {
 #define EBPF_CLS_STX 0x03
 #define EBPF_CLS_ALU 0x04
 #define EBPF_CLS_JMP 0x05
+#define EBPF_CLS_JMP32 0x06
 #define EBPF_CLS_ALU64 0x07
 
 #define EBPF_SRC_IMM 0x00
@@ -51,6 +54,7 @@ struct ebpf_inst {
 /* Other memory modes are not yet supported */
 #define EBPF_MODE_IMM 0x00
 #define EBPF_MODE_MEM 0x60
+#define EBPF_MODE_MEMSX 0x80
 
 #define EBPF_OP_ADD_IMM  (EBPF_CLS_ALU|EBPF_SRC_IMM|0x00)
 #define EBPF_OP_ADD_REG  (EBPF_CLS_ALU|EBPF_SRC_REG|0x00)
@@ -80,6 +84,12 @@ struct ebpf_inst {
 #define EBPF_OP_LE       (EBPF_CLS_ALU|EBPF_SRC_IMM|0xd0)
 #define EBPF_OP_BE       (EBPF_CLS_ALU|EBPF_SRC_REG|0xd0)
 
+/*
+ * Signed division and modulo are DIV and MOD with an offset of 1, and
+ * MOVSX is MOV with the source width in bits as its offset.
+ */
+#define EBPF_OFFSET_SDIV 1
+
 #define EBPF_OP_ADD64_IMM  (EBPF_CLS_ALU64|EBPF_SRC_IMM|0x00)
 #define EBPF_OP_ADD64_REG  (EBPF_CLS_ALU64|EBPF_SRC_REG|0x00)
 #define EBPF_OP_SUB64_IMM  (EBPF_CLS_ALU64|EBPF_SRC_IMM|0x10)
@@ -105,11 +115,15 @@ struct ebpf_inst {
 #define EBPF_OP_MOV64_REG  (EBPF_CLS_ALU64|EBPF_SRC_REG|0xb0)
 #define EBPF_OP_ARSH64_IMM (EBPF_CLS_ALU64|EBPF_SRC_IMM|0xc0)
 #define EBPF_OP_ARSH64_REG (EBPF_CLS_ALU64|EBPF_SRC_REG|0xc0)
+#define EBPF_OP_BSWAP      (EBPF_CLS_ALU64|EBPF_SRC_IMM|0xd0)
 
 #define EBPF_OP_LDXW  (EBPF_CLS_LDX|EBPF_MODE_MEM|EBPF_SIZE_W)
 #define EBPF_OP_LDXH  (EBPF_CLS_LDX|EBPF_MODE_MEM|EBPF_SIZE_H)
 #define EBPF_OP_LDXB  (EBPF_CLS_LDX|EBPF_MODE_MEM|EBPF_SIZE_B)
 #define EBPF_OP_LDXDW (EBPF_CLS_LDX|EBPF_MODE_MEM|EBPF_SIZE_DW)
+#define EBPF_OP_LDXSW (EBPF_CLS_LDX|EBPF_MODE_MEMSX|EBPF_SIZE_W)
+#define EBPF_OP_LDXSH (EBPF_CLS_LDX|EBPF_MODE_MEMSX|EBPF_SIZE_H)
+#define EBPF_OP_LDXSB (EBPF_CLS_LDX|EBPF_MODE_MEMSX|EBPF_SIZE_B)
 #define EBPF_OP_STW   (EBPF_CLS_ST|EBPF_MODE_MEM|EBPF_SIZE_W)
 #define EBPF_OP_STH   (EBPF_CLS_ST|EBPF_MODE_MEM|EBPF_SIZE_H)
 #define EBPF_OP_STB   (EBPF_CLS_ST|EBPF_MODE_MEM|EBPF_SIZE_B)
@@ -146,4 +160,36 @@ struct ebpf_inst {
 #define EBPF_OP_JSLE_IMM (EBPF_CLS_JMP|EBPF_SRC_IMM|0xd0)
 #define EBPF_OP_JSLE_REG (EBPF_CLS_JMP|EBPF_SRC_REG|0xd0)
 
+/* gotol, with a 32-bit offset in imm */
+#define EBPF_OP_JA32       (EBPF_CLS_JMP32|0x00)
+#define EBPF_OP_JEQ32_IMM  (EBPF_CLS_JMP32|EBPF_SRC_IMM|0x10)
+#define EBPF_OP_JEQ32_REG  (EBPF_CLS_JMP32|EBPF_SRC_REG|0x10)
+#define EBPF_OP_JGT32_IMM  (EBPF_CLS_JMP32|EBPF_SRC_IMM|0x20)
+#define EBPF_OP_JGT32_REG  (EBPF_CLS_JMP32|EBPF_SRC_REG|0x20)
+#define EBPF_OP_JGE32_IMM  (EBPF_CLS_JMP32|EBPF_SRC_IMM|0x30)
+#define EBPF_OP_JGE32_REG  (EBPF_CLS_JMP32|EBPF_SRC_REG|0x30)
+#define EBPF_OP_JSET32_IMM (EBPF_CLS_JMP32|EBPF_SRC_IMM|0x40)
+#define EBPF_OP_JSET32_REG (EBPF_CLS_JMP32|EBPF_SRC_REG|0x40)
+#define EBPF_OP_JNE32_IMM  (EBPF_CLS_JMP32|EBPF_SRC_IMM|0x50)
+#define EBPF_OP_JNE32_REG  (EBPF_CLS_JMP32|EBPF_SRC_REG|0x50)
+#define EBPF_OP_JSGT32_IMM (EBPF_CLS_JMP32|EBPF_SRC_IMM|0x60)
+#define EBPF_OP_JSGT32_REG (EBPF_CLS_JMP32|EBPF_SRC_REG|0x60)
+#define EBPF_OP_JSGE32_IMM (EBPF_CLS_JMP32|EBPF_SRC_IMM|0x70)
+#define EBPF_OP_JSGE32_REG (EBPF_CLS_JMP32|EBPF_SRC_REG|0x70)
+#define EBPF_OP_JLT32_IMM  (EBPF_CLS_JMP32|EBPF_SRC_IMM|0xa0)
+#define EBPF_OP_JLT32_REG  (EBPF_CLS_JMP32|EBPF_SRC_REG|0xa0)
+#define EBPF_OP_JLE32_IMM  (EBPF_CLS_JMP32|EBPF_SRC_IMM|0xb0)
+#define EBPF_OP_JLE32_REG  (EBPF_CLS_JMP32|EBPF_SRC_REG|0xb0)
+#define EBPF_OP_JSLT32_IMM (EBPF_CLS_JMP32|EBPF_SRC_IMM|0xc0)
+#define EBPF_OP_JSLT32_REG (EBPF_CLS_JMP32|EBPF_SRC_REG|0xc0)
+#define EBPF_OP_JSLE32_IMM (EBPF_CLS_JMP32|EBPF_SRC_IMM|0xd0)
+#define EBPF_OP_JSLE32_REG (EBPF_CLS_JMP32|EBPF_SRC_REG|0xd0)
+
+/* Distance from the instruction after a jump to its target */
+static inline int32_t
+ebpf_jump_offset(struct ebpf_inst inst)
+{
+    return inst.opcode == EBPF_OP_JA32 ? inst.imm : inst.offset;
+}
+
 #endif
@@ -0,0 +1,209 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compares running a set of filters one by one with running the program
+ * produced by ubpf_fuse, both JIT compiled.
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include "ubpf.h"
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-h] [-n ITERATIONS] [-r REPEAT] [-f bitmask|first] PACKET FILTER...\n", name);
+    fprintf(stderr, "\nTimes the raw eBPF FILTERs on the PACKET file, one ubpf_jit_fn call\n");
+    fprintf(stderr, "per filter, against a single call of the fused program.\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -n, --iterations NUM: Number of times the packet is classified (default 1000000)\n");
+    fprintf(stderr, "  -r, --repeat NUM: Use each filter NUM times, to simulate larger sets (default 1)\n");
+    fprintf(stderr, "  -f, --fuse RESULT: 'bitmask' (default, at most 64 filters) or 'first'\n");
+}
+
+static void *
+readfile(const char *path, size_t *len)
+{
+    FILE *file = fopen(path, "r");
+    size_t maxlen = 1024 * 1024;
+    void *data;
+
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    data = calloc(maxlen, 1);
+    *len = fread(data, 1, maxlen, file);
+    fclose(file);
+    return data;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t
+run_separately(ubpf_jit_fn *fns, int num_fns, enum ubpf_fuse_result result, void *pkt, size_t pkt_len)
+{
+    uint64_t mask = 0;
+    int i;
+
+    for (i = 0; i < num_fns; i++) {
+        if (fns[i](pkt, pkt_len)) {
+            if (result == UBPF_FUSE_FIRST_MATCH) {
+                return i + 1;
+            }
+            mask |= 1ULL << i;
+        }
+    }
+    return result == UBPF_FUSE_FIRST_MATCH ? 0 : mask;
+}
+
+int main(int argc, char **argv)
+{
+    struct option longopts[] = {
+        { .name = "help", .val = 'h', },
+        { .name = "iterations", .val = 'n', .has_arg=1 },
+        { .name = "repeat", .val = 'r', .has_arg=1 },
+        { .name = "fuse", .val = 'f', .has_arg=1 },
+        { }
+    };
+
+    long iterations = 1000000, n;
+    int repeat = 1;
+    enum ubpf_fuse_result result = UBPF_FUSE_BITMASK;
+    char *errmsg;
+    int opt, i;
+
+    while ((opt = getopt_long(argc, argv, "hn:r:f:", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'f':
+            if (!strcmp(optarg, "bitmask")) {
+                result = UBPF_FUSE_BITMASK;
+            } else if (!strcmp(optarg, "first")) {
+                result = UBPF_FUSE_FIRST_MATCH;
+            } else {
+                fprintf(stderr, "Unknown fuse result %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc < optind + 2 || repeat < 1 || iterations < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t pkt_len;
+    void *pkt = readfile(argv[optind], &pkt_len);
+    if (!pkt) {
+        return 1;
+    }
+
+    int num_files = argc - optind - 1;
+    int num_vms = num_files * repeat;
+    struct ubpf_vm **vms = calloc(num_vms, sizeof(vms[0]));
+    ubpf_jit_fn *fns = calloc(num_vms, sizeof(fns[0]));
+
+    for (i = 0; i < num_vms; i++) {
+        size_t code_len;
+        void *code = readfile(argv[optind + 1 + i % num_files], &code_len);
+        if (!code) {
+            return 1;
+        }
+        vms[i] = ubpf_create();
+        if (ubpf_load(vms[i], code, code_len, &errmsg) < 0) {
+            fprintf(stderr, "Failed to load %s: %s\n", argv[optind + 1 + i % num_files], errmsg);
+            return 1;
+        }
+        free(code);
+        fns[i] = ubpf_compile(vms[i], &errmsg);
+        if (!fns[i]) {
+            fprintf(stderr, "Failed to compile: %s\n", errmsg);
+            return 1;
+        }
+    }
+
+    struct ubpf_vm *fused = ubpf_fuse(vms, num_vms, result, &errmsg);
+    if (!fused) {
+        fprintf(stderr, "Failed to fuse programs: %s\n", errmsg);
+        return 1;
+    }
+    ubpf_jit_fn fused_fn = ubpf_compile(fused, &errmsg);
+    if (!fused_fn) {
+        fprintf(stderr, "Failed to compile: %s\n", errmsg);
+        return 1;
+    }
+
+    uint64_t expected = run_separately(fns, num_vms, result, pkt, pkt_len);
+    uint64_t actual = fused_fn(pkt, pkt_len);
+    if (expected != actual) {
+        fprintf(stderr, "Fused program returned 0x%"PRIx64", expected 0x%"PRIx64"\n", actual, expected);
+        return 1;
+    }
+
+    volatile uint64_t sink = 0;
+    double start = now();
+    for (n = 0; n < iterations; n++) {
+        sink += run_separately(fns, num_vms, result, pkt, pkt_len);
+    }
+    double separate = (now() - start) / iterations;
+
+    start = now();
+    for (n = 0; n < iterations; n++) {
+        sink += fused_fn(pkt, pkt_len);
+    }
+    double fused_time = (now() - start) / iterations;
+
+    printf("result 0x%"PRIx64", %d filters\n", expected, num_vms);
+    printf("separate: %.1f ns/packet\n", separate * 1e9);
+    printf("fused:    %.1f ns/packet\n", fused_time * 1e9);
+    printf("speedup:  %.2fx\n", separate / fused_time);
+
+    ubpf_destroy(fused);
+    for (i = 0; i < num_vms; i++) {
+        ubpf_destroy(vms[i]);
+    }
+    free(vms);
+    free(fns);
+    free(pkt);
+    return 0;
+}
@@ -45,6 +45,28 @@ void ubpf_destroy(struct ubpf_vm *vm);
  */
 bool ubpf_toggle_bounds_check(struct ubpf_vm *vm, bool enable);
 
+/*
+ * Enable / disable the bounded loop requirement
+ *
+ * When enabled, ubpf_load rejects programs containing a loop whose trip
+ * count cannot be proven statically. Loops are allowed by default.
+ * Either way, the JIT unrolls small loops whose trip count is proven.
+ * Must be called before loading code.
+ * Pass true to enable, false to disable
+ * Returns previous state
+ */
+bool ubpf_toggle_bounded_loops(struct ubpf_vm *vm, bool enable);
+
+/*
+ * Set the instruction limit of programs loaded into this VM
+ *
+ * ubpf_load rejects programs of 'max_insts' instructions or more,
+ * UBPF_MAX_INSTS by default. Translation time and memory grow with the
+ * program, not with this limit. Must be called before loading code.
+ * Returns 0 on success, -1 if code is loaded or 'max_insts' is 0.
+ */
+int ubpf_set_max_insts(struct ubpf_vm *vm, uint32_t max_insts);
+
 
 /*
  * Set the function to be invoked if the jitted program hits divide by zero.
@@ -53,6 +75,43 @@ bool ubpf_toggle_bounds_check(struct ubpf_vm *vm, bool enable);
  */
 void ubpf_set_error_print(struct ubpf_vm *vm, int (*error_printf)(FILE* stream, const char* format, ...));
 
+/*
+ * Limit the runtime error messages printed for this VM
+ *
+ * At most 'per_second' messages are printed per second, 10 by default.
+ * 0 disables printing; errors are still available through
+ * ubpf_exec_ex and ubpf_take_last_error.
+ */
+void ubpf_set_error_print_limit(struct ubpf_vm *vm, uint32_t per_second);
+
+enum ubpf_error_kind {
+    UBPF_ERROR_NONE,
+    UBPF_ERROR_OUT_OF_BOUNDS_LOAD,
+    UBPF_ERROR_OUT_OF_BOUNDS_STORE,
+    UBPF_ERROR_DIV_BY_ZERO,
+    UBPF_ERROR_NO_CODE,
+    UBPF_ERROR_SANDBOX_BUSY,
+};
+#define UBPF_NUM_ERROR_KINDS (UBPF_ERROR_SANDBOX_BUSY + 1)
+
+/* A runtime error */
+struct ubpf_error_info {
+    enum ubpf_error_kind kind;
+    uint32_t pc;
+    uint64_t addr; /* faulting address of an out of bounds access */
+    uint32_t size; /* and its size */
+};
+
+/*
+ * Return the most recent runtime error on the calling thread, from
+ * ubpf_exec or jitted code, and clear it
+ *
+ * Jitted code returns UINT64_MAX on error; this tells the error apart from
+ * a program returning that value. Returns false if there was no error
+ * since the last call.
+ */
+bool ubpf_take_last_error(struct ubpf_error_info *error);
+
 /*
  * Register an external function
  *
@@ -66,6 +125,135 @@ void ubpf_set_error_print(struct ubpf_vm *vm, int (*error_printf)(FILE* stream,
  */
 int ubpf_register(struct ubpf_vm *vm, unsigned int idx, const char *name, void *fn);
 
+/*
+ * Register an array map
+ *
+ * Helper 'idx' then looks up keys in the array of 'max_entries' values of
+ * 'value_size' bytes at 'values', like bpf_map_lookup_elem: r2 points to
+ * a 32-bit key, and the call returns the address of its value, or 0 if
+ * the key is out of range. r1, the map in the kernel's calling
+ * convention, is ignored, since each map has a helper index of its own.
+ * ubpf_load rejects programs unless r2 holds r10 plus a constant, with
+ * the key inside the stack, at every call to the map.
+ *
+ * Jitted code computes the address inline instead of calling a helper,
+ * and the interpreter's bounds checks accept accesses to the values. In a
+ * sandbox, 'values' must come from ubpf_sandbox_alloc.
+ *
+ * 'name' should be a string with a lifetime longer than the VM. Must be
+ * called before loading code, since the loader checks the calls.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int ubpf_register_array_map(struct ubpf_vm *vm, unsigned int idx, const char *name, void *values,
+                            uint32_t value_size, uint32_t max_entries);
+
+/*
+ * Context passed in r1 to programs loaded with packet access enabled
+ *
+ * The packet is the bytes from 'data' to 'data_end'. 'data_meta' points to
+ * metadata the host placed before it and is equal to 'data' if there is
+ * none.
+ */
+struct ubpf_packet_ctx {
+    void *data;
+    void *data_end;
+    void *data_meta;
+};
+
+/*
+ * Enable direct packet access
+ *
+ * The program then receives a struct ubpf_packet_ctx in r1, passed as
+ * 'mem' to ubpf_exec or the jitted function, and reads or writes the
+ * caller's packet buffer in place. At load time, every access through a
+ * pointer derived from 'data' must be proven in bounds by comparing a
+ * pointer at least as far into the packet against 'data_end' beforehand,
+ * as in:
+ *
+ *     ldxdw r2, [r1+0]        data
+ *     ldxdw r3, [r1+8]        data_end
+ *     mov r4, r2
+ *     add r4, 14
+ *     jgt r4, r3, +N          drop if the 14-byte header is not there
+ *     ldxh r5, [r2+12]        proven in bounds
+ *
+ * Accesses through 'data_meta' are proven against 'data' the same way.
+ * Pointer arithmetic is limited to adding constants, and packet and
+ * context pointers may not be stored to memory.
+ *
+ * Must be called before ubpf_load and cannot be combined with
+ * ubpf_register_ctx_field. Returns the previous setting.
+ */
+bool ubpf_toggle_packet_access(struct ubpf_vm *vm, bool enable);
+
+/*
+ * Confine the memory accesses of jitted code to a guard-region sandbox
+ *
+ * The VM reserves a 4 GiB window of address space holding its eBPF stack
+ * and the buffers returned by ubpf_sandbox_alloc, with everything else
+ * inaccessible. The JIT forces every address into the window without
+ * compare-and-branch checks, and a SIGSEGV handler turns accesses to
+ * inaccessible pages into a program error: the jitted function returns
+ * UINT64_MAX and the error can be read with ubpf_take_last_error.
+ *
+ * Memory passed to the jitted function must come from ubpf_sandbox_alloc.
+ * Threads get their own stack in the window, indexed like the statistics
+ * shards: the first 15 threads to run sandboxed or instrumented code own
+ * one each, and later threads share another. A call on a thread of the
+ * shared stack fails with UBPF_ERROR_SANDBOX_BUSY while another thread
+ * runs on it. The interpreter is not affected. Only supported on Linux
+ * x86-64 with the template JIT, and cannot be used in chains.
+ *
+ * Must be called before ubpf_compile. Returns the previous setting.
+ */
+bool ubpf_toggle_sandbox(struct ubpf_vm *vm, bool enable);
+
+/*
+ * Allocate 'size' bytes inside the sandbox of a VM with sandboxing enabled
+ *
+ * The buffer ends right before an inaccessible page, so reads and writes
+ * past its end fault (for sizes that are a multiple of 8). It is freed with
+ * the VM. Returns NULL on failure.
+ */
+void *ubpf_sandbox_alloc(struct ubpf_vm *vm, size_t size);
+
+/*
+ * Confine jitted code by address masking instead of guard regions
+ *
+ * Enables the sandbox with a window of 'size' bytes, a power of two from
+ * 64 KiB to 1 GiB, aligned to its size and accessible in its entirety.
+ * The JIT masks every address into the window with three ALU instructions
+ * and no branches, so wild accesses land somewhere in the window instead of
+ * faulting, and no signal handler is involved. Programs stay confined as
+ * long as bounds checks are enabled; with ubpf_toggle_bounds_check(vm,
+ * false) the masking is left out as well.
+ *
+ * Must be called before ubpf_compile and ubpf_sandbox_alloc. Returns 0 on
+ * success, -1 if 'size' is invalid or the sandbox already exists.
+ */
+int ubpf_set_sandbox_window(struct ubpf_vm *vm, size_t size);
+
+/*
+ * Map a field of the program's context structure to the host's descriptor
+ *
+ * Once any field is registered, r1 on entry is treated as a pointer to a
+ * context with a stable layout. At load time every access through it must
+ * match a registered field's offset and size exactly, and is rewritten to
+ * access 'native_offset' in the memory passed to ubpf_exec or the jitted
+ * function instead. The host can then pass its native descriptor without
+ * copying it into the stable layout. Programs doing arithmetic on the
+ * context pointer or storing it to memory are rejected. Helpers receive
+ * the native descriptor.
+ *
+ * Must be called before ubpf_load.
+ *
+ * Returns 0 on success, -1 if the field overlaps another one, has an
+ * invalid size or offset, there are too many fields, or code is already
+ * loaded.
+ */
+int ubpf_register_ctx_field(struct ubpf_vm *vm, uint16_t ctx_offset, uint8_t size, uint16_t native_offset);
+
 /*
  * Load code into a VM
  *
@@ -100,8 +288,296 @@ int ubpf_load_elf(struct ubpf_vm *vm, const void *elf, size_t elf_len, char **er
 
 int ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t* bpf_return_value);
 
+/*
+ * Like ubpf_exec, and on error stores what happened in 'error' if it is
+ * not NULL. error->kind is UBPF_ERROR_NONE on success.
+ */
+int ubpf_exec_ex(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t *bpf_return_value,
+                 struct ubpf_error_info *error);
+
+#define UBPF_BATCH_LANES 8
+
+/*
+ * Run the program once on each of the 'n' buffers in 'mems', storing the
+ * return values in 'results'
+ *
+ * Experimental. Groups of UBPF_BATCH_LANES inputs run together in the
+ * lanes of a SIMD interpreter, where branches that go different ways in
+ * different lanes are executed under a mask. This suits short filters
+ * without many diverging branches. Programs that call helpers, and VMs
+ * with statistics or latency histograms, run one input at a time instead.
+ *
+ * Runtime errors are reported like those of ubpf_exec and set the result
+ * of the failed run to UINT64_MAX. Returns the number of failed runs, or
+ * -1 if no code is loaded.
+ */
+int ubpf_exec_batch(const struct ubpf_vm *vm, void *const *mems, const size_t *mem_lens, uint64_t *results,
+                    unsigned int n);
+
+/* Whether ubpf_exec_batch runs this VM's program in SIMD lanes */
+bool ubpf_batch_supported(const struct ubpf_vm *vm);
+
+struct ubpf_stats {
+    uint64_t executions;
+    uint64_t errors[UBPF_NUM_ERROR_KINDS]; /* indexed by enum ubpf_error_kind */
+    uint64_t instructions; /* retired by the interpreter */
+    uint64_t helper_calls;
+    uint64_t cycles;       /* total time spent running, in TSC cycles, estimated from sampled runs */
+};
+
+/*
+ * Start counting executions, errors, helper calls and time for this VM
+ *
+ * Counters are sharded per thread and updated without locks or atomic
+ * instructions, except by threads beyond the first 15 to run an
+ * instrumented program, which share a shard. Only one in 64 executions on
+ * a thread's own shard is timed. Jitted code is instrumented at compile
+ * time, so this must be called before ubpf_compile. Errors of jitted code
+ * are not counted as executions of their own, and the JIT does not count
+ * instructions.
+ *
+ * Returns 0 on success, -1 if the VM is already compiled or on allocation
+ * failure.
+ */
+int ubpf_enable_stats(struct ubpf_vm *vm);
+
+/*
+ * Sum the counters of all shards into 'stats'
+ *
+ * The snapshot is taken without locking, so counters updated by running
+ * programs may be slightly inconsistent with each other. Returns -1 if
+ * statistics are not enabled.
+ */
+int ubpf_get_stats(const struct ubpf_vm *vm, struct ubpf_stats *stats);
+
+/*
+ * Log-linear histogram of execution times in TSC cycles
+ *
+ * Values below 2^UBPF_LATENCY_SUB_BITS have a bucket each. Larger values
+ * are bucketed by their highest set bit, with each power of two split into
+ * 2^UBPF_LATENCY_SUB_BITS linear sub-buckets, so a bucket is at most 1/16
+ * of its value wide.
+ */
+#define UBPF_LATENCY_SUB_BITS 4
+#define UBPF_LATENCY_BUCKETS ((64 - UBPF_LATENCY_SUB_BITS + 1) << UBPF_LATENCY_SUB_BITS)
+
+struct ubpf_latency_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[UBPF_LATENCY_BUCKETS];
+};
+
+/*
+ * Record the execution time of one in every 'sample_period' runs of this VM
+ * on each thread
+ *
+ * Like ubpf_enable_stats this must be called before ubpf_compile, and the
+ * histograms are kept per thread without locking. The time stamp counter
+ * is read on every run; sampling only limits how often a histogram is
+ * updated.
+ *
+ * Returns 0 on success, -1 if the VM is already compiled, 'sample_period'
+ * is 0 or on allocation failure.
+ */
+int ubpf_enable_latency_histogram(struct ubpf_vm *vm, uint32_t sample_period);
+
+/*
+ * Merge the per-thread histograms of this VM into 'hist'
+ *
+ * Returns -1 if latency histograms are not enabled.
+ */
+int ubpf_get_latency_histogram(const struct ubpf_vm *vm, struct ubpf_latency_histogram *hist);
+
+/* Add the samples of 'src' to 'dst', e.g. to combine the histograms of several VMs */
+void ubpf_latency_histogram_merge(struct ubpf_latency_histogram *dst, const struct ubpf_latency_histogram *src);
+
+/*
+ * Estimate the given percentile (0 to 100) of a histogram
+ *
+ * Returns the upper bound of the bucket holding it, so the estimate errs
+ * high by at most one bucket width. Returns 0 for an empty histogram.
+ */
+uint64_t ubpf_latency_percentile(const struct ubpf_latency_histogram *hist, double percentile);
+
+/*
+ * Count profiler samples per instruction of this VM's jitted code
+ *
+ * Samples in code hoisted out of a loop, or in unrolled copies of a loop,
+ * count for the instruction that the code was emitted for.
+ * Code must be loaded first. At most 64 VMs can be profiled at a time.
+ * Returns 0 on success, -1 on failure.
+ */
+int ubpf_enable_profiling(struct ubpf_vm *vm);
+
+/*
+ * Start sampling the process 'hz' times per second of CPU time
+ *
+ * Installs a SIGPROF handler and an ITIMER_PROF timer, replacing any the
+ * application uses. Each sample taken while jitted code of a profiled VM
+ * runs is counted for the eBPF instruction being executed; the interpreter
+ * and the code of helpers are not attributed. Call ubpf_profile_stop
+ * before destroying profiled VMs.
+ *
+ * Only supported on Linux x86-64. Returns 0 on success, -1 on failure or
+ * if the profiler is already running.
+ */
+int ubpf_profile_start(uint32_t hz);
+
+void ubpf_profile_stop(void);
+
+/*
+ * Copy the sample counts of up to 'num_samples' instructions to 'samples'
+ *
+ * Returns the number of instructions of the program, or -1 if profiling is
+ * not enabled for this VM.
+ */
+int ubpf_get_profile(const struct ubpf_vm *vm, uint64_t *samples, uint32_t num_samples);
+
+struct ubpf_helper_profile {
+    uint64_t calls;
+    uint64_t cycles; /* TSC cycles spent in the helper */
+};
+
+/*
+ * Read the calls of helper 'idx' from all call sites of the program
+ *
+ * Helper profiling is compiled in only with 'make HELPER_PROFILE=1'.
+ * Calls from the interpreter and the x86-64 JIT (except on Windows) are
+ * counted. Returns -1 if helper profiling is not built in or no code is
+ * loaded.
+ */
+int ubpf_get_helper_profile(const struct ubpf_vm *vm, unsigned int idx, struct ubpf_helper_profile *profile);
+
+/* Like ubpf_get_helper_profile, for the single call instruction at 'pc' */
+int ubpf_get_helper_site_profile(const struct ubpf_vm *vm, uint32_t pc, struct ubpf_helper_profile *profile);
+
 ubpf_jit_fn ubpf_compile(struct ubpf_vm *vm, char **errmsg);
 
+/*
+ * Use a natively compiled function as the VM's jitted code
+ *
+ * 'fn' is typically generated ahead of time by bin/ubpf-aot. Afterwards
+ * ubpf_compile returns 'fn'. The VM does not take ownership of 'fn'.
+ *
+ * Returns 0 on success, -1 if the VM already has jitted code.
+ */
+int ubpf_set_jitted(struct ubpf_vm *vm, ubpf_jit_fn fn);
+
+enum ubpf_jit_tier {
+    UBPF_JIT_TIER_TEMPLATE, /* single-pass x86-64 code generator (default) */
+    UBPF_JIT_TIER_LLVM,     /* optimizing LLVM ORC backend, built with LLVM=1 */
+};
+
+/*
+ * Select the code generator used by ubpf_compile
+ *
+ * The LLVM tier optimizes across instructions at the cost of a much slower
+ * compile, so it only pays off for long-running, hot programs. ubpf_compile
+ * fails with it for VMs that are sandboxed or have statistics or latency
+ * histograms enabled.
+ *
+ * Returns 0 on success, -1 if the tier is not available in this build or
+ * the VM already has jitted code.
+ */
+int ubpf_set_jit_tier(struct ubpf_vm *vm, enum ubpf_jit_tier tier);
+
+enum ubpf_fuse_result {
+    UBPF_FUSE_BITMASK,     /* bit i set if program i returned nonzero */
+    UBPF_FUSE_FIRST_MATCH, /* i + 1 for the first program i returning nonzero, or 0 */
+};
+
+/*
+ * Combine several filters into one program
+ *
+ * Each VM must have code loaded that only reads its input: no helper
+ * calls, no stores outside the stack, and no use of r10 other than as the
+ * base of a stack access. The fused program runs the filters in order on
+ * the same input, evaluating the straight-line prefix they all start with
+ * only once. Either all VMs or none must have packet access enabled, and
+ * the fused VM inherits that setting.
+ *
+ * A bitmask result supports at most 64 programs. A runtime error in any
+ * filter aborts the fused program.
+ *
+ * Returns a new VM with the fused program loaded, or NULL on error. In
+ * case of error a pointer to the error message will be stored in 'errmsg'
+ * and should be freed by the caller.
+ */
+struct ubpf_vm *ubpf_fuse(struct ubpf_vm **vms, int num_vms, enum ubpf_fuse_result result, char **errmsg);
+
+/*
+ * Program chains
+ *
+ * A chain runs the programs of several VMs one after the other on the same
+ * input. After each stage its return value is looked up in the stage's
+ * policy to decide whether to continue with the next stage, drop (stop
+ * the chain), or go to a later stage. The chain returns the value of the
+ * last stage that ran.
+ *
+ * The chain does not take ownership of the VMs, which must outlive it.
+ */
+struct ubpf_chain;
+
+enum ubpf_chain_action {
+    UBPF_CHAIN_CONTINUE, /* run the next stage, or stop after the last one */
+    UBPF_CHAIN_DROP,     /* stop the chain */
+    UBPF_CHAIN_GOTO,     /* run the given stage next */
+};
+
+struct ubpf_chain *ubpf_chain_create(void);
+void ubpf_chain_destroy(struct ubpf_chain *chain);
+
+/*
+ * Append a stage running the code loaded into 'vm'
+ *
+ * Returns the index of the new stage, or -1 if the chain is full or
+ * already compiled.
+ */
+int ubpf_chain_add(struct ubpf_chain *chain, struct ubpf_vm *vm);
+
+/*
+ * Set the action taken when 'stage' returns 'retval'
+ *
+ * 'target' is the stage to go to for UBPF_CHAIN_GOTO and must come after
+ * 'stage', so a chain always terminates.
+ *
+ * Returns 0 on success, -1 on an invalid stage or target, if the stage has
+ * too many rules, or if the chain is already compiled.
+ */
+int ubpf_chain_set_action(struct ubpf_chain *chain, int stage, uint64_t retval,
+                          enum ubpf_chain_action action, int target);
+
+/*
+ * Set the action taken when no rule of 'stage' matches its return value
+ *
+ * The default is UBPF_CHAIN_CONTINUE. Same return values as
+ * ubpf_chain_set_action.
+ */
+int ubpf_chain_set_default(struct ubpf_chain *chain, int stage,
+                           enum ubpf_chain_action action, int target);
+
+/*
+ * Run the chain with the interpreter
+ *
+ * Returns 0 on success, -1 if a stage failed.
+ */
+int ubpf_chain_exec(const struct ubpf_chain *chain, void *mem, size_t mem_len, uint64_t *bpf_return_value);
+
+/*
+ * Compile the chain into a single function
+ *
+ * A dispatcher calls the stages' machine code directly and applies the
+ * policy between them, without returning to the caller. Stages are always
+ * compiled with the template JIT. As with ubpf_compile, a runtime error in
+ * a stage makes it return UINT64_MAX, which is then looked up in the
+ * policy like any other value.
+ *
+ * Returns NULL on error. In case of error a pointer to the error message
+ * will be stored in 'errmsg' and should be freed by the caller.
+ */
+ubpf_jit_fn ubpf_chain_compile(struct ubpf_chain *chain, char **errmsg);
+
 /*
  * Translate the eBPF byte code to x64 machine code, store in buffer, and 
  * write the resulting count of bytes to size.
@@ -110,6 +586,7 @@ ubpf_jit_fn ubpf_compile(struct ubpf_vm *vm, char **errmsg);
  *
  * Returns 0 on success, -1 on error. In case of error a pointer to the error
  * message will be stored in 'errmsg' and should be freed by the caller.
+ * If the buffer was too small, 'size' is set to the size needed.
  */
 int ubpf_translate(struct ubpf_vm *vm, uint8_t *buffer, size_t *size, char **errmsg);
 
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures the cost of execution statistics on jitted code, by timing the
+ * same program compiled without and with ubpf_enable_stats in alternating
+ * rounds and keeping the fastest round of each.
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include "ubpf.h"
+
+#define ROUNDS 10
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-h] [-n ITERATIONS] PROGRAM [MEMORY]\n", name);
+    fprintf(stderr, "\nTimes the raw eBPF PROGRAM on the MEMORY file, jitted without and with\n");
+    fprintf(stderr, "execution statistics.\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -n, --iterations NUM: Number of runs per round (default 10000000)\n");
+}
+
+static void *
+readfile(const char *path, size_t *len)
+{
+    FILE *file = fopen(path, "r");
+    size_t maxlen = 1024 * 1024;
+    void *data;
+
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    data = calloc(maxlen, 1);
+    *len = fread(data, 1, maxlen, file);
+    fclose(file);
+    return data;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static ubpf_jit_fn
+compile(struct ubpf_vm *vm, const void *code, size_t code_len, bool stats)
+{
+    char *errmsg;
+    ubpf_jit_fn fn;
+
+    if (stats && ubpf_enable_stats(vm) < 0) {
+        fprintf(stderr, "Failed to enable statistics\n");
+        return NULL;
+    }
+    if (ubpf_load(vm, code, code_len, &errmsg) < 0) {
+        fprintf(stderr, "Failed to load code: %s\n", errmsg);
+        return NULL;
+    }
+    fn = ubpf_compile(vm, &errmsg);
+    if (!fn) {
+        fprintf(stderr, "Failed to compile: %s\n", errmsg);
+    }
+    return fn;
+}
+
+static double
+time_round(ubpf_jit_fn fn, void *mem, size_t mem_len, long iterations)
+{
+    volatile uint64_t sink = 0;
+    double start = now();
+    long n;
+
+    for (n = 0; n < iterations; n++) {
+        sink += fn(mem, mem_len);
+    }
+    return (now() - start) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    struct option longopts[] = {
+        { .name = "help", .val = 'h', },
+        { .name = "iterations", .val = 'n', .has_arg=1 },
+        { }
+    };
+
+    long iterations = 10000000;
+    int opt, round;
+
+    while ((opt = getopt_long(argc, argv, "hn:", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc != optind + 1 && argc != optind + 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (iterations < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t code_len, mem_len = 0;
+    void *code = readfile(argv[optind], &code_len);
+    void *mem = NULL;
+    if (!code) {
+        return 1;
+    }
+    if (argc == optind + 2) {
+        mem = readfile(argv[optind + 1], &mem_len);
+        if (!mem) {
+            return 1;
+        }
+    }
+
+    struct ubpf_vm *plain_vm = ubpf_create();
+    struct ubpf_vm *stats_vm = ubpf_create();
+    ubpf_jit_fn plain = compile(plain_vm, code, code_len, false);
+    ubpf_jit_fn counted = compile(stats_vm, code, code_len, true);
+    if (!plain || !counted) {
+        return 1;
+    }
+
+    double best_plain = 0, best_counted = 0;
+    for (round = 0; round < ROUNDS; round++) {
+        double t = time_round(plain, mem, mem_len, iterations);
+        if (round == 0 || t < best_plain) {
+            best_plain = t;
+        }
+        t = time_round(counted, mem, mem_len, iterations);
+        if (round == 0 || t < best_counted) {
+            best_counted = t;
+        }
+    }
+
+    struct ubpf_stats stats;
+    ubpf_get_stats(stats_vm, &stats);
+    if (stats.executions != (uint64_t)iterations * ROUNDS) {
+        fprintf(stderr, "Counted %" PRIu64 " executions, expected %ld\n", stats.executions, iterations * ROUNDS);
+        return 1;
+    }
+
+    printf("without stats: %.2f ns/run\n", best_plain * 1e9);
+    printf("with stats:    %.2f ns/run\n", best_counted * 1e9);
+    printf("overhead:      %.2f%%\n", (best_counted / best_plain - 1) * 100);
+    printf("estimated:     %.1f cycles/run\n", (double)stats.cycles / stats.executions);
+
+    ubpf_destroy(plain_vm);
+    ubpf_destroy(stats_vm);
+    free(code);
+    free(mem);
+    return 0;
+}
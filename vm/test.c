@@ -26,20 +26,88 @@
 #include <errno.h>
 #include <elf.h>
 #include <math.h>
+#include <pthread.h>
 #include "ubpf.h"
 
 void ubpf_set_register_offset(int x);
 static void *readfile(const char *path, size_t maxlen, size_t *len);
 static void register_functions(struct ubpf_vm *vm);
+static int register_array_map(struct ubpf_vm *vm);
+static struct ubpf_vm *load_program(const char *path, bool bounded_loops);
+
+/* Context fields given with --ctx-field, registered on every VM */
+static struct {
+    unsigned int ctx_offset, size, native_offset;
+} ctx_fields[32];
+static int num_ctx_fields;
+
+/* --packet: the memory is metadata followed by a packet, passed through a struct ubpf_packet_ctx */
+static bool packet_access;
+
+/* --sandbox: jitted code runs in a guard-region sandbox holding a copy of the memory */
+static bool sandbox;
+
+/* --sandbox-window, or 0 for guard regions */
+static unsigned long sandbox_window;
+
+/* --max-insts, or 0 to keep the default */
+static unsigned long max_insts;
+
+/* --error-limit, or -1 to keep the default */
+static long error_limit = -1;
+
+/* --threads: jitted code runs on this many threads at once */
+static long num_threads = 1;
+
+static void print_error(const struct ubpf_error_info *error);
+static void print_stats(const struct ubpf_vm *vm);
+static void print_latency(const struct ubpf_vm *vm);
+static int write_profile(const struct ubpf_vm *vm, const char *path);
+static int print_helper_profile(const struct ubpf_vm *vm);
+static void *copy_to_sandbox(struct ubpf_vm *vm, void *mem, size_t mem_len);
+static int run_batch(const struct ubpf_vm *vm, void *mem, size_t mem_len, unsigned int n, uint64_t *ret);
+static int run_threads(ubpf_jit_fn fn, void *mem, size_t mem_len, long runs, uint64_t *ret);
+
+/* Sampling rate of --profile */
+#define PROFILE_HZ 1000
+static int run_chain(char **paths, int num_paths, char *policy, bool jit, bool bounded_loops,
+                     void *mem, size_t mem_len);
 
 static void usage(const char *name)
 {
-    fprintf(stderr, "usage: %s [-h] [-j|--jit] [-m|--mem PATH] BINARY\n", name);
+    fprintf(stderr, "usage: %s [-h] [-j|--jit] [-m|--mem PATH] BINARY...\n", name);
     fprintf(stderr, "\nExecutes the eBPF code in BINARY and prints the result to stdout.\n");
     fprintf(stderr, "If --mem is given then the specified file will be read and a pointer\nto its data passed in r1.\n");
     fprintf(stderr, "If --jit is given then the JIT compiler will be used.\n");
     fprintf(stderr, "\nOther options:\n");
     fprintf(stderr, "  -r, --register-offset NUM: Change the mapping from eBPF to x86 registers\n");
+    fprintf(stderr, "  -l, --bounded-loops: Reject programs with loops that cannot be proven bounded\n");
+    fprintf(stderr, "  -I, --max-insts NUM: Reject programs of NUM instructions or more\n");
+    fprintf(stderr, "  -t, --jit-tier NAME: JIT code generator to use, 'template' (default) or 'llvm'\n");
+    fprintf(stderr, "  -f, --fuse RESULT: Fuse all BINARY filters into one program returning 'bitmask' or 'first'\n");
+    fprintf(stderr, "  -c, --chain POLICY: Run all BINARY programs as a chain. POLICY is a comma-separated\n");
+    fprintf(stderr, "      list of STAGE:VALUE=ACTION, where VALUE is a return value or '*' for any other\n");
+    fprintf(stderr, "      value and ACTION is 'continue', 'drop' or the stage to go to\n");
+    fprintf(stderr, "  -x, --ctx-field CTX:SIZE:NATIVE: Rewrite context accesses at offset CTX with SIZE\n");
+    fprintf(stderr, "      bytes to offset NATIVE of the memory. May be repeated\n");
+    fprintf(stderr, "  -E, --error-limit NUM: Print at most NUM runtime errors per second. With 0, the\n");
+    fprintf(stderr, "      structured error of a failed run is printed instead\n");
+    fprintf(stderr, "  -p, --packet META_LEN: Enable direct packet access. The first META_LEN bytes of\n");
+    fprintf(stderr, "      the memory are data_meta, the rest is the packet\n");
+    fprintf(stderr, "  -G, --sandbox: Run jitted code in a guard-region sandbox\n");
+    fprintf(stderr, "  -W, --sandbox-window SIZE: Run jitted code in a sandbox of SIZE bytes that\n");
+    fprintf(stderr, "      confines addresses by masking. Implies --sandbox\n");
+    fprintf(stderr, "  -b, --batch NUM: Run the interpreter on NUM copies of the memory at once with\n");
+    fprintf(stderr, "      ubpf_exec_batch\n");
+    fprintf(stderr, "  -s, --stats: Print execution statistics to stderr\n");
+    fprintf(stderr, "  -n, --runs NUM: Run the program NUM times and print percentiles of its\n");
+    fprintf(stderr, "      execution time in cycles to stderr\n");
+    fprintf(stderr, "  -T, --threads NUM: Run jitted code on NUM threads at once, --runs times on each.\n");
+    fprintf(stderr, "      All of them must return the same value\n");
+    fprintf(stderr, "  -P, --profile PATH: Profile the jitted program and write 'PC SAMPLES' lines to\n");
+    fprintf(stderr, "      PATH, for use with bin/ubpf-profile\n");
+    fprintf(stderr, "  -H, --helper-profile: Print calls and cycles per helper and call site to stderr.\n");
+    fprintf(stderr, "      Needs a build with HELPER_PROFILE=1\n");
 }
 
 int main(int argc, char **argv)
@@ -49,14 +117,41 @@ int main(int argc, char **argv)
         { .name = "mem", .val = 'm', .has_arg=1 },
         { .name = "jit", .val = 'j' },
         { .name = "register-offset", .val = 'r', .has_arg=1 },
+        { .name = "bounded-loops", .val = 'l' },
+        { .name = "max-insts", .val = 'I', .has_arg=1 },
+        { .name = "jit-tier", .val = 't', .has_arg=1 },
+        { .name = "fuse", .val = 'f', .has_arg=1 },
+        { .name = "chain", .val = 'c', .has_arg=1 },
+        { .name = "ctx-field", .val = 'x', .has_arg=1 },
+        { .name = "packet", .val = 'p', .has_arg=1 },
+        { .name = "error-limit", .val = 'E', .has_arg=1 },
+        { .name = "sandbox", .val = 'G' },
+        { .name = "sandbox-window", .val = 'W', .has_arg=1 },
+        { .name = "batch", .val = 'b', .has_arg=1 },
+        { .name = "stats", .val = 's' },
+        { .name = "runs", .val = 'n', .has_arg=1 },
+        { .name = "threads", .val = 'T', .has_arg=1 },
+        { .name = "profile", .val = 'P', .has_arg=1 },
+        { .name = "helper-profile", .val = 'H' },
         { }
     };
 
     const char *mem_filename = NULL;
     bool jit = false;
+    bool bounded_loops = false;
+    enum ubpf_jit_tier jit_tier = UBPF_JIT_TIER_TEMPLATE;
+    bool fuse = false;
+    enum ubpf_fuse_result fuse_result = UBPF_FUSE_BITMASK;
+    char *chain_policy = NULL;
+    size_t meta_len = 0;
+    bool stats = false;
+    long runs = 1;
+    unsigned long batch = 0;
+    const char *profile_filename = NULL;
+    bool helper_profile = false;
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "hm:jr:", longopts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hm:jr:lI:t:f:c:x:p:E:GW:b:sn:T:P:H", longopts, NULL)) != -1) {
         switch (opt) {
         case 'm':
             mem_filename = optarg;
@@ -67,6 +162,85 @@ int main(int argc, char **argv)
         case 'r':
             ubpf_set_register_offset(atoi(optarg));
             break;
+        case 'l':
+            bounded_loops = true;
+            break;
+        case 'I':
+            max_insts = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            if (!strcmp(optarg, "template")) {
+                jit_tier = UBPF_JIT_TIER_TEMPLATE;
+            } else if (!strcmp(optarg, "llvm")) {
+                jit_tier = UBPF_JIT_TIER_LLVM;
+            } else {
+                fprintf(stderr, "Unknown JIT tier %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'f':
+            fuse = true;
+            if (!strcmp(optarg, "bitmask")) {
+                fuse_result = UBPF_FUSE_BITMASK;
+            } else if (!strcmp(optarg, "first")) {
+                fuse_result = UBPF_FUSE_FIRST_MATCH;
+            } else {
+                fprintf(stderr, "Unknown fuse result %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            chain_policy = optarg;
+            break;
+        case 'x':
+            if (num_ctx_fields == sizeof(ctx_fields) / sizeof(ctx_fields[0]) ||
+                    sscanf(optarg, "%u:%u:%u", &ctx_fields[num_ctx_fields].ctx_offset,
+                           &ctx_fields[num_ctx_fields].size, &ctx_fields[num_ctx_fields].native_offset) != 3) {
+                fprintf(stderr, "Invalid context field %s\n", optarg);
+                return 1;
+            }
+            num_ctx_fields++;
+            break;
+        case 'G':
+            sandbox = true;
+            break;
+        case 'W':
+            sandbox = true;
+            sandbox_window = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            batch = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            stats = true;
+            break;
+        case 'P':
+            profile_filename = optarg;
+            break;
+        case 'H':
+            helper_profile = true;
+            break;
+        case 'n':
+            runs = atol(optarg);
+            if (runs < 1) {
+                fprintf(stderr, "Invalid number of runs %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'T':
+            num_threads = atol(optarg);
+            if (num_threads < 1) {
+                fprintf(stderr, "Invalid number of threads %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'E':
+            error_limit = atol(optarg);
+            break;
+        case 'p':
+            packet_access = true;
+            meta_len = strtoul(optarg, NULL, 0);
+            break;
         case 'h':
             usage(argv[0]);
             return 0;
@@ -76,18 +250,11 @@ int main(int argc, char **argv)
         }
     }
 
-    if (argc != optind + 1) {
+    if (argc != optind + 1 && !((fuse || chain_policy) && argc > optind)) {
         usage(argv[0]);
         return 1;
     }
 
-    const char *code_filename = argv[optind];
-    size_t code_len;
-    void *code = readfile(code_filename, 1024*1024, &code_len);
-    if (code == NULL) {
-        return 1;
-    }
-
     size_t mem_len = 0;
     void *mem = NULL;
     if (mem_filename != NULL) {
@@ -97,38 +264,73 @@ int main(int argc, char **argv)
         }
     }
 
-    struct ubpf_vm *vm = ubpf_create();
-    if (!vm) {
-        fprintf(stderr, "Failed to create VM\n");
-        return 1;
+    struct ubpf_packet_ctx packet_ctx;
+    if (packet_access) {
+        if (meta_len > mem_len) {
+            fprintf(stderr, "Metadata length %zu exceeds the memory size %zu\n", meta_len, mem_len);
+            return 1;
+        }
+        packet_ctx.data_meta = mem;
+        packet_ctx.data = (char *)mem + meta_len;
+        packet_ctx.data_end = (char *)mem + mem_len;
+        mem = &packet_ctx;
+        mem_len = sizeof(packet_ctx);
     }
 
-    register_functions(vm);
-
-    /* 
-     * The ELF magic corresponds to an RSH instruction with an offset,
-     * which is invalid.
-     */
-    bool elf = code_len >= SELFMAG && !memcmp(code, ELFMAG, SELFMAG);
+    if (chain_policy) {
+        return run_chain(argv + optind, argc - optind, chain_policy, jit, bounded_loops, mem, mem_len);
+    }
 
     char *errmsg;
-    int rv;
-    if (elf) {
-	rv = ubpf_load_elf(vm, code, code_len, &errmsg);
+    struct ubpf_vm *vm;
+
+    if (fuse) {
+        int num_vms = argc - optind, i;
+        struct ubpf_vm **vms = calloc(num_vms, sizeof(vms[0]));
+        for (i = 0; i < num_vms; i++) {
+            vms[i] = load_program(argv[optind + i], bounded_loops);
+            if (!vms[i]) {
+                return 1;
+            }
+        }
+        vm = ubpf_fuse(vms, num_vms, fuse_result, &errmsg);
+        for (i = 0; i < num_vms; i++) {
+            ubpf_destroy(vms[i]);
+        }
+        free(vms);
+        if (!vm) {
+            fprintf(stderr, "Failed to fuse programs: %s\n", errmsg);
+            free(errmsg);
+            return 1;
+        }
     } else {
-	rv = ubpf_load(vm, code, code_len, &errmsg);
+        vm = load_program(argv[optind], bounded_loops);
+        if (!vm) {
+            return 1;
+        }
     }
 
-    free(code);
+    if (ubpf_set_jit_tier(vm, jit_tier) < 0) {
+        fprintf(stderr, "JIT tier %s is not available\n", jit_tier == UBPF_JIT_TIER_LLVM ? "llvm" : "template");
+        return 1;
+    }
 
-    if (rv < 0) {
-        fprintf(stderr, "Failed to load code: %s\n", errmsg);
-        free(errmsg);
-        ubpf_destroy(vm);
+    if (stats && ubpf_enable_stats(vm) < 0) {
+        fprintf(stderr, "Failed to enable statistics\n");
+        return 1;
+    }
+    if (runs > 1 && ubpf_enable_latency_histogram(vm, 1) < 0) {
+        fprintf(stderr, "Failed to enable latency histograms\n");
+        return 1;
+    }
+
+    if (profile_filename && ubpf_enable_profiling(vm) < 0) {
+        fprintf(stderr, "Failed to enable profiling\n");
         return 1;
     }
 
     uint64_t ret;
+    long run;
 
     if (jit) {
         ubpf_jit_fn fn = ubpf_compile(vm, &errmsg);
@@ -137,19 +339,467 @@ int main(int argc, char **argv)
             free(errmsg);
             return 1;
         }
+        if (profile_filename && ubpf_profile_start(PROFILE_HZ) < 0) {
+            fprintf(stderr, "Failed to start the profiler\n");
+            return 1;
+        }
+        if (sandbox && mem && !(mem = copy_to_sandbox(vm, mem, mem_len))) {
+            fprintf(stderr, "Failed to allocate sandbox memory\n");
+            return 1;
+        }
+        if (num_threads > 1) {
+            if (run_threads(fn, mem, mem_len, runs, &ret) < 0) {
+                return 1;
+            }
+        } else {
+            for (run = 0; run < runs; run++) {
+                ret = fn(mem, mem_len);
+            }
+        }
+        ubpf_profile_stop();
+    } else if (batch) {
+        for (run = 0; run < runs; run++) {
+            if (run_batch(vm, mem, mem_len, batch, &ret) < 0) {
+                return 1;
+            }
+        }
+    } else {
+        for (run = 0; run < runs; run++) {
+            if (ubpf_exec(vm, mem, mem_len, &ret) < 0)
+                ret = UINT64_MAX;
+        }
+    }
+
+    struct ubpf_error_info error;
+    if (ubpf_take_last_error(&error) && error_limit == 0) {
+        print_error(&error);
+    }
+
+    if (stats) {
+        print_stats(vm);
+    }
+    if (runs > 1) {
+        print_latency(vm);
+    }
+    if (profile_filename && write_profile(vm, profile_filename) < 0) {
+        return 1;
+    }
+    if (helper_profile && print_helper_profile(vm) < 0) {
+        return 1;
+    }
+
+    printf("0x%"PRIx64"\n", ret);
+
+    ubpf_destroy(vm);
+
+    return 0;
+}
+
+static int run_chain(char **paths, int num_paths, char *policy, bool jit, bool bounded_loops,
+                     void *mem, size_t mem_len)
+{
+    struct ubpf_chain *chain = ubpf_chain_create();
+    struct ubpf_vm **vms = calloc(num_paths, sizeof(vms[0]));
+    char *rule, *saveptr = NULL;
+    char *errmsg;
+    uint64_t ret;
+    int result = 1;
+    int i;
+
+    for (i = 0; i < num_paths; i++) {
+        vms[i] = load_program(paths[i], bounded_loops);
+        if (!vms[i]) {
+            goto out;
+        }
+        if (ubpf_chain_add(chain, vms[i]) < 0) {
+            fprintf(stderr, "Too many stages\n");
+            goto out;
+        }
+    }
+
+    for (rule = strtok_r(policy, ",", &saveptr); rule; rule = strtok_r(NULL, ",", &saveptr)) {
+        char value[32], action[32];
+        enum ubpf_chain_action chain_action = UBPF_CHAIN_GOTO;
+        int stage, target = 0, rc;
+
+        if (sscanf(rule, "%d:%31[^=]=%31s", &stage, value, action) != 3) {
+            fprintf(stderr, "Invalid chain rule %s\n", rule);
+            goto out;
+        }
+        if (!strcmp(action, "continue")) {
+            chain_action = UBPF_CHAIN_CONTINUE;
+        } else if (!strcmp(action, "drop")) {
+            chain_action = UBPF_CHAIN_DROP;
+        } else {
+            target = atoi(action);
+        }
+
+        if (!strcmp(value, "*")) {
+            rc = ubpf_chain_set_default(chain, stage, chain_action, target);
+        } else {
+            rc = ubpf_chain_set_action(chain, stage, strtoull(value, NULL, 0), chain_action, target);
+        }
+        if (rc < 0) {
+            fprintf(stderr, "Failed to set chain rule %s\n", rule);
+            goto out;
+        }
+    }
+
+    if (jit) {
+        ubpf_jit_fn fn = ubpf_chain_compile(chain, &errmsg);
+        if (fn == NULL) {
+            fprintf(stderr, "Failed to compile: %s\n", errmsg);
+            free(errmsg);
+            goto out;
+        }
         ret = fn(mem, mem_len);
     } else {
-        if (ubpf_exec(vm, mem, mem_len, &ret) < 0)
+        if (ubpf_chain_exec(chain, mem, mem_len, &ret) < 0)
             ret = UINT64_MAX;
     }
 
     printf("0x%"PRIx64"\n", ret);
+    result = 0;
 
-    ubpf_destroy(vm);
+out:
+    ubpf_chain_destroy(chain);
+    for (i = 0; i < num_paths; i++) {
+        if (vms[i]) {
+            ubpf_destroy(vms[i]);
+        }
+    }
+    free(vms);
+    return result;
+}
+
+static void print_error(const struct ubpf_error_info *error)
+{
+    static const char *names[] = {
+        [UBPF_ERROR_NONE] = "no error",
+        [UBPF_ERROR_OUT_OF_BOUNDS_LOAD] = "out of bounds load",
+        [UBPF_ERROR_OUT_OF_BOUNDS_STORE] = "out of bounds store",
+        [UBPF_ERROR_DIV_BY_ZERO] = "division by zero",
+        [UBPF_ERROR_NO_CODE] = "no code loaded",
+        [UBPF_ERROR_SANDBOX_BUSY] = "shared sandbox stack busy",
+    };
+
+    fprintf(stderr, "%s at PC %u", names[error->kind], error->pc);
+    if (error->kind == UBPF_ERROR_OUT_OF_BOUNDS_LOAD || error->kind == UBPF_ERROR_OUT_OF_BOUNDS_STORE) {
+        fprintf(stderr, ", addr 0x%"PRIx64", size %u", error->addr, error->size);
+    }
+    fprintf(stderr, "\n");
+}
+
+static void print_stats(const struct ubpf_vm *vm)
+{
+    struct ubpf_stats stats;
+    uint64_t errors = 0;
+    int i;
+
+    ubpf_get_stats(vm, &stats);
+    for (i = 0; i < UBPF_NUM_ERROR_KINDS; i++) {
+        errors += stats.errors[i];
+    }
+    fprintf(stderr, "executions %"PRIu64", instructions %"PRIu64", helper calls %"PRIu64", errors %"PRIu64", cycles %"PRIu64"\n",
+            stats.executions, stats.instructions, stats.helper_calls, errors, stats.cycles);
+}
 
+static void print_latency(const struct ubpf_vm *vm)
+{
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    struct ubpf_latency_histogram hist;
+    int i;
+
+    ubpf_get_latency_histogram(vm, &hist);
+    fprintf(stderr, "runs %"PRIu64, hist.count);
+    for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        fprintf(stderr, ", p%g %"PRIu64, percentiles[i], ubpf_latency_percentile(&hist, percentiles[i]));
+    }
+    fprintf(stderr, ", max %"PRIu64" cycles\n", hist.max);
+}
+
+static int write_profile(const struct ubpf_vm *vm, const char *path)
+{
+    int num_insts = ubpf_get_profile(vm, NULL, 0);
+    uint64_t *samples = calloc(num_insts, sizeof(samples[0]));
+    FILE *file = fopen(path, "w");
+    int i;
+
+    if (!file) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        free(samples);
+        return -1;
+    }
+
+    ubpf_get_profile(vm, samples, num_insts);
+    for (i = 0; i < num_insts; i++) {
+        if (samples[i]) {
+            fprintf(file, "%d %"PRIu64"\n", i, samples[i]);
+        }
+    }
+
+    fclose(file);
+    free(samples);
     return 0;
 }
 
+/*
+ * Run the program on 'n' copies of the memory, and of the packet of a
+ * struct ubpf_packet_ctx, which must all give the same result
+ */
+static int run_batch(const struct ubpf_vm *vm, void *mem, size_t mem_len, unsigned int n, uint64_t *ret)
+{
+    struct ubpf_packet_ctx *pkt = packet_access ? mem : NULL;
+    size_t pkt_len = pkt ? (size_t)((char *)pkt->data_end - (char *)pkt->data_meta) : 0;
+    size_t copy_len = mem_len + pkt_len;
+    void **mems = calloc(n, sizeof(mems[0]));
+    size_t *mem_lens = calloc(n, sizeof(mem_lens[0]));
+    uint64_t *results = calloc(n, sizeof(results[0]));
+    char *copies = copy_len ? malloc(n * copy_len) : NULL;
+    unsigned int i;
+    int rv = 0;
+
+    if (!mems || !mem_lens || !results || (copy_len && !copies)) {
+        fprintf(stderr, "Failed to allocate the batch\n");
+        rv = -1;
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (mem) {
+            mems[i] = copies + i * copy_len;
+            memcpy(mems[i], mem, mem_len);
+        }
+        if (pkt) {
+            struct ubpf_packet_ctx *copy = mems[i];
+            char *data = (char *)mems[i] + mem_len;
+            memcpy(data, pkt->data_meta, pkt_len);
+            copy->data = data + ((char *)pkt->data - (char *)pkt->data_meta);
+            copy->data_meta = data;
+            copy->data_end = data + pkt_len;
+        }
+        mem_lens[i] = mem_len;
+    }
+
+    ubpf_exec_batch(vm, mems, mem_lens, results, n);
+    for (i = 1; i < n; i++) {
+        if (results[i] != results[0]) {
+            fprintf(stderr, "Batch run %u returned 0x%"PRIx64", run 0 returned 0x%"PRIx64"\n",
+                    i, results[i], results[0]);
+            rv = -1;
+            goto out;
+        }
+    }
+    *ret = results[0];
+
+out:
+    free(mems);
+    free(mem_lens);
+    free(results);
+    free(copies);
+    return rv;
+}
+
+struct thread_run {
+    pthread_t thread;
+    ubpf_jit_fn fn;
+    void *mem;
+    size_t mem_len;
+    long runs;
+    uint64_t ret;
+    bool failed;
+    struct ubpf_error_info error;
+};
+
+static void *run_thread(void *arg)
+{
+    struct thread_run *t = arg;
+    long run;
+
+    for (run = 0; run < t->runs; run++) {
+        t->ret = t->fn(t->mem, t->mem_len);
+    }
+    t->failed = ubpf_take_last_error(&t->error);
+    return NULL;
+}
+
+/* Run jitted code on num_threads threads at once, printing the first error with --error-limit 0 */
+static int run_threads(ubpf_jit_fn fn, void *mem, size_t mem_len, long runs, uint64_t *ret)
+{
+    struct thread_run *threads = calloc(num_threads, sizeof(threads[0]));
+    long i, started;
+    bool printed = false;
+    int rv = 0;
+
+    if (!threads) {
+        fprintf(stderr, "Failed to allocate the threads\n");
+        return -1;
+    }
+
+    for (started = 0; started < num_threads; started++) {
+        struct thread_run *t = &threads[started];
+        t->fn = fn;
+        t->mem = mem;
+        t->mem_len = mem_len;
+        t->runs = runs;
+        if (pthread_create(&t->thread, NULL, run_thread, t) != 0) {
+            fprintf(stderr, "Failed to start thread %ld\n", started);
+            rv = -1;
+            break;
+        }
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+
+    for (i = 0; i < started; i++) {
+        if (threads[i].failed && error_limit == 0 && !printed) {
+            print_error(&threads[i].error);
+            printed = true;
+        }
+        if (threads[i].ret != threads[0].ret) {
+            fprintf(stderr, "Thread %ld returned 0x%"PRIx64", thread 0 0x%"PRIx64"\n", i, threads[i].ret,
+                    threads[0].ret);
+            rv = -1;
+        }
+    }
+    *ret = threads[0].ret;
+
+    free(threads);
+    return rv;
+}
+
+/* Copy the memory, or the packet of a struct ubpf_packet_ctx, into the sandbox */
+static void *copy_to_sandbox(struct ubpf_vm *vm, void *mem, size_t mem_len)
+{
+    if (packet_access) {
+        struct ubpf_packet_ctx *pkt = mem;
+        size_t len = (char *)pkt->data_end - (char *)pkt->data_meta;
+        size_t meta_len = (char *)pkt->data - (char *)pkt->data_meta;
+        struct ubpf_packet_ctx *copy = ubpf_sandbox_alloc(vm, sizeof(*copy));
+        char *data = ubpf_sandbox_alloc(vm, len);
+        if (!copy || !data) {
+            return NULL;
+        }
+        memcpy(data, pkt->data_meta, len);
+        copy->data_meta = data;
+        copy->data = data + meta_len;
+        copy->data_end = data + len;
+        return copy;
+    }
+
+    void *copy = ubpf_sandbox_alloc(vm, mem_len);
+    if (copy) {
+        memcpy(copy, mem, mem_len);
+    }
+    return copy;
+}
+
+static int print_helper_profile(const struct ubpf_vm *vm)
+{
+    struct ubpf_helper_profile profile;
+    unsigned int idx;
+    uint32_t pc;
+
+    if (ubpf_get_helper_profile(vm, 0, &profile) < 0) {
+        fprintf(stderr, "Helper profiling is not built in\n");
+        return -1;
+    }
+
+    for (idx = 0; ubpf_get_helper_profile(vm, idx, &profile) == 0; idx++) {
+        if (profile.calls) {
+            fprintf(stderr, "helper %u: calls %"PRIu64", cycles %"PRIu64"\n", idx, profile.calls, profile.cycles);
+        }
+    }
+    for (pc = 0; pc < (max_insts ? max_insts : UBPF_MAX_INSTS); pc++) {
+        if (ubpf_get_helper_site_profile(vm, pc, &profile) == 0) {
+            fprintf(stderr, "call at PC %u: calls %"PRIu64", cycles %"PRIu64"\n", pc, profile.calls, profile.cycles);
+        }
+    }
+    return 0;
+}
+
+static struct ubpf_vm *load_program(const char *path, bool bounded_loops)
+{
+    size_t code_len;
+    void *code = readfile(path, 1024*1024 + max_insts * 8, &code_len);
+    if (code == NULL) {
+        return NULL;
+    }
+
+    struct ubpf_vm *vm = ubpf_create();
+    if (!vm) {
+        fprintf(stderr, "Failed to create VM\n");
+        free(code);
+        return NULL;
+    }
+
+    register_functions(vm);
+    ubpf_toggle_bounded_loops(vm, bounded_loops);
+    if (max_insts && ubpf_set_max_insts(vm, max_insts) < 0) {
+        fprintf(stderr, "Invalid instruction limit %lu\n", max_insts);
+        ubpf_destroy(vm);
+        free(code);
+        return NULL;
+    }
+    ubpf_toggle_packet_access(vm, packet_access);
+    ubpf_toggle_sandbox(vm, sandbox);
+    if (sandbox_window && ubpf_set_sandbox_window(vm, sandbox_window) < 0) {
+        fprintf(stderr, "Invalid sandbox window size %lu\n", sandbox_window);
+        ubpf_destroy(vm);
+        free(code);
+        return NULL;
+    }
+    if (error_limit >= 0) {
+        ubpf_set_error_print_limit(vm, error_limit);
+    }
+
+    int i;
+    for (i = 0; i < num_ctx_fields; i++) {
+        if (ubpf_register_ctx_field(vm, ctx_fields[i].ctx_offset, ctx_fields[i].size,
+                                    ctx_fields[i].native_offset) < 0) {
+            fprintf(stderr, "Failed to register context field %u:%u:%u\n",
+                    ctx_fields[i].ctx_offset, ctx_fields[i].size, ctx_fields[i].native_offset);
+            ubpf_destroy(vm);
+            free(code);
+            return NULL;
+        }
+    }
+
+    /* After the sandbox settings, since its values may have to go in the sandbox */
+    if (register_array_map(vm) < 0) {
+        fprintf(stderr, "Failed to register the array map\n");
+        ubpf_destroy(vm);
+        free(code);
+        return NULL;
+    }
+
+    /* 
+     * The ELF magic corresponds to an RSH instruction with an offset,
+     * which is invalid.
+     */
+    bool elf = code_len >= SELFMAG && !memcmp(code, ELFMAG, SELFMAG);
+
+    char *errmsg;
+    int rv;
+    if (elf) {
+	rv = ubpf_load_elf(vm, code, code_len, &errmsg);
+    } else {
+	rv = ubpf_load(vm, code, code_len, &errmsg);
+    }
+
+    free(code);
+
+    if (rv < 0) {
+        fprintf(stderr, "Failed to load code: %s\n", errmsg);
+        free(errmsg);
+        ubpf_destroy(vm);
+        return NULL;
+    }
+
+    return vm;
+}
+
 static void *readfile(const char *path, size_t maxlen, size_t *len)
 {
     FILE *file;
@@ -243,3 +893,22 @@ register_functions(struct ubpf_vm *vm)
     ubpf_register(vm, 5, "unwind", unwind);
     ubpf_set_unwind_function_index(vm, 5);
 }
+
+/* Values of the array map looked up by helper 6, shared by all programs */
+static uint64_t array_map_values[4] = { 0x11, 0x22, 0x33, 0x44 };
+
+static int
+register_array_map(struct ubpf_vm *vm)
+{
+    void *values = array_map_values;
+
+    if (sandbox) {
+        values = ubpf_sandbox_alloc(vm, sizeof(array_map_values));
+        if (!values) {
+            return -1;
+        }
+        memcpy(values, array_map_values, sizeof(array_map_values));
+    }
+    return ubpf_register_array_map(vm, 6, "array_map_lookup", values, sizeof(array_map_values[0]),
+                                   sizeof(array_map_values) / sizeof(array_map_values[0]));
+}
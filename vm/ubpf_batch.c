@@ -0,0 +1,528 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * SPMD batch interpreter
+ *
+ * Runs one program over UBPF_BATCH_LANES inputs at once. Each eBPF
+ * register holds one value per lane in a vector, so ALU instructions and
+ * comparisons execute for all lanes together, and decoding and dispatch
+ * are shared by the lanes.
+ *
+ * The lanes at the current PC are active. When a branch goes different
+ * ways in different lanes, the lanes headed for the higher PC wait while
+ * the others run under a mask. Execution always continues at the lowest
+ * PC of any running lane, so waiting lanes join the active ones again
+ * where their paths meet. Lanes stop at exit or at a runtime error while
+ * the others carry on.
+ *
+ * Loads and stores access memory lane by lane, since each address needs a
+ * bounds check against its own lane's buffers. The loads of all lanes are
+ * issued back to back, so their cache misses overlap. Programs that call
+ * helpers run one input at a time through ubpf_exec instead.
+ *
+ * Either way, inputs are processed in groups of UBPF_BATCH_LANES, and the
+ * inputs of later groups are prefetched while a group runs: the bytes the
+ * program reads from its input two groups ahead and, for packets, the
+ * headers of the packet one group ahead, whose context is in cache by
+ * then.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <byteswap.h>
+#include "ubpf_int.h"
+
+#define LANES UBPF_BATCH_LANES
+
+#define CACHE_LINE_SIZE 64
+/* Most of the input prefetched, and the packet headers prefetched */
+#define MAX_PREFETCH_SIZE 256
+#define PACKET_PREFETCH_SIZE 128
+
+typedef uint64_t lanes __attribute__((vector_size(LANES * sizeof(uint64_t))));
+typedef int64_t slanes __attribute__((vector_size(LANES * sizeof(int64_t))));
+
+#define SPLAT(x) ((lanes){ 0 } + (uint64_t)(x))
+#define FOR_EACH_LANE(i, bits) for (unsigned int _b = (bits); _b && ((i) = __builtin_ctz(_b), 1); _b &= _b - 1)
+
+/* Inlined into each clone of run_lanes, so that vectors never cross a call */
+#define LANE_OP static inline __attribute__((always_inline))
+
+/* Wider vectors where the CPU has them, selected when the program starts */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define BATCH_TARGETS __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define BATCH_TARGETS
+#endif
+
+/* All-ones in the lanes whose bit is set in 'bits' */
+LANE_OP lanes
+mask_of(unsigned int bits)
+{
+    lanes index = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    return (lanes)(((SPLAT(bits) >> index) & 1) != 0);
+}
+
+LANE_OP unsigned int
+bits_of(lanes mask)
+{
+    unsigned int bits = 0;
+    for (int i = 0; i < LANES; i++) {
+        bits |= (mask[i] & 1) << i;
+    }
+    return bits;
+}
+
+LANE_OP lanes
+blend(lanes mask, lanes a, lanes b)
+{
+    return (a & mask) | (b & ~mask);
+}
+
+bool
+ubpf_batch_supported(const struct ubpf_vm *vm)
+{
+    if (!vm->insts || ubpf_instrumented(vm)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < vm->num_insts; i++) {
+        if (vm->insts[i].opcode == EBPF_OP_CALL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Active lanes whose divisor is zero fail; all lanes get a divisor that is safe to use */
+LANE_OP lanes
+check_divisor(const struct ubpf_vm *vm, uint32_t pc, unsigned int *active, lanes b)
+{
+    unsigned int zero = bits_of((lanes)(b == 0)) & *active;
+
+    for (int i = __builtin_popcount(zero); i > 0; i--) {
+        ubpf_report_div_by_zero(vm, pc);
+    }
+    *active &= ~zero;
+
+    return blend((lanes)(b != 0), b, SPLAT(1));
+}
+
+/* The low 'bits' bits of x, sign-extended */
+LANE_OP lanes
+sign_extend(lanes x, int bits)
+{
+    return (lanes)((slanes)(x << (64 - bits)) >> (64 - bits));
+}
+
+/* Signed division or modulo by nonzero divisors, wrapping on INT_MIN / -1 like the interpreter */
+LANE_OP lanes
+signed_divmod(bool mod, bool is64, lanes a, lanes b)
+{
+    slanes sa = (slanes)(is64 ? a : sign_extend(a, 32));
+    slanes sb = (slanes)(is64 ? b : sign_extend(b, 32));
+    lanes minus_one = (lanes)(sb == -1);
+    slanes safe = (slanes)blend(minus_one, SPLAT(1), (lanes)sb);
+    lanes r = (lanes)(mod ? sa % safe : sa / safe);
+
+    return blend(minus_one, mod ? SPLAT(0) : -(lanes)sa, r);
+}
+
+LANE_OP lanes
+alu(const struct ubpf_vm *vm, struct ebpf_inst inst, uint32_t pc, lanes a, lanes b, unsigned int *active)
+{
+    bool is64 = (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+    lanes lo = SPLAT(UINT32_MAX);
+    lanes r;
+
+    switch (inst.opcode & EBPF_ALU_OP_MASK) {
+    case 0x00: r = a + b; break;
+    case 0x10: r = a - b; break;
+    case 0x20: r = a * b; break;
+    case 0x30:
+        b = check_divisor(vm, pc, active, is64 ? b : b & lo);
+        if (inst.offset == EBPF_OFFSET_SDIV) {
+            r = signed_divmod(false, is64, a, b);
+        } else {
+            r = is64 ? a / b : (a & lo) / b;
+        }
+        break;
+    case 0x40: r = a | b; break;
+    case 0x50: r = a & b; break;
+    case 0x60: r = a << (b & (is64 ? 63 : 31)); break;
+    case 0x70: r = is64 ? a >> (b & 63) : (a & lo) >> (b & 31); break;
+    case 0x80: r = -a; break;
+    case 0x90:
+        b = check_divisor(vm, pc, active, is64 ? b : b & lo);
+        if (inst.offset == EBPF_OFFSET_SDIV) {
+            r = signed_divmod(true, is64, a, b);
+        } else {
+            r = is64 ? a % b : (a & lo) % b;
+        }
+        break;
+    case 0xa0: r = a ^ b; break;
+    case 0xb0: r = inst.offset ? sign_extend(b, inst.offset) : b; break;
+    case 0xc0:
+        if (is64) {
+            r = (lanes)((slanes)a >> (slanes)(b & 63));
+        } else {
+            r = (lanes)(((slanes)(a << 32) >> 32) >> (slanes)(b & 31));
+        }
+        break;
+    default: /* EBPF_OP_LE, EBPF_OP_BE, EBPF_OP_BSWAP */
+        r = a;
+        for (int i = 0; i < LANES; i++) {
+            if (inst.opcode == EBPF_OP_LE) {
+                r[i] = inst.imm == 16 ? htole16(a[i]) : inst.imm == 32 ? htole32(a[i]) : htole64(a[i]);
+            } else if (inst.opcode == EBPF_OP_BE) {
+                r[i] = inst.imm == 16 ? htobe16(a[i]) : inst.imm == 32 ? htobe32(a[i]) : htobe64(a[i]);
+            } else {
+                r[i] = inst.imm == 16 ? bswap_16(a[i]) : inst.imm == 32 ? bswap_32(a[i]) : bswap_64(a[i]);
+            }
+        }
+        return r;
+    }
+
+    return is64 ? r : r & lo;
+}
+
+/* Lanes where the conditional branch of 'inst' is taken */
+LANE_OP lanes
+branch_taken(struct ebpf_inst inst, lanes a, lanes b)
+{
+    switch (inst.opcode & EBPF_ALU_OP_MASK) {
+    case 0x10: return (lanes)(a == b);
+    case 0x20: return (lanes)(a > b);
+    case 0x30: return (lanes)(a >= b);
+    case 0x40: return (lanes)((a & b) != 0);
+    case 0x50: return (lanes)(a != b);
+    case 0x60: return (lanes)((slanes)a > (slanes)b);
+    case 0x70: return (lanes)((slanes)a >= (slanes)b);
+    case 0xa0: return (lanes)(a < b);
+    case 0xb0: return (lanes)(a <= b);
+    case 0xc0: return (lanes)((slanes)a < (slanes)b);
+    default:   return (lanes)((slanes)a <= (slanes)b); /* 0xd0 */
+    }
+}
+
+/* The low halves of the operands of a 32-bit jump, extended for its compare */
+LANE_OP lanes
+low_half(struct ebpf_inst inst, lanes x)
+{
+    switch (inst.opcode & EBPF_ALU_OP_MASK) {
+    case 0x60: case 0x70: case 0xc0: case 0xd0:
+        return (lanes)((slanes)(x << 32) >> 32);
+    default:
+        return x & 0xffffffff;
+    }
+}
+
+LANE_OP bool
+in_range(const char *addr, int size, const void *start, size_t len)
+{
+    return len >= (size_t)size && (uintptr_t)addr - (uintptr_t)start <= len - size;
+}
+
+BATCH_TARGETS
+static int
+run_lanes(const struct ubpf_vm *vm, void *const *mems, const size_t *mem_lens, uint64_t *results, int n)
+{
+    static const int sizes[] = { [EBPF_SIZE_W >> 3] = 4, [EBPF_SIZE_H >> 3] = 2, [EBPF_SIZE_B >> 3] = 1, [EBPF_SIZE_DW >> 3] = 8 };
+    const struct ebpf_inst *insts = vm->insts;
+    uint64_t stacks[LANES][(UBPF_STACK_SIZE+7)/8];
+    struct ubpf_packet_ctx pkt_bounds[LANES]; /* copied at entry, as the program can write the context */
+    const struct ubpf_packet_ctx *pkts[LANES];
+    lanes reg[16] = { 0 };
+    uint32_t pc = 0;
+    uint32_t pcs[LANES];             /* of the waiting lanes */
+    uint32_t next_wait = UINT32_MAX; /* lowest PC of a waiting lane */
+    unsigned int active = 0, waiting = 0, failed = 0;
+    int i, num_failed = 0;
+
+    for (i = 0; i < n; i++) {
+        active |= 1u << i;
+        reg[1][i] = (uintptr_t)mems[i];
+        reg[2][i] = mem_lens[i];
+        reg[10][i] = (uintptr_t)stacks[i] + sizeof(stacks[i]);
+        pkts[i] = NULL;
+        if (vm->packet_access && mem_lens[i] >= sizeof(pkt_bounds[i])) {
+            memcpy(&pkt_bounds[i], mems[i], sizeof(pkt_bounds[i]));
+            pkts[i] = &pkt_bounds[i];
+        }
+    }
+
+    while (1) {
+        if (pc >= next_wait) {
+            /* Park the active lanes and continue with those at the lowest PC */
+            FOR_EACH_LANE(i, active) {
+                pcs[i] = pc;
+            }
+            waiting |= active;
+            if (!waiting) {
+                break;
+            }
+            pc = UINT32_MAX;
+            FOR_EACH_LANE(i, waiting) {
+                pc = pcs[i] < pc ? pcs[i] : pc;
+            }
+            active = 0;
+            next_wait = UINT32_MAX;
+            FOR_EACH_LANE(i, waiting) {
+                if (pcs[i] == pc) {
+                    active |= 1u << i;
+                } else if (pcs[i] < next_wait) {
+                    next_wait = pcs[i];
+                }
+            }
+            waiting &= ~active;
+        }
+
+        struct ebpf_inst inst = insts[pc];
+        lanes b = inst.opcode & EBPF_SRC_REG ? reg[inst.src] : SPLAT((int64_t)inst.imm);
+
+        switch (inst.opcode & EBPF_CLS_MASK) {
+        case EBPF_CLS_ALU:
+        case EBPF_CLS_ALU64: {
+            unsigned int ok = active;
+            lanes result = alu(vm, inst, pc, reg[inst.dst], b, &ok);
+            failed |= active & ~ok;
+            active = ok;
+            /* Lanes that are neither active nor waiting have stopped, so their registers do not matter */
+            reg[inst.dst] = waiting ? blend(mask_of(active), result, reg[inst.dst]) : result;
+            pc++;
+            break;
+        }
+
+        case EBPF_CLS_JMP:
+        case EBPF_CLS_JMP32: {
+            if (inst.opcode == EBPF_OP_EXIT) {
+                FOR_EACH_LANE(i, active) {
+                    results[i] = reg[0][i];
+                }
+                active = 0;
+                break;
+            }
+
+            uint32_t target = pc + 1 + ebpf_jump_offset(inst);
+            lanes a = reg[inst.dst];
+            unsigned int taken;
+            if ((inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP32) {
+                a = low_half(inst, a);
+                b = low_half(inst, b);
+            }
+            switch (inst.opcode) {
+            case EBPF_OP_JA:
+            case EBPF_OP_JA32:
+                taken = active;
+                break;
+            case EBPF_OP_JGT_IMM:
+            case EBPF_OP_JGE_IMM:
+            case EBPF_OP_JLT_IMM:
+            case EBPF_OP_JLE_IMM:
+                /* Compared to the zero-extended immediate, like the interpreter */
+                b = SPLAT((uint32_t)inst.imm);
+                /* fallthrough */
+            default:
+                taken = bits_of(branch_taken(inst, a, b)) & active;
+                break;
+            }
+
+            if (taken == active || target == pc + 1) {
+                pc = target;
+            } else if (!taken) {
+                pc++;
+            } else {
+                /* Lanes going further wait until the others get there */
+                unsigned int later = target > pc + 1 ? taken : active & ~taken;
+                uint32_t later_pc = target > pc + 1 ? target : pc + 1;
+                FOR_EACH_LANE(i, later) {
+                    pcs[i] = later_pc;
+                }
+                waiting |= later;
+                active &= ~later;
+                next_wait = later_pc < next_wait ? later_pc : next_wait;
+                pc = target > pc + 1 ? pc + 1 : target;
+            }
+            break;
+        }
+
+        case EBPF_CLS_LD: { /* EBPF_OP_LDDW */
+            lanes value = SPLAT((uint32_t)inst.imm | ((uint64_t)insts[pc + 1].imm << 32));
+            reg[inst.dst] = waiting ? blend(mask_of(active), value, reg[inst.dst]) : value;
+            pc += 2;
+            break;
+        }
+
+        default: {
+            int cls = inst.opcode & EBPF_CLS_MASK;
+            int size = sizes[(inst.opcode & EBPF_SIZE_MASK) >> 3];
+            enum ubpf_error_kind kind = cls == EBPF_CLS_LDX ? UBPF_ERROR_OUT_OF_BOUNDS_LOAD : UBPF_ERROR_OUT_OF_BOUNDS_STORE;
+            lanes base = cls == EBPF_CLS_LDX ? reg[inst.src] : reg[inst.dst];
+            lanes value = cls == EBPF_CLS_ST ? SPLAT((int64_t)inst.imm) : reg[inst.src];
+
+            FOR_EACH_LANE(i, active) {
+                struct ubpf_error_info error;
+                char *addr = (char *)(uintptr_t)(base[i] + inst.offset);
+
+                /* The interpreter's bounds check, with the common cases inline */
+                if (!in_range(addr, size, stacks[i], UBPF_STACK_SIZE) && !in_range(addr, size, mems[i], mem_lens[i]) &&
+                    !ubpf_bounds_check(vm, addr, size, kind, pc, mems[i], mem_lens[i], stacks[i], pkts[i], &error)) {
+                    failed |= 1u << i;
+                    continue;
+                }
+                if ((inst.opcode & EBPF_MODE_MASK) == EBPF_MODE_MEMSX) {
+                    switch (size) {
+                    case 1: reg[inst.dst][i] = *(int8_t *)addr; break;
+                    case 2: reg[inst.dst][i] = *(int16_t *)addr; break;
+                    case 4: reg[inst.dst][i] = *(int32_t *)addr; break;
+                    }
+                } else if (cls == EBPF_CLS_LDX) {
+                    switch (size) {
+                    case 1: reg[inst.dst][i] = *(uint8_t *)addr; break;
+                    case 2: reg[inst.dst][i] = *(uint16_t *)addr; break;
+                    case 4: reg[inst.dst][i] = *(uint32_t *)addr; break;
+                    case 8: reg[inst.dst][i] = *(uint64_t *)addr; break;
+                    }
+                } else {
+                    switch (size) {
+                    case 1: *(uint8_t *)addr = value[i]; break;
+                    case 2: *(uint16_t *)addr = value[i]; break;
+                    case 4: *(uint32_t *)addr = value[i]; break;
+                    case 8: *(uint64_t *)addr = value[i]; break;
+                    }
+                }
+            }
+            active &= ~failed;
+            pc++;
+            break;
+        }
+        }
+
+        if (!active) {
+            pc = UINT32_MAX;
+        }
+    }
+
+    FOR_EACH_LANE(i, failed) {
+        results[i] = UINT64_MAX;
+        num_failed++;
+    }
+    return num_failed;
+}
+
+/*
+ * Bytes at the start of the input that the program loads at constant
+ * offsets, following copies of r1 in a linear scan. Branches are ignored,
+ * which is fine for deciding what to prefetch.
+ */
+static uint32_t
+input_footprint(const struct ubpf_vm *vm)
+{
+    static const int sizes[] = { [EBPF_SIZE_W >> 3] = 4, [EBPF_SIZE_H >> 3] = 2, [EBPF_SIZE_B >> 3] = 1, [EBPF_SIZE_DW >> 3] = 8 };
+    uint16_t aliases = 1 << 1;
+    uint32_t end = 0;
+
+    for (uint32_t i = 0; i < vm->num_insts; i++) {
+        struct ebpf_inst inst = vm->insts[i];
+        int cls = inst.opcode & EBPF_CLS_MASK;
+
+        if (cls == EBPF_CLS_LDX && (aliases & (1 << inst.src)) && inst.offset >= 0) {
+            uint32_t access_end = inst.offset + sizes[(inst.opcode & EBPF_SIZE_MASK) >> 3];
+            end = access_end > end ? access_end : end;
+        }
+
+        if (inst.opcode == EBPF_OP_MOV64_REG && !inst.offset && (aliases & (1 << inst.src))) {
+            aliases |= 1 << inst.dst;
+        } else if (cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64 || cls == EBPF_CLS_LDX || cls == EBPF_CLS_LD) {
+            aliases &= ~(1 << inst.dst);
+        } else if (inst.opcode == EBPF_OP_CALL) {
+            aliases &= ~0x3f;
+        }
+        if (inst.opcode == EBPF_OP_LDDW) {
+            i++;
+        }
+    }
+
+    return end < MAX_PREFETCH_SIZE ? end : MAX_PREFETCH_SIZE;
+}
+
+/* Prefetch the inputs in [start, end), and the packets of those in [packet_start, packet_end) */
+static void
+prefetch_inputs(const struct ubpf_vm *vm, void *const *mems, const size_t *mem_lens, uint32_t footprint,
+                unsigned int start, unsigned int end, unsigned int packet_start, unsigned int packet_end)
+{
+    unsigned int i;
+    uint32_t off;
+
+    for (i = start; i < end; i++) {
+        for (off = 0; off < footprint && off < mem_lens[i]; off += CACHE_LINE_SIZE) {
+            __builtin_prefetch((char *)mems[i] + off);
+        }
+    }
+
+    if (!vm->packet_access) {
+        return;
+    }
+    for (i = packet_start; i < packet_end; i++) {
+        if (mem_lens[i] >= sizeof(struct ubpf_packet_ctx)) {
+            const struct ubpf_packet_ctx *pkt = mems[i];
+            for (off = 0; off < PACKET_PREFETCH_SIZE; off += CACHE_LINE_SIZE) {
+                __builtin_prefetch((char *)pkt->data + off);
+            }
+        }
+    }
+}
+
+int
+ubpf_exec_batch(const struct ubpf_vm *vm, void *const *mems, const size_t *mem_lens, uint64_t *results,
+                unsigned int n)
+{
+    unsigned int i, j;
+    int num_failed = 0;
+
+    if (!vm->insts) {
+        return -1;
+    }
+
+    bool supported = ubpf_batch_supported(vm);
+    uint32_t footprint = input_footprint(vm);
+
+    /* Get the first two groups going; the packets of the first are fetched on demand */
+    prefetch_inputs(vm, mems, mem_lens, footprint, 0, n < 2 * LANES ? n : 2 * LANES, 0, 0);
+
+    for (i = 0; i < n; i += LANES) {
+        unsigned int group = n - i < LANES ? n - i : LANES;
+        unsigned int next = i + group;
+        unsigned int ahead = next + LANES < n ? next + LANES : n;
+
+        prefetch_inputs(vm, mems, mem_lens, footprint, ahead, ahead + LANES < n ? ahead + LANES : n, next, ahead);
+
+        if (supported) {
+            num_failed += run_lanes(vm, mems + i, mem_lens + i, results + i, group);
+            continue;
+        }
+        for (j = i; j < next; j++) {
+            if (ubpf_exec(vm, mems[j], mem_lens[j], &results[j]) < 0) {
+                results[j] = UINT64_MAX;
+                num_failed++;
+            }
+        }
+    }
+    return num_failed;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Program chains
+ *
+ * This file holds the chain object, its policy and the interpreted
+ * dispatcher. ubpf_chain_compile in ubpf_jit_x86_64.c generates the same
+ * dispatch logic as machine code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "ubpf_int.h"
+
+struct ubpf_chain *
+ubpf_chain_create(void)
+{
+    return calloc(1, sizeof(struct ubpf_chain));
+}
+
+void
+ubpf_chain_destroy(struct ubpf_chain *chain)
+{
+    if (chain->jitted) {
+        munmap(chain->jitted, chain->jitted_size);
+    }
+    free(chain);
+}
+
+int
+ubpf_chain_add(struct ubpf_chain *chain, struct ubpf_vm *vm)
+{
+    if (chain->jitted || chain->num_stages >= UBPF_CHAIN_MAX_STAGES) {
+        return -1;
+    }
+
+    struct ubpf_chain_stage *stage = &chain->stages[chain->num_stages];
+    stage->vm = vm;
+    stage->num_rules = 0;
+    stage->otherwise.action = UBPF_CHAIN_CONTINUE;
+    return chain->num_stages++;
+}
+
+static int
+check_action(const struct ubpf_chain *chain, int stage, enum ubpf_chain_action action, int target)
+{
+    if (chain->jitted || stage < 0 || stage >= chain->num_stages) {
+        return -1;
+    }
+
+    switch (action) {
+    case UBPF_CHAIN_CONTINUE:
+    case UBPF_CHAIN_DROP:
+        return 0;
+    case UBPF_CHAIN_GOTO:
+        return target > stage && target < chain->num_stages ? 0 : -1;
+    }
+    return -1;
+}
+
+int
+ubpf_chain_set_action(struct ubpf_chain *chain, int stage, uint64_t retval,
+                      enum ubpf_chain_action action, int target)
+{
+    int i;
+
+    if (check_action(chain, stage, action, target) < 0) {
+        return -1;
+    }
+
+    struct ubpf_chain_stage *s = &chain->stages[stage];
+    for (i = 0; i < s->num_rules; i++) {
+        if (s->rules[i].retval == retval) {
+            break;
+        }
+    }
+    if (i == UBPF_CHAIN_MAX_RULES) {
+        return -1;
+    }
+    if (i == s->num_rules) {
+        s->num_rules++;
+    }
+
+    s->rules[i].retval = retval;
+    s->rules[i].action = action;
+    s->rules[i].target = target;
+    return 0;
+}
+
+int
+ubpf_chain_set_default(struct ubpf_chain *chain, int stage,
+                       enum ubpf_chain_action action, int target)
+{
+    if (check_action(chain, stage, action, target) < 0) {
+        return -1;
+    }
+
+    chain->stages[stage].otherwise.action = action;
+    chain->stages[stage].otherwise.target = target;
+    return 0;
+}
+
+int
+ubpf_chain_exec(const struct ubpf_chain *chain, void *mem, size_t mem_len, uint64_t *bpf_return_value)
+{
+    int stage = 0;
+    int i;
+
+    *bpf_return_value = 0;
+
+    while (stage < chain->num_stages) {
+        const struct ubpf_chain_stage *s = &chain->stages[stage];
+        const struct ubpf_chain_rule *rule = &s->otherwise;
+
+        if (ubpf_exec(s->vm, mem, mem_len, bpf_return_value) < 0) {
+            return -1;
+        }
+
+        for (i = 0; i < s->num_rules; i++) {
+            if (s->rules[i].retval == *bpf_return_value) {
+                rule = &s->rules[i];
+                break;
+            }
+        }
+
+        switch (rule->action) {
+        case UBPF_CHAIN_CONTINUE:
+            stage++;
+            break;
+        case UBPF_CHAIN_DROP:
+            return 0;
+        case UBPF_CHAIN_GOTO:
+            stage = rule->target;
+            break;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Context access conversion
+ *
+ * When the host registers context fields, programs are written against a
+ * stable context layout but run on the host's native descriptor. At load
+ * time every SSA value is classified as holding the context pointer (r1 on
+ * entry and copies of it), not holding it, or holding it only on some
+ * paths. Each memory access through the context pointer must hit a
+ * registered field exactly and is rewritten to the field's native offset.
+ * Any other use of the context pointer that could reach memory, such as
+ * arithmetic or storing it, is rejected.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ubpf_int.h"
+#include "ubpf_ir.h"
+
+enum ctx_state {
+    CTX_UNKNOWN, /* not computed yet */
+    CTX_NO,
+    CTX_YES,
+    CTX_MAYBE,   /* the context pointer on some paths only */
+};
+
+static enum ctx_state
+join(enum ctx_state a, enum ctx_state b)
+{
+    if (a == CTX_UNKNOWN || a == b) {
+        return b;
+    }
+    if (b == CTX_UNKNOWN) {
+        return a;
+    }
+    return CTX_MAYBE;
+}
+
+static enum ctx_state
+value_state(const struct ubpf_ir *ir, const uint8_t *states, uint32_t v)
+{
+    const struct ubpf_ir_value *value = &ir->values[v];
+    const struct ubpf_ir_block *block;
+    enum ctx_state state = CTX_UNKNOWN;
+    uint32_t i;
+
+    switch (value->kind) {
+    case UBPF_IR_VALUE_ARG:
+        return value->reg == 1 ? CTX_YES : CTX_NO;
+    case UBPF_IR_VALUE_INST:
+        if (ir->insts[value->def].inst.opcode == EBPF_OP_MOV64_REG && !ir->insts[value->def].inst.offset) {
+            return states[ir->insts[value->def].src_val];
+        }
+        return CTX_NO;
+    case UBPF_IR_VALUE_PHI:
+        block = &ir->blocks[value->def];
+        for (i = 0; i < block->num_preds; i++) {
+            uint32_t p = ubpf_ir_pred(ir, value->def, i);
+            if (ubpf_ir_reachable(ir, p)) {
+                state = join(state, states[ir->blocks[p].out[value->reg]]);
+            }
+        }
+        return state;
+    default:
+        return CTX_NO;
+    }
+}
+
+static const struct ubpf_ctx_field *
+find_field(const struct ubpf_vm *vm, int16_t offset, int size)
+{
+    int i;
+    for (i = 0; i < vm->num_ctx_fields; i++) {
+        if (vm->ctx_fields[i].ctx_offset == offset && vm->ctx_fields[i].size == size) {
+            return &vm->ctx_fields[i];
+        }
+    }
+    return NULL;
+}
+
+static int
+access_size(uint8_t opcode)
+{
+    switch (opcode & 0x18) {
+    case EBPF_SIZE_B: return 1;
+    case EBPF_SIZE_H: return 2;
+    case EBPF_SIZE_W: return 4;
+    default: return 8;
+    }
+}
+
+/* Check the use of the context pointer by one instruction, rewriting its accesses */
+static int
+convert_inst(const struct ubpf_vm *vm, struct ebpf_inst *inst, uint32_t pc,
+             enum ctx_state dst, enum ctx_state src, char **errmsg)
+{
+    uint8_t cls = inst->opcode & EBPF_CLS_MASK;
+    enum ctx_state base = CTX_NO;
+    const struct ubpf_ctx_field *field;
+
+    switch (cls) {
+    case EBPF_CLS_LDX:
+        base = src;
+        break;
+    case EBPF_CLS_ST:
+        base = dst;
+        break;
+    case EBPF_CLS_STX:
+        if (src != CTX_NO) {
+            *errmsg = ubpf_error("context pointer stored to memory at PC %u", pc);
+            return -1;
+        }
+        base = dst;
+        break;
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64:
+        if (inst->opcode == EBPF_OP_MOV64_REG && !inst->offset) {
+            return 0;
+        }
+        if ((dst != CTX_NO && (inst->opcode & 0xf0) != (EBPF_OP_MOV_IMM & 0xf0)) ||
+                (src != CTX_NO && (inst->opcode & EBPF_SRC_REG))) {
+            *errmsg = ubpf_error("arithmetic on context pointer at PC %u", pc);
+            return -1;
+        }
+        return 0;
+    default:
+        return 0;
+    }
+
+    if (base == CTX_NO) {
+        return 0;
+    }
+    if (base == CTX_MAYBE) {
+        *errmsg = ubpf_error("access through a register that may not hold the context pointer at PC %u", pc);
+        return -1;
+    }
+
+    field = find_field(vm, inst->offset, access_size(inst->opcode));
+    if (!field) {
+        *errmsg = ubpf_error("invalid context access at PC %u: offset %d size %d",
+                             pc, inst->offset, access_size(inst->opcode));
+        return -1;
+    }
+    inst->offset = field->native_offset;
+    return 0;
+}
+
+int
+ubpf_convert_ctx_access(const struct ubpf_vm *vm, struct ebpf_inst *insts, uint32_t num_insts, char **errmsg)
+{
+    struct ubpf_ir *ir = ubpf_ir_build(insts, num_insts);
+    uint8_t *states = NULL;
+    uint32_t i, pc;
+    bool changed = true;
+    int result = -1;
+
+    if (!ir || !(states = calloc(ir->num_values + 1, sizeof(states[0])))) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    /* Values only depend on earlier ones, except for phis at loop heads */
+    while (changed) {
+        changed = false;
+        for (i = 0; i < ir->num_values; i++) {
+            enum ctx_state state = value_state(ir, states, i);
+            if (state != states[i]) {
+                states[i] = state;
+                changed = true;
+            }
+        }
+    }
+
+    for (pc = 0; pc < num_insts; pc++) {
+        const struct ubpf_ir_inst *ir_inst = &ir->insts[pc];
+        if (ir_inst->lddw_hi || !ubpf_ir_reachable(ir, ir_inst->block)) {
+            continue;
+        }
+        if (convert_inst(vm, &insts[pc], pc, states[ir_inst->dst_val], states[ir_inst->src_val], errmsg) < 0) {
+            goto out;
+        }
+    }
+    result = 0;
+
+out:
+    free(states);
+    ubpf_ir_free(ir);
+    return result;
+}
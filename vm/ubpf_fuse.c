@@ -0,0 +1,373 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Filter fusion
+ *
+ * Several filters that only read their input are combined into a single
+ * program that runs them one after the other on the same input:
+ *
+ *     stdw [r10-8], 0            clear the result bitmask
+ *     <common prefix>            straight-line code all filters start with
+ *     stxdw [r10-16-8*k], rk     save the context and the registers it set
+ *   filter i:
+ *     ldxdw rk, [r10-16-8*k]     restore them
+ *     <body of filter i>         stack offsets moved down, exit -> ja done_i
+ *   done_i:
+ *     set bit i or return i + 1 if r0 is nonzero
+ *
+ * The common prefix is typically the header parsing that every filter
+ * repeats. After it has run once, the JIT sees the bodies as one program
+ * and can share their loads of the same packet fields.
+ *
+ * Each slot is written once, so in packet mode the loader can follow the
+ * saved packet pointers and the ranges the prefix proved for them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ubpf_int.h"
+
+#define NUM_SAVED_REGS 10 /* r0-r9 */
+
+/* Stack slots at the top of the frame: the result bitmask, then r0-r9 as left by the prefix */
+#define RESULT_SLOT (-8)
+#define REG_SLOT(r) (-16 - 8 * (r))
+
+struct fuse_state {
+    struct ebpf_inst *insts;
+    uint32_t num_insts;
+    uint32_t capacity;
+};
+
+static void
+emit(struct fuse_state *s, uint8_t opcode, uint8_t dst, uint8_t src, int16_t offset, int32_t imm)
+{
+    if (s->num_insts < s->capacity) {
+        struct ebpf_inst *inst = &s->insts[s->num_insts];
+        inst->opcode = opcode;
+        inst->dst = dst;
+        inst->src = src;
+        inst->offset = offset;
+        inst->imm = imm;
+    }
+    s->num_insts++;
+}
+
+static bool
+is_jump(uint8_t opcode)
+{
+    uint8_t cls = opcode & EBPF_CLS_MASK;
+    return (cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) &&
+        opcode != EBPF_OP_CALL && opcode != EBPF_OP_EXIT;
+}
+
+/* Check that a program only reads its input and does not let the stack address escape */
+static bool
+check_pure(const struct ubpf_vm *vm, int index, char **errmsg)
+{
+    uint32_t i;
+
+    if (!vm->insts) {
+        *errmsg = ubpf_error("program %d has not been loaded", index);
+        return false;
+    }
+
+    for (i = 0; i < vm->num_insts; i++) {
+        struct ebpf_inst inst = vm->insts[i];
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+
+        if (inst.opcode == EBPF_OP_LDDW) {
+            i++;
+            continue;
+        }
+        if (inst.opcode == EBPF_OP_CALL) {
+            *errmsg = ubpf_error("program %d calls a helper at PC %u", index, i);
+            return false;
+        }
+        if ((cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) && inst.dst != 10) {
+            *errmsg = ubpf_error("program %d writes to memory other than the stack at PC %u", index, i);
+            return false;
+        }
+        bool reads_src = cls == EBPF_CLS_STX ||
+            ((cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64 || cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) &&
+             (inst.opcode & EBPF_SRC_REG));
+        if ((reads_src && inst.src == 10) || (is_jump(inst.opcode) && inst.dst == 10)) {
+            *errmsg = ubpf_error("program %d uses the stack pointer as a value at PC %u", index, i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Deepest stack byte used by a program, as a positive number */
+static int
+stack_depth(const struct ubpf_vm *vm)
+{
+    int depth = 0;
+    uint32_t i;
+
+    for (i = 0; i < vm->num_insts; i++) {
+        struct ebpf_inst inst = vm->insts[i];
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+        int base = cls == EBPF_CLS_LDX ? inst.src : inst.dst;
+
+        if (inst.opcode == EBPF_OP_LDDW) {
+            i++;
+        } else if ((cls == EBPF_CLS_LDX || cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) &&
+                base == 10 && -inst.offset > depth) {
+            depth = -inst.offset;
+        }
+    }
+
+    return depth;
+}
+
+/*
+ * Length of the straight-line prefix shared by all programs, in
+ * instructions. The prefix only computes registers: it has no jumps or
+ * stores, and no program jumps back into it.
+ */
+static uint32_t
+common_prefix(struct ubpf_vm **vms, int num_vms)
+{
+    uint32_t len = 0, i;
+    int v;
+
+    for (;; len++) {
+        struct ebpf_inst inst = vms[0]->insts[len];
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+
+        if (len + 1 >= vms[0]->num_insts || cls == EBPF_CLS_ST || cls == EBPF_CLS_STX ||
+                cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) {
+            break;
+        }
+        for (v = 1; v < num_vms; v++) {
+            if (len + 1 >= vms[v]->num_insts ||
+                    memcmp(&vms[v]->insts[len], &inst, sizeof(inst))) {
+                break;
+            }
+        }
+        if (v < num_vms) {
+            break;
+        }
+        if (inst.opcode == EBPF_OP_LDDW) {
+            /* Keep both halves or neither */
+            for (v = 0; v < num_vms; v++) {
+                if (len + 2 >= vms[v]->num_insts ||
+                        memcmp(&vms[v]->insts[len + 1], &vms[0]->insts[len + 1], sizeof(inst))) {
+                    break;
+                }
+            }
+            if (v < num_vms) {
+                break;
+            }
+            len++;
+        }
+    }
+
+    for (v = 0; v < num_vms; v++) {
+        for (i = len; i < vms[v]->num_insts; i++) {
+            struct ebpf_inst inst = vms[v]->insts[i];
+            uint32_t target = i + ebpf_jump_offset(inst) + 1;
+            if (inst.opcode == EBPF_OP_LDDW) {
+                i++;
+            } else if (is_jump(inst.opcode) && target < len) {
+                len = target;
+            }
+        }
+    }
+
+    return len;
+}
+
+/* Copy instructions, moving stack accesses below the reserved slots */
+static void
+copy_insts(struct fuse_state *s, const struct ebpf_inst *insts, uint32_t start, uint32_t end, int16_t reserved)
+{
+    uint32_t i;
+
+    for (i = start; i < end; i++) {
+        struct ebpf_inst inst = insts[i];
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+        int base = cls == EBPF_CLS_LDX ? inst.src : inst.dst;
+
+        if (inst.opcode == EBPF_OP_LDDW) {
+            emit(s, inst.opcode, inst.dst, inst.src, inst.offset, inst.imm);
+            inst = insts[++i];
+        } else if ((cls == EBPF_CLS_LDX || cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) && base == 10) {
+            inst.offset -= reserved;
+        }
+        emit(s, inst.opcode, inst.dst, inst.src, inst.offset, inst.imm);
+    }
+}
+
+struct ubpf_vm *
+ubpf_fuse(struct ubpf_vm **vms, int num_vms, enum ubpf_fuse_result result, char **errmsg)
+{
+    struct fuse_state s = { 0 };
+    struct ubpf_vm *vm = NULL;
+    uint16_t saved = 1 << 1; /* registers the prefix leaves for the bodies */
+    int16_t reserved;
+    uint32_t prefix, i, max_insts = 0;
+    int v, r, num_saved = 0;
+
+    *errmsg = NULL;
+
+    if (num_vms <= 0) {
+        *errmsg = ubpf_error("no programs to fuse");
+        return NULL;
+    }
+    if (result == UBPF_FUSE_BITMASK && num_vms > 64) {
+        *errmsg = ubpf_error("too many programs for a bitmask result (max 64)");
+        return NULL;
+    }
+
+    for (v = 0; v < num_vms; v++) {
+        if (!check_pure(vms[v], v, errmsg)) {
+            return NULL;
+        }
+        if (vms[v]->packet_access != vms[0]->packet_access) {
+            *errmsg = ubpf_error("program %d and program 0 differ in packet access", v);
+            return NULL;
+        }
+    }
+
+    prefix = common_prefix(vms, num_vms);
+    for (i = 0; i < prefix; i++) {
+        struct ebpf_inst inst = vms[0]->insts[i];
+        saved |= 1 << inst.dst;
+        if (inst.opcode == EBPF_OP_LDDW) {
+            i++;
+        }
+    }
+    for (r = 0; r < NUM_SAVED_REGS; r++) {
+        if (saved & (1 << r)) {
+            num_saved = r + 1;
+        }
+    }
+    reserved = -REG_SLOT(num_saved - 1);
+
+    for (v = 0; v < num_vms; v++) {
+        if (stack_depth(vms[v]) + reserved > UBPF_STACK_SIZE) {
+            *errmsg = ubpf_error("program %d uses too much stack to be fused", v);
+            return NULL;
+        }
+    }
+
+    /* The prologue, prefix and saves, then each body with its reloads and result, then the epilogue */
+    s.capacity = 2 + prefix + NUM_SAVED_REGS + 2;
+    for (v = 0; v < num_vms; v++) {
+        s.capacity += NUM_SAVED_REGS + vms[v]->num_insts - prefix + 6;
+        max_insts = vms[v]->max_insts > max_insts ? vms[v]->max_insts : max_insts;
+    }
+    s.insts = calloc(s.capacity, sizeof(s.insts[0]));
+    if (!s.insts) {
+        *errmsg = ubpf_error("out of memory");
+        return NULL;
+    }
+
+    if (result == UBPF_FUSE_BITMASK) {
+        emit(&s, EBPF_OP_STDW, 10, 0, RESULT_SLOT, 0);
+    }
+    copy_insts(&s, vms[0]->insts, 0, prefix, reserved);
+    for (r = 0; r < NUM_SAVED_REGS; r++) {
+        if (saved & (1 << r)) {
+            emit(&s, EBPF_OP_STXDW, 10, r, REG_SLOT(r), 0);
+        }
+    }
+
+    for (v = 0; v < num_vms; v++) {
+        const struct ubpf_vm *filter = vms[v];
+        uint32_t body, done;
+
+        for (r = 0; r < NUM_SAVED_REGS; r++) {
+            if (saved & (1 << r)) {
+                emit(&s, EBPF_OP_LDXDW, r, 10, REG_SLOT(r), 0);
+            }
+        }
+        body = s.num_insts;
+        copy_insts(&s, filter->insts, prefix, filter->num_insts, reserved);
+        done = s.num_insts;
+
+        /* Exits continue with the next filter */
+        for (i = body; i < done && i < s.capacity; i++) {
+            int32_t offset = done - i - 1;
+            if (s.insts[i].opcode == EBPF_OP_LDDW) {
+                i++;
+            } else if (s.insts[i].opcode == EBPF_OP_EXIT) {
+                if (offset > INT16_MAX) {
+                    *errmsg = ubpf_error("program %d is too large to be fused", v);
+                    goto out;
+                }
+                s.insts[i].opcode = EBPF_OP_JA;
+                s.insts[i].offset = offset;
+            }
+        }
+
+        if (result == UBPF_FUSE_BITMASK) {
+            emit(&s, EBPF_OP_JEQ_IMM, 0, 0, 5, 0);
+            emit(&s, EBPF_OP_LDXDW, 2, 10, RESULT_SLOT, 0);
+            emit(&s, EBPF_OP_LDDW, 3, 0, 0, (uint32_t)(1ULL << v));
+            emit(&s, 0, 0, 0, 0, (1ULL << v) >> 32);
+            emit(&s, EBPF_OP_OR64_REG, 2, 3, 0, 0);
+            emit(&s, EBPF_OP_STXDW, 10, 2, RESULT_SLOT, 0);
+        } else {
+            emit(&s, EBPF_OP_JEQ_IMM, 0, 0, 2, 0);
+            emit(&s, EBPF_OP_MOV64_IMM, 0, 0, 0, v + 1);
+            emit(&s, EBPF_OP_EXIT, 0, 0, 0, 0);
+        }
+    }
+
+    if (result == UBPF_FUSE_BITMASK) {
+        emit(&s, EBPF_OP_LDXDW, 0, 10, RESULT_SLOT, 0);
+    } else {
+        emit(&s, EBPF_OP_MOV64_IMM, 0, 0, 0, 0);
+    }
+    emit(&s, EBPF_OP_EXIT, 0, 0, 0, 0);
+
+    if (s.num_insts >= max_insts) {
+        *errmsg = ubpf_error("fused program is too large (max %u instructions)", max_insts);
+        goto out;
+    }
+
+    vm = ubpf_create();
+    if (!vm) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+    vm->max_insts = max_insts;
+    vm->error_printf = vms[0]->error_printf;
+    vm->error_limit.per_second = vms[0]->error_limit.per_second;
+    vm->bounds_check_enabled = false;
+    vm->packet_access = vms[0]->packet_access;
+    for (v = 0; v < num_vms; v++) {
+        vm->bounded_loops_required |= vms[v]->bounded_loops_required;
+        vm->bounds_check_enabled |= vms[v]->bounds_check_enabled;
+    }
+    ubpf_select_interpreter(vm);
+
+    if (ubpf_load(vm, s.insts, s.num_insts * sizeof(s.insts[0]), errmsg) < 0) {
+        ubpf_destroy(vm);
+        vm = NULL;
+    }
+
+out:
+    free(s.insts);
+    return vm;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Helper call profiling
+ *
+ * When built with UBPF_HELPER_PROFILE, every call instruction gets a site
+ * record at load time. The interpreter and jitted code call helpers through
+ * ubpf_profile_helper, which times the call and adds it to the record of
+ * its call site. Totals per helper index are summed over the sites.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ubpf_int.h"
+
+#ifdef UBPF_HELPER_PROFILE
+
+int
+ubpf_helper_profile_init(struct ubpf_vm *vm)
+{
+    uint32_t pc;
+
+    vm->helper_sites = calloc(vm->num_insts, sizeof(vm->helper_sites[0]));
+    if (!vm->helper_sites) {
+        return -1;
+    }
+
+    for (pc = 0; pc < vm->num_insts; pc++) {
+        if (vm->insts[pc].opcode == EBPF_OP_CALL) {
+            vm->helper_sites[pc].fn = vm->ext_funcs[vm->insts[pc].imm];
+            vm->helper_sites[pc].idx = vm->insts[pc].imm;
+        }
+    }
+    return 0;
+}
+
+uint64_t
+ubpf_profile_helper(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4, uint64_t r5, struct ubpf_helper_site *site)
+{
+    uint64_t start = ubpf_cycles();
+    uint64_t ret = site->fn(r1, r2, r3, r4, r5);
+
+    __atomic_fetch_add(&site->cycles, ubpf_cycles() - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&site->calls, 1, __ATOMIC_RELAXED);
+    return ret;
+}
+
+static void
+add_site(struct ubpf_helper_profile *profile, const struct ubpf_helper_site *site)
+{
+    profile->calls += __atomic_load_n(&site->calls, __ATOMIC_RELAXED);
+    profile->cycles += __atomic_load_n(&site->cycles, __ATOMIC_RELAXED);
+}
+
+int
+ubpf_get_helper_profile(const struct ubpf_vm *vm, unsigned int idx, struct ubpf_helper_profile *profile)
+{
+    uint32_t pc;
+
+    memset(profile, 0, sizeof(*profile));
+    if (!vm->helper_sites || idx >= MAX_EXT_FUNCS) {
+        return -1;
+    }
+
+    for (pc = 0; pc < vm->num_insts; pc++) {
+        if (vm->insts[pc].opcode == EBPF_OP_CALL && vm->helper_sites[pc].idx == idx) {
+            add_site(profile, &vm->helper_sites[pc]);
+        }
+    }
+    return 0;
+}
+
+int
+ubpf_get_helper_site_profile(const struct ubpf_vm *vm, uint32_t pc, struct ubpf_helper_profile *profile)
+{
+    memset(profile, 0, sizeof(*profile));
+    if (!vm->helper_sites || pc >= vm->num_insts || vm->insts[pc].opcode != EBPF_OP_CALL) {
+        return -1;
+    }
+
+    add_site(profile, &vm->helper_sites[pc]);
+    return 0;
+}
+
+#else
+
+int
+ubpf_get_helper_profile(const struct ubpf_vm *vm, unsigned int idx, struct ubpf_helper_profile *profile)
+{
+    (void)vm;
+    (void)idx;
+    memset(profile, 0, sizeof(*profile));
+    return -1;
+}
+
+int
+ubpf_get_helper_site_profile(const struct ubpf_vm *vm, uint32_t pc, struct ubpf_helper_profile *profile)
+{
+    (void)vm;
+    (void)pc;
+    memset(profile, 0, sizeof(*profile));
+    return -1;
+}
+
+#endif
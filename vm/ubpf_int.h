@@ -23,19 +23,212 @@
 struct ebpf_inst;
 typedef uint64_t (*ext_func)(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4);
 
+#define MAX_EXT_FUNCS 64
+
+/* Value of max_trips for loops whose trip count could not be proven */
+#define UBPF_LOOP_UNBOUNDED UINT64_MAX
+
+struct ubpf_loop {
+    uint32_t head;      /* target of the back-edge */
+    uint32_t latch;     /* jump instruction forming the back-edge */
+    uint64_t max_trips; /* maximum number of times the back-edge is taken */
+};
+
+/* Runtime error messages printed per second and VM, by default */
+#define UBPF_DEFAULT_ERROR_PRINT_LIMIT 10
+
+struct ubpf_error_limit {
+    uint32_t per_second;
+    uint64_t second; /* current one-second window */
+    uint32_t count;  /* messages printed in it */
+};
+
+#define UBPF_STATS_SHARDS 16
+
+/* Shard of every thread beyond the first UBPF_STATS_SHARDS - 1, updated atomically */
+#define UBPF_STATS_SHARED_SHARD (UBPF_STATS_SHARDS - 1)
+
+/* One in this many executions on a shard is timed, a power of two below 256 */
+#define UBPF_STATS_TIMING_PERIOD 64
+
+struct ubpf_stats_shard {
+    uint64_t executions;
+    uint64_t errors[UBPF_NUM_ERROR_KINDS];
+    uint64_t instructions;
+    uint64_t helper_calls;
+    uint64_t cycles; /* of the timed executions */
+    uint64_t timed;
+} __attribute__((aligned(64)));
+
+/* Histograms of execution time, sharded like the statistics */
+struct ubpf_latency_shard {
+    struct ubpf_latency_histogram hist;
+    uint64_t runs; /* of this VM on the shard, sampled every latency_sample_period */
+} __attribute__((aligned(64)));
+
+/* Jitted code from 'offset' up to the next range belongs to instruction 'pc' */
+struct ubpf_code_range {
+    uint32_t offset;
+    uint32_t pc; /* UBPF_NO_PC for the epilogue and what follows it */
+};
+
+#define UBPF_NO_PC UINT32_MAX
+
+/* Calls through one call instruction, when built with UBPF_HELPER_PROFILE */
+struct ubpf_helper_site {
+    ext_func fn;
+    uint32_t idx;
+    uint64_t calls;
+    uint64_t cycles;
+};
+
+struct ubpf_sandbox {
+    uint8_t *reservation;    /* the window with its guard regions */
+    size_t reservation_size;
+    uint8_t *base;           /* start of the window, aligned to its size */
+    uint64_t mask;           /* window size - 1 if addresses are masked, else 0 */
+    uint64_t next;           /* window offset of the next allocation */
+    uint8_t *stacks;         /* UBPF_STATS_SHARDS stacks of UBPF_STACK_SIZE bytes, one per shard index */
+    uint64_t stack_stride;   /* distance between consecutive stacks */
+    int shared_stack_busy;   /* a thread on the shared shard index is running on the last stack */
+};
+
+/* Array map behind a helper index, see ubpf_register_array_map */
+struct ubpf_array_map {
+    uint8_t *values; /* NULL for ordinary helpers */
+    uint32_t value_size;
+    uint32_t max_entries;
+};
+
+#define UBPF_MAX_CTX_FIELDS 32
+
+struct ubpf_ctx_field {
+    int16_t ctx_offset;    /* in the stable context layout */
+    uint8_t size;
+    int16_t native_offset; /* in the host's descriptor */
+};
+
+/* Work done by one execution, for the statistics counters */
+struct ubpf_exec_counts {
+    uint64_t instructions;
+    uint64_t helper_calls;
+};
+
+typedef int (*ubpf_interpreter)(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t *bpf_return_value,
+                                struct ubpf_error_info *error, struct ubpf_exec_counts *counts);
+
 struct ubpf_vm {
     struct ebpf_inst *insts;
-    uint16_t num_insts;
+    uint32_t num_insts;
+    uint32_t max_insts; /* loads fail for programs of this many instructions or more */
+    struct ubpf_loop *loops;
+    uint32_t num_loops;
     ubpf_jit_fn jitted;
     size_t jitted_size;
+    bool jitted_external;
+    enum ubpf_jit_tier jit_tier;
+    void *llvm_jit;
     ext_func *ext_funcs;
     const char **ext_func_names;
+    struct ubpf_array_map *array_maps; /* MAX_EXT_FUNCS entries, or NULL */
     bool bounds_check_enabled;
+    ubpf_interpreter interpret; /* variant of the interpreter loop for these settings */
+    bool bounded_loops_required;
     int (*error_printf)(FILE* stream, const char* format, ...);
+    struct ubpf_error_limit error_limit;
     int unwind_stack_extension_index;
+    struct ubpf_ctx_field ctx_fields[UBPF_MAX_CTX_FIELDS];
+    int num_ctx_fields;
+    bool packet_access;
+    struct ubpf_stats_shard *stats; /* UBPF_STATS_SHARDS entries, or NULL */
+    struct ubpf_latency_shard *latency; /* UBPF_STATS_SHARDS entries, or NULL */
+    uint32_t latency_sample_period;
+    struct ubpf_code_range *jitted_ranges; /* in code order, then the epilogue */
+    uint32_t num_jitted_ranges;
+    uint64_t *profile;        /* samples per instruction, or NULL */
+    struct ubpf_helper_site *helper_sites; /* indexed by PC, or NULL */
+    bool sandboxed;
+    size_t sandbox_window;        /* size of a masked window, or 0 for guard regions */
+    struct ubpf_sandbox *sandbox; /* created when first needed */
+    uint32_t sandbox_fault_loc;   /* offset of the fault exit in the jitted code */
+};
+
+/* Whether executions are timed, for statistics or latency histograms */
+static inline bool
+ubpf_instrumented(const struct ubpf_vm *vm)
+{
+    return vm->stats || vm->latency;
+}
+
+/* The array map that helper 'idx' looks up, or NULL if it is an ordinary helper */
+static inline const struct ubpf_array_map *
+ubpf_array_map(const struct ubpf_vm *vm, unsigned int idx)
+{
+    if (!vm->array_maps || idx >= MAX_EXT_FUNCS || !vm->array_maps[idx].values) {
+        return NULL;
+    }
+    return &vm->array_maps[idx];
+}
+
+#define UBPF_CHAIN_MAX_STAGES 64
+#define UBPF_CHAIN_MAX_RULES 8
+
+struct ubpf_chain_rule {
+    uint64_t retval;
+    enum ubpf_chain_action action;
+    int target; /* stage for UBPF_CHAIN_GOTO */
+};
+
+struct ubpf_chain_stage {
+    struct ubpf_vm *vm;
+    struct ubpf_chain_rule rules[UBPF_CHAIN_MAX_RULES];
+    int num_rules;
+    struct ubpf_chain_rule otherwise; /* action when no rule matches */
+};
+
+struct ubpf_chain {
+    struct ubpf_chain_stage stages[UBPF_CHAIN_MAX_STAGES];
+    int num_stages;
+    ubpf_jit_fn jitted;
+    size_t jitted_size;
 };
 
 char *ubpf_error(const char *fmt, ...);
+bool ubpf_error_print_allowed(const struct ubpf_vm *vm);
+uint64_t ubpf_cycles(void);
+void ubpf_select_interpreter(struct ubpf_vm *vm);
+bool ubpf_bounds_check(const struct ubpf_vm *vm, void *addr, int size, enum ubpf_error_kind kind, uint32_t cur_pc,
+                       void *mem, size_t mem_len, void *stack, const struct ubpf_packet_ctx *pkt,
+                       struct ubpf_error_info *error);
+uint64_t ubpf_stats_start(const struct ubpf_vm *vm);
+void ubpf_stats_record(const struct ubpf_vm *vm, uint64_t start, uint64_t instructions, uint64_t helper_calls,
+                       enum ubpf_error_kind error);
+bool ubpf_stats_shard_tls_offset(int32_t *offset);
+int ubpf_stats_shard_index(void);
+void ubpf_stats_jit_error(const struct ubpf_vm *vm, enum ubpf_error_kind error);
+void ubpf_profile_unregister(struct ubpf_vm *vm);
+int ubpf_jitted_pc(const struct ubpf_vm *vm, uintptr_t ip);
+int ubpf_sandbox_create(struct ubpf_vm *vm, char **errmsg);
+void ubpf_sandbox_destroy(struct ubpf_vm *vm);
+#ifdef UBPF_HELPER_PROFILE
+int ubpf_helper_profile_init(struct ubpf_vm *vm);
+/* Called by jitted code */
+uint64_t ubpf_profile_helper(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4, uint64_t r5,
+                             struct ubpf_helper_site *site);
+#endif
+
+/* Called by jitted code */
+void ubpf_report_div_by_zero(const struct ubpf_vm *vm, uint32_t pc);
+void ubpf_stats_jit_exit(const struct ubpf_vm *vm, uint64_t start, uint64_t helper_calls);
+void ubpf_report_sandbox_fault(const struct ubpf_vm *vm, uint32_t pc, uint64_t addr);
+uint8_t *ubpf_sandbox_enter(const struct ubpf_vm *vm);
+void ubpf_report_sandbox_busy(const struct ubpf_vm *vm);
 unsigned int ubpf_lookup_registered_function(struct ubpf_vm *vm, const char *name);
+ubpf_jit_fn ubpf_compile_llvm(struct ubpf_vm *vm, char **errmsg);
+void ubpf_destroy_llvm(struct ubpf_vm *vm);
+int ubpf_check_packet_access(const struct ebpf_inst *insts, uint32_t num_insts, char **errmsg);
+int ubpf_check_map_keys(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_insts, char **errmsg);
+int ubpf_convert_ctx_access(const struct ubpf_vm *vm, struct ebpf_inst *insts, uint32_t num_insts, char **errmsg);
+int ubpf_find_loops(const struct ebpf_inst *insts, uint32_t num_insts, struct ubpf_loop **loops, uint32_t *num_loops);
 
 #endif
@@ -0,0 +1,442 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Construction of the JIT IR: basic blocks, CFG, dominators and SSA values
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ubpf_int.h"
+#include "ubpf_ir.h"
+
+static bool
+is_branch(uint8_t opcode)
+{
+    uint8_t cls = opcode & EBPF_CLS_MASK;
+    return (cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) &&
+        opcode != EBPF_OP_CALL && opcode != EBPF_OP_EXIT;
+}
+
+static int
+build_blocks(struct ubpf_ir *ir)
+{
+    uint32_t num_insts = ir->num_insts;
+    uint8_t *leader = calloc(num_insts + 1, 1);
+    uint32_t i, b;
+
+    if (!leader) {
+        return -1;
+    }
+
+    leader[0] = 1;
+    for (i = 0; i < num_insts; i++) {
+        struct ebpf_inst inst = ir->insts[i].inst;
+        if (inst.opcode == EBPF_OP_LDDW) {
+            ir->insts[++i].lddw_hi = true;
+        } else if (is_branch(inst.opcode)) {
+            leader[i + 1 + ebpf_jump_offset(inst)] = 1;
+            leader[i + 1] = 1;
+        } else if (inst.opcode == EBPF_OP_EXIT) {
+            leader[i + 1] = 1;
+        }
+    }
+
+    ir->num_blocks = 0;
+    for (i = 0; i < num_insts; i++) {
+        ir->num_blocks += leader[i];
+    }
+
+    ir->blocks = calloc(ir->num_blocks, sizeof(ir->blocks[0]));
+    if (!ir->blocks) {
+        free(leader);
+        return -1;
+    }
+
+    b = 0;
+    for (i = 0; i < num_insts; i++) {
+        if (leader[i]) {
+            if (i > 0) {
+                ir->blocks[b - 1].end = i;
+            }
+            ir->blocks[b++].start = i;
+        }
+        ir->insts[i].block = b - 1;
+    }
+    ir->blocks[b - 1].end = num_insts;
+
+    free(leader);
+    return 0;
+}
+
+static uint32_t
+last_inst(const struct ubpf_ir *ir, uint32_t block)
+{
+    uint32_t pc = ir->blocks[block].end - 1;
+    if (ir->insts[pc].lddw_hi) {
+        pc--;
+    }
+    return pc;
+}
+
+static int
+build_cfg(struct ubpf_ir *ir)
+{
+    uint32_t b, i, num_edges = 0;
+    uint32_t *fill;
+
+    for (b = 0; b < ir->num_blocks; b++) {
+        struct ubpf_ir_block *block = &ir->blocks[b];
+        uint32_t pc = last_inst(ir, b);
+        struct ebpf_inst inst = ir->insts[pc].inst;
+        uint32_t fallthrough = block->end < ir->num_insts ? ir->insts[block->end].block : UBPF_IR_NONE;
+
+        block->num_succs = 0;
+        if (inst.opcode == EBPF_OP_EXIT) {
+            /* no successors */
+        } else if (inst.opcode == EBPF_OP_JA || inst.opcode == EBPF_OP_JA32) {
+            block->succs[block->num_succs++] = ir->insts[pc + 1 + ebpf_jump_offset(inst)].block;
+        } else if (is_branch(inst.opcode)) {
+            uint32_t target = ir->insts[pc + 1 + inst.offset].block;
+            block->succs[block->num_succs++] = target;
+            if (fallthrough != UBPF_IR_NONE && fallthrough != target) {
+                block->succs[block->num_succs++] = fallthrough;
+            }
+        } else if (fallthrough != UBPF_IR_NONE) {
+            block->succs[block->num_succs++] = fallthrough;
+        }
+
+        for (i = 0; i < block->num_succs; i++) {
+            ir->blocks[block->succs[i]].num_preds++;
+        }
+        num_edges += block->num_succs;
+    }
+
+    ir->preds = calloc(num_edges + 1, sizeof(ir->preds[0]));
+    fill = calloc(ir->num_blocks, sizeof(fill[0]));
+    if (!ir->preds || !fill) {
+        free(fill);
+        return -1;
+    }
+
+    for (b = 0, num_edges = 0; b < ir->num_blocks; b++) {
+        ir->blocks[b].pred_start = num_edges;
+        num_edges += ir->blocks[b].num_preds;
+    }
+
+    for (b = 0; b < ir->num_blocks; b++) {
+        for (i = 0; i < ir->blocks[b].num_succs; i++) {
+            uint32_t s = ir->blocks[b].succs[i];
+            ir->preds[ir->blocks[s].pred_start + fill[s]++] = b;
+        }
+    }
+
+    free(fill);
+    return 0;
+}
+
+static int
+build_rpo(struct ubpf_ir *ir)
+{
+    uint32_t *stack = calloc(ir->num_blocks, sizeof(stack[0]));
+    uint8_t *next_succ = calloc(ir->num_blocks, 1);
+    uint8_t *visited = calloc(ir->num_blocks, 1);
+    uint32_t sp = 0, post = ir->num_blocks, b;
+
+    ir->rpo = calloc(ir->num_blocks, sizeof(ir->rpo[0]));
+    if (!stack || !next_succ || !visited || !ir->rpo) {
+        free(stack);
+        free(next_succ);
+        free(visited);
+        return -1;
+    }
+
+    for (b = 0; b < ir->num_blocks; b++) {
+        ir->blocks[b].rpo_index = UBPF_IR_NONE;
+        ir->blocks[b].idom = UBPF_IR_NONE;
+    }
+
+    /* Iterative DFS, filling the postorder from the back */
+    stack[sp++] = 0;
+    visited[0] = 1;
+    while (sp > 0) {
+        uint32_t top = stack[sp - 1];
+        struct ubpf_ir_block *block = &ir->blocks[top];
+        if (next_succ[top] < block->num_succs) {
+            uint32_t s = block->succs[next_succ[top]++];
+            if (!visited[s]) {
+                visited[s] = 1;
+                stack[sp++] = s;
+            }
+        } else {
+            ir->rpo[--post] = top;
+            sp--;
+        }
+    }
+
+    ir->num_reachable = ir->num_blocks - post;
+    memmove(ir->rpo, ir->rpo + post, ir->num_reachable * sizeof(ir->rpo[0]));
+    for (b = 0; b < ir->num_reachable; b++) {
+        ir->blocks[ir->rpo[b]].rpo_index = b;
+    }
+
+    free(stack);
+    free(next_succ);
+    free(visited);
+    return 0;
+}
+
+static uint32_t
+intersect(const struct ubpf_ir *ir, uint32_t a, uint32_t b)
+{
+    while (a != b) {
+        while (ir->blocks[a].rpo_index > ir->blocks[b].rpo_index) {
+            a = ir->blocks[a].idom;
+        }
+        while (ir->blocks[b].rpo_index > ir->blocks[a].rpo_index) {
+            b = ir->blocks[b].idom;
+        }
+    }
+    return a;
+}
+
+/* Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm" */
+static void
+build_dominators(struct ubpf_ir *ir)
+{
+    bool changed = true;
+    uint32_t i, j;
+
+    ir->blocks[0].idom = 0;
+    while (changed) {
+        changed = false;
+        for (i = 1; i < ir->num_reachable; i++) {
+            uint32_t b = ir->rpo[i];
+            uint32_t new_idom = UBPF_IR_NONE;
+
+            for (j = 0; j < ir->blocks[b].num_preds; j++) {
+                uint32_t p = ubpf_ir_pred(ir, b, j);
+                if (ir->blocks[p].idom == UBPF_IR_NONE) {
+                    continue;
+                }
+                new_idom = new_idom == UBPF_IR_NONE ? p : intersect(ir, p, new_idom);
+            }
+
+            if (ir->blocks[b].idom != new_idom) {
+                ir->blocks[b].idom = new_idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+bool
+ubpf_ir_dominates(const struct ubpf_ir *ir, uint32_t a, uint32_t b)
+{
+    if (!ubpf_ir_reachable(ir, a) || !ubpf_ir_reachable(ir, b)) {
+        return false;
+    }
+    while (ir->blocks[b].rpo_index > ir->blocks[a].rpo_index) {
+        b = ir->blocks[b].idom;
+    }
+    return a == b;
+}
+
+bool
+ubpf_ir_entered_by_fallthrough(const struct ubpf_ir *ir, uint32_t block)
+{
+    uint32_t start = ir->blocks[block].start;
+    uint32_t i;
+
+    for (i = 0; i < ir->blocks[block].num_preds; i++) {
+        uint32_t p = ubpf_ir_pred(ir, block, i);
+        uint32_t pc;
+        struct ebpf_inst last;
+
+        if (!ubpf_ir_reachable(ir, p) || ubpf_ir_dominates(ir, block, p)) {
+            continue;
+        }
+        pc = last_inst(ir, p);
+        last = ir->insts[pc].inst;
+        if (ir->blocks[p].end != start || last.opcode == EBPF_OP_JA || last.opcode == EBPF_OP_JA32 ||
+                (is_branch(last.opcode) && pc + 1 + ebpf_jump_offset(last) == start)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t
+new_value(struct ubpf_ir *ir, uint8_t kind, uint8_t reg, uint32_t def)
+{
+    if (ir->num_values == ir->values_size) {
+        uint32_t size = ir->values_size * 2;
+        struct ubpf_ir_value *values = realloc(ir->values, size * sizeof(values[0]));
+        if (!values) {
+            return UBPF_IR_NONE;
+        }
+        ir->values = values;
+        ir->values_size = size;
+    }
+    ir->values[ir->num_values] = (struct ubpf_ir_value){ .kind = kind, .reg = reg, .def = def };
+    return ir->num_values++;
+}
+
+/*
+ * Rename registers into SSA values, visiting blocks in reverse postorder.
+ *
+ * A block whose reachable predecessors have all been visited and agree on
+ * a register inherits that value; otherwise (a join of different values,
+ * or a loop header reached by a back-edge) the register gets a phi value.
+ * The operands of a phi in block B for register r are the out[r] values
+ * of B's predecessors.
+ */
+int
+ubpf_ir_build_ssa(struct ubpf_ir *ir)
+{
+    uint32_t cur[UBPF_IR_NUM_REGS];
+    uint32_t i, j, pc;
+    int r;
+
+    ir->num_values = 0;
+
+    for (i = 0; i < ir->num_reachable; i++) {
+        uint32_t b = ir->rpo[i];
+        struct ubpf_ir_block *block = &ir->blocks[b];
+
+        for (r = 0; r < UBPF_IR_NUM_REGS; r++) {
+            uint32_t value = UBPF_IR_NONE;
+            bool phi = b == 0;
+
+            for (j = 0; j < block->num_preds && !phi; j++) {
+                uint32_t p = ubpf_ir_pred(ir, b, j);
+                if (!ubpf_ir_reachable(ir, p)) {
+                    continue;
+                }
+                if (ir->blocks[p].rpo_index >= block->rpo_index ||
+                        (value != UBPF_IR_NONE && ir->blocks[p].out[r] != value)) {
+                    phi = true;
+                }
+                value = ir->blocks[p].out[r];
+            }
+
+            if (b == 0 && block->num_preds == 0) {
+                value = new_value(ir, UBPF_IR_VALUE_ARG, r, b);
+            } else if (phi) {
+                value = new_value(ir, UBPF_IR_VALUE_PHI, r, b);
+            }
+            if (value == UBPF_IR_NONE) {
+                return -1;
+            }
+            block->in[r] = cur[r] = value;
+        }
+
+        for (pc = block->start; pc < block->end; pc++) {
+            struct ubpf_ir_inst *ir_inst = &ir->insts[pc];
+            struct ebpf_inst inst = ir_inst->inst;
+            uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+
+            ir_inst->def = UBPF_IR_NONE;
+            if (ir_inst->deleted || ir_inst->lddw_hi) {
+                continue;
+            }
+
+            ir_inst->dst_val = cur[inst.dst];
+            ir_inst->src_val = cur[inst.src];
+
+            if (cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64 || cls == EBPF_CLS_LDX ||
+                    inst.opcode == EBPF_OP_LDDW) {
+                ir_inst->def = cur[inst.dst] = new_value(ir, UBPF_IR_VALUE_INST, inst.dst, pc);
+            } else if (inst.opcode == EBPF_OP_CALL) {
+                ir_inst->def = cur[0] = new_value(ir, UBPF_IR_VALUE_INST, 0, pc);
+                for (r = 1; r <= 5; r++) {
+                    cur[r] = new_value(ir, UBPF_IR_VALUE_CLOBBER, r, pc);
+                }
+            }
+            for (r = 0; r < UBPF_IR_NUM_REGS; r++) {
+                if (cur[r] == UBPF_IR_NONE) {
+                    return -1;
+                }
+            }
+        }
+
+        memcpy(block->out, cur, sizeof(cur));
+    }
+
+    return 0;
+}
+
+void
+ubpf_ir_delete(struct ubpf_ir *ir, uint32_t pc)
+{
+    ir->insts[pc].deleted = true;
+    if (ir->insts[pc].inst.opcode == EBPF_OP_LDDW) {
+        ir->insts[pc + 1].deleted = true;
+    }
+}
+
+struct ubpf_ir *
+ubpf_ir_build(const struct ebpf_inst *insts, uint32_t num_insts)
+{
+    struct ubpf_ir *ir = calloc(1, sizeof(*ir));
+    uint32_t i;
+
+    if (!ir || num_insts == 0) {
+        return ir;
+    }
+
+    ir->num_insts = num_insts;
+    ir->insts = calloc(num_insts, sizeof(ir->insts[0]));
+    ir->values_size = 64;
+    ir->values = calloc(ir->values_size, sizeof(ir->values[0]));
+    if (!ir->insts || !ir->values) {
+        goto fail;
+    }
+
+    for (i = 0; i < num_insts; i++) {
+        ir->insts[i].inst = insts[i];
+    }
+
+    if (build_blocks(ir) < 0 || build_cfg(ir) < 0 || build_rpo(ir) < 0) {
+        goto fail;
+    }
+    build_dominators(ir);
+
+    if (ubpf_ir_build_ssa(ir) < 0) {
+        goto fail;
+    }
+
+    return ir;
+
+fail:
+    ubpf_ir_free(ir);
+    return NULL;
+}
+
+void
+ubpf_ir_free(struct ubpf_ir *ir)
+{
+    if (!ir) {
+        return;
+    }
+    free(ir->insts);
+    free(ir->blocks);
+    free(ir->preds);
+    free(ir->rpo);
+    free(ir->values);
+    free(ir);
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Mid-level IR used by the JIT
+ *
+ * The IR keeps one entry per eBPF instruction slot so that jump offsets and
+ * PCs in error messages stay valid, and groups the slots into basic blocks
+ * with a CFG, a reverse postorder and immediate dominators. Register
+ * operands are renamed into SSA values: every definition creates a value,
+ * and a join block gets a phi value for each register whose incoming
+ * values may differ.
+ *
+ * Optimization passes rewrite instructions in place, either deleting them
+ * or replacing them with cheaper equivalents. The backend emits the
+ * remaining instructions in PC order, except that hoisted instructions
+ * are emitted just before the head of their loop.
+ */
+
+#ifndef UBPF_IR_H
+#define UBPF_IR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ebpf.h"
+
+#define UBPF_IR_NUM_REGS 11
+#define UBPF_IR_NONE UINT32_MAX
+
+enum ubpf_ir_value_kind {
+    UBPF_IR_VALUE_ARG,     /* register contents on entry */
+    UBPF_IR_VALUE_INST,    /* result of an instruction */
+    UBPF_IR_VALUE_PHI,     /* merge of the incoming values at a join block */
+    UBPF_IR_VALUE_CLOBBER, /* caller-saved register after a helper call */
+};
+
+struct ubpf_ir_value {
+    uint8_t kind;
+    uint8_t reg;
+    uint32_t def; /* defining instruction, or block for phis */
+};
+
+struct ubpf_ir_inst {
+    struct ebpf_inst inst;
+    uint32_t block;
+    uint32_t dst_val; /* SSA values in the dst and src registers before the instruction */
+    uint32_t src_val;
+    uint32_t def;     /* SSA value defined, or UBPF_IR_NONE */
+    bool deleted;
+    bool hoisted;     /* out of the loop whose head block holds it */
+    bool lddw_hi;     /* second slot of an lddw */
+};
+
+struct ubpf_ir_block {
+    uint32_t start;  /* first instruction */
+    uint32_t end;    /* one past the last instruction */
+    uint32_t succs[2];
+    uint8_t num_succs;
+    uint32_t pred_start; /* index into ubpf_ir.preds */
+    uint32_t num_preds;
+    uint32_t rpo_index;  /* UBPF_IR_NONE if unreachable */
+    uint32_t idom;
+    uint32_t in[UBPF_IR_NUM_REGS];  /* SSA value of each register on entry */
+    uint32_t out[UBPF_IR_NUM_REGS]; /* and on exit */
+};
+
+struct ubpf_ir {
+    struct ubpf_ir_inst *insts;
+    uint32_t num_insts;
+    struct ubpf_ir_block *blocks;
+    uint32_t num_blocks;
+    uint32_t *preds;
+    uint32_t *rpo;        /* reachable blocks in reverse postorder */
+    uint32_t num_reachable;
+    struct ubpf_ir_value *values;
+    uint32_t num_values;
+    uint32_t values_size;
+};
+
+/* Build the IR, CFG, dominators and SSA values for validated code */
+struct ubpf_ir *ubpf_ir_build(const struct ebpf_inst *insts, uint32_t num_insts);
+void ubpf_ir_free(struct ubpf_ir *ir);
+
+/* Recompute the SSA values after instructions were deleted or rewritten */
+int ubpf_ir_build_ssa(struct ubpf_ir *ir);
+
+bool ubpf_ir_dominates(const struct ubpf_ir *ir, uint32_t a, uint32_t b);
+
+/*
+ * Whether the only way into loop head 'block' from outside the loop is by
+ * falling through from the instruction before it
+ */
+bool ubpf_ir_entered_by_fallthrough(const struct ubpf_ir *ir, uint32_t block);
+
+static inline uint32_t
+ubpf_ir_pred(const struct ubpf_ir *ir, uint32_t block, uint32_t i)
+{
+    return ir->preds[ir->blocks[block].pred_start + i];
+}
+
+static inline bool
+ubpf_ir_reachable(const struct ubpf_ir *ir, uint32_t block)
+{
+    return ir->blocks[block].rpo_index != UBPF_IR_NONE;
+}
+
+void ubpf_ir_delete(struct ubpf_ir *ir, uint32_t pc);
+
+/* Optimization passes, in ubpf_ir_opt.c */
+void ubpf_ir_coalesce_loads(struct ubpf_ir *ir);
+int ubpf_ir_gvn(struct ubpf_ir *ir);
+void ubpf_ir_dce(struct ubpf_ir *ir);
+int ubpf_ir_optimize(struct ubpf_ir *ir);
+int ubpf_ir_hoist_invariants(struct ubpf_ir *ir);
+
+/* An 8-byte stack slot that is only accessed as a whole through r10 */
+struct ubpf_ir_slot {
+    int16_t offset;  /* from r10 */
+    uint32_t weight; /* static access count, scaled by loop depth */
+};
+
+bool ubpf_ir_has_calls(const struct ubpf_ir *ir);
+
+/*
+ * Find the stack slots that can live in host registers, heaviest first.
+ * Returns the number of slots stored, at most 'max_slots'.
+ */
+int ubpf_ir_find_stack_slots(const struct ubpf_ir *ir, struct ubpf_ir_slot *slots, int max_slots);
+
+#endif
@@ -0,0 +1,1177 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Optimization passes over the JIT IR
+ *
+ * Load coalescing first replaces an OR of adjacent narrow loads, shifted
+ * into place, with a single wider little-endian load.
+ *
+ * Global value numbering assigns a value number to every SSA value from a
+ * hash of its operation and operand value numbers. Loads are numbered
+ * together with a version of the memory they read, so a load that repeats
+ * an earlier load (or reads back an earlier 64-bit store) with no store in
+ * between gets the same number. Within a block, loads stay available across
+ * stores through the same base register to other offsets. An instruction
+ * whose value is already in its destination register is deleted, and one
+ * whose value is in another register becomes a register move.
+ *
+ * Dead-code elimination then deletes unreachable blocks and side-effect
+ * free instructions whose result is never read, using register liveness.
+ *
+ * Finally, the stack slot analysis finds 8-byte slots that the backend
+ * can keep in spare host registers instead of memory.
+ *
+ * Loop-invariant code motion runs separately, when the backend can emit
+ * code before a loop head. It hoists instructions out of the head block of
+ * a loop, which runs every time the loop is entered, so that they run once
+ * per entry rather than once per iteration. An instruction qualifies when
+ * its operands are defined outside the loop or by hoisted instructions,
+ * no other instruction in the loop writes its register, and the head block
+ * does not read that register before it. A load also needs a loop without
+ * helper calls or stores that may overwrite what it reads, and no
+ * instruction that may end the program before it in the block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ubpf_int.h"
+#include "ubpf_ir.h"
+
+#define KEY_CONST 0x100
+
+/* Loads tracked per block so that they can survive non-aliasing stores */
+#define MAX_AVAIL_LOADS 16
+
+/* Memory partitions: the stack is separate from everything else as long as its address never escapes */
+#define MEM_OTHER 0
+#define MEM_STACK 1
+
+struct vn_key {
+    uint32_t op;
+    uint32_t a;
+    uint32_t b;
+    uint64_t imm;
+};
+
+struct vn_entry {
+    struct vn_key key;
+    uint32_t vn;
+};
+
+struct avail_load {
+    uint32_t op;
+    uint32_t base;
+    uint32_t vn;
+    int16_t offset;
+    uint8_t part;
+};
+
+struct gvn_state {
+    struct ubpf_ir *ir;
+    uint32_t *vn;              /* value number of each SSA value */
+    uint32_t next_vn;
+    struct vn_entry *table;
+    uint32_t table_mask;
+    uint32_t (*mem_out)[2];    /* memory versions at the end of each block */
+    bool stack_escapes;
+    uint32_t stack_vn;         /* value number of r10 */
+    struct avail_load avail[MAX_AVAIL_LOADS];
+    int num_avail;
+};
+
+static uint32_t
+fresh_vn(struct gvn_state *s)
+{
+    return s->next_vn++;
+}
+
+static uint32_t
+hash_key(const struct vn_key *key)
+{
+    uint64_t h = key->op;
+    h = h * 0x9e3779b97f4a7c15ULL + key->a;
+    h = h * 0x9e3779b97f4a7c15ULL + key->b;
+    h = h * 0x9e3779b97f4a7c15ULL + key->imm;
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static bool
+key_equal(const struct vn_key *a, const struct vn_key *b)
+{
+    return a->op == b->op && a->a == b->a && a->b == b->b && a->imm == b->imm;
+}
+
+/* Value number for 'key', allocating a new one the first time it is seen */
+static uint32_t
+lookup_vn(struct gvn_state *s, struct vn_key key)
+{
+    uint32_t i = hash_key(&key) & s->table_mask;
+
+    while (s->table[i].vn) {
+        if (key_equal(&s->table[i].key, &key)) {
+            return s->table[i].vn;
+        }
+        i = (i + 1) & s->table_mask;
+    }
+
+    s->table[i].key = key;
+    return s->table[i].vn = fresh_vn(s);
+}
+
+/* Record that 'key' has value number 'vn', e.g. a load after a store */
+static void
+insert_vn(struct gvn_state *s, struct vn_key key, uint32_t vn)
+{
+    uint32_t i = hash_key(&key) & s->table_mask;
+
+    while (s->table[i].vn) {
+        if (key_equal(&s->table[i].key, &key)) {
+            return;
+        }
+        i = (i + 1) & s->table_mask;
+    }
+
+    s->table[i].key = key;
+    s->table[i].vn = vn;
+}
+
+static struct vn_key
+make_key(uint32_t op, uint32_t a, uint32_t b, uint64_t imm)
+{
+    struct vn_key key = { .op = op, .a = a, .b = b, .imm = imm };
+    return key;
+}
+
+static uint32_t
+const_vn(struct gvn_state *s, uint64_t value)
+{
+    return lookup_vn(s, make_key(KEY_CONST, 0, 0, value));
+}
+
+static bool
+is_commutative(uint8_t opcode)
+{
+    switch (opcode & EBPF_ALU_OP_MASK) {
+    case 0x00: /* add */
+    case 0x20: /* mul */
+    case 0x40: /* or */
+    case 0x50: /* and */
+    case 0xa0: /* xor */
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int
+mem_partition(struct gvn_state *s, uint32_t base_vn)
+{
+    return !s->stack_escapes && base_vn == s->stack_vn ? MEM_STACK : MEM_OTHER;
+}
+
+static int
+access_size(uint8_t opcode)
+{
+    switch (opcode & 0x18) {
+    case EBPF_SIZE_B: return 1;
+    case EBPF_SIZE_H: return 2;
+    case EBPF_SIZE_W: return 4;
+    default: return 8;
+    }
+}
+
+static uint64_t
+truncate_to_size(uint64_t value, uint8_t opcode)
+{
+    switch (opcode & 0x18) {
+    case EBPF_SIZE_B: return (uint8_t)value;
+    case EBPF_SIZE_H: return (uint16_t)value;
+    case EBPF_SIZE_W: return (uint32_t)value;
+    default: return value;
+    }
+}
+
+/* Does the program use r10 as a value rather than only as a memory base? */
+static bool
+stack_escapes(const struct ubpf_ir *ir)
+{
+    uint32_t pc;
+
+    for (pc = 0; pc < ir->num_insts; pc++) {
+        struct ebpf_inst inst = ir->insts[pc].inst;
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+
+        if (ir->insts[pc].deleted || ir->insts[pc].lddw_hi) {
+            continue;
+        }
+        if ((cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64 || cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) &&
+                (inst.opcode & EBPF_SRC_REG) && inst.src == 10) {
+            return true;
+        }
+        if ((cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) && inst.opcode != EBPF_OP_CALL && inst.dst == 10) {
+            return true;
+        }
+        if (cls == EBPF_CLS_STX && inst.src == 10) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Bytes [offset, offset + size) at 'base', shifted left by 'shift' bits */
+struct load_piece {
+    uint32_t base;
+    int32_t offset;
+    int size;
+    int shift;
+    uint32_t first_pc;
+};
+
+#define MAX_PIECE_DEPTH 16
+
+/*
+ * Describe SSA value 'v' as a zero-extended little-endian load built from
+ * loads, constant left shifts and ORs within 'block'.
+ */
+static bool
+load_piece(const struct ubpf_ir *ir, uint32_t v, uint32_t block, int depth, struct load_piece *piece)
+{
+    const struct ubpf_ir_inst *ir_inst;
+    struct ebpf_inst inst;
+    struct load_piece lo, hi, tmp;
+    int limit = 64;
+
+    if (depth > MAX_PIECE_DEPTH || ir->values[v].kind != UBPF_IR_VALUE_INST) {
+        return false;
+    }
+    ir_inst = &ir->insts[ir->values[v].def];
+    inst = ir_inst->inst;
+    if (ir_inst->deleted || ir_inst->block != block) {
+        return false;
+    }
+
+    switch (inst.opcode) {
+    case EBPF_OP_LDXB:
+    case EBPF_OP_LDXH:
+    case EBPF_OP_LDXW:
+    case EBPF_OP_LDXDW:
+        piece->base = ir_inst->src_val;
+        piece->offset = inst.offset;
+        piece->size = access_size(inst.opcode);
+        piece->shift = 0;
+        piece->first_pc = ir->values[v].def;
+        return true;
+
+    case EBPF_OP_MOV64_REG:
+        if (inst.offset) {
+            return false;
+        }
+        return load_piece(ir, ir_inst->src_val, block, depth + 1, piece);
+
+    case EBPF_OP_LSH_IMM:
+        limit = 32;
+        /* fallthrough */
+    case EBPF_OP_LSH64_IMM:
+        if (inst.imm < 0 || inst.imm >= limit || inst.imm % 8 ||
+                !load_piece(ir, ir_inst->dst_val, block, depth + 1, piece)) {
+            return false;
+        }
+        piece->shift += inst.imm;
+        return piece->shift + 8 * piece->size <= limit;
+
+    case EBPF_OP_OR_REG:
+        limit = 32;
+        /* fallthrough */
+    case EBPF_OP_OR64_REG:
+        if (!load_piece(ir, ir_inst->dst_val, block, depth + 1, &lo) ||
+                !load_piece(ir, ir_inst->src_val, block, depth + 1, &hi)) {
+            return false;
+        }
+        if (lo.shift > hi.shift) {
+            tmp = lo;
+            lo = hi;
+            hi = tmp;
+        }
+        if (lo.base != hi.base || hi.offset != lo.offset + lo.size ||
+                hi.shift != lo.shift + 8 * lo.size || hi.shift + 8 * hi.size > limit) {
+            return false;
+        }
+        *piece = lo;
+        piece->size += hi.size;
+        if (hi.first_pc < piece->first_pc) {
+            piece->first_pc = hi.first_pc;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Replace ORs that assemble a 2, 4 or 8-byte little-endian field from
+ * adjacent narrower loads with one load of the whole field. The narrow
+ * loads are left for dead-code elimination.
+ */
+void
+ubpf_ir_coalesce_loads(struct ubpf_ir *ir)
+{
+    uint32_t cur[UBPF_IR_NUM_REGS];
+    uint32_t i, pc, barrier;
+    int r;
+
+    for (i = 0; i < ir->num_reachable; i++) {
+        uint32_t block = ir->rpo[i];
+        struct ubpf_ir_block *b = &ir->blocks[block];
+
+        memcpy(cur, b->in, sizeof(cur));
+        /* Loads before this point may have read different memory */
+        barrier = b->start;
+
+        for (pc = b->start; pc < b->end; pc++) {
+            struct ubpf_ir_inst *ir_inst = &ir->insts[pc];
+            struct ebpf_inst *inst = &ir_inst->inst;
+            uint8_t cls = inst->opcode & EBPF_CLS_MASK;
+            struct load_piece piece;
+
+            if (ir_inst->deleted || ir_inst->lddw_hi) {
+                continue;
+            }
+
+            if (inst->opcode == EBPF_OP_CALL) {
+                for (r = 0; r <= 5; r++) {
+                    cur[r] = ir_inst->def + r;
+                }
+                barrier = pc + 1;
+                continue;
+            }
+            if (cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) {
+                barrier = pc + 1;
+            }
+
+            if ((inst->opcode == EBPF_OP_OR_REG || inst->opcode == EBPF_OP_OR64_REG) &&
+                    load_piece(ir, ir_inst->def, block, 0, &piece) &&
+                    piece.shift == 0 && piece.first_pc >= barrier &&
+                    (piece.size == 2 || piece.size == 4 || piece.size == 8)) {
+                for (r = 0; r < UBPF_IR_NUM_REGS; r++) {
+                    if (cur[r] == piece.base) {
+                        break;
+                    }
+                }
+                if (r < UBPF_IR_NUM_REGS) {
+                    inst->opcode = EBPF_CLS_LDX | EBPF_MODE_MEM |
+                        (piece.size == 2 ? EBPF_SIZE_H : piece.size == 4 ? EBPF_SIZE_W : EBPF_SIZE_DW);
+                    inst->src = r;
+                    inst->offset = piece.offset;
+                    inst->imm = 0;
+                    ir_inst->src_val = piece.base;
+                }
+            }
+
+            if (ir_inst->def != UBPF_IR_NONE) {
+                cur[inst->dst] = ir_inst->def;
+            }
+        }
+    }
+}
+
+/* Merge the per-predecessor state of a block, or return a fresh number if unknown or different */
+static uint32_t
+merge_vn(struct gvn_state *s, uint32_t block, uint32_t (*get)(struct gvn_state *, uint32_t, int), int arg)
+{
+    struct ubpf_ir *ir = s->ir;
+    struct ubpf_ir_block *b = &ir->blocks[block];
+    uint32_t vn = 0, i;
+
+    for (i = 0; i < b->num_preds; i++) {
+        uint32_t p = ubpf_ir_pred(ir, block, i);
+        if (!ubpf_ir_reachable(ir, p)) {
+            continue;
+        }
+        if (ir->blocks[p].rpo_index >= b->rpo_index) {
+            return fresh_vn(s);
+        }
+        if (vn && get(s, p, arg) != vn) {
+            return fresh_vn(s);
+        }
+        vn = get(s, p, arg);
+    }
+
+    return vn ? vn : fresh_vn(s);
+}
+
+static uint32_t
+get_reg_out(struct gvn_state *s, uint32_t block, int reg)
+{
+    return s->vn[s->ir->blocks[block].out[reg]];
+}
+
+static uint32_t
+get_mem_out(struct gvn_state *s, uint32_t block, int part)
+{
+    return s->mem_out[block][part];
+}
+
+static void
+add_avail(struct gvn_state *s, uint32_t op, uint32_t base, int16_t offset, int part, uint32_t vn)
+{
+    if (s->num_avail == MAX_AVAIL_LOADS) {
+        memmove(&s->avail[0], &s->avail[1], sizeof(s->avail[0]) * (MAX_AVAIL_LOADS - 1));
+        s->num_avail--;
+    }
+    s->avail[s->num_avail].op = op;
+    s->avail[s->num_avail].base = base;
+    s->avail[s->num_avail].vn = vn;
+    s->avail[s->num_avail].offset = offset;
+    s->avail[s->num_avail].part = part;
+    s->num_avail++;
+}
+
+/* Forget the tracked loads in a memory partition, or all of them */
+static void
+kill_avail(struct gvn_state *s, int part)
+{
+    int i, n = 0;
+
+    for (i = 0; i < s->num_avail; i++) {
+        if (!s->stack_escapes && s->avail[i].part != part) {
+            s->avail[n++] = s->avail[i];
+        }
+    }
+    s->num_avail = n;
+}
+
+/*
+ * A store through 'base' starts a new memory version. Loads through the
+ * same base that do not overlap the stored bytes keep their value numbers
+ * in the new version; any other load in the partition may alias the store.
+ */
+static void
+set_store_version(struct gvn_state *s, uint32_t mem[2], int part, uint32_t base, int16_t offset, int size)
+{
+    int i, n = 0;
+
+    if (s->stack_escapes) {
+        mem[MEM_OTHER] = mem[MEM_STACK] = fresh_vn(s);
+    } else {
+        mem[part] = fresh_vn(s);
+    }
+
+    for (i = 0; i < s->num_avail; i++) {
+        struct avail_load *a = &s->avail[i];
+        if (!s->stack_escapes && a->part != part) {
+            s->avail[n++] = *a;
+            continue;
+        }
+        if (a->base == base &&
+                (a->offset + access_size(a->op) <= offset || offset + size <= a->offset)) {
+            insert_vn(s, make_key(a->op, a->base, mem[part], (int64_t)a->offset), a->vn);
+            s->avail[n++] = *a;
+        }
+    }
+    s->num_avail = n;
+}
+
+/*
+ * Value number of the result of an ALU instruction, or 0 if it cannot be
+ * expressed in terms of its operands.
+ */
+static uint32_t
+alu_vn(struct gvn_state *s, const struct ubpf_ir_inst *ir_inst)
+{
+    struct ebpf_inst inst = ir_inst->inst;
+    uint32_t dst = s->vn[ir_inst->dst_val];
+    uint32_t src = s->vn[ir_inst->src_val];
+    /* The offset tells signed division and MOVSX apart from the plain forms */
+    uint32_t op = inst.opcode | (uint32_t)(uint16_t)inst.offset << 8;
+
+    switch (inst.opcode) {
+    case EBPF_OP_MOV64_REG:
+        return inst.offset ? lookup_vn(s, make_key(op, src, 0, 0)) : src;
+    case EBPF_OP_MOV64_IMM:
+        return const_vn(s, (int64_t)inst.imm);
+    case EBPF_OP_MOV_IMM:
+        return const_vn(s, (uint32_t)inst.imm);
+    case EBPF_OP_MOV_REG:
+        return lookup_vn(s, make_key(op, src, 0, 0));
+    case EBPF_OP_NEG:
+    case EBPF_OP_NEG64:
+        return lookup_vn(s, make_key(inst.opcode, dst, 0, 0));
+    case EBPF_OP_LE:
+    case EBPF_OP_BE:
+    case EBPF_OP_BSWAP:
+        return lookup_vn(s, make_key(inst.opcode, dst, 0, inst.imm));
+    }
+
+    if (inst.opcode & EBPF_SRC_REG) {
+        if (is_commutative(inst.opcode) && src < dst) {
+            return lookup_vn(s, make_key(op, src, dst, 0));
+        }
+        return lookup_vn(s, make_key(op, dst, src, 0));
+    }
+
+    return lookup_vn(s, make_key(op, dst, 0, (uint32_t)inst.imm));
+}
+
+/* Use a copy of the value already held in a register, if there is one */
+static void
+reuse_value(struct gvn_state *s, uint32_t pc, uint32_t cur[UBPF_IR_NUM_REGS], uint32_t vn)
+{
+    struct ubpf_ir_inst *ir_inst = &s->ir->insts[pc];
+    struct ebpf_inst *inst = &ir_inst->inst;
+    int r;
+
+    if (s->vn[cur[inst->dst]] == vn) {
+        ubpf_ir_delete(s->ir, pc);
+        return;
+    }
+
+    if (inst->opcode == EBPF_OP_MOV64_REG) {
+        return;
+    }
+
+    for (r = 0; r < UBPF_IR_NUM_REGS; r++) {
+        if (s->vn[cur[r]] == vn) {
+            if (inst->opcode == EBPF_OP_LDDW) {
+                ubpf_ir_delete(s->ir, pc + 1);
+            }
+            inst->opcode = EBPF_OP_MOV64_REG;
+            inst->src = r;
+            inst->offset = 0;
+            inst->imm = 0;
+            ir_inst->src_val = cur[r];
+            return;
+        }
+    }
+}
+
+static void
+gvn_block(struct gvn_state *s, uint32_t block)
+{
+    struct ubpf_ir *ir = s->ir;
+    struct ubpf_ir_block *b = &ir->blocks[block];
+    uint32_t cur[UBPF_IR_NUM_REGS];
+    uint32_t mem[2];
+    uint32_t pc;
+    int r;
+
+    for (r = 0; r < UBPF_IR_NUM_REGS; r++) {
+        uint32_t value = b->in[r];
+        if (ir->values[value].def == block) {
+            if (ir->values[value].kind == UBPF_IR_VALUE_ARG) {
+                s->vn[value] = fresh_vn(s);
+            } else if (ir->values[value].kind == UBPF_IR_VALUE_PHI) {
+                s->vn[value] = merge_vn(s, block, get_reg_out, r);
+            }
+        }
+        cur[r] = value;
+    }
+    if (block == 0) {
+        s->stack_vn = s->vn[cur[10]];
+    }
+
+    mem[MEM_OTHER] = merge_vn(s, block, get_mem_out, MEM_OTHER);
+    mem[MEM_STACK] = s->stack_escapes ? mem[MEM_OTHER] : merge_vn(s, block, get_mem_out, MEM_STACK);
+    s->num_avail = 0;
+
+    for (pc = b->start; pc < b->end; pc++) {
+        struct ubpf_ir_inst *ir_inst = &ir->insts[pc];
+        struct ebpf_inst inst = ir_inst->inst;
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+        uint32_t vn = 0;
+
+        if (ir_inst->deleted || ir_inst->lddw_hi) {
+            continue;
+        }
+
+        if (cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64) {
+            vn = alu_vn(s, ir_inst);
+        } else if (cls == EBPF_CLS_LDX) {
+            uint32_t base = s->vn[ir_inst->src_val];
+            int part = mem_partition(s, base);
+            vn = lookup_vn(s, make_key(inst.opcode, base, mem[part], (int64_t)inst.offset));
+            add_avail(s, inst.opcode, base, inst.offset, part, vn);
+        } else if (inst.opcode == EBPF_OP_LDDW) {
+            vn = const_vn(s, (uint32_t)inst.imm | ((uint64_t)ir->insts[pc + 1].inst.imm << 32));
+        } else if (cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) {
+            uint32_t base = s->vn[ir_inst->dst_val];
+            uint8_t load_op = EBPF_CLS_LDX | EBPF_MODE_MEM | (inst.opcode & 0x18);
+            int part = mem_partition(s, base);
+            uint32_t stored = 0;
+
+            set_store_version(s, mem, part, base, inst.offset, access_size(inst.opcode));
+            if (cls == EBPF_CLS_ST) {
+                stored = const_vn(s, truncate_to_size((int64_t)inst.imm, inst.opcode));
+            } else if (inst.opcode == EBPF_OP_STXDW) {
+                stored = s->vn[ir_inst->src_val];
+            }
+            if (stored) {
+                insert_vn(s, make_key(load_op, base, mem[part], (int64_t)inst.offset), stored);
+                add_avail(s, load_op, base, inst.offset, part, stored);
+            }
+        } else if (inst.opcode == EBPF_OP_CALL) {
+            mem[MEM_OTHER] = fresh_vn(s);
+            if (s->stack_escapes) {
+                mem[MEM_STACK] = mem[MEM_OTHER];
+            }
+            kill_avail(s, MEM_OTHER);
+            s->vn[ir_inst->def] = fresh_vn(s);
+            /* The clobbered r1-r5 values follow the call's result */
+            for (r = 0; r <= 5; r++) {
+                cur[r] = ir_inst->def + r;
+            }
+            continue;
+        }
+
+        if (ir_inst->def != UBPF_IR_NONE) {
+            s->vn[ir_inst->def] = vn ? vn : fresh_vn(s);
+            reuse_value(s, pc, cur, s->vn[ir_inst->def]);
+            cur[inst.dst] = ir_inst->def;
+        }
+    }
+
+    s->mem_out[block][MEM_OTHER] = mem[MEM_OTHER];
+    s->mem_out[block][MEM_STACK] = mem[MEM_STACK];
+}
+
+int
+ubpf_ir_gvn(struct ubpf_ir *ir)
+{
+    struct gvn_state s = { .ir = ir, .next_vn = 1 };
+    uint32_t table_size = 64, i;
+    int result = -1;
+
+    while (table_size < 4 * ir->num_insts) {
+        table_size *= 2;
+    }
+    s.table_mask = table_size - 1;
+    s.table = calloc(table_size, sizeof(s.table[0]));
+    s.vn = calloc(ir->num_values, sizeof(s.vn[0]));
+    s.mem_out = calloc(ir->num_blocks, sizeof(s.mem_out[0]));
+    if (!s.table || !s.vn || !s.mem_out) {
+        goto out;
+    }
+    s.stack_escapes = stack_escapes(ir);
+
+    /* Clobbered registers never hold a known value */
+    for (i = 0; i < ir->num_values; i++) {
+        if (ir->values[i].kind == UBPF_IR_VALUE_CLOBBER) {
+            s.vn[i] = fresh_vn(&s);
+        }
+    }
+
+    for (i = 0; i < ir->num_reachable; i++) {
+        gvn_block(&s, ir->rpo[i]);
+    }
+    result = 0;
+
+out:
+    free(s.table);
+    free(s.vn);
+    free(s.mem_out);
+    return result;
+}
+
+/* Registers read and written by an instruction, as bitmasks */
+static void
+inst_regs(struct ebpf_inst inst, uint16_t *use, uint16_t *def)
+{
+    uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+
+    *use = 0;
+    *def = 0;
+
+    switch (cls) {
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64:
+        if ((inst.opcode & EBPF_ALU_OP_MASK) != 0xb0) {
+            *use |= 1 << inst.dst;
+        }
+        if ((inst.opcode & EBPF_SRC_REG) && inst.opcode != EBPF_OP_BE) {
+            *use |= 1 << inst.src;
+        }
+        *def |= 1 << inst.dst;
+        break;
+    case EBPF_CLS_LDX:
+        *use |= 1 << inst.src;
+        *def |= 1 << inst.dst;
+        break;
+    case EBPF_CLS_LD:
+        *def |= 1 << inst.dst;
+        break;
+    case EBPF_CLS_ST:
+        *use |= 1 << inst.dst;
+        break;
+    case EBPF_CLS_STX:
+        *use |= (1 << inst.dst) | (1 << inst.src);
+        break;
+    case EBPF_CLS_JMP:
+    case EBPF_CLS_JMP32:
+        if (inst.opcode == EBPF_OP_CALL) {
+            *use |= 0x3e;
+            *def |= 0x3f;
+        } else if (inst.opcode == EBPF_OP_EXIT) {
+            *use |= 1;
+        } else if (inst.opcode != EBPF_OP_JA && inst.opcode != EBPF_OP_JA32) {
+            *use |= 1 << inst.dst;
+            if (inst.opcode & EBPF_SRC_REG) {
+                *use |= 1 << inst.src;
+            }
+        }
+        break;
+    }
+}
+
+static bool
+removable(struct ebpf_inst inst)
+{
+    uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+
+    if (cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64) {
+        /* Division by a register may report an error */
+        uint8_t op = inst.opcode & EBPF_ALU_OP_MASK;
+        return !((op == 0x30 || op == 0x90) && (inst.opcode & EBPF_SRC_REG));
+    }
+    return cls == EBPF_CLS_LDX || inst.opcode == EBPF_OP_LDDW;
+}
+
+/* Backward liveness over registers; returns the live-out set of each block */
+static uint16_t *
+compute_liveness(struct ubpf_ir *ir)
+{
+    uint16_t *live_in = calloc(ir->num_blocks, sizeof(live_in[0]));
+    uint16_t *live_out = calloc(ir->num_blocks, sizeof(live_out[0]));
+    bool changed = true;
+    uint32_t i, j, pc;
+
+    if (!live_in || !live_out) {
+        free(live_in);
+        free(live_out);
+        return NULL;
+    }
+
+    while (changed) {
+        changed = false;
+        for (i = ir->num_reachable; i-- > 0;) {
+            uint32_t b = ir->rpo[i];
+            struct ubpf_ir_block *block = &ir->blocks[b];
+            /* Falling off the end returns r0 */
+            uint16_t live = block->num_succs == 0 ? 1 : 0;
+
+            for (j = 0; j < block->num_succs; j++) {
+                live |= live_in[block->succs[j]];
+            }
+            live_out[b] = live;
+
+            for (pc = block->end; pc-- > block->start;) {
+                uint16_t use, def;
+                if (ir->insts[pc].deleted || ir->insts[pc].lddw_hi) {
+                    continue;
+                }
+                inst_regs(ir->insts[pc].inst, &use, &def);
+                live = (live & ~def) | use;
+            }
+
+            if (live != live_in[b]) {
+                live_in[b] = live;
+                changed = true;
+            }
+        }
+    }
+
+    free(live_in);
+    return live_out;
+}
+
+void
+ubpf_ir_dce(struct ubpf_ir *ir)
+{
+    bool changed = true;
+    uint32_t b, i, pc;
+
+    for (b = 0; b < ir->num_blocks; b++) {
+        if (!ubpf_ir_reachable(ir, b)) {
+            for (pc = ir->blocks[b].start; pc < ir->blocks[b].end; pc++) {
+                ir->insts[pc].deleted = true;
+            }
+        }
+    }
+
+    while (changed) {
+        uint16_t *live_out = compute_liveness(ir);
+        if (!live_out) {
+            return;
+        }
+
+        changed = false;
+        for (i = 0; i < ir->num_reachable; i++) {
+            struct ubpf_ir_block *block = &ir->blocks[ir->rpo[i]];
+            uint16_t live = live_out[ir->rpo[i]];
+
+            for (pc = block->end; pc-- > block->start;) {
+                struct ubpf_ir_inst *ir_inst = &ir->insts[pc];
+                uint16_t use, def;
+
+                if (ir_inst->deleted || ir_inst->lddw_hi) {
+                    continue;
+                }
+                inst_regs(ir_inst->inst, &use, &def);
+                if (removable(ir_inst->inst) && !(live & def)) {
+                    ubpf_ir_delete(ir, pc);
+                    changed = true;
+                    continue;
+                }
+                live = (live & ~def) | use;
+            }
+        }
+
+        free(live_out);
+    }
+}
+
+int
+ubpf_ir_optimize(struct ubpf_ir *ir)
+{
+    ubpf_ir_coalesce_loads(ir);
+    if (ubpf_ir_build_ssa(ir) < 0 || ubpf_ir_gvn(ir) < 0) {
+        return -1;
+    }
+    ubpf_ir_dce(ir);
+    return ubpf_ir_build_ssa(ir);
+}
+
+/* Mark the blocks of the natural loop headed by 'head'; false if it is not a loop head */
+static bool
+mark_loop(const struct ubpf_ir *ir, uint32_t head, uint8_t *in_loop, uint32_t *worklist)
+{
+    uint32_t n = 0, i;
+    bool loop = false;
+
+    memset(in_loop, 0, ir->num_blocks);
+    in_loop[head] = 1;
+    for (i = 0; i < ir->blocks[head].num_preds; i++) {
+        uint32_t p = ubpf_ir_pred(ir, head, i);
+        if (ubpf_ir_reachable(ir, p) && ubpf_ir_dominates(ir, head, p)) {
+            loop = true;
+            if (!in_loop[p]) {
+                in_loop[p] = 1;
+                worklist[n++] = p;
+            }
+        }
+    }
+    if (!loop) {
+        return false;
+    }
+    while (n > 0) {
+        uint32_t b = worklist[--n];
+        for (i = 0; i < ir->blocks[b].num_preds; i++) {
+            uint32_t p = ubpf_ir_pred(ir, b, i);
+            if (ubpf_ir_reachable(ir, p) && !in_loop[p]) {
+                in_loop[p] = 1;
+                worklist[n++] = p;
+            }
+        }
+    }
+    return true;
+}
+
+/* Hoisted instructions of inner loops still run on every iteration of this one */
+static bool
+is_invariant(const struct ubpf_ir *ir, uint32_t head, const uint8_t *in_loop, const uint8_t *defs, uint32_t v)
+{
+    const struct ubpf_ir_value *value = &ir->values[v];
+
+    switch (value->kind) {
+    case UBPF_IR_VALUE_ARG:
+        return true;
+    case UBPF_IR_VALUE_PHI:
+        /* Phis of registers that the loop does not write merge the value on entry with itself */
+        return !in_loop[value->def] || !defs[value->reg];
+    case UBPF_IR_VALUE_INST:
+        if (ir->insts[value->def].hoisted && ir->insts[value->def].block == head) {
+            return true;
+        }
+        return !in_loop[ir->insts[value->def].block];
+    default:
+        return !in_loop[ir->insts[value->def].block];
+    }
+}
+
+/* Writes in a loop, for deciding what in it is invariant */
+struct loop_writes {
+    uint8_t defs[UBPF_IR_NUM_REGS]; /* instructions writing each register, up to 2 */
+    bool calls;
+    bool other_stores;              /* through registers other than r10 */
+    int32_t stack_lo, stack_hi;     /* bytes stored through r10 */
+};
+
+static void
+find_loop_writes(const struct ubpf_ir *ir, const uint8_t *in_loop, struct loop_writes *w)
+{
+    uint32_t pc;
+    int r;
+
+    memset(w, 0, sizeof(*w));
+    w->stack_lo = INT32_MAX;
+    w->stack_hi = INT32_MIN;
+
+    for (pc = 0; pc < ir->num_insts; pc++) {
+        struct ebpf_inst inst = ir->insts[pc].inst;
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+        uint16_t use, def;
+
+        if (ir->insts[pc].deleted || ir->insts[pc].lddw_hi || !in_loop[ir->insts[pc].block]) {
+            continue;
+        }
+        inst_regs(inst, &use, &def);
+        for (r = 0; r < UBPF_IR_NUM_REGS; r++) {
+            if ((def & (1 << r)) && w->defs[r] < 2) {
+                w->defs[r]++;
+            }
+        }
+        if (inst.opcode == EBPF_OP_CALL) {
+            w->calls = true;
+        } else if ((cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) && inst.dst != 10) {
+            w->other_stores = true;
+        } else if (cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) {
+            if (inst.offset < w->stack_lo) {
+                w->stack_lo = inst.offset;
+            }
+            if (inst.offset + access_size(inst.opcode) > w->stack_hi) {
+                w->stack_hi = inst.offset + access_size(inst.opcode);
+            }
+        }
+    }
+}
+
+static bool
+load_invariant(const struct loop_writes *w, struct ebpf_inst inst, bool escapes)
+{
+    bool stack_stores = w->stack_lo < w->stack_hi;
+
+    if (w->calls) {
+        return false;
+    }
+    if (inst.src == 10) {
+        if (stack_stores && inst.offset < w->stack_hi && inst.offset + access_size(inst.opcode) > w->stack_lo) {
+            return false;
+        }
+        return !escapes || !w->other_stores;
+    }
+    return !w->other_stores && (!escapes || !stack_stores);
+}
+
+static void
+hoist_from_head(struct ubpf_ir *ir, uint32_t head, const uint8_t *in_loop, bool escapes)
+{
+    const struct ubpf_ir_block *block = &ir->blocks[head];
+    struct loop_writes w;
+    uint16_t read = 0;
+    bool may_exit = false;
+    uint32_t pc;
+
+    find_loop_writes(ir, in_loop, &w);
+
+    for (pc = block->start; pc < block->end; pc++) {
+        struct ubpf_ir_inst *ir_inst = &ir->insts[pc];
+        struct ebpf_inst inst = ir_inst->inst;
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+        uint16_t use, def;
+        bool hoist;
+
+        if (ir_inst->deleted || ir_inst->lddw_hi) {
+            continue;
+        }
+        inst_regs(inst, &use, &def);
+
+        hoist = removable(inst) && inst.opcode != EBPF_OP_LDDW && w.defs[inst.dst] == 1 &&
+            !(read & (1 << inst.dst));
+        if (hoist && (use & (1 << inst.dst))) {
+            hoist = is_invariant(ir, head, in_loop, w.defs, ir_inst->dst_val);
+        }
+        if (hoist && (use & (1 << inst.src))) {
+            hoist = is_invariant(ir, head, in_loop, w.defs, ir_inst->src_val);
+        }
+        if (hoist && cls == EBPF_CLS_LDX) {
+            hoist = !may_exit && load_invariant(&w, inst, escapes);
+        }
+
+        ir_inst->hoisted = hoist;
+        read |= use;
+        if (!removable(inst) && inst.opcode != EBPF_OP_LDDW) {
+            may_exit = true;
+        }
+    }
+}
+
+int
+ubpf_ir_hoist_invariants(struct ubpf_ir *ir)
+{
+    uint8_t *in_loop = calloc(ir->num_blocks + 1, sizeof(in_loop[0]));
+    uint32_t *worklist = calloc(ir->num_blocks + 1, sizeof(worklist[0]));
+    bool escapes = stack_escapes(ir);
+    uint32_t i;
+
+    if (!in_loop || !worklist) {
+        free(in_loop);
+        free(worklist);
+        return -1;
+    }
+
+    for (i = 0; i < ir->num_reachable; i++) {
+        uint32_t b = ir->rpo[i];
+        if (mark_loop(ir, b, in_loop, worklist) && ubpf_ir_entered_by_fallthrough(ir, b)) {
+            hoist_from_head(ir, b, in_loop, escapes);
+        }
+    }
+
+    free(in_loop);
+    free(worklist);
+    return 0;
+}
+
+bool
+ubpf_ir_has_calls(const struct ubpf_ir *ir)
+{
+    uint32_t pc;
+
+    for (pc = 0; pc < ir->num_insts; pc++) {
+        if (!ir->insts[pc].deleted && !ir->insts[pc].lddw_hi &&
+                ir->insts[pc].inst.opcode == EBPF_OP_CALL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Loop nesting depth of each instruction, approximating the body of the
+ * loop formed by a back-edge latch->head by the PC range head..latch.
+ */
+static uint8_t *
+loop_depths(const struct ubpf_ir *ir)
+{
+    int32_t *delta = calloc(ir->num_insts + 1, sizeof(delta[0]));
+    uint8_t *depth = calloc(ir->num_insts, sizeof(depth[0]));
+    uint32_t b, i, pc;
+    int32_t d = 0;
+
+    if (!delta || !depth) {
+        free(delta);
+        free(depth);
+        return NULL;
+    }
+
+    for (b = 0; b < ir->num_blocks; b++) {
+        for (i = 0; i < ir->blocks[b].num_succs; i++) {
+            uint32_t head = ir->blocks[b].succs[i];
+            if (ubpf_ir_dominates(ir, head, b)) {
+                delta[ir->blocks[head].start]++;
+                delta[ir->blocks[b].end]--;
+            }
+        }
+    }
+
+    for (pc = 0; pc < ir->num_insts; pc++) {
+        d += delta[pc];
+        depth[pc] = d > 255 ? 255 : d;
+    }
+
+    free(delta);
+    return depth;
+}
+
+int
+ubpf_ir_find_stack_slots(const struct ubpf_ir *ir, struct ubpf_ir_slot *slots, int max_slots)
+{
+    uint32_t weight[UBPF_STACK_SIZE / 8];
+    bool partial[UBPF_STACK_SIZE / 8];
+    uint8_t *depth;
+    int num_slots = 0, i, j;
+    uint32_t pc;
+
+    if (max_slots <= 0 || stack_escapes(ir)) {
+        return 0;
+    }
+
+    depth = loop_depths(ir);
+    if (!depth) {
+        return 0;
+    }
+
+    memset(weight, 0, sizeof(weight));
+    memset(partial, 0, sizeof(partial));
+
+    for (pc = 0; pc < ir->num_insts; pc++) {
+        struct ebpf_inst inst = ir->insts[pc].inst;
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+        int base, size, lo, hi;
+
+        if (ir->insts[pc].deleted || ir->insts[pc].lddw_hi) {
+            continue;
+        }
+
+        if (cls == EBPF_CLS_LDX) {
+            base = inst.src;
+        } else if (cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) {
+            base = inst.dst;
+        } else {
+            continue;
+        }
+        if (base != 10) {
+            continue;
+        }
+
+        size = access_size(inst.opcode);
+
+        if (size == 8 && inst.offset % 8 == 0 && inst.offset < 0 && inst.offset >= -UBPF_STACK_SIZE) {
+            int d = depth[pc] > 5 ? 5 : depth[pc];
+            weight[(UBPF_STACK_SIZE + inst.offset) / 8] += 1 << (3 * d);
+            continue;
+        }
+
+        /* Any other access pins the slots it overlaps to memory */
+        lo = UBPF_STACK_SIZE + inst.offset;
+        hi = lo + size;
+        for (i = lo < 0 ? 0 : lo / 8; i < UBPF_STACK_SIZE / 8 && i * 8 < hi; i++) {
+            partial[i] = true;
+        }
+    }
+
+    free(depth);
+
+    /* Keep the heaviest slots, sorted by descending weight */
+    for (i = 0; i < UBPF_STACK_SIZE / 8; i++) {
+        if (!weight[i] || partial[i]) {
+            continue;
+        }
+        for (j = num_slots; j > 0 && slots[j - 1].weight < weight[i]; j--) {
+            if (j < max_slots) {
+                slots[j] = slots[j - 1];
+            }
+        }
+        if (j < max_slots) {
+            slots[j].offset = i * 8 - UBPF_STACK_SIZE;
+            slots[j].weight = weight[i];
+            if (num_slots < max_slots) {
+                num_slots++;
+            }
+        }
+    }
+
+    return num_slots;
+}
@@ -0,0 +1,746 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Optimizing JIT tier built on LLVM ORC
+ *
+ * Each eBPF register becomes an alloca and each instruction that starts a
+ * basic block becomes an LLVM block, so mem2reg/SROA turn the registers
+ * into SSA values. Stack accesses through r10 with a constant offset are
+ * addressed as GEPs into a stack alloca, which lets SROA promote those
+ * slots as well. Helpers are declared as external nounwind functions and
+ * resolved to the registered addresses through absolute symbols.
+ *
+ * The generated code follows the semantics of the template JIT: immediates
+ * are sign-extended, shift counts are masked to the operand width and
+ * division by zero reports an error and returns UINT64_MAX.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/Error.h>
+#include <llvm-c/LLJIT.h>
+#include <llvm-c/Orc.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/Transforms/PassBuilder.h>
+#include "ubpf_int.h"
+
+#define ENTRY_NAME "ubpf_entry"
+#define DIV_BY_ZERO_NAME "ubpf_report_div_by_zero"
+#define HELPER_NAME_FMT "ubpf_helper_%u"
+#define PROFILE_HELPER_NAME "ubpf_profile_helper"
+
+struct llvm_state {
+    struct ubpf_vm *vm;
+    LLVMContextRef ctx;
+    LLVMModuleRef mod;
+    LLVMBuilderRef b;
+    LLVMValueRef fn;
+    LLVMTypeRef i8, i16, i32, i64;
+    LLVMTypeRef helper_type;
+    LLVMValueRef regs[10];
+    LLVMValueRef stack;
+    LLVMBasicBlockRef *blocks; /* num_insts+1 entries, NULL unless a block starts there */
+    LLVMBasicBlockRef exit_block;
+    bool *helper_used;
+};
+
+static char *
+llvm_error(LLVMErrorRef err)
+{
+    char *msg = LLVMGetErrorMessage(err);
+    char *result = ubpf_error("LLVM JIT: %s", msg);
+    LLVMDisposeErrorMessage(msg);
+    return result;
+}
+
+static LLVMValueRef
+const64(struct llvm_state *s, uint64_t value)
+{
+    return LLVMConstInt(s->i64, value, false);
+}
+
+static LLVMTypeRef
+int_type(struct llvm_state *s, int bits)
+{
+    switch (bits) {
+    case 8: return s->i8;
+    case 16: return s->i16;
+    case 32: return s->i32;
+    default: return s->i64;
+    }
+}
+
+static LLVMValueRef
+stack_top(struct llvm_state *s)
+{
+    LLVMValueRef idx = const64(s, UBPF_STACK_SIZE);
+    LLVMValueRef ptr = LLVMBuildInBoundsGEP2(s->b, s->i8, s->stack, &idx, 1, "");
+    return LLVMBuildPtrToInt(s->b, ptr, s->i64, "r10");
+}
+
+static LLVMValueRef
+read_reg(struct llvm_state *s, int reg)
+{
+    if (reg == 10) {
+        return stack_top(s);
+    }
+    return LLVMBuildLoad2(s->b, s->i64, s->regs[reg], "");
+}
+
+static void
+write_reg(struct llvm_state *s, int reg, LLVMValueRef value)
+{
+    LLVMBuildStore(s->b, value, s->regs[reg]);
+}
+
+/* Address of a 'bits'-wide access at reg+off, as a pointer to that width */
+static LLVMValueRef
+mem_ptr(struct llvm_state *s, int reg, int16_t off, int bits)
+{
+    LLVMTypeRef ptr_type = LLVMPointerType(int_type(s, bits), 0);
+    LLVMValueRef ptr;
+
+    if (reg == 10 && off < 0 && -off >= bits / 8 && -off <= UBPF_STACK_SIZE) {
+        LLVMValueRef idx = const64(s, UBPF_STACK_SIZE + off);
+        ptr = LLVMBuildInBoundsGEP2(s->b, s->i8, s->stack, &idx, 1, "");
+        return LLVMBuildBitCast(s->b, ptr, ptr_type, "");
+    }
+
+    ptr = LLVMBuildAdd(s->b, read_reg(s, reg), const64(s, (int64_t)off), "");
+    return LLVMBuildIntToPtr(s->b, ptr, ptr_type, "");
+}
+
+static LLVMValueRef
+load(struct llvm_state *s, int reg, int16_t off, int bits, bool sign)
+{
+    LLVMValueRef value = LLVMBuildLoad2(s->b, int_type(s, bits), mem_ptr(s, reg, off, bits), "");
+    LLVMSetAlignment(value, 1);
+    if (sign) {
+        return LLVMBuildSExt(s->b, value, s->i64, "");
+    }
+    return LLVMBuildZExt(s->b, value, s->i64, "");
+}
+
+static void
+store(struct llvm_state *s, int reg, int16_t off, int bits, LLVMValueRef value)
+{
+    value = LLVMBuildTrunc(s->b, value, int_type(s, bits), "");
+    LLVMSetAlignment(LLVMBuildStore(s->b, value, mem_ptr(s, reg, off, bits)), 1);
+}
+
+static LLVMValueRef
+call_intrinsic(struct llvm_state *s, const char *name, LLVMTypeRef type, LLVMValueRef arg)
+{
+    unsigned id = LLVMLookupIntrinsicID(name, strlen(name));
+    LLVMValueRef fn = LLVMGetIntrinsicDeclaration(s->mod, id, &type, 1);
+    return LLVMBuildCall2(s->b, LLVMIntrinsicGetType(s->ctx, id, &type, 1), fn, &arg, 1, "");
+}
+
+static void
+add_nounwind(struct llvm_state *s, LLVMValueRef fn)
+{
+    unsigned kind = LLVMGetEnumAttributeKindForName("nounwind", strlen("nounwind"));
+    LLVMAddAttributeAtIndex(fn, LLVMAttributeFunctionIndex, LLVMCreateEnumAttribute(s->ctx, kind, 0));
+}
+
+#ifndef UBPF_HELPER_PROFILE
+static LLVMValueRef
+helper_decl(struct llvm_state *s, unsigned int idx)
+{
+    char name[32];
+    LLVMValueRef fn;
+
+    snprintf(name, sizeof(name), HELPER_NAME_FMT, idx);
+    fn = LLVMGetNamedFunction(s->mod, name);
+    if (!fn) {
+        fn = LLVMAddFunction(s->mod, name, s->helper_type);
+        add_nounwind(s, fn);
+        s->helper_used[idx] = true;
+    }
+    return fn;
+}
+#endif
+
+/*
+ * Branch to a block that reports division by zero at 'pc' if 'divisor' is
+ * zero, and continue in a fresh block otherwise.
+ */
+static void
+check_div_by_zero(struct llvm_state *s, uint32_t pc, LLVMValueRef divisor)
+{
+    LLVMBasicBlockRef error_block = LLVMAppendBasicBlockInContext(s->ctx, s->fn, "div_by_zero");
+    LLVMBasicBlockRef cont_block = LLVMAppendBasicBlockInContext(s->ctx, s->fn, "");
+    LLVMValueRef is_zero = LLVMBuildICmp(s->b, LLVMIntEQ, divisor, LLVMConstNull(LLVMTypeOf(divisor)), "");
+
+    LLVMBuildCondBr(s->b, is_zero, error_block, cont_block);
+
+    LLVMPositionBuilderAtEnd(s->b, error_block);
+    LLVMTypeRef i8ptr = LLVMPointerType(s->i8, 0);
+    LLVMTypeRef param_types[] = { i8ptr, s->i32 };
+    LLVMTypeRef report_type = LLVMFunctionType(LLVMVoidTypeInContext(s->ctx), param_types, 2, false);
+    LLVMValueRef report_fn = LLVMGetNamedFunction(s->mod, DIV_BY_ZERO_NAME);
+    if (!report_fn) {
+        report_fn = LLVMAddFunction(s->mod, DIV_BY_ZERO_NAME, report_type);
+        LLVMSetFunctionCallConv(report_fn, LLVMCCallConv);
+    }
+    LLVMValueRef args[] = {
+        LLVMConstIntToPtr(const64(s, (uintptr_t)s->vm), i8ptr),
+        LLVMConstInt(s->i32, pc, false),
+    };
+    LLVMBuildCall2(s->b, report_type, report_fn, args, 2, "");
+    LLVMBuildRet(s->b, const64(s, UINT64_MAX));
+
+    LLVMPositionBuilderAtEnd(s->b, cont_block);
+}
+
+/*
+ * Signed division or modulo by a nonzero divisor. INT_MIN / -1 overflows,
+ * so division by -1 is a negation and modulo by -1 is zero, as in the
+ * interpreter.
+ */
+static LLVMValueRef
+signed_divmod(struct llvm_state *s, bool mod, LLVMValueRef dst, LLVMValueRef src)
+{
+    LLVMTypeRef type = LLVMTypeOf(dst);
+    LLVMValueRef minus_one = LLVMBuildICmp(s->b, LLVMIntEQ, src, LLVMConstAllOnes(type), "");
+    LLVMValueRef safe = LLVMBuildSelect(s->b, minus_one, LLVMConstInt(type, 1, false), src, "");
+
+    if (mod) {
+        return LLVMBuildSelect(s->b, minus_one, LLVMConstNull(type), LLVMBuildSRem(s->b, dst, safe, ""), "");
+    }
+    return LLVMBuildSelect(s->b, minus_one, LLVMBuildNeg(s->b, dst, ""), LLVMBuildSDiv(s->b, dst, safe, ""), "");
+}
+
+static LLVMValueRef
+translate_alu(struct llvm_state *s, uint32_t pc, struct ebpf_inst inst)
+{
+    bool is64 = (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+    LLVMTypeRef type = is64 ? s->i64 : s->i32;
+    unsigned int width = is64 ? 64 : 32;
+    LLVMValueRef dst = read_reg(s, inst.dst);
+    LLVMValueRef src;
+    LLVMValueRef result;
+
+    if (inst.opcode == EBPF_OP_LE || inst.opcode == EBPF_OP_BE || inst.opcode == EBPF_OP_BSWAP) {
+        LLVMTypeRef t = int_type(s, inst.imm);
+        result = LLVMBuildTrunc(s->b, dst, t, "");
+        if (inst.opcode != EBPF_OP_LE) {
+            result = call_intrinsic(s, "llvm.bswap", t, result);
+        }
+        return LLVMBuildZExt(s->b, result, s->i64, "");
+    }
+
+    if (inst.opcode & EBPF_SRC_REG) {
+        src = read_reg(s, inst.src);
+    } else {
+        src = const64(s, (int64_t)inst.imm);
+    }
+
+    if (!is64) {
+        dst = LLVMBuildTrunc(s->b, dst, type, "");
+        src = LLVMBuildTrunc(s->b, src, type, "");
+    }
+
+    switch (inst.opcode & EBPF_ALU_OP_MASK) {
+    case 0x00:
+        result = LLVMBuildAdd(s->b, dst, src, "");
+        break;
+    case 0x10:
+        result = LLVMBuildSub(s->b, dst, src, "");
+        break;
+    case 0x20:
+        result = LLVMBuildMul(s->b, dst, src, "");
+        break;
+    case 0x30:
+    case 0x90:
+        if (inst.opcode & EBPF_SRC_REG) {
+            check_div_by_zero(s, pc, src);
+        }
+        if (inst.offset == EBPF_OFFSET_SDIV) {
+            result = signed_divmod(s, (inst.opcode & EBPF_ALU_OP_MASK) == 0x90, dst, src);
+        } else if ((inst.opcode & EBPF_ALU_OP_MASK) == 0x30) {
+            result = LLVMBuildUDiv(s->b, dst, src, "");
+        } else {
+            result = LLVMBuildURem(s->b, dst, src, "");
+        }
+        break;
+    case 0x40:
+        result = LLVMBuildOr(s->b, dst, src, "");
+        break;
+    case 0x50:
+        result = LLVMBuildAnd(s->b, dst, src, "");
+        break;
+    case 0x60:
+        src = LLVMBuildAnd(s->b, src, LLVMConstInt(type, width - 1, false), "");
+        result = LLVMBuildShl(s->b, dst, src, "");
+        break;
+    case 0x70:
+        src = LLVMBuildAnd(s->b, src, LLVMConstInt(type, width - 1, false), "");
+        result = LLVMBuildLShr(s->b, dst, src, "");
+        break;
+    case 0x80:
+        result = LLVMBuildNeg(s->b, dst, "");
+        break;
+    case 0xa0:
+        result = LLVMBuildXor(s->b, dst, src, "");
+        break;
+    case 0xb0:
+        if (inst.offset) {
+            /* MOVSX */
+            src = LLVMBuildTrunc(s->b, src, int_type(s, inst.offset), "");
+            src = LLVMBuildSExt(s->b, src, type, "");
+        }
+        result = src;
+        break;
+    case 0xc0:
+        src = LLVMBuildAnd(s->b, src, LLVMConstInt(type, width - 1, false), "");
+        result = LLVMBuildAShr(s->b, dst, src, "");
+        break;
+    default:
+        return NULL;
+    }
+
+    if (!is64) {
+        result = LLVMBuildZExt(s->b, result, s->i64, "");
+    }
+    return result;
+}
+
+static LLVMValueRef
+translate_cond(struct llvm_state *s, struct ebpf_inst inst)
+{
+    LLVMValueRef dst = read_reg(s, inst.dst);
+    LLVMValueRef src;
+
+    if (inst.opcode & EBPF_SRC_REG) {
+        src = read_reg(s, inst.src);
+    } else {
+        src = const64(s, (int64_t)inst.imm);
+    }
+
+    if ((inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP32) {
+        dst = LLVMBuildTrunc(s->b, dst, s->i32, "");
+        src = LLVMBuildTrunc(s->b, src, s->i32, "");
+    }
+
+    switch (inst.opcode & EBPF_ALU_OP_MASK) {
+    case 0x10: return LLVMBuildICmp(s->b, LLVMIntEQ, dst, src, "");
+    case 0x20: return LLVMBuildICmp(s->b, LLVMIntUGT, dst, src, "");
+    case 0x30: return LLVMBuildICmp(s->b, LLVMIntUGE, dst, src, "");
+    case 0x40: return LLVMBuildICmp(s->b, LLVMIntNE, LLVMBuildAnd(s->b, dst, src, ""),
+                                  LLVMConstInt(LLVMTypeOf(dst), 0, false), "");
+    case 0x50: return LLVMBuildICmp(s->b, LLVMIntNE, dst, src, "");
+    case 0x60: return LLVMBuildICmp(s->b, LLVMIntSGT, dst, src, "");
+    case 0x70: return LLVMBuildICmp(s->b, LLVMIntSGE, dst, src, "");
+    case 0xa0: return LLVMBuildICmp(s->b, LLVMIntULT, dst, src, "");
+    case 0xb0: return LLVMBuildICmp(s->b, LLVMIntULE, dst, src, "");
+    case 0xc0: return LLVMBuildICmp(s->b, LLVMIntSLT, dst, src, "");
+    case 0xd0: return LLVMBuildICmp(s->b, LLVMIntSLE, dst, src, "");
+    default: return NULL;
+    }
+}
+
+/* Inline lookup of the 32-bit key at [r2] in an array map */
+static void
+translate_array_map_lookup(struct llvm_state *s, const struct ubpf_array_map *map)
+{
+    LLVMValueRef key = load(s, 2, 0, 32, false);
+    LLVMValueRef in_range = LLVMBuildICmp(s->b, LLVMIntULT, key, const64(s, map->max_entries), "");
+    LLVMValueRef offset = LLVMBuildMul(s->b, key, const64(s, map->value_size), "");
+    LLVMValueRef value = LLVMBuildAdd(s->b, const64(s, (uintptr_t)map->values), offset, "");
+    write_reg(s, 0, LLVMBuildSelect(s->b, in_range, value, const64(s, 0), ""));
+}
+
+#ifdef UBPF_HELPER_PROFILE
+/* Call the helper through ubpf_profile_helper, which counts calls and cycles for the call site at 'pc' */
+static LLVMValueRef
+call_profiled_helper(struct llvm_state *s, uint32_t pc, LLVMValueRef *args)
+{
+    LLVMTypeRef i8ptr = LLVMPointerType(s->i8, 0);
+    LLVMTypeRef param_types[] = { s->i64, s->i64, s->i64, s->i64, s->i64, i8ptr };
+    LLVMTypeRef profile_type = LLVMFunctionType(s->i64, param_types, 6, false);
+    LLVMValueRef profile_fn = LLVMGetNamedFunction(s->mod, PROFILE_HELPER_NAME);
+    LLVMValueRef profile_args[6];
+
+    if (!profile_fn) {
+        profile_fn = LLVMAddFunction(s->mod, PROFILE_HELPER_NAME, profile_type);
+        add_nounwind(s, profile_fn);
+    }
+    memcpy(profile_args, args, 5 * sizeof(args[0]));
+    profile_args[5] = LLVMConstIntToPtr(const64(s, (uintptr_t)&s->vm->helper_sites[pc]), i8ptr);
+    return LLVMBuildCall2(s->b, profile_type, profile_fn, profile_args, 6, "");
+}
+#endif
+
+static void
+translate_call(struct llvm_state *s, uint32_t pc, struct ebpf_inst inst)
+{
+    LLVMValueRef args[5];
+    int i;
+
+    if (ubpf_array_map(s->vm, inst.imm)) {
+        translate_array_map_lookup(s, ubpf_array_map(s->vm, inst.imm));
+        return;
+    }
+
+    for (i = 0; i < 5; i++) {
+        args[i] = read_reg(s, i + 1);
+    }
+#ifdef UBPF_HELPER_PROFILE
+    LLVMValueRef ret = call_profiled_helper(s, pc, args);
+#else
+    (void)pc;
+    LLVMValueRef ret = LLVMBuildCall2(s->b, s->helper_type, helper_decl(s, inst.imm), args, 5, "");
+#endif
+    write_reg(s, 0, ret);
+
+    if (inst.imm == s->vm->unwind_stack_extension_index) {
+        LLVMBasicBlockRef cont_block = LLVMAppendBasicBlockInContext(s->ctx, s->fn, "");
+        LLVMValueRef is_zero = LLVMBuildICmp(s->b, LLVMIntEQ, ret, const64(s, 0), "");
+        LLVMBuildCondBr(s->b, is_zero, s->exit_block, cont_block);
+        LLVMPositionBuilderAtEnd(s->b, cont_block);
+    }
+}
+
+static bool
+block_terminated(struct llvm_state *s)
+{
+    return LLVMGetBasicBlockTerminator(LLVMGetInsertBlock(s->b)) != NULL;
+}
+
+static int
+translate(struct llvm_state *s, char **errmsg)
+{
+    struct ubpf_vm *vm = s->vm;
+    LLVMTypeRef i8ptr = LLVMPointerType(s->i8, 0);
+    LLVMTypeRef param_types[] = { i8ptr, s->i64 };
+    uint32_t i;
+
+    s->fn = LLVMAddFunction(s->mod, ENTRY_NAME, LLVMFunctionType(s->i64, param_types, 2, false));
+    add_nounwind(s, s->fn);
+
+    LLVMBasicBlockRef entry_block = LLVMAppendBasicBlockInContext(s->ctx, s->fn, "entry");
+    s->exit_block = LLVMAppendBasicBlockInContext(s->ctx, s->fn, "exit");
+
+    /* Every jump target and every instruction after a jump starts a block */
+    for (i = 0; i < vm->num_insts; i++) {
+        struct ebpf_inst inst = vm->insts[i];
+        if (inst.opcode == EBPF_OP_LDDW) {
+            i++;
+        } else if (((inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP && inst.opcode != EBPF_OP_CALL) ||
+                   (inst.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP32) {
+            if (inst.opcode != EBPF_OP_EXIT) {
+                s->blocks[i + 1 + ebpf_jump_offset(inst)] = s->exit_block;
+            }
+            s->blocks[i + 1] = s->exit_block;
+        }
+    }
+    s->blocks[0] = s->exit_block;
+    for (i = 0; i < vm->num_insts; i++) {
+        if (s->blocks[i]) {
+            char name[16];
+            snprintf(name, sizeof(name), "pc%u", i);
+            s->blocks[i] = LLVMAppendBasicBlockInContext(s->ctx, s->fn, name);
+        }
+    }
+    s->blocks[vm->num_insts] = s->exit_block;
+
+    LLVMPositionBuilderAtEnd(s->b, entry_block);
+    LLVMValueRef stack = LLVMBuildAlloca(s->b, LLVMArrayType(s->i8, UBPF_STACK_SIZE), "stack");
+    LLVMSetAlignment(stack, 16);
+    s->stack = LLVMBuildBitCast(s->b, stack, i8ptr, "");
+    for (i = 0; i < 10; i++) {
+        char name[4];
+        snprintf(name, sizeof(name), "r%u", i);
+        s->regs[i] = LLVMBuildAlloca(s->b, s->i64, name);
+        write_reg(s, i, const64(s, 0));
+    }
+    write_reg(s, 1, LLVMBuildPtrToInt(s->b, LLVMGetParam(s->fn, 0), s->i64, ""));
+    write_reg(s, 2, LLVMGetParam(s->fn, 1));
+    LLVMBuildBr(s->b, s->blocks[0]);
+
+    for (i = 0; i < vm->num_insts; i++) {
+        struct ebpf_inst inst = vm->insts[i];
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+        int bits;
+
+        if (s->blocks[i]) {
+            if (i > 0 && !block_terminated(s)) {
+                LLVMBuildBr(s->b, s->blocks[i]);
+            }
+            LLVMPositionBuilderAtEnd(s->b, s->blocks[i]);
+        }
+
+        switch (inst.opcode & 0x18) {
+        case EBPF_SIZE_W: bits = 32; break;
+        case EBPF_SIZE_H: bits = 16; break;
+        case EBPF_SIZE_B: bits = 8; break;
+        default: bits = 64; break;
+        }
+
+        switch (cls) {
+        case EBPF_CLS_ALU:
+        case EBPF_CLS_ALU64: {
+            LLVMValueRef result = translate_alu(s, i, inst);
+            if (!result) {
+                goto unknown;
+            }
+            write_reg(s, inst.dst, result);
+            break;
+        }
+        case EBPF_CLS_LDX:
+            write_reg(s, inst.dst, load(s, inst.src, inst.offset, bits,
+                                        (inst.opcode & EBPF_MODE_MASK) == EBPF_MODE_MEMSX));
+            break;
+        case EBPF_CLS_ST:
+            store(s, inst.dst, inst.offset, bits, const64(s, (int64_t)inst.imm));
+            break;
+        case EBPF_CLS_STX:
+            store(s, inst.dst, inst.offset, bits, read_reg(s, inst.src));
+            break;
+        case EBPF_CLS_LD: {
+            if (inst.opcode != EBPF_OP_LDDW) {
+                goto unknown;
+            }
+            uint64_t imm = (uint32_t)inst.imm | ((uint64_t)vm->insts[++i].imm << 32);
+            write_reg(s, inst.dst, const64(s, imm));
+            break;
+        }
+        case EBPF_CLS_JMP:
+            if (inst.opcode == EBPF_OP_CALL) {
+                translate_call(s, i, inst);
+            } else if (inst.opcode == EBPF_OP_EXIT) {
+                LLVMBuildBr(s->b, s->exit_block);
+            } else if (inst.opcode == EBPF_OP_JA) {
+                LLVMBuildBr(s->b, s->blocks[i + 1 + inst.offset]);
+            } else {
+                LLVMValueRef cond = translate_cond(s, inst);
+                if (!cond) {
+                    goto unknown;
+                }
+                LLVMBuildCondBr(s->b, cond, s->blocks[i + 1 + inst.offset], s->blocks[i + 1]);
+            }
+            break;
+        case EBPF_CLS_JMP32: {
+            if (inst.opcode == EBPF_OP_JA32) {
+                LLVMBuildBr(s->b, s->blocks[i + 1 + inst.imm]);
+                break;
+            }
+            LLVMValueRef cond = translate_cond(s, inst);
+            if (!cond) {
+                goto unknown;
+            }
+            LLVMBuildCondBr(s->b, cond, s->blocks[i + 1 + inst.offset], s->blocks[i + 1]);
+            break;
+        }
+        default:
+            goto unknown;
+        }
+    }
+
+    if (!block_terminated(s)) {
+        LLVMBuildBr(s->b, s->exit_block);
+    }
+
+    LLVMPositionBuilderAtEnd(s->b, s->exit_block);
+    LLVMBuildRet(s->b, read_reg(s, 0));
+    return 0;
+
+unknown:
+    *errmsg = ubpf_error("Unknown instruction at PC %d: opcode %02x", i, vm->insts[i].opcode);
+    return -1;
+}
+
+static LLVMErrorRef
+optimize(LLVMModuleRef mod)
+{
+    char *triple = LLVMGetDefaultTargetTriple();
+    char *cpu = LLVMGetHostCPUName();
+    char *features = LLVMGetHostCPUFeatures();
+    char *msg = NULL;
+    LLVMTargetRef target;
+    LLVMErrorRef err = NULL;
+
+    if (LLVMGetTargetFromTriple(triple, &target, &msg)) {
+        err = LLVMCreateStringError(msg);
+    } else {
+        LLVMTargetMachineRef tm = LLVMCreateTargetMachine(target, triple, cpu, features,
+                LLVMCodeGenLevelDefault, LLVMRelocDefault, LLVMCodeModelJITDefault);
+        LLVMPassBuilderOptionsRef options = LLVMCreatePassBuilderOptions();
+        err = LLVMRunPasses(mod, "default<O2>", tm, options);
+        LLVMDisposePassBuilderOptions(options);
+        LLVMDisposeTargetMachine(tm);
+    }
+
+    LLVMDisposeMessage(msg);
+    LLVMDisposeMessage(features);
+    LLVMDisposeMessage(cpu);
+    LLVMDisposeMessage(triple);
+    return err;
+}
+
+/* Resolve the helper and error reporting declarations to their addresses */
+static LLVMErrorRef
+define_symbols(struct llvm_state *s, LLVMOrcLLJITRef jit)
+{
+    LLVMJITCSymbolMapPair syms[MAX_EXT_FUNCS + 2];
+    LLVMJITSymbolFlags flags = {
+        LLVMJITSymbolGenericFlagsExported | LLVMJITSymbolGenericFlagsCallable, 0
+    };
+    size_t num_syms = 0;
+    unsigned int i;
+
+    for (i = 0; i < MAX_EXT_FUNCS; i++) {
+        if (s->helper_used[i]) {
+            char name[32];
+            snprintf(name, sizeof(name), HELPER_NAME_FMT, i);
+            syms[num_syms].Name = LLVMOrcLLJITMangleAndIntern(jit, name);
+            syms[num_syms].Sym.Address = (uintptr_t)s->vm->ext_funcs[i];
+            syms[num_syms].Sym.Flags = flags;
+            num_syms++;
+        }
+    }
+
+#ifdef UBPF_HELPER_PROFILE
+    syms[num_syms].Name = LLVMOrcLLJITMangleAndIntern(jit, PROFILE_HELPER_NAME);
+    syms[num_syms].Sym.Address = (uintptr_t)ubpf_profile_helper;
+    syms[num_syms].Sym.Flags = flags;
+    num_syms++;
+#endif
+
+    syms[num_syms].Name = LLVMOrcLLJITMangleAndIntern(jit, DIV_BY_ZERO_NAME);
+    syms[num_syms].Sym.Address = (uintptr_t)ubpf_report_div_by_zero;
+    syms[num_syms].Sym.Flags = flags;
+    num_syms++;
+
+    return LLVMOrcJITDylibDefine(LLVMOrcLLJITGetMainJITDylib(jit),
+            LLVMOrcAbsoluteSymbols(syms, num_syms));
+}
+
+ubpf_jit_fn
+ubpf_compile_llvm(struct ubpf_vm *vm, char **errmsg)
+{
+    struct llvm_state s = { .vm = vm };
+    LLVMOrcThreadSafeContextRef tsc = NULL;
+    LLVMOrcLLJITRef jit = NULL;
+    LLVMOrcExecutorAddress addr;
+    LLVMErrorRef err;
+    char *msg = NULL;
+
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    s.blocks = calloc(vm->num_insts + 1, sizeof(s.blocks[0]));
+    s.helper_used = calloc(MAX_EXT_FUNCS, sizeof(s.helper_used[0]));
+    if (!s.blocks || !s.helper_used) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    tsc = LLVMOrcCreateNewThreadSafeContext();
+    s.ctx = LLVMOrcThreadSafeContextGetContext(tsc);
+    s.mod = LLVMModuleCreateWithNameInContext("ubpf", s.ctx);
+    s.b = LLVMCreateBuilderInContext(s.ctx);
+    s.i8 = LLVMInt8TypeInContext(s.ctx);
+    s.i16 = LLVMInt16TypeInContext(s.ctx);
+    s.i32 = LLVMInt32TypeInContext(s.ctx);
+    s.i64 = LLVMInt64TypeInContext(s.ctx);
+    LLVMTypeRef helper_params[] = { s.i64, s.i64, s.i64, s.i64, s.i64 };
+    s.helper_type = LLVMFunctionType(s.i64, helper_params, 5, false);
+
+    if (translate(&s, errmsg) < 0) {
+        goto out;
+    }
+
+    if (LLVMVerifyModule(s.mod, LLVMReturnStatusAction, &msg)) {
+        *errmsg = ubpf_error("LLVM JIT: invalid module: %s", msg);
+        goto out;
+    }
+
+    LLVMOrcJITTargetMachineBuilderRef jtmb;
+    if ((err = LLVMOrcJITTargetMachineBuilderDetectHost(&jtmb))) {
+        *errmsg = llvm_error(err);
+        goto out;
+    }
+    LLVMOrcLLJITBuilderRef builder = LLVMOrcCreateLLJITBuilder();
+    LLVMOrcLLJITBuilderSetJITTargetMachineBuilder(builder, jtmb);
+    if ((err = LLVMOrcCreateLLJIT(&jit, builder))) {
+        *errmsg = llvm_error(err);
+        goto out;
+    }
+
+    LLVMSetTarget(s.mod, LLVMOrcLLJITGetTripleString(jit));
+    LLVMSetDataLayout(s.mod, LLVMOrcLLJITGetDataLayoutStr(jit));
+    if ((err = optimize(s.mod))) {
+        *errmsg = llvm_error(err);
+        goto out;
+    }
+
+    if ((err = define_symbols(&s, jit))) {
+        *errmsg = llvm_error(err);
+        goto out;
+    }
+
+    /* The JIT takes ownership of the module */
+    err = LLVMOrcLLJITAddLLVMIRModule(jit, LLVMOrcLLJITGetMainJITDylib(jit),
+            LLVMOrcCreateNewThreadSafeModule(s.mod, tsc));
+    s.mod = NULL;
+    if (err) {
+        *errmsg = llvm_error(err);
+        goto out;
+    }
+
+    if ((err = LLVMOrcLLJITLookup(jit, &addr, ENTRY_NAME))) {
+        *errmsg = llvm_error(err);
+        goto out;
+    }
+
+    vm->jitted = (ubpf_jit_fn)(uintptr_t)addr;
+    vm->jitted_size = 0;
+    vm->jitted_external = true;
+    vm->llvm_jit = jit;
+    jit = NULL;
+
+out:
+    LLVMDisposeMessage(msg);
+    if (s.b) {
+        LLVMDisposeBuilder(s.b);
+    }
+    if (s.mod) {
+        LLVMDisposeModule(s.mod);
+    }
+    if (tsc) {
+        LLVMOrcDisposeThreadSafeContext(tsc);
+    }
+    if (jit) {
+        LLVMConsumeError(LLVMOrcDisposeLLJIT(jit));
+    }
+    free(s.blocks);
+    free(s.helper_used);
+    return vm->jitted;
+}
+
+void
+ubpf_destroy_llvm(struct ubpf_vm *vm)
+{
+    LLVMConsumeError(LLVMOrcDisposeLLJIT(vm->llvm_jit));
+    vm->llvm_jit = NULL;
+}
@@ -25,17 +25,39 @@
 #include <errno.h>
 #include <assert.h>
 #include "ubpf_int.h"
+#include "ubpf_ir.h"
 #include "ubpf_jit_x86_64.h"
 
 #if !defined(_countof)
 #define _countof(array) (sizeof(array) / sizeof(array[0]))
 #endif
 
+/* Alignment of loop heads in the generated code */
+#define LOOP_HEAD_ALIGN 16
+
+/* Loops with a proven trip count are unrolled into at most this many copies, of this many instructions in all */
+#define MAX_UNROLL_COPIES 8
+#define MAX_UNROLL_INSTS 64
+
+/* Shortest JEQ chain lowered as a switch, and the least dense one using a jump table */
+#define MIN_SWITCH_CASES 4
+#define MIN_JUMP_TABLE_DENSITY 2 /* at least 1 in 2 table entries is a case */
+
+/* Cases are compared linearly below this count in a compare tree */
+#define MAX_LINEAR_CASES 3
+
+/* Estimated code size of the prologue and stubs, and per instruction */
+#define JIT_FIXED_SIZE 1024
+#define JIT_BYTES_PER_INST 16
+
+/* Estimated dispatcher code size per chain rule */
+#define CHAIN_BYTES_PER_RULE 32
+
 /* Special values for target_pc in struct jump */
 #define TARGET_PC_EXIT -1
 #define TARGET_PC_DIV_BY_ZERO -2
 
-static void muldivmod(struct jit_state *state, uint16_t pc, uint8_t opcode, int src, int dst, int32_t imm);
+static void muldivmod(struct jit_state *state, uint32_t pc, struct ebpf_inst inst, int src, int dst);
 
 #define REGISTER_MAP_SIZE 11
 
@@ -71,6 +93,14 @@ static int register_map[REGISTER_MAP_SIZE] = {
     RBX,
     RBP,
 };
+// Host registers not in the map, used to hold promoted stack slots.
+// The volatile ones can only be used in programs without helper calls.
+static int spare_volatile_registers[] = {
+    R11
+};
+static int spare_nonvolatile_registers[] = {
+    R12, R13
+};
 #else
 #define RCX_ALT R9
 static int platform_nonvolatile_registers[] = {
@@ -92,8 +122,16 @@ static int register_map[REGISTER_MAP_SIZE] = {
     R15,
     RBP,
 };
+static int spare_volatile_registers[] = {
+    R10, R11
+};
+static int spare_nonvolatile_registers[] = {
+    R12
+};
 #endif
 
+#define MAX_SLOT_REGS (_countof(spare_volatile_registers) + _countof(spare_nonvolatile_registers))
+
 /* Return the x86 register for the given eBPF register */
 static int
 map_register(int r)
@@ -125,35 +163,717 @@ ubpf_set_register_offset(int x)
     }
 }
 
+static bool
+is_platform_nonvolatile(int r)
+{
+    int i;
+    for (i = 0; i < _countof(platform_nonvolatile_registers); i++) {
+        if (platform_nonvolatile_registers[i] == r) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Host registers holding the sandbox window and the confined address */
+#define SANDBOX_BASE R12
+#define SANDBOX_SCRATCH R11
+
+/*
+ * Assign the most used stack slots to spare host registers. Returns the
+ * number of registers used; those that the prologue has to save are stored
+ * in 'saved'.
+ */
+static int
+assign_slot_registers(struct ubpf_ir *ir, bool sandboxed, int8_t *slot_regs, int *saved, int *num_saved)
+{
+    struct ubpf_ir_slot slots[MAX_SLOT_REGS];
+    int regs[MAX_SLOT_REGS];
+    int num_regs = 0, num_volatile, num_slots, i;
+
+    memset(slot_regs, -1, UBPF_STACK_SIZE / 8);
+    *num_saved = 0;
+
+    if (!ubpf_ir_has_calls(ir)) {
+        for (i = 0; i < _countof(spare_volatile_registers); i++) {
+            if (!sandboxed || spare_volatile_registers[i] != SANDBOX_SCRATCH) {
+                regs[num_regs++] = spare_volatile_registers[i];
+            }
+        }
+    }
+    num_volatile = num_regs;
+    for (i = 0; i < _countof(spare_nonvolatile_registers); i++) {
+        if (!sandboxed || spare_nonvolatile_registers[i] != SANDBOX_BASE) {
+            regs[num_regs++] = spare_nonvolatile_registers[i];
+        }
+    }
+
+    num_slots = ubpf_ir_find_stack_slots(ir, slots, num_regs);
+    for (i = 0; i < num_slots; i++) {
+        slot_regs[(UBPF_STACK_SIZE + slots[i].offset) / 8] = regs[i];
+        if (!is_platform_nonvolatile(regs[i]) && i >= num_volatile) {
+            saved[(*num_saved)++] = regs[i];
+        }
+    }
+    return num_slots;
+}
+
+/* Host register holding the stack slot accessed by inst, or -1 */
+static int
+slot_register(const int8_t *slot_regs, int base, int16_t offset)
+{
+    if (base != 10 || offset >= 0 || offset < -UBPF_STACK_SIZE || offset % 8) {
+        return -1;
+    }
+    return slot_regs[(UBPF_STACK_SIZE + offset) / 8];
+}
+
+struct switch_case {
+    int64_t value;
+    uint32_t target_pc;
+    uint32_t index; /* position in the chain; the first of equal values wins */
+};
+
+/*
+ * Collect the chain of JEQ_IMM instructions on one register starting at
+ * 'pc' into 'cases'. Only the first instruction may be a jump target, and
+ * no case may jump into the chain. Returns the length of the chain.
+ */
+static uint32_t
+find_switch(const struct ubpf_ir *ir, uint32_t pc, struct switch_case *cases)
+{
+    uint8_t reg = ir->insts[pc].inst.dst;
+    uint32_t first_target = UINT32_MAX; /* lowest target after pc */
+    uint32_t end, n = 0;
+
+    for (end = pc; end < ir->num_insts; end++) {
+        const struct ubpf_ir_inst *ir_inst = &ir->insts[end];
+        uint32_t target = end + ir_inst->inst.offset + 1;
+
+        if (ir_inst->deleted || ir_inst->inst.opcode != EBPF_OP_JEQ_IMM || ir_inst->inst.dst != reg) {
+            break;
+        }
+        if (end > pc && ir->blocks[ir_inst->block].num_preds != 1) {
+            break;
+        }
+        if ((target > pc && target <= end) || first_target <= end) {
+            break;
+        }
+
+        cases[n].value = ir_inst->inst.imm;
+        cases[n].target_pc = target;
+        cases[n].index = n;
+        n++;
+        if (target > pc && target < first_target) {
+            first_target = target;
+        }
+    }
+
+    return n;
+}
+
+static int
+compare_cases(const void *a, const void *b)
+{
+    const struct switch_case *x = a, *y = b;
+
+    if (x->value != y->value) {
+        return x->value < y->value ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : 1;
+}
+
+static uint32_t
+emit_forward_jcc(struct jit_state *state, int code)
+{
+    uint32_t loc;
+
+    emit1(state, 0x0f);
+    emit1(state, code);
+    loc = state->offset;
+    emit4(state, 0);
+    return loc;
+}
+
+/* Jump over code emitted before the matching patch_forward_jump */
+static uint32_t
+emit_forward_jmp(struct jit_state *state)
+{
+    uint32_t loc;
+
+    emit1(state, 0xe9);
+    loc = state->offset;
+    emit4(state, 0);
+    return loc;
+}
+
+/* Point the jump whose offset is at 'loc' to the current location */
+static void
+patch_forward_jump(struct jit_state *state, uint32_t loc)
+{
+    uint32_t rel = state->offset - (loc + sizeof(uint32_t));
+    if (!jit_overflowed(state)) {
+        memcpy(&state->buf[loc], &rel, sizeof(uint32_t));
+    }
+}
+
+/* Balanced binary search over sorted cases */
+static void
+emit_compare_tree(struct jit_state *state, int reg, const struct switch_case *cases, uint32_t n, uint32_t default_pc)
+{
+    uint32_t i, mid, loc;
+
+    if (n <= MAX_LINEAR_CASES) {
+        for (i = 0; i < n; i++) {
+            emit_cmp_imm32(state, reg, cases[i].value);
+            emit_jcc(state, 0x84, cases[i].target_pc);
+        }
+        emit_jmp(state, default_pc);
+        return;
+    }
+
+    mid = n / 2;
+    emit_cmp_imm32(state, reg, cases[mid].value);
+    emit_jcc(state, 0x84, cases[mid].target_pc);
+    loc = emit_forward_jcc(state, 0x8f); /* jg */
+    emit_compare_tree(state, reg, cases, mid, default_pc);
+    patch_forward_jump(state, loc);
+    emit_compare_tree(state, reg, cases + mid + 1, n - mid - 1, default_pc);
+}
+
+/* Bounds-checked jump table of 32-bit offsets from the start of the table */
+static void
+emit_jump_table(struct jit_state *state, int reg, const struct switch_case *cases, uint32_t n, uint32_t default_pc)
+{
+    uint64_t range = cases[n - 1].value - cases[0].value + 1;
+    uint32_t lea_loc, table_loc, i, v;
+
+    emit_mov(state, reg, RCX);
+    if (cases[0].value) {
+        emit_alu64_imm32(state, 0x81, 5, RCX, cases[0].value);
+    }
+    emit_cmp_imm32(state, RCX, range - 1);
+    emit_jcc(state, 0x87, default_pc); /* ja */
+
+    emit_push(state, RAX);
+    /* lea table(%rip),%rax */
+    emit1(state, 0x48);
+    emit1(state, 0x8d);
+    emit1(state, 0x05);
+    lea_loc = state->offset;
+    emit4(state, 0);
+    /* movslq (%rax,%rcx,4),%rcx */
+    emit1(state, 0x48);
+    emit1(state, 0x63);
+    emit1(state, 0x0c);
+    emit1(state, 0x88);
+    emit_alu64(state, 0x01, RAX, RCX);
+    emit_pop(state, RAX);
+    /* jmp *%rcx */
+    emit1(state, 0xff);
+    emit1(state, 0xe1);
+
+    emit_align(state, sizeof(uint32_t));
+    table_loc = state->offset;
+    state->offset = lea_loc;
+    emit4(state, table_loc - (lea_loc + sizeof(uint32_t)));
+    state->offset = table_loc;
+
+    for (i = 0, v = 0; v < range; v++) {
+        struct jump *jump = &state->jumps[state->num_jumps++];
+        if (cases[i].value - cases[0].value == v) {
+            jump->target_pc = cases[i++].target_pc;
+        } else {
+            jump->target_pc = default_pc;
+        }
+        jump->offset_loc = state->offset;
+        jump->rel_loc = table_loc;
+        emit4(state, 0);
+    }
+}
+
+/* Lower a JEQ chain, falling through to 'default_pc' if no case matches */
+static void
+emit_switch(struct jit_state *state, int reg, struct switch_case *cases, uint32_t n, uint32_t default_pc)
+{
+    uint32_t i, num_cases = 0;
+
+    qsort(cases, n, sizeof(cases[0]), compare_cases);
+    for (i = 0; i < n; i++) {
+        if (num_cases == 0 || cases[i].value != cases[num_cases - 1].value) {
+            cases[num_cases++] = cases[i];
+        }
+    }
+
+    if ((uint64_t)(cases[num_cases - 1].value - cases[0].value) < (uint64_t)num_cases * MIN_JUMP_TABLE_DENSITY) {
+        emit_jump_table(state, reg, cases, num_cases, default_pc);
+    } else {
+        emit_compare_tree(state, reg, cases, num_cases, default_pc);
+    }
+}
+
+/* Frame slots below the eBPF stack used when statistics are enabled */
+#define STATS_START_SLOT 0
+#define STATS_HELPER_CALLS_SLOT 8
+#define STATS_SHARD_SLOT 16
+#define STATS_FRAME_SIZE 32
+
+/* Load the 64-bit time stamp counter into RAX, preserving RDX */
+static void
+emit_read_tsc(struct jit_state *state)
+{
+    emit_mov(state, RDX, R11);
+    emit1(state, 0x0f); /* rdtsc */
+    emit1(state, 0x31);
+    emit_alu64_imm8(state, 0xc1, 4, RDX, 32);
+    emit_alu64(state, 0x09, RDX, RAX);
+    emit_mov(state, R11, RDX);
+}
+
+/* Load the 32-bit thread-local variable at 'offset' from the thread pointer into dst */
+static void
+emit_load_fs32(struct jit_state *state, int dst, int32_t offset)
+{
+    emit1(state, 0x64); /* fs */
+    emit_basic_rex(state, 0, dst, 0);
+    emit1(state, 0x8b);
+    emit_modrm(state, 0x00, dst, RSP);
+    emit1(state, 0x25); /* SIB: no base, no index */
+    emit4(state, offset);
+}
+
+/*
+ * Load the time stamp counter into RAX if this execution is timed, else 0,
+ * and the address of the thread's own shard into the shard slot, using
+ * R11. Like ubpf_stats_start, every execution of a thread on the shared
+ * shard or without one yet is timed, which sends it through
+ * ubpf_stats_jit_exit.
+ */
+static void
+emit_stats_start(struct jit_state *state, const struct ubpf_vm *vm, int32_t shard_offset)
+{
+    uint32_t timed_loc, untimed_loc;
+
+    emit_load_fs32(state, RAX, shard_offset);
+    emit_cmp32_imm32(state, RAX, UBPF_STATS_SHARED_SHARD);
+    timed_loc = emit_forward_jcc(state, 0x83); /* jae, taken for -1 too */
+    emit_alu64_imm32(state, 0x69, RAX, RAX, sizeof(struct ubpf_stats_shard)); /* imul */
+    emit_load_imm(state, R11, (uintptr_t)vm->stats);
+    emit_alu64(state, 0x01, RAX, R11);
+    emit_store_rsp(state, R11, STATS_SHARD_SLOT);
+    emit_alu32(state, 0x31, RAX, RAX); /* xor */
+    emit_basic_rex(state, 0, 0, R11);
+    emit1(state, 0xf6); /* test byte [r11 + executions], UBPF_STATS_TIMING_PERIOD - 1 */
+    emit_modrm_and_displacement(state, 0, R11, offsetof(struct ubpf_stats_shard, executions));
+    emit1(state, UBPF_STATS_TIMING_PERIOD - 1);
+    untimed_loc = emit_forward_jcc(state, 0x85); /* jne */
+    patch_forward_jump(state, timed_loc);
+    emit_read_tsc(state);
+    patch_forward_jump(state, untimed_loc);
+}
+
+/*
+ * Count an untimed execution in the thread's own shard, or jump to the
+ * returned location to call ubpf_stats_jit_exit for a timed one. Uses RCX
+ * and RDX, which hold no eBPF register at exit.
+ */
+static uint32_t
+emit_stats_exit(struct jit_state *state, bool helper_calls)
+{
+    uint32_t timed_loc;
+
+    emit_load_rsp(state, RCX, STATS_START_SLOT);
+    emit_alu64(state, 0x85, RCX, RCX); /* test */
+    timed_loc = emit_forward_jcc(state, 0x85); /* jne */
+    emit_load_rsp(state, RDX, STATS_SHARD_SLOT);
+    emit_basic_rex(state, 1, 0, RDX);
+    emit1(state, 0x83); /* add qword [rdx + executions], 1 */
+    emit_modrm_and_displacement(state, 0, RDX, offsetof(struct ubpf_stats_shard, executions));
+    emit1(state, 1);
+    if (helper_calls) {
+        emit_load_rsp(state, RCX, STATS_HELPER_CALLS_SLOT);
+        emit_basic_rex(state, 1, RCX, RDX);
+        emit1(state, 0x01); /* add [rdx + helper_calls], rcx */
+        emit_modrm_and_displacement(state, RCX, RDX, offsetof(struct ubpf_stats_shard, helper_calls));
+    }
+    return timed_loc;
+}
+
+/*
+ * Point R10 at the top of the thread's sandbox stack. A thread with a stats
+ * shard of its own finds its stack inline, others call ubpf_sandbox_enter,
+ * which also claims the shared stack. Returns the location of the jump to
+ * take if that is busy. Uses SANDBOX_BASE, which is loaded afterwards.
+ */
+static uint32_t
+emit_sandbox_stack(struct jit_state *state, const struct ubpf_vm *vm)
+{
+    const struct ubpf_sandbox *sandbox = vm->sandbox;
+    int stack = map_register(10);
+    uint32_t call_loc, done_loc = 0, busy_loc;
+    int32_t shard_offset;
+    bool inline_index = ubpf_stats_shard_tls_offset(&shard_offset);
+
+    if (inline_index) {
+        emit_load_fs32(state, stack, shard_offset);
+        emit_cmp32_imm32(state, stack, UBPF_STATS_SHARED_SHARD);
+        call_loc = emit_forward_jcc(state, 0x83); /* jae, taken for -1 too */
+        emit_alu64_imm32(state, 0x69, stack, stack, sandbox->stack_stride); /* imul */
+        emit_load_imm(state, SANDBOX_BASE, (uintptr_t)sandbox->stacks + UBPF_STACK_SIZE);
+        emit_alu64(state, 0x01, SANDBOX_BASE, stack);
+        done_loc = emit_forward_jmp(state);
+        patch_forward_jump(state, call_loc);
+    }
+
+    /* R1 already holds the first parameter, keep it across the call */
+    emit_mov(state, map_register(1), SANDBOX_BASE);
+    emit_load_imm(state, platform_parameter_registers[0], (uintptr_t)vm);
+    emit_call(state, ubpf_sandbox_enter);
+    emit_mov(state, RAX, stack);
+    emit_mov(state, SANDBOX_BASE, map_register(1));
+    emit_alu64(state, 0x85, stack, stack); /* test */
+    busy_loc = emit_forward_jcc(state, 0x84); /* je */
+
+    if (inline_index) {
+        patch_forward_jump(state, done_loc);
+    }
+    return busy_loc;
+}
+
+/* Release the shared sandbox stack if this thread ran on it, using RCX */
+static void
+emit_sandbox_exit(struct jit_state *state, const struct ubpf_vm *vm)
+{
+    const struct ubpf_sandbox *sandbox = vm->sandbox;
+    uint32_t skip_loc;
+
+    emit_load_imm(state, RCX,
+                  (uintptr_t)sandbox->stacks + UBPF_STATS_SHARED_SHARD * sandbox->stack_stride + UBPF_STACK_SIZE);
+    emit_alu64(state, 0x39, RCX, map_register(10)); /* cmp */
+    skip_loc = emit_forward_jcc(state, 0x85); /* jne */
+    emit_load_imm(state, RCX, (uintptr_t)&sandbox->shared_stack_busy);
+    emit_store_imm32(state, S32, RCX, 0, 0);
+    patch_forward_jump(state, skip_loc);
+}
+
+/*
+ * Confine the address [base + offset] accessed by 'inst' to the sandbox
+ * window and return the host register to use as the new base.
+ *
+ * With guard regions, the upper half of the base is replaced with that of
+ * the window and the offset is applied by the access. With a fully
+ * accessible window, the whole address is masked into it and the offset
+ * becomes 0. Accesses at constant offsets inside the stack frame need no
+ * confining, since r10 cannot be changed.
+ */
+static int
+emit_sandbox_address(struct jit_state *state, const struct ubpf_vm *vm, struct ebpf_inst *inst, int ebpf_base,
+                     int host_base)
+{
+    static const int sizes[] = { [EBPF_SIZE_W >> 3] = 4, [EBPF_SIZE_H >> 3] = 2, [EBPF_SIZE_B >> 3] = 1, [EBPF_SIZE_DW >> 3] = 8 };
+    int size = sizes[(inst->opcode & EBPF_SIZE_MASK) >> 3];
+
+    if (ebpf_base == 10 && inst->offset >= -UBPF_STACK_SIZE && inst->offset + size <= 0) {
+        return host_base;
+    }
+
+    if (vm->sandbox->mask) {
+        emit_lea(state, host_base, SANDBOX_SCRATCH, inst->offset);
+        emit_alu64_imm32(state, 0x81, 4, SANDBOX_SCRATCH, vm->sandbox->mask);
+        emit_alu64(state, 0x09, SANDBOX_BASE, SANDBOX_SCRATCH);
+        inst->offset = 0;
+    } else {
+        emit_alu32(state, 0x89, host_base, SANDBOX_SCRATCH); /* mov, zero-extending */
+        emit_alu64(state, 0x01, SANDBOX_BASE, SANDBOX_SCRATCH);
+    }
+    return SANDBOX_SCRATCH;
+}
+
+/*
+ * Inline lookup in an array map: r0 = key < max_entries ? values + key * value_size : 0,
+ * with the 32-bit key read from [r2]. Helpers may clobber r1-r5, but this only writes r0.
+ */
+static void
+emit_array_map_lookup(struct jit_state *state, const struct ubpf_array_map *map)
+{
+    int dst = map_register(0);
+    uint32_t loc;
+
+    emit_load(state, S32, map_register(2), RCX, 0);
+    emit_alu32(state, 0x31, dst, dst); /* xor */
+    emit_cmp32_imm32(state, RCX, map->max_entries);
+    loc = emit_forward_jcc(state, 0x83); /* jae */
+    if ((map->value_size & (map->value_size - 1)) == 0) {
+        emit_alu64_imm8(state, 0xc1, 4, RCX, __builtin_ctz(map->value_size));
+    } else {
+        emit_alu64_imm32(state, 0x69, RCX, RCX, map->value_size); /* imul */
+    }
+    emit_load_imm(state, dst, (uintptr_t)map->values);
+    emit_alu64(state, 0x01, RCX, dst);
+    patch_forward_jump(state, loc);
+}
+
+/* Charge the code emitted from here on to 'pc' */
+static void
+add_range(struct jit_state *state, uint32_t pc)
+{
+    if (state->ranges) {
+        state->ranges[state->num_ranges++] = (struct ubpf_code_range){ .offset = state->offset, .pc = pc };
+    }
+}
+
+/*
+ * Instructions are emitted in PC order, except that instructions hoisted
+ * out of a loop go just before its head, followed by the copies of the loop
+ * body if it is unrolled. Each copy but the original falls through into
+ * the next one instead of taking the back-edge, and leaves the loop when
+ * the back-edge would not be taken. Copies have their own entries in
+ * pc_locs, after the one past the program that hoisted instructions use.
+ */
+struct emit_step {
+    uint32_t pc;
+    uint32_t loc;       /* index in pc_locs, pc itself for the original code */
+    bool moved;         /* hoisted out of its loop */
+    uint32_t head, end; /* the loop body [head, end) that this step copies, end 0 if none */
+    uint32_t copy_loc;  /* index of the head in this copy */
+    uint32_t next_loc;  /* and in the next one */
+};
+
+static bool
+unrollable(const struct ubpf_vm *vm, const struct ubpf_ir *ir, const struct ubpf_loop *loop)
+{
+    struct ebpf_inst latch = ir->insts[loop->latch].inst;
+    uint32_t len = loop->latch - loop->head + 1;
+    uint32_t i;
+
+    if (loop->max_trips == UBPF_LOOP_UNBOUNDED || loop->max_trips == 0 || loop->max_trips >= MAX_UNROLL_COPIES ||
+        len * (loop->max_trips + 1) > MAX_UNROLL_INSTS || !ubpf_ir_reachable(ir, ir->insts[loop->head].block)) {
+        return false;
+    }
+    if (latch.opcode == EBPF_OP_JA || latch.opcode == EBPF_OP_JA32 || ir->insts[loop->latch].deleted ||
+        loop->latch + 1 + ebpf_jump_offset(latch) != loop->head) {
+        return false;
+    }
+    for (i = 0; i < vm->num_loops; i++) {
+        if (&vm->loops[i] != loop && vm->loops[i].head >= loop->head && vm->loops[i].head <= loop->latch) {
+            return false;
+        }
+    }
+    return ubpf_ir_entered_by_fallthrough(ir, ir->insts[loop->head].block);
+}
+
+/* Fill in 'steps' if not NULL; returns their number */
+static uint32_t
+plan_steps(const struct ubpf_vm *vm, const struct ubpf_ir *ir, const uint8_t *unrolled, struct emit_step *steps,
+           uint32_t *num_locs)
+{
+    uint32_t n = 0, next_loc = vm->num_insts + 1;
+    uint32_t pc, i, j;
+
+    for (pc = 0; pc < vm->num_insts; pc++) {
+        const struct ubpf_ir_block *block = &ir->blocks[ir->insts[pc].block];
+
+        if (!ir->insts[pc].lddw_hi && block->start == pc) {
+            for (i = pc; i < block->end; i++) {
+                if (ir->insts[i].hoisted && !ir->insts[i].deleted) {
+                    if (steps) {
+                        steps[n] = (struct emit_step){ .pc = i, .loc = vm->num_insts, .moved = true };
+                    }
+                    n++;
+                }
+            }
+        }
+        for (i = 0; i < vm->num_loops; i++) {
+            const struct ubpf_loop *loop = &vm->loops[i];
+            uint32_t len = loop->latch - loop->head + 1;
+            uint64_t copy;
+
+            if (!unrolled[i] || loop->head != pc) {
+                continue;
+            }
+            for (copy = 0; copy < loop->max_trips; copy++, next_loc += len) {
+                for (j = 0; j < len; j++) {
+                    if (steps) {
+                        steps[n] = (struct emit_step){
+                            .pc = pc + j,
+                            .loc = next_loc + j,
+                            .head = pc,
+                            .end = loop->latch + 1,
+                            .copy_loc = next_loc,
+                            .next_loc = copy + 1 < loop->max_trips ? next_loc + len : pc,
+                        };
+                    }
+                    n++;
+                }
+            }
+        }
+        if (steps) {
+            steps[n] = (struct emit_step){ .pc = pc, .loc = pc };
+        }
+        n++;
+    }
+
+    *num_locs = next_loc;
+    return n;
+}
+
+/*
+ * Chain stages are called by a dispatcher that saves the non-volatile
+ * registers once for all of them, so they are translated with
+ * 'save_nonvolatile' false.
+ */
 static int
-translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
+translate(struct ubpf_vm *vm, struct ubpf_ir *ir, struct jit_state *state, const struct emit_step *steps,
+          uint32_t num_steps, bool save_nonvolatile, char **errmsg)
 {
     int i;
+    uint32_t k;
+    int last_pc = vm->num_insts - 1;
+    uint8_t *loop_head = calloc(vm->num_insts, sizeof(loop_head[0]));
+    struct switch_case *cases = calloc(vm->num_insts, sizeof(cases[0]));
+    int8_t slot_regs[UBPF_STACK_SIZE / 8];
+    int saved_regs[MAX_SLOT_REGS + 1];
+    int num_saved_regs;
+    int num_pushed;
+    int stack_size;
+    int32_t shard_offset = 0;
+    uint32_t timed_loc = 0, done_loc = 0, busy_loc = 0;
+    /* Latency histograms time every execution, so only plain statistics keep it inline */
+    bool inline_stats = vm->stats && !vm->latency && ubpf_stats_shard_tls_offset(&shard_offset);
+    bool helper_calls = false;
+
+    if (loop_head == NULL || cases == NULL) {
+        *errmsg = ubpf_error("out of memory");
+        free(loop_head);
+        free(cases);
+        return -1;
+    }
+
+    if (vm->sandboxed && ubpf_sandbox_create(vm, errmsg) < 0) {
+        free(loop_head);
+        free(cases);
+        return -1;
+    }
+
+    for (i = 0; i < vm->num_loops; i++) {
+        loop_head[vm->loops[i].head] = 1;
+    }
+
+    /* Array map lookups are inlined rather than called */
+    for (i = 0; i < vm->num_insts; i++) {
+        if (vm->insts[i].opcode == EBPF_OP_CALL && !ubpf_array_map(vm, vm->insts[i].imm)) {
+            helper_calls = true;
+        }
+    }
+
+    assign_slot_registers(ir, vm->sandboxed, slot_regs, saved_regs, &num_saved_regs);
+    if (vm->sandboxed && (!save_nonvolatile || !is_platform_nonvolatile(SANDBOX_BASE))) {
+        saved_regs[num_saved_regs++] = SANDBOX_BASE;
+    }
 
     /* Save platform non-volatile registers */
-    for (i = 0; i < _countof(platform_nonvolatile_registers); i++)
+    for (i = 0; save_nonvolatile && i < _countof(platform_nonvolatile_registers); i++)
     {
         emit_push(state, platform_nonvolatile_registers[i]);
     }
 
+    /* And the ones holding stack slots, keeping the stack 16-byte aligned */
+    for (i = 0; i < num_saved_regs; i++) {
+        emit_push(state, saved_regs[i]);
+    }
+    num_pushed = num_saved_regs + (save_nonvolatile ? 0 : _countof(platform_nonvolatile_registers));
+    stack_size = UBPF_STACK_SIZE + (num_pushed % 2) * 8;
+    if (ubpf_instrumented(vm)) {
+        stack_size += STATS_FRAME_SIZE;
+    }
+
+    /* Allocate stack space */
+    emit_alu64_imm32(state, 0x81, 5, RSP, stack_size);
+
+    /* Before setting up r1 and r10, which may be mapped to RAX or R11 */
+    if (ubpf_instrumented(vm)) {
+        if (inline_stats) {
+            emit_stats_start(state, vm, shard_offset);
+        } else {
+            emit_read_tsc(state);
+        }
+        emit_store_rsp(state, RAX, STATS_START_SLOT);
+        if (helper_calls) {
+            emit_alu32(state, 0x31, RAX, RAX);
+            emit_store_rsp(state, RAX, STATS_HELPER_CALLS_SLOT);
+        }
+    }
+
     /* Move first platform parameter register into register 1 */
     if (map_register(1) != platform_parameter_registers[0]) {
         emit_mov(state, platform_parameter_registers[0], map_register(1));
     }
 
-    /* Copy stack pointer to R10 */
-    emit_mov(state, RSP, map_register(10));
+    if (vm->sandboxed) {
+        /* The stacks are in the sandbox too */
+        busy_loc = emit_sandbox_stack(state, vm);
+        emit_load_imm(state, SANDBOX_BASE, (uintptr_t)vm->sandbox->base);
+    } else {
+        /* Point R10 at the top of the allocated stack space */
+        emit_mov(state, RSP, map_register(10));
+        emit_alu64_imm32(state, 0x81, 0, map_register(10), stack_size);
+    }
+
+    while (last_pc > 0 && ir->insts[last_pc].deleted) {
+        last_pc--;
+    }
 
-    /* Allocate stack space */
-    emit_alu64_imm32(state, 0x81, 5, RSP, UBPF_STACK_SIZE);
+    /* Instructions consumed along with a step, like the second half of an lddw, are skipped */
+    for (k = 0; k < num_steps; k += 1 + i - steps[k].pc) {
+        const struct emit_step *step = &steps[k];
+        uint32_t shift = step->loc - step->pc;
+        struct ebpf_inst inst;
+
+        i = step->pc;
+        inst = ir->insts[i].inst;
+        state->copy_head = step->head;
+        state->copy_end = step->end;
+        state->copy_loc = step->copy_loc;
+        state->next_copy_loc = step->next_loc;
+
+        if (ir->insts[i].deleted || (ir->insts[i].hoisted && !step->moved)) {
+            state->pc_locs[i + shift] = state->offset;
+            continue;
+        }
 
-    for (i = 0; i < vm->num_insts; i++) {
-        struct ebpf_inst inst = vm->insts[i];
-        state->pc_locs[i] = state->offset;
+        if (loop_head[i] && !shift) {
+            emit_align(state, LOOP_HEAD_ALIGN);
+        }
+        state->pc_locs[i + shift] = state->offset;
+        add_range(state, i);
 
         int dst = map_register(inst.dst);
         int src = map_register(inst.src);
-        uint32_t target_pc = i + inst.offset + 1;
+        uint32_t target_pc = i + ebpf_jump_offset(inst) + 1;
+        int slot_reg;
+        uint32_t num_cases;
+
+        if (inst.opcode == EBPF_OP_JEQ_IMM && !step->end) {
+            num_cases = find_switch(ir, i, cases);
+            if (num_cases >= MIN_SWITCH_CASES) {
+                emit_switch(state, dst, cases, num_cases, i + num_cases);
+                while (--num_cases) {
+                    i++;
+                    state->pc_locs[i] = state->pc_locs[i - 1];
+                }
+                continue;
+            }
+        }
+
+        /* A masked window only confines programs run with bounds checks */
+        if (vm->sandboxed && (!vm->sandbox->mask || vm->bounds_check_enabled)) {
+            int cls = inst.opcode & EBPF_CLS_MASK;
+            if (cls == EBPF_CLS_LDX) {
+                src = emit_sandbox_address(state, vm, &inst, inst.src, src);
+            } else if (cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) {
+                dst = emit_sandbox_address(state, vm, &inst, inst.dst, dst);
+            }
+        }
 
         switch (inst.opcode) {
         case EBPF_OP_ADD_IMM:
@@ -174,7 +894,7 @@ translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
         case EBPF_OP_DIV_REG:
         case EBPF_OP_MOD_IMM:
         case EBPF_OP_MOD_REG:
-            muldivmod(state, i, inst.opcode, src, dst, inst.imm);
+            muldivmod(state, i, inst, src, dst);
             break;
         case EBPF_OP_OR_IMM:
             emit_alu32_imm32(state, 0x81, 1, dst, inst.imm);
@@ -215,7 +935,11 @@ translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
             emit_alu32_imm32(state, 0xc7, 0, dst, inst.imm);
             break;
         case EBPF_OP_MOV_REG:
-            emit_mov(state, src, dst);
+            if (inst.offset) {
+                emit_movsx(state, inst.offset == 8 ? S8 : S16, false, src, dst);
+            } else {
+                emit_alu32(state, 0x89, src, dst); /* zero-extending */
+            }
             break;
         case EBPF_OP_ARSH_IMM:
             emit_alu32_imm8(state, 0xc1, 7, dst, inst.imm);
@@ -261,7 +985,7 @@ translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
         case EBPF_OP_DIV64_REG:
         case EBPF_OP_MOD64_IMM:
         case EBPF_OP_MOD64_REG:
-            muldivmod(state, i, inst.opcode, src, dst, inst.imm);
+            muldivmod(state, i, inst, src, dst);
             break;
         case EBPF_OP_OR64_IMM:
             emit_alu64_imm32(state, 0x81, 1, dst, inst.imm);
@@ -302,7 +1026,11 @@ translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
             emit_load_imm(state, dst, inst.imm);
             break;
         case EBPF_OP_MOV64_REG:
-            emit_mov(state, src, dst);
+            if (inst.offset) {
+                emit_movsx(state, inst.offset == 8 ? S8 : inst.offset == 16 ? S16 : S32, true, src, dst);
+            } else {
+                emit_mov(state, src, dst);
+            }
             break;
         case EBPF_OP_ARSH64_IMM:
             emit_alu64_imm8(state, 0xc1, 7, dst, inst.imm);
@@ -311,9 +1039,24 @@ translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
             emit_mov(state, src, RCX);
             emit_alu64(state, 0xd3, 7, dst);
             break;
+        case EBPF_OP_BSWAP:
+            if (inst.imm == 16) {
+                /* rol */
+                emit1(state, 0x66); /* 16-bit override */
+                emit_alu32_imm8(state, 0xc1, 0, dst, 8);
+                /* and */
+                emit_alu32_imm32(state, 0x81, 4, dst, 0xffff);
+            } else {
+                /* bswap */
+                emit_basic_rex(state, inst.imm == 64, 0, dst);
+                emit1(state, 0x0f);
+                emit1(state, 0xc8 | (dst & 7));
+            }
+            break;
 
         /* TODO use 8 bit immediate when possible */
         case EBPF_OP_JA:
+        case EBPF_OP_JA32:
             emit_jmp(state, target_pc);
             break;
         case EBPF_OP_JEQ_IMM:
@@ -404,17 +1147,119 @@ translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
             emit_cmp(state, src, dst);
             emit_jcc(state, 0x8e, target_pc);
             break;
+        case EBPF_OP_JEQ32_IMM:
+            emit_cmp32_imm32(state, dst, inst.imm);
+            emit_jcc(state, 0x84, target_pc);
+            break;
+        case EBPF_OP_JEQ32_REG:
+            emit_cmp32(state, src, dst);
+            emit_jcc(state, 0x84, target_pc);
+            break;
+        case EBPF_OP_JGT32_IMM:
+            emit_cmp32_imm32(state, dst, inst.imm);
+            emit_jcc(state, 0x87, target_pc);
+            break;
+        case EBPF_OP_JGT32_REG:
+            emit_cmp32(state, src, dst);
+            emit_jcc(state, 0x87, target_pc);
+            break;
+        case EBPF_OP_JGE32_IMM:
+            emit_cmp32_imm32(state, dst, inst.imm);
+            emit_jcc(state, 0x83, target_pc);
+            break;
+        case EBPF_OP_JGE32_REG:
+            emit_cmp32(state, src, dst);
+            emit_jcc(state, 0x83, target_pc);
+            break;
+        case EBPF_OP_JLT32_IMM:
+            emit_cmp32_imm32(state, dst, inst.imm);
+            emit_jcc(state, 0x82, target_pc);
+            break;
+        case EBPF_OP_JLT32_REG:
+            emit_cmp32(state, src, dst);
+            emit_jcc(state, 0x82, target_pc);
+            break;
+        case EBPF_OP_JLE32_IMM:
+            emit_cmp32_imm32(state, dst, inst.imm);
+            emit_jcc(state, 0x86, target_pc);
+            break;
+        case EBPF_OP_JLE32_REG:
+            emit_cmp32(state, src, dst);
+            emit_jcc(state, 0x86, target_pc);
+            break;
+        case EBPF_OP_JSET32_IMM:
+            emit_alu32_imm32(state, 0xf7, 0, dst, inst.imm);
+            emit_jcc(state, 0x85, target_pc);
+            break;
+        case EBPF_OP_JSET32_REG:
+            emit_alu32(state, 0x85, src, dst);
+            emit_jcc(state, 0x85, target_pc);
+            break;
+        case EBPF_OP_JNE32_IMM:
+            emit_cmp32_imm32(state, dst, inst.imm);
+            emit_jcc(state, 0x85, target_pc);
+            break;
+        case EBPF_OP_JNE32_REG:
+            emit_cmp32(state, src, dst);
+            emit_jcc(state, 0x85, target_pc);
+            break;
+        case EBPF_OP_JSGT32_IMM:
+            emit_cmp32_imm32(state, dst, inst.imm);
+            emit_jcc(state, 0x8f, target_pc);
+            break;
+        case EBPF_OP_JSGT32_REG:
+            emit_cmp32(state, src, dst);
+            emit_jcc(state, 0x8f, target_pc);
+            break;
+        case EBPF_OP_JSGE32_IMM:
+            emit_cmp32_imm32(state, dst, inst.imm);
+            emit_jcc(state, 0x8d, target_pc);
+            break;
+        case EBPF_OP_JSGE32_REG:
+            emit_cmp32(state, src, dst);
+            emit_jcc(state, 0x8d, target_pc);
+            break;
+        case EBPF_OP_JSLT32_IMM:
+            emit_cmp32_imm32(state, dst, inst.imm);
+            emit_jcc(state, 0x8c, target_pc);
+            break;
+        case EBPF_OP_JSLT32_REG:
+            emit_cmp32(state, src, dst);
+            emit_jcc(state, 0x8c, target_pc);
+            break;
+        case EBPF_OP_JSLE32_IMM:
+            emit_cmp32_imm32(state, dst, inst.imm);
+            emit_jcc(state, 0x8e, target_pc);
+            break;
+        case EBPF_OP_JSLE32_REG:
+            emit_cmp32(state, src, dst);
+            emit_jcc(state, 0x8e, target_pc);
+            break;
         case EBPF_OP_CALL:
+            if (ubpf_array_map(vm, inst.imm)) {
+                emit_array_map_lookup(state, ubpf_array_map(vm, inst.imm));
+                break;
+            }
             /* We reserve RCX for shifts */
             emit_mov(state, RCX_ALT, RCX);
+#if defined(UBPF_HELPER_PROFILE) && !defined(_WIN32)
+            /* The call site goes in the sixth parameter register, which holds r4 until the move above */
+            emit_load_imm(state, R9, (uintptr_t)&vm->helper_sites[i]);
+            emit_call(state, ubpf_profile_helper);
+#else
             emit_call(state, vm->ext_funcs[inst.imm]);
+#endif
+            if (ubpf_instrumented(vm)) {
+                emit_add_rsp_imm8(state, STATS_HELPER_CALLS_SLOT, 1);
+            }
             if (inst.imm == vm->unwind_stack_extension_index) {
                 emit_cmp_imm32(state, map_register(0), 0);
                 emit_jcc(state, 0x84, TARGET_PC_EXIT);
             }
             break;
         case EBPF_OP_EXIT:
-            if (i != vm->num_insts - 1) {
+            /* Only the original last instruction falls through into the epilogue */
+            if (i != last_pc || shift) {
                 emit_jmp(state, TARGET_PC_EXIT);
             }
             break;
@@ -429,7 +1274,21 @@ translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
             emit_load(state, S8, src, dst, inst.offset);
             break;
         case EBPF_OP_LDXDW:
-            emit_load(state, S64, src, dst, inst.offset);
+            slot_reg = slot_register(slot_regs, inst.src, inst.offset);
+            if (slot_reg >= 0) {
+                emit_mov(state, slot_reg, dst);
+            } else {
+                emit_load(state, S64, src, dst, inst.offset);
+            }
+            break;
+        case EBPF_OP_LDXSW:
+            emit_load_sx(state, S32, src, dst, inst.offset);
+            break;
+        case EBPF_OP_LDXSH:
+            emit_load_sx(state, S16, src, dst, inst.offset);
+            break;
+        case EBPF_OP_LDXSB:
+            emit_load_sx(state, S8, src, dst, inst.offset);
             break;
 
         case EBPF_OP_STW:
@@ -442,7 +1301,12 @@ translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
             emit_store_imm32(state, S8, dst, inst.offset, inst.imm);
             break;
         case EBPF_OP_STDW:
-            emit_store_imm32(state, S64, dst, inst.offset, inst.imm);
+            slot_reg = slot_register(slot_regs, inst.dst, inst.offset);
+            if (slot_reg >= 0) {
+                emit_load_imm(state, slot_reg, inst.imm);
+            } else {
+                emit_store_imm32(state, S64, dst, inst.offset, inst.imm);
+            }
             break;
 
         case EBPF_OP_STXW:
@@ -455,11 +1319,16 @@ translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
             emit_store(state, S8, src, dst, inst.offset);
             break;
         case EBPF_OP_STXDW:
-            emit_store(state, S64, src, dst, inst.offset);
+            slot_reg = slot_register(slot_regs, inst.dst, inst.offset);
+            if (slot_reg >= 0) {
+                emit_mov(state, src, slot_reg);
+            } else {
+                emit_store(state, S64, src, dst, inst.offset);
+            }
             break;
 
         case EBPF_OP_LDDW: {
-            struct ebpf_inst inst2 = vm->insts[++i];
+            struct ebpf_inst inst2 = ir->insts[++i].inst;
             uint64_t imm = (uint32_t)inst.imm | ((uint64_t)inst2.imm << 32);
             emit_load_imm(state, dst, imm);
             break;
@@ -467,23 +1336,69 @@ translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
 
         default:
             *errmsg = ubpf_error("Unknown instruction at PC %d: opcode %02x", i, inst.opcode);
+            free(loop_head);
+            free(cases);
             return -1;
         }
+
+        if (step->end && i == step->end - 1) {
+            /* Invert the latch of a copy to leave the loop, falling through into the next copy */
+            struct jump *jump = &state->jumps[state->num_jumps - 1];
+            if (jump->offset_loc <= state->size) {
+                state->buf[jump->offset_loc - 1] ^= 1;
+            }
+            jump->target_pc = step->end;
+        }
     }
 
+    free(loop_head);
+    free(cases);
+
     /* Epilogue */
     state->exit_loc = state->offset;
+    add_range(state, UBPF_NO_PC);
+
+    /* Before moving register 0, since register 10 may be mapped to RAX */
+    if (vm->sandboxed) {
+        emit_sandbox_exit(state, vm);
+    }
 
     /* Move register 0 into rax */
     if (map_register(0) != RAX) {
         emit_mov(state, map_register(0), RAX);
     }
 
+    if (ubpf_instrumented(vm)) {
+        if (inline_stats) {
+            timed_loc = emit_stats_exit(state, helper_calls);
+            done_loc = emit_forward_jmp(state);
+            patch_forward_jump(state, timed_loc);
+        }
+        /* RBX is non-volatile and no eBPF register is live at exit */
+        emit_mov(state, RAX, RBX);
+        if (helper_calls) {
+            emit_load_rsp(state, platform_parameter_registers[2], STATS_HELPER_CALLS_SLOT);
+        } else {
+            emit_alu32(state, 0x31, platform_parameter_registers[2], platform_parameter_registers[2]);
+        }
+        emit_load_rsp(state, platform_parameter_registers[1], STATS_START_SLOT);
+        emit_load_imm(state, platform_parameter_registers[0], (uintptr_t)vm);
+        emit_call(state, ubpf_stats_jit_exit);
+        emit_mov(state, RBX, RAX);
+        if (inline_stats) {
+            patch_forward_jump(state, done_loc);
+        }
+    }
+
     /* Deallocate stack space */
-    emit_alu64_imm32(state, 0x81, 0, RSP, UBPF_STACK_SIZE);
+    emit_alu64_imm32(state, 0x81, 0, RSP, stack_size);
+
+    for (i = num_saved_regs - 1; i >= 0; i--) {
+        emit_pop(state, saved_regs[i]);
+    }
 
     /* Restore platform non-volatile registers */
-    for (i = 0; i < _countof(platform_nonvolatile_registers); i++)
+    for (i = 0; save_nonvolatile && i < _countof(platform_nonvolatile_registers); i++)
     {
         emit_pop(state, platform_nonvolatile_registers[_countof(platform_nonvolatile_registers) - i - 1]);
     }
@@ -492,28 +1407,49 @@ translate(struct ubpf_vm *vm, struct jit_state *state, char **errmsg)
 
     /* Division by zero handler */
     state->div_by_zero_loc = state->offset;
-    const char *div_by_zero_fmt = "uBPF error: division by zero at PC %u\n";
     // RCX is the first parameter register for Windows, so first save the value.
-    emit_mov(state, RCX, platform_parameter_registers[2]); /* muldivmod stored pc in RCX */
-    emit_load_imm(state, platform_parameter_registers[0], (uintptr_t)stderr);
-    emit_load_imm(state, platform_parameter_registers[1], (uintptr_t)div_by_zero_fmt);
-    emit_call(state, vm->error_printf);
+    emit_mov(state, RCX, platform_parameter_registers[1]); /* muldivmod stored pc in RCX */
+    emit_load_imm(state, platform_parameter_registers[0], (uintptr_t)vm);
+    emit_call(state, ubpf_report_div_by_zero);
 
     emit_load_imm(state, map_register(0), -1);
     emit_jmp(state, TARGET_PC_EXIT);
 
+    if (vm->sandboxed) {
+        /* Another thread is running on the shared stack, ubpf_sandbox_enter reported it */
+        patch_forward_jump(state, busy_loc);
+        emit_load_imm(state, map_register(0), -1);
+        emit_jmp(state, TARGET_PC_EXIT);
+
+        /* Sandbox fault handler, entered from the SIGSEGV handler with the PC in RCX and the address in RDX */
+        vm->sandbox_fault_loc = state->offset;
+        if (platform_parameter_registers[2] != RDX) {
+            emit_mov(state, RDX, platform_parameter_registers[2]);
+        }
+        emit_mov(state, RCX, platform_parameter_registers[1]);
+        emit_load_imm(state, platform_parameter_registers[0], (uintptr_t)vm);
+        emit_call(state, ubpf_report_sandbox_fault);
+
+        emit_load_imm(state, map_register(0), -1);
+        emit_jmp(state, TARGET_PC_EXIT);
+    }
+
     return 0;
 }
 
 static void
-muldivmod(struct jit_state *state, uint16_t pc, uint8_t opcode, int src, int dst, int32_t imm)
+muldivmod(struct jit_state *state, uint32_t pc, struct ebpf_inst inst, int src, int dst)
 {
+    uint8_t opcode = inst.opcode;
     bool mul = (opcode & EBPF_ALU_OP_MASK) == (EBPF_OP_MUL_IMM & EBPF_ALU_OP_MASK);
     bool div = (opcode & EBPF_ALU_OP_MASK) == (EBPF_OP_DIV_IMM & EBPF_ALU_OP_MASK);
     bool mod = (opcode & EBPF_ALU_OP_MASK) == (EBPF_OP_MOD_IMM & EBPF_ALU_OP_MASK);
     bool is64 = (opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+    bool reg = opcode & EBPF_SRC_REG;
+    bool sign = (div || mod) && inst.offset == EBPF_OFFSET_SDIV;
+    uint32_t not_minus_one_loc = 0, done_loc = 0;
 
-    if (div || mod) {
+    if ((div || mod) && reg) {
         emit_load_imm(state, RCX, pc);
 
         /* test src,src */
@@ -527,21 +1463,54 @@ muldivmod(struct jit_state *state, uint16_t pc, uint8_t opcode, int src, int dst
         emit_jcc(state, 0x84, TARGET_PC_DIV_BY_ZERO);
     }
 
+    /*
+     * idiv faults on INT_MIN / -1, so division by -1 is a negation and
+     * modulo by -1 is zero instead.
+     */
+    if (sign && (reg || inst.imm == -1)) {
+        if (reg) {
+            if (is64) {
+                emit_alu64_imm8(state, 0x83, 7, src, -1);
+            } else {
+                emit_alu32_imm8(state, 0x83, 7, src, -1);
+            }
+            not_minus_one_loc = emit_forward_jcc(state, 0x85);
+        }
+        if (div && is64) {
+            emit_alu64(state, 0xf7, 3, dst);
+        } else if (div) {
+            emit_alu32(state, 0xf7, 3, dst);
+        } else {
+            emit_alu32(state, 0x31, dst, dst);
+        }
+        if (!reg) {
+            return;
+        }
+        done_loc = emit_forward_jmp(state);
+        patch_forward_jump(state, not_minus_one_loc);
+    }
+
     if (dst != RAX) {
         emit_push(state, RAX);
     }
     if (dst != RDX) {
         emit_push(state, RDX);
     }
-    if (imm) {
-        emit_load_imm(state, RCX, imm);
-    } else {
+    if (reg) {
         emit_mov(state, src, RCX);
+    } else {
+        emit_load_imm(state, RCX, inst.imm);
     }
 
     emit_mov(state, dst, RAX);
 
-    if (div || mod) {
+    if (sign) {
+        /* cdq or cqo */
+        if (is64) {
+            emit_rex(state, 1, 0, 0, 0);
+        }
+        emit1(state, 0x99);
+    } else if (div || mod) {
         /* xor %edx,%edx */
         emit_alu32(state, 0x31, RDX, RDX);
     }
@@ -550,8 +1519,8 @@ muldivmod(struct jit_state *state, uint16_t pc, uint8_t opcode, int src, int dst
         emit_rex(state, 1, 0, 0, 0);
     }
 
-    /* mul %ecx or div %ecx */
-    emit_alu32(state, 0xf7, mul ? 4 : 6, RCX);
+    /* mul %ecx, div %ecx or idiv %ecx */
+    emit_alu32(state, 0xf7, mul ? 4 : sign ? 7 : 6, RCX);
 
     if (dst != RDX) {
         if (mod) {
@@ -565,6 +1534,10 @@ muldivmod(struct jit_state *state, uint16_t pc, uint8_t opcode, int src, int dst
         }
         emit_pop(state, RAX);
     }
+
+    if (done_loc) {
+        patch_forward_jump(state, done_loc);
+    }
 }
 
 static void
@@ -583,47 +1556,159 @@ resolve_jumps(struct jit_state *state)
             target_loc = state->pc_locs[jump.target_pc];
         }
 
-        /* Assumes jump offset is at end of instruction */
-        uint32_t rel = target_loc - (jump.offset_loc + sizeof(uint32_t));
+        uint32_t rel = target_loc - jump.rel_loc;
 
         uint8_t *offset_ptr = &state->buf[jump.offset_loc];
         memcpy(offset_ptr, &rel, sizeof(uint32_t));
     }
 }
 
-int
-ubpf_translate(struct ubpf_vm *vm, uint8_t * buffer, size_t * size, char **errmsg)
+/*
+ * Copy the code ranges for ubpf_jitted_pc. Hoisted instructions and the
+ * copies of unrolled loops are emitted out of PC order, so the ranges are
+ * kept in code order with the PC of each.
+ */
+static struct ubpf_code_range *
+retain_ranges(const struct jit_state *state)
+{
+    size_t size = state->num_ranges * sizeof(state->ranges[0]);
+    struct ubpf_code_range *ranges = malloc(size);
+
+    if (ranges) {
+        memcpy(ranges, state->ranges, size);
+    }
+    return ranges;
+}
+
+static int
+translate_program(struct ubpf_vm *vm, uint8_t *buffer, size_t *size, bool save_nonvolatile,
+                  struct ubpf_code_range **ranges, uint32_t *num_ranges, char **errmsg)
 {
     struct jit_state state;
+    struct ubpf_ir *ir = NULL;
+    uint8_t *unrolled = NULL;
+    struct emit_step *steps = NULL;
+    uint32_t num_steps, num_locs, i;
     int result = -1;
 
     state.offset = 0;
     state.size = *size;
     state.buf = buffer;
-    state.pc_locs = calloc(UBPF_MAX_INSTS+1, sizeof(state.pc_locs[0]));
-    state.jumps = calloc(UBPF_MAX_INSTS, sizeof(state.jumps[0]));
+    state.pc_locs = NULL;
+    state.ranges = NULL;
+    state.num_ranges = 0;
+    state.jumps = NULL;
     state.num_jumps = 0;
+    state.copy_head = state.copy_end = state.copy_loc = state.next_copy_loc = 0;
 
-    if (translate(vm, &state, errmsg) < 0) {
+    ir = ubpf_ir_build(vm->insts, vm->num_insts);
+    unrolled = calloc(vm->num_loops + 1, sizeof(unrolled[0]));
+    if (!ir || !unrolled || ubpf_ir_optimize(ir) < 0) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    /* Sandbox faults are reported at the PC whose code faulted, so loops keep their layout there */
+    if (!vm->sandboxed) {
+        if (ubpf_ir_hoist_invariants(ir) < 0) {
+            *errmsg = ubpf_error("out of memory");
+            goto out;
+        }
+        for (i = 0; i < vm->num_loops; i++) {
+            unrolled[i] = unrollable(vm, ir, &vm->loops[i]);
+        }
+    }
+
+    num_steps = plan_steps(vm, ir, unrolled, NULL, &num_locs);
+    steps = calloc(num_steps, sizeof(steps[0]));
+    state.pc_locs = calloc(num_locs, sizeof(state.pc_locs[0]));
+    /* A switch may need up to three jumps per instruction, and the stubs need one each */
+    state.jumps = malloc((num_steps * 3 + 3) * sizeof(state.jumps[0]));
+    if (ranges) {
+        state.ranges = malloc((num_steps + 1) * sizeof(state.ranges[0]));
+    }
+    if (!steps || !state.pc_locs || !state.jumps || (ranges && !state.ranges)) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+    plan_steps(vm, ir, unrolled, steps, &num_locs);
+
+    if (translate(vm, ir, &state, steps, num_steps, save_nonvolatile, errmsg) < 0) {
+        goto out;
+    }
+
+    if (jit_overflowed(&state)) {
+        *errmsg = ubpf_error("jitted code needs %u bytes, the buffer has %zu", state.offset, *size);
+        *size = state.offset;
         goto out;
     }
 
     resolve_jumps(&state);
+    if (ranges) {
+        if (!(*ranges = retain_ranges(&state))) {
+            *errmsg = ubpf_error("out of memory");
+            goto out;
+        }
+        *num_ranges = state.num_ranges;
+    }
     result = 0;
 
     *size = state.offset;
 
 out:
+    ubpf_ir_free(ir);
+    free(unrolled);
+    free(steps);
     free(state.pc_locs);
+    free(state.ranges);
     free(state.jumps);
     return result;
 }
 
+int
+ubpf_translate(struct ubpf_vm *vm, uint8_t *buffer, size_t *size, char **errmsg)
+{
+    return translate_program(vm, buffer, size, true, NULL, NULL, errmsg);
+}
+
+/*
+ * Guess at the size of the jitted code, for the buffer it is first
+ * translated into. Programs that turn out larger are translated again.
+ */
+static size_t
+estimate_jitted_size(const struct ubpf_vm *vm)
+{
+    return JIT_FIXED_SIZE + (size_t)vm->num_insts * JIT_BYTES_PER_INST;
+}
+
+/* Copy code into new executable memory */
+static void *
+make_executable(const uint8_t *buffer, size_t size, char **errmsg)
+{
+    void *code = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        *errmsg = ubpf_error("internal uBPF error: mmap failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    memcpy(code, buffer, size);
+
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) < 0) {
+        *errmsg = ubpf_error("internal uBPF error: mprotect failed: %s\n", strerror(errno));
+        munmap(code, size);
+        return NULL;
+    }
+
+    return code;
+}
+
 ubpf_jit_fn
 ubpf_compile(struct ubpf_vm *vm, char **errmsg)
 {
     void *jitted = NULL;
     uint8_t *buffer = NULL;
+    struct ubpf_code_range *ranges = NULL;
+    uint32_t num_ranges = 0;
     size_t jitted_size;
 
     if (vm->jitted) {
@@ -637,33 +1722,235 @@ ubpf_compile(struct ubpf_vm *vm, char **errmsg)
         return NULL;
     }
 
-    jitted_size = 65536;
-    buffer = calloc(jitted_size, 1);
+#ifdef UBPF_HAVE_LLVM
+    if (vm->jit_tier == UBPF_JIT_TIER_LLVM) {
+        if (vm->sandboxed) {
+            *errmsg = ubpf_error("sandboxing is not supported by the LLVM JIT tier");
+            return NULL;
+        }
+        if (vm->stats) {
+            *errmsg = ubpf_error("statistics are not supported by the LLVM JIT tier");
+            return NULL;
+        }
+        if (vm->latency) {
+            *errmsg = ubpf_error("latency histograms are not supported by the LLVM JIT tier");
+            return NULL;
+        }
+        return ubpf_compile_llvm(vm, errmsg);
+    }
+#endif
+
+    jitted_size = estimate_jitted_size(vm);
+    for (;;) {
+        size_t size = jitted_size;
 
-    if (ubpf_translate(vm, buffer, &jitted_size, errmsg) < 0) {
-        goto out;
+        buffer = malloc(jitted_size);
+        if (!buffer) {
+            *errmsg = ubpf_error("out of memory");
+            goto out;
+        }
+        if (translate_program(vm, buffer, &size, true, &ranges, &num_ranges, errmsg) == 0) {
+            jitted_size = size;
+            break;
+        }
+        free(buffer);
+        buffer = NULL;
+        if (size <= jitted_size) {
+            goto out;
+        }
+        /* The estimate was too small; now the size is exact */
+        free(*errmsg);
+        *errmsg = NULL;
+        jitted_size = size;
     }
 
-    jitted = mmap(0, jitted_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (jitted == MAP_FAILED) {
-        *errmsg = ubpf_error("internal uBPF error: mmap failed: %s\n", strerror(errno));
-        goto out;
+    jitted = make_executable(buffer, jitted_size, errmsg);
+    if (jitted) {
+        vm->jitted_ranges = ranges;
+        vm->num_jitted_ranges = num_ranges;
+        vm->jitted_size = jitted_size;
+        /* The profiler's signal handler may look at the VM as soon as this is set */
+        __atomic_store_n(&vm->jitted, jitted, __ATOMIC_RELEASE);
+    } else {
+        free(ranges);
     }
 
-    memcpy(jitted, buffer, jitted_size);
+out:
+    free(buffer);
+    return vm->jitted;
+}
 
-    if (mprotect(jitted, jitted_size, PROT_READ | PROT_EXEC) < 0) {
-        *errmsg = ubpf_error("internal uBPF error: mprotect failed: %s\n", strerror(errno));
+/* Jump to where 'rule' continues after 'stage', or fall through if that is the next stage */
+static void
+emit_chain_rule(struct jit_state *state, const struct ubpf_chain *chain, int stage,
+                const struct ubpf_chain_rule *rule, int jcc)
+{
+    int32_t target_pc;
+
+    switch (rule->action) {
+    case UBPF_CHAIN_GOTO:
+        target_pc = rule->target;
+        break;
+    case UBPF_CHAIN_CONTINUE:
+        target_pc = stage + 1 < chain->num_stages ? stage + 1 : TARGET_PC_EXIT;
+        break;
+    default:
+        target_pc = TARGET_PC_EXIT;
+        break;
+    }
+
+    if (jcc) {
+        emit_jcc(state, jcc, target_pc);
+    } else if (target_pc != stage + 1 && !(target_pc == TARGET_PC_EXIT && stage + 1 == chain->num_stages)) {
+        emit_jmp(state, target_pc);
+    }
+}
+
+/* Replace the error of a translation that ran out of room with a buffer of 'size' bytes */
+static int
+grow_buffer(struct jit_state *state, size_t size, char **errmsg)
+{
+    uint8_t *buf = realloc(state->buf, size);
+
+    free(*errmsg);
+    *errmsg = NULL;
+    if (!buf) {
+        *errmsg = ubpf_error("out of memory");
+        return -1;
+    }
+    state->buf = buf;
+    state->size = size;
+    return 0;
+}
+
+/*
+ * The dispatcher saves the non-volatile registers and the two parameters
+ * once, then for each stage reloads the parameters, calls the stage's
+ * code and compares the return value in rax against the policy. The
+ * stages follow the dispatcher in the same buffer; their "pc" in
+ * pc_locs is num_stages + stage.
+ */
+ubpf_jit_fn
+ubpf_chain_compile(struct ubpf_chain *chain, char **errmsg)
+{
+    struct jit_state state;
+    int num_stages = chain->num_stages;
+    int i, j;
+#if defined(_WIN32)
+    int shadow = 4 * sizeof(uint64_t);
+#else
+    int shadow = 0;
+#endif
+    int frame = shadow + 2 * sizeof(uint64_t);
+    size_t rest;
+
+    if (chain->jitted) {
+        return chain->jitted;
+    }
+
+    *errmsg = NULL;
+
+    for (i = 0; i < num_stages; i++) {
+        if (!chain->stages[i].vm->insts) {
+            *errmsg = ubpf_error("code has not been loaded into stage %d", i);
+            return NULL;
+        }
+        if (chain->stages[i].vm->sandboxed) {
+            *errmsg = ubpf_error("stage %d is sandboxed, which chains do not support", i);
+            return NULL;
+        }
+    }
+
+    /* The dispatcher, then each stage at its estimated size */
+    rest = 0;
+    for (i = 0; i < num_stages; i++) {
+        rest += LOOP_HEAD_ALIGN + estimate_jitted_size(chain->stages[i].vm);
+    }
+    state.offset = 0;
+    state.size = JIT_FIXED_SIZE + num_stages * (UBPF_CHAIN_MAX_RULES + 2) * CHAIN_BYTES_PER_RULE + rest;
+    state.buf = malloc(state.size);
+    state.pc_locs = calloc(2 * num_stages + 1, sizeof(state.pc_locs[0]));
+    state.jumps = calloc(num_stages * (UBPF_CHAIN_MAX_RULES + 2), sizeof(state.jumps[0]));
+    state.num_jumps = 0;
+    state.copy_head = state.copy_end = state.copy_loc = state.next_copy_loc = 0;
+    if (!state.buf || !state.pc_locs || !state.jumps) {
+        *errmsg = ubpf_error("out of memory");
         goto out;
     }
 
-    vm->jitted = jitted;
-    vm->jitted_size = jitted_size;
+    /* Keep rsp 16-byte aligned at the calls */
+    for (i = 0; i < _countof(platform_nonvolatile_registers); i++) {
+        emit_push(&state, platform_nonvolatile_registers[i]);
+    }
+    if ((sizeof(uint64_t) * (1 + _countof(platform_nonvolatile_registers)) + frame) % 16) {
+        frame += sizeof(uint64_t);
+    }
+    emit_alu64_imm32(&state, 0x81, 5, RSP, frame);
+    emit_store_rsp(&state, platform_parameter_registers[0], shadow);
+    emit_store_rsp(&state, platform_parameter_registers[1], shadow + sizeof(uint64_t));
 
-out:
-    free(buffer);
-    if (jitted && vm->jitted == NULL) {
-        munmap(jitted, jitted_size);
+    for (i = 0; i < num_stages; i++) {
+        const struct ubpf_chain_stage *s = &chain->stages[i];
+
+        state.pc_locs[i] = state.offset;
+        if (i > 0) {
+            emit_load_rsp(&state, platform_parameter_registers[0], shadow);
+            emit_load_rsp(&state, platform_parameter_registers[1], shadow + sizeof(uint64_t));
+        }
+
+        /* call rel32 */
+        emit1(&state, 0xe8);
+        emit_jump_offset(&state, num_stages + i);
+
+        for (j = 0; j < s->num_rules; j++) {
+            int64_t retval = s->rules[j].retval;
+            if (retval >= INT32_MIN && retval <= INT32_MAX) {
+                emit_cmp_imm32(&state, RAX, retval);
+            } else {
+                emit_load_imm(&state, RCX, retval);
+                emit_cmp(&state, RCX, RAX);
+            }
+            emit_chain_rule(&state, chain, i, &s->rules[j], 0x84);
+        }
+        emit_chain_rule(&state, chain, i, &s->otherwise, 0);
     }
-    return vm->jitted;
+
+    state.exit_loc = state.offset;
+    emit_alu64_imm32(&state, 0x81, 0, RSP, frame);
+    for (i = _countof(platform_nonvolatile_registers) - 1; i >= 0; i--) {
+        emit_pop(&state, platform_nonvolatile_registers[i]);
+    }
+    emit1(&state, 0xc3); /* ret */
+
+    /* Stage bodies are position independent, so translate them in place */
+    for (i = 0; i < num_stages; i++) {
+        struct ubpf_vm *vm = chain->stages[i].vm;
+        size_t size;
+
+        rest -= LOOP_HEAD_ALIGN + estimate_jitted_size(vm);
+        emit_align(&state, LOOP_HEAD_ALIGN);
+        size = state.size - state.offset;
+        state.pc_locs[num_stages + i] = state.offset;
+        if (translate_program(vm, state.buf + state.offset, &size, false, NULL, NULL, errmsg) < 0) {
+            /* Make room for the stage at its exact size and for the rest at their estimates */
+            if (size <= state.size - state.offset || grow_buffer(&state, state.offset + size + rest, errmsg) < 0 ||
+                translate_program(vm, state.buf + state.offset, &size, false, NULL, NULL, errmsg) < 0) {
+                goto out;
+            }
+        }
+        state.offset += size;
+    }
+
+    resolve_jumps(&state);
+
+    chain->jitted = make_executable(state.buf, state.offset, errmsg);
+    if (chain->jitted) {
+        chain->jitted_size = state.offset;
+    }
+
+out:
+    free(state.buf);
+    free(state.pc_locs);
+    free(state.jumps);
+    return chain->jitted;
 }
@@ -22,6 +22,7 @@
 #define UBPF_JIT_X86_64_H
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -52,6 +53,7 @@ enum operand_size {
 struct jump {
     uint32_t offset_loc;
     uint32_t target_pc;
+    uint32_t rel_loc; /* location the offset is relative to */
 };
 
 struct jit_state {
@@ -59,21 +61,40 @@ struct jit_state {
     uint32_t offset;
     uint32_t size;
     uint32_t *pc_locs;
+    struct ubpf_code_range *ranges; /* one per emitted step, in code order, or NULL */
+    uint32_t num_ranges;
     uint32_t exit_loc;
     uint32_t div_by_zero_loc;
     uint32_t unwind_loc;
     struct jump *jumps;
     int num_jumps;
+    /* While emitting a copy of an unrolled loop, jumps into [copy_head, copy_end) stay in it */
+    uint32_t copy_head;
+    uint32_t copy_end;      /* 0 outside copies */
+    uint32_t copy_loc;      /* pc_locs index of the copy's head */
+    uint32_t next_copy_loc; /* and of the next copy's, which the back-edge enters */
 };
 
+/*
+ * Past the end of the buffer, code is only measured, so that a caller that
+ * guessed the size too small can translate again into a buffer of
+ * state->offset bytes.
+ */
 static inline void
 emit_bytes(struct jit_state *state, void *data, uint32_t len)
 {
-    assert(state->offset <= state->size - len);
-    memcpy(state->buf + state->offset, data, len);
+    if (state->offset + len <= state->size) {
+        memcpy(state->buf + state->offset, data, len);
+    }
     state->offset += len;
 }
 
+static inline bool
+jit_overflowed(const struct jit_state *state)
+{
+    return state->offset > state->size;
+}
+
 static inline void
 emit1(struct jit_state *state, uint8_t x)
 {
@@ -102,8 +123,13 @@ static inline void
 emit_jump_offset(struct jit_state *state, int32_t target_pc)
 {
     struct jump *jump = &state->jumps[state->num_jumps++];
+    uint32_t t = target_pc;
+    if (t >= state->copy_head && t < state->copy_end) {
+        target_pc = t == state->copy_head ? state->next_copy_loc : state->copy_loc + (t - state->copy_head);
+    }
     jump->offset_loc = state->offset;
     jump->target_pc = target_pc;
+    jump->rel_loc = state->offset + sizeof(uint32_t);
     emit4(state, 0);
 }
 
@@ -243,6 +269,18 @@ emit_cmp(struct jit_state *state, int src, int dst)
     emit_alu64(state, 0x39, src, dst);
 }
 
+static inline void
+emit_cmp32_imm32(struct jit_state *state, int dst, int32_t imm)
+{
+    emit_alu32_imm32(state, 0x81, 7, dst, imm);
+}
+
+static inline void
+emit_cmp32(struct jit_state *state, int src, int dst)
+{
+    emit_alu32(state, 0x39, src, dst);
+}
+
 static inline void
 emit_jcc(struct jit_state *state, int code, int32_t target_pc)
 {
@@ -269,6 +307,94 @@ emit_load(struct jit_state *state, enum operand_size size, int src, int dst, int
     emit_modrm_and_displacement(state, dst, src, offset);
 }
 
+/* Load [src + offset] into dst, sign-extended to 64 bits */
+static inline void
+emit_load_sx(struct jit_state *state, enum operand_size size, int src, int dst, int32_t offset)
+{
+    emit_basic_rex(state, 1, dst, src);
+
+    if (size == S8 || size == S16) {
+        /* movsx */
+        emit1(state, 0x0f);
+        emit1(state, size == S8 ? 0xbe : 0xbf);
+    } else {
+        /* movsxd */
+        emit1(state, 0x63);
+    }
+
+    emit_modrm_and_displacement(state, dst, src, offset);
+}
+
+/*
+ * Sign-extend the low byte, word or doubleword of src into dst, either to
+ * 64 bits or to 32 bits with the upper half cleared. Byte operands always
+ * need a REX prefix so that registers 4-7 mean spl-dil rather than ah-bh.
+ */
+static inline void
+emit_movsx(struct jit_state *state, enum operand_size size, bool is64, int src, int dst)
+{
+    if (is64 || (src & 8) || (dst & 8) || size == S8) {
+        emit_rex(state, is64, !!(dst & 8), 0, !!(src & 8));
+    }
+
+    if (size == S8 || size == S16) {
+        /* movsx */
+        emit1(state, 0x0f);
+        emit1(state, size == S8 ? 0xbe : 0xbf);
+    } else {
+        /* movsxd */
+        emit1(state, 0x63);
+    }
+
+    emit_modrm_reg2reg(state, dst, src);
+}
+
+/*
+ * Load the 64-bit value at [rsp + offset] into dst. RSP as a base needs a
+ * SIB byte, which emit_modrm_and_displacement does not emit.
+ */
+static inline void
+emit_load_rsp(struct jit_state *state, int dst, int8_t offset)
+{
+    emit_basic_rex(state, 1, dst, 0);
+    emit1(state, 0x8b);
+    emit_modrm(state, 0x40, dst, RSP);
+    emit1(state, 0x24); /* SIB: base rsp, no index */
+    emit1(state, offset);
+}
+
+/* Store the 64-bit register src to [rsp + offset] */
+static inline void
+emit_store_rsp(struct jit_state *state, int src, int8_t offset)
+{
+    emit_basic_rex(state, 1, src, 0);
+    emit1(state, 0x89);
+    emit_modrm(state, 0x40, src, RSP);
+    emit1(state, 0x24);
+    emit1(state, offset);
+}
+
+/* Add a sign-extended 8-bit immediate to the 64-bit value at [rsp + offset] */
+static inline void
+emit_add_rsp_imm8(struct jit_state *state, int8_t offset, int8_t imm)
+{
+    emit_basic_rex(state, 1, 0, 0);
+    emit1(state, 0x83);
+    emit_modrm(state, 0x40, 0, RSP);
+    emit1(state, 0x24);
+    emit1(state, offset);
+    emit1(state, imm);
+}
+
+/* Load the address [src + offset] into dst */
+static inline void
+emit_lea(struct jit_state *state, int src, int dst, int32_t offset)
+{
+    emit_basic_rex(state, 1, dst, src);
+    emit1(state, 0x8d);
+    emit_modrm_and_displacement(state, dst, src, offset);
+}
+
 /* Load sign-extended immediate into register */
 static inline void
 emit_load_imm(struct jit_state *state, int dst, int64_t imm)
@@ -341,6 +467,30 @@ emit_call(struct jit_state *state, void *target)
 #endif
 }
 
+/* Pad with multi-byte nops until the offset is a multiple of 'align' */
+static inline void
+emit_align(struct jit_state *state, uint32_t align)
+{
+    static const uint8_t nops[9][9] = {
+        { 0x90 },
+        { 0x66, 0x90 },
+        { 0x0f, 0x1f, 0x00 },
+        { 0x0f, 0x1f, 0x40, 0x00 },
+        { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+        { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+        { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+        { 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        { 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    };
+    uint32_t pad = (align - state->offset % align) % align;
+
+    while (pad > 0) {
+        uint32_t len = pad > 9 ? 9 : pad;
+        emit_bytes(state, (void *)nops[len - 1], len);
+        pad -= len;
+    }
+}
+
 static inline void
 emit_jmp(struct jit_state *state, uint32_t target_pc)
 {
@@ -0,0 +1,551 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Loop detection and trip-count analysis
+ *
+ * Every cycle in an eBPF program contains at least one backward jump, so
+ * loops are found from those back-edges. The natural loop of a back-edge
+ * latch->head is the head plus every instruction that can reach the latch
+ * without passing through the head.
+ *
+ * A trip-count bound is proven for loops of the form clang emits for
+ * counted loops: a single latch that is a conditional jump against an
+ * immediate, whose register is changed in the loop only by a constant
+ * add/sub that runs on every iteration. A 32-bit latch only sees the low
+ * half of the register, so the counter must not wrap around in it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ubpf_int.h"
+
+struct loop_graph {
+    const struct ebpf_inst *insts;
+    uint32_t num_insts;
+    uint32_t *pred_start; /* num_insts+1 entries, indexes into preds */
+    uint32_t *preds;
+};
+
+static bool
+is_cond_jump(uint8_t opcode)
+{
+    uint8_t cls = opcode & EBPF_CLS_MASK;
+    return (cls == EBPF_CLS_JMP || cls == EBPF_CLS_JMP32) &&
+        opcode != EBPF_OP_JA && opcode != EBPF_OP_JA32 && opcode != EBPF_OP_CALL && opcode != EBPF_OP_EXIT;
+}
+
+static bool
+is_jump(uint8_t opcode)
+{
+    return is_cond_jump(opcode) || opcode == EBPF_OP_JA || opcode == EBPF_OP_JA32;
+}
+
+/* Returns the number of successors of 'pc' and stores them in 'succ' */
+static int
+successors(const struct ebpf_inst *insts, uint32_t pc, uint32_t succ[2])
+{
+    struct ebpf_inst inst = insts[pc];
+    switch (inst.opcode) {
+    case EBPF_OP_EXIT:
+        return 0;
+    case EBPF_OP_JA:
+    case EBPF_OP_JA32:
+        succ[0] = pc + 1 + ebpf_jump_offset(inst);
+        return 1;
+    case EBPF_OP_LDDW:
+        succ[0] = pc + 2;
+        return 1;
+    default:
+        succ[0] = pc + 1;
+        if (is_cond_jump(inst.opcode)) {
+            succ[1] = pc + 1 + inst.offset;
+            return 2;
+        }
+        return 1;
+    }
+}
+
+static int
+build_graph(struct loop_graph *g)
+{
+    uint32_t pc, succ[2];
+    int i, n;
+
+    g->pred_start = calloc(g->num_insts + 1, sizeof(g->pred_start[0]));
+    g->preds = calloc(2 * g->num_insts, sizeof(g->preds[0]));
+    if (!g->pred_start || !g->preds) {
+        return -1;
+    }
+
+    for (pc = 0; pc < g->num_insts; pc++) {
+        n = successors(g->insts, pc, succ);
+        for (i = 0; i < n; i++) {
+            if (succ[i] < g->num_insts) {
+                g->pred_start[succ[i] + 1]++;
+            }
+        }
+        if (g->insts[pc].opcode == EBPF_OP_LDDW) {
+            pc++;
+        }
+    }
+
+    for (pc = 0; pc < g->num_insts; pc++) {
+        g->pred_start[pc + 1] += g->pred_start[pc];
+    }
+
+    uint32_t *fill = calloc(g->num_insts, sizeof(fill[0]));
+    if (!fill) {
+        return -1;
+    }
+
+    for (pc = 0; pc < g->num_insts; pc++) {
+        n = successors(g->insts, pc, succ);
+        for (i = 0; i < n; i++) {
+            if (succ[i] < g->num_insts) {
+                g->preds[g->pred_start[succ[i]] + fill[succ[i]]++] = pc;
+            }
+        }
+        if (g->insts[pc].opcode == EBPF_OP_LDDW) {
+            pc++;
+        }
+    }
+
+    free(fill);
+    return 0;
+}
+
+/*
+ * Mark the natural loop of latch->head in 'body'. Returns false if the
+ * loop can be entered other than through its head.
+ */
+static bool
+mark_body(const struct loop_graph *g, uint32_t head, uint32_t latch, uint8_t *body, uint32_t *worklist)
+{
+    uint32_t n = 0, pc, i;
+
+    memset(body, 0, g->num_insts);
+    body[head] = 1;
+    if (!body[latch]) {
+        body[latch] = 1;
+        worklist[n++] = latch;
+    }
+
+    while (n > 0) {
+        pc = worklist[--n];
+        for (i = g->pred_start[pc]; i < g->pred_start[pc + 1]; i++) {
+            uint32_t pred = g->preds[i];
+            if (!body[pred]) {
+                body[pred] = 1;
+                worklist[n++] = pred;
+            }
+        }
+    }
+
+    for (pc = 0; pc < g->num_insts; pc++) {
+        if (!body[pc] || pc == head) {
+            continue;
+        }
+        if (pc == 0) {
+            return false;
+        }
+        for (i = g->pred_start[pc]; i < g->pred_start[pc + 1]; i++) {
+            if (!body[g->preds[i]]) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Returns true if 'inst' may change the value of register 'reg' */
+static bool
+writes_reg(struct ebpf_inst inst, int reg)
+{
+    switch (inst.opcode & EBPF_CLS_MASK) {
+    case EBPF_CLS_ALU:
+    case EBPF_CLS_ALU64:
+    case EBPF_CLS_LDX:
+        return inst.dst == reg;
+    case EBPF_CLS_LD:
+        return inst.opcode == EBPF_OP_LDDW && inst.dst == reg;
+    case EBPF_CLS_JMP:
+        /* Helpers return in r0 and may clobber the argument registers */
+        return inst.opcode == EBPF_OP_CALL && reg <= 5;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Returns true if every path from 'head' to 'latch' inside the loop passes
+ * through 'pc'.
+ */
+static bool
+dominates_latch(const struct loop_graph *g, const uint8_t *body, uint32_t head, uint32_t latch, uint32_t pc, uint8_t *seen, uint32_t *worklist)
+{
+    uint32_t n = 0, cur, succ[2];
+    int i, num_succ;
+
+    if (pc == head) {
+        return true;
+    }
+
+    memset(seen, 0, g->num_insts);
+    seen[pc] = 1;
+    seen[head] = 1;
+    worklist[n++] = head;
+
+    while (n > 0) {
+        cur = worklist[--n];
+        if (cur == latch) {
+            return false;
+        }
+        num_succ = successors(g->insts, cur, succ);
+        for (i = 0; i < num_succ; i++) {
+            if (succ[i] < g->num_insts && body[succ[i]] && !seen[succ[i]]) {
+                seen[succ[i]] = 1;
+                worklist[n++] = succ[i];
+            }
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Find the value of 'reg' on entry to the loop if it is set by a mov
+ * immediate in the straight-line code falling into 'head'.
+ */
+static bool
+entry_value(const struct loop_graph *g, const uint8_t *body, uint32_t head, int reg, int64_t *value)
+{
+    uint32_t i, entry = UINT32_MAX;
+
+    for (i = g->pred_start[head]; i < g->pred_start[head + 1]; i++) {
+        if (body[g->preds[i]]) {
+            continue;
+        }
+        if (entry != UINT32_MAX) {
+            return false;
+        }
+        entry = g->preds[i];
+    }
+
+    while (entry != UINT32_MAX) {
+        struct ebpf_inst inst = g->insts[entry];
+        if (inst.opcode == EBPF_OP_MOV64_IMM && inst.dst == reg) {
+            *value = inst.imm;
+            return true;
+        }
+        if (inst.opcode == EBPF_OP_MOV_IMM && inst.dst == reg) {
+            *value = (uint32_t)inst.imm;
+            return true;
+        }
+        if (writes_reg(inst, reg)) {
+            return false;
+        }
+        /* Only follow an unambiguous fall-through chain */
+        if (g->pred_start[entry + 1] - g->pred_start[entry] != 1 ||
+                g->preds[g->pred_start[entry]] != entry - 1) {
+            return false;
+        }
+        entry--;
+    }
+
+    return false;
+}
+
+static int64_t
+ceil_div(int64_t a, int64_t b)
+{
+    return a > 0 ? (a + b - 1) / b : a / b;
+}
+
+/*
+ * Bound the loop using the known entry value of the induction register.
+ * Every input fits in 33 bits, so the arithmetic cannot overflow. The
+ * counter must stay in [lo, hi] for the compare to see it move steadily.
+ */
+static bool
+bound_from_init(uint8_t opcode, int64_t k, int64_t step, int64_t init, int64_t lo, int64_t hi, uint64_t *bound)
+{
+    int64_t first_fail;
+
+    /* Find the first iteration count at which the latch falls through */
+    switch (opcode) {
+    case EBPF_OP_JLT_IMM:
+    case EBPF_OP_JSLT_IMM:
+        if (step <= 0) {
+            return false;
+        }
+        first_fail = ceil_div(k - init, step);
+        break;
+    case EBPF_OP_JLE_IMM:
+    case EBPF_OP_JSLE_IMM:
+        if (step <= 0) {
+            return false;
+        }
+        first_fail = ceil_div(k + 1 - init, step);
+        break;
+    case EBPF_OP_JGT_IMM:
+    case EBPF_OP_JSGT_IMM:
+        if (step >= 0) {
+            return false;
+        }
+        first_fail = ceil_div(init - k, -step);
+        break;
+    case EBPF_OP_JGE_IMM:
+    case EBPF_OP_JSGE_IMM:
+        if (step >= 0) {
+            return false;
+        }
+        first_fail = ceil_div(init - k + 1, -step);
+        break;
+    case EBPF_OP_JNE_IMM:
+        /* The counter must land exactly on the limit */
+        if ((k - init) % step != 0 || (k - init) / step < 1) {
+            return false;
+        }
+        first_fail = (k - init) / step;
+        break;
+    default:
+        return false;
+    }
+
+    if (first_fail < 1) {
+        first_fail = 1;
+    }
+
+    /* The counter moves in one direction, so its extremes are after the first and last steps */
+    if (init + step < lo || init + step > hi || init + first_fail * step < lo || init + first_fail * step > hi) {
+        return false;
+    }
+
+    *bound = first_fail - 1;
+    return true;
+}
+
+/*
+ * Compute how many times the back-edge can be taken when the induction
+ * register starts at 'init' (if 'init_known') and the latch continues the
+ * loop while "reg OP imm" holds after each increment by 'step'. 'opcode'
+ * is the 64-bit form of the latch, and 'narrow' is set if the latch
+ * compares the low 32 bits, in which case 'init' is as the latch sees it.
+ */
+static bool
+trip_bound(uint8_t opcode, int32_t imm, int64_t step, bool init_known, int64_t init, bool narrow, uint64_t *bound)
+{
+    bool is_unsigned = false;
+    int64_t k = imm;
+
+    switch (opcode) {
+    case EBPF_OP_JLT_IMM:
+    case EBPF_OP_JLE_IMM:
+    case EBPF_OP_JGT_IMM:
+    case EBPF_OP_JGE_IMM:
+        if (narrow) {
+            k = (uint32_t)imm;
+        } else if (imm < 0) {
+            /* The interpreter zero-extends these immediates, the JIT does not */
+            return false;
+        }
+        is_unsigned = true;
+        break;
+    }
+
+    if (init_known) {
+        int64_t lo = INT64_MIN, hi = INT64_MAX;
+        if (narrow) {
+            lo = is_unsigned ? 0 : INT32_MIN;
+            hi = is_unsigned ? UINT32_MAX : INT32_MAX;
+        } else if (is_unsigned) {
+            /* Unsigned compares must never see the counter wrap below zero */
+            lo = 0;
+        }
+        if (bound_from_init(opcode, k, step, init, lo, hi, bound)) {
+            return true;
+        }
+    }
+
+    /* Counting up towards an unsigned limit is bounded whatever the start, unless a narrow counter wraps */
+    if (step > 0 && opcode == EBPF_OP_JLT_IMM && (!narrow || k + step - 1 <= UINT32_MAX)) {
+        *bound = ceil_div(k, step);
+        return true;
+    } else if (step > 0 && opcode == EBPF_OP_JLE_IMM && (!narrow || k + step <= UINT32_MAX)) {
+        *bound = k / step + 1;
+        return true;
+    }
+
+    return false;
+}
+
+static bool
+prove_bound(const struct loop_graph *g, const uint8_t *body, uint32_t head, uint32_t latch, uint64_t *bound, uint8_t *seen, uint32_t *worklist)
+{
+    struct ebpf_inst test = g->insts[latch];
+    bool narrow = (test.opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP32;
+    uint8_t opcode = test.opcode;
+    uint32_t pc, inc = UINT32_MAX;
+    int64_t step, init = 0;
+    bool init_known;
+
+    /* The latch must continue the loop when its condition holds */
+    if (!is_cond_jump(test.opcode) || (test.opcode & EBPF_SRC_REG) ||
+            latch + 1 >= g->num_insts || body[latch + 1]) {
+        return false;
+    }
+
+    for (pc = 0; pc < g->num_insts; pc++) {
+        if (!body[pc] || !writes_reg(g->insts[pc], test.dst)) {
+            continue;
+        }
+        if (inc != UINT32_MAX) {
+            return false;
+        }
+        inc = pc;
+    }
+
+    if (inc == UINT32_MAX) {
+        return false;
+    }
+
+    /* A 32-bit latch does not see whether the upper half is changed as well */
+    if (g->insts[inc].opcode == EBPF_OP_ADD64_IMM || (narrow && g->insts[inc].opcode == EBPF_OP_ADD_IMM)) {
+        step = g->insts[inc].imm;
+    } else if (g->insts[inc].opcode == EBPF_OP_SUB64_IMM || (narrow && g->insts[inc].opcode == EBPF_OP_SUB_IMM)) {
+        step = -(int64_t)g->insts[inc].imm;
+    } else {
+        return false;
+    }
+
+    if (step == 0 || !dominates_latch(g, body, head, latch, inc, seen, worklist)) {
+        return false;
+    }
+
+    /* The increment must run once per iteration, not inside an inner loop */
+    for (pc = 0; pc < g->num_insts; pc++) {
+        struct ebpf_inst inst = g->insts[pc];
+        if (!body[pc] || pc == latch || inst.opcode == EBPF_OP_LDDW ||
+                !is_jump(inst.opcode) || pc + 1 + ebpf_jump_offset(inst) > pc) {
+            continue;
+        }
+        mark_body(g, pc + 1 + ebpf_jump_offset(inst), pc, seen, worklist);
+        if (seen[inc]) {
+            return false;
+        }
+    }
+
+    init_known = entry_value(g, body, head, test.dst, &init);
+    if (narrow) {
+        opcode = EBPF_CLS_JMP | (test.opcode & ~EBPF_CLS_MASK);
+        if (opcode == EBPF_OP_JSGT_IMM || opcode == EBPF_OP_JSGE_IMM || opcode == EBPF_OP_JSLT_IMM ||
+                opcode == EBPF_OP_JSLE_IMM || opcode == EBPF_OP_JNE_IMM) {
+            init = (int32_t)init;
+        } else {
+            init = (uint32_t)init;
+        }
+    }
+    return trip_bound(opcode, test.imm, step, init_known, init, narrow, bound);
+}
+
+int
+ubpf_find_loops(const struct ebpf_inst *insts, uint32_t num_insts, struct ubpf_loop **loops_out, uint32_t *num_loops_out)
+{
+    struct loop_graph g = { .insts = insts, .num_insts = num_insts };
+    struct ubpf_loop *loops = NULL;
+    uint32_t num_loops = 0;
+    uint8_t *body = NULL, *seen = NULL;
+    uint32_t *worklist = NULL;
+    uint32_t pc;
+    int result = -1;
+
+    *loops_out = NULL;
+    *num_loops_out = 0;
+
+    if (build_graph(&g) < 0) {
+        goto out;
+    }
+
+    body = malloc(num_insts);
+    seen = malloc(num_insts);
+    worklist = malloc(num_insts * sizeof(worklist[0]));
+    if (!body || !seen || !worklist) {
+        goto out;
+    }
+
+    for (pc = 0; pc < num_insts; pc++) {
+        struct ebpf_inst inst = insts[pc];
+        uint32_t head, latch = pc;
+        uint32_t i;
+
+        if (inst.opcode == EBPF_OP_LDDW) {
+            pc++;
+            continue;
+        }
+        if (!is_jump(inst.opcode)) {
+            continue;
+        }
+        head = pc + 1 + ebpf_jump_offset(inst);
+        if (head > pc) {
+            continue;
+        }
+
+        /* Loops sharing a head are reported once, as unbounded */
+        for (i = 0; i < num_loops; i++) {
+            if (loops[i].head == head) {
+                break;
+            }
+        }
+        if (i < num_loops) {
+            loops[i].max_trips = UBPF_LOOP_UNBOUNDED;
+            continue;
+        }
+
+        struct ubpf_loop *tmp = realloc(loops, (num_loops + 1) * sizeof(*loops));
+        if (!tmp) {
+            goto out;
+        }
+        loops = tmp;
+
+        struct ubpf_loop *loop = &loops[num_loops++];
+        loop->head = head;
+        loop->latch = latch;
+        loop->max_trips = UBPF_LOOP_UNBOUNDED;
+
+        uint64_t bound;
+        if (mark_body(&g, head, latch, body, worklist) &&
+                prove_bound(&g, body, head, latch, &bound, seen, worklist)) {
+            loop->max_trips = bound;
+        }
+    }
+
+    *loops_out = loops;
+    *num_loops_out = num_loops;
+    loops = NULL;
+    result = 0;
+
+out:
+    free(loops);
+    free(body);
+    free(seen);
+    free(worklist);
+    free(g.pred_start);
+    free(g.preds);
+    return result;
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Array map key verification
+ *
+ * A call to an array map reads its 32-bit key through r2. Neither the JIT
+ * nor the LLVM tier checks that read, so at load time every SSA value is
+ * classified as r10 plus a constant offset or not, and r2 must hold a key
+ * slot inside the stack at each call to an array map.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "ubpf_int.h"
+#include "ubpf_ir.h"
+
+#define KEY_SIZE 4
+
+enum stack_kind {
+    STACK_UNKNOWN, /* not computed yet */
+    STACK_NO,
+    STACK_YES,     /* r10 + off */
+};
+
+struct stack_state {
+    uint8_t kind;
+    int32_t off;
+};
+
+static struct stack_state
+join(struct stack_state a, struct stack_state b)
+{
+    if (a.kind == STACK_UNKNOWN) {
+        return b;
+    }
+    if (b.kind == STACK_UNKNOWN || (a.kind == b.kind && a.off == b.off)) {
+        return a;
+    }
+    return (struct stack_state){ .kind = STACK_NO };
+}
+
+static struct stack_state
+add_offset(struct stack_state s, int64_t delta)
+{
+    int64_t off = s.off + delta;
+    if (s.kind == STACK_YES && off >= -UBPF_STACK_SIZE && off <= 0) {
+        s.off = off;
+        return s;
+    }
+    return (struct stack_state){ .kind = STACK_NO };
+}
+
+static struct stack_state
+inst_state(const struct ubpf_ir *ir, const struct stack_state *states, uint32_t pc)
+{
+    const struct ubpf_ir_inst *ir_inst = &ir->insts[pc];
+    struct ebpf_inst inst = ir_inst->inst;
+    struct stack_state dst = states[ir_inst->dst_val];
+
+    switch (inst.opcode) {
+    case EBPF_OP_MOV64_REG:
+        if (!inst.offset) {
+            return states[ir_inst->src_val];
+        }
+        break;
+    case EBPF_OP_ADD64_IMM:
+        return add_offset(dst, inst.imm);
+    case EBPF_OP_SUB64_IMM:
+        return add_offset(dst, -(int64_t)inst.imm);
+    }
+    return (struct stack_state){ .kind = STACK_NO };
+}
+
+static struct stack_state
+value_state(const struct ubpf_ir *ir, const struct stack_state *states, uint32_t v)
+{
+    const struct ubpf_ir_value *value = &ir->values[v];
+    const struct ubpf_ir_block *block;
+    struct stack_state state = { .kind = STACK_UNKNOWN };
+    uint32_t i;
+
+    switch (value->kind) {
+    case UBPF_IR_VALUE_ARG:
+        state.kind = value->reg == 10 ? STACK_YES : STACK_NO;
+        return state;
+    case UBPF_IR_VALUE_INST:
+        return inst_state(ir, states, value->def);
+    case UBPF_IR_VALUE_PHI:
+        block = &ir->blocks[value->def];
+        for (i = 0; i < block->num_preds; i++) {
+            uint32_t p = ubpf_ir_pred(ir, value->def, i);
+            if (ubpf_ir_reachable(ir, p)) {
+                state = join(state, states[ir->blocks[p].out[value->reg]]);
+            }
+        }
+        return state;
+    default:
+        state.kind = STACK_NO;
+        return state;
+    }
+}
+
+static bool
+calls_array_map(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_insts)
+{
+    uint32_t pc;
+
+    for (pc = 0; pc < num_insts; pc++) {
+        if (insts[pc].opcode == EBPF_OP_CALL && ubpf_array_map(vm, insts[pc].imm)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int
+ubpf_check_map_keys(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_insts, char **errmsg)
+{
+    struct ubpf_ir *ir;
+    struct stack_state *states = NULL;
+    uint32_t i, pc;
+    bool changed = true;
+    int result = -1;
+
+    if (!calls_array_map(vm, insts, num_insts)) {
+        return 0;
+    }
+
+    ir = ubpf_ir_build(insts, num_insts);
+    if (!ir || !(states = calloc(ir->num_values + 1, sizeof(states[0])))) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    /* Values only depend on earlier ones, except for phis at loop heads */
+    while (changed) {
+        changed = false;
+        for (i = 0; i < ir->num_values; i++) {
+            struct stack_state state = value_state(ir, states, i);
+            if (state.kind != states[i].kind || state.off != states[i].off) {
+                states[i] = state;
+                changed = true;
+            }
+        }
+    }
+
+    for (pc = 0; pc < num_insts; pc++) {
+        const struct ubpf_ir_inst *ir_inst = &ir->insts[pc];
+        struct stack_state key;
+
+        if (ir_inst->lddw_hi || !ubpf_ir_reachable(ir, ir_inst->block) ||
+                ir_inst->inst.opcode != EBPF_OP_CALL || !ubpf_array_map(vm, ir_inst->inst.imm)) {
+            continue;
+        }
+        /* Calls have no r2 operand, so find its value from the start of the block */
+        key = states[ir->blocks[ir_inst->block].in[2]];
+        for (i = ir->blocks[ir_inst->block].start; i < pc; i++) {
+            if (ir->insts[i].inst.opcode == EBPF_OP_CALL) {
+                key.kind = STACK_NO;
+            } else if (ir->insts[i].def != UBPF_IR_NONE && ir->values[ir->insts[i].def].reg == 2) {
+                key = states[ir->insts[i].def];
+            }
+        }
+        if (key.kind != STACK_YES || key.off > -KEY_SIZE) {
+            *errmsg = ubpf_error("array map key at PC %u is not on the stack", pc);
+            goto out;
+        }
+    }
+    result = 0;
+
+out:
+    free(states);
+    ubpf_ir_free(ir);
+    return result;
+}
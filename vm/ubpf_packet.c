@@ -0,0 +1,489 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Direct packet access verification
+ *
+ * In packet mode r1 points to a struct ubpf_packet_ctx. Every SSA value is
+ * given a kind: the context pointer, data or data_meta plus a constant
+ * offset, data_end, or a scalar. A comparison of a data pointer against
+ * data_end (or of a data_meta pointer against data) proves that many bytes
+ * of the packet on one of the two edges, and the proven ranges flow along
+ * the CFG, taking the minimum at joins. Each access through a packet
+ * pointer must lie within the range proven in its block, so no check is
+ * needed at runtime.
+ *
+ * Pointers may be spilled to an 8-byte stack slot that a single stxdw
+ * writes, such as the registers saved by a fused program, as long as r10
+ * is never used as a value and so cannot alias the slot. A reload that the
+ * store dominates gets the kind of the stored value. Any other load that
+ * touches a slot holding a pointer is rejected, since its bytes would give
+ * a scalar copy of the pointer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include "ubpf_int.h"
+#include "ubpf_ir.h"
+
+/* Largest constant offset tracked on a packet pointer */
+#define MAX_PACKET_OFFSET 0xffff
+
+#define NUM_SLOTS (UBPF_STACK_SIZE / 8)
+#define SLOT_UNUSED UINT32_MAX
+#define SLOT_SHARED (UINT32_MAX - 1) /* written by several stores, or partially */
+
+enum ptr_kind {
+    KIND_UNKNOWN,  /* not computed yet */
+    KIND_SCALAR,
+    KIND_CTX,
+    KIND_DATA,     /* data + off */
+    KIND_META,     /* data_meta + off */
+    KIND_END,      /* data_end */
+    KIND_INVALID,  /* packet pointer with an unknown offset */
+};
+
+struct ptr_state {
+    uint8_t kind;
+    int32_t off;
+};
+
+/* Bytes proven accessible from data and from data_meta */
+struct range {
+    int32_t data;
+    int32_t meta;
+};
+
+#define RANGE_TOP INT32_MAX
+
+static bool
+is_pointer(uint8_t kind)
+{
+    return kind != KIND_SCALAR && kind != KIND_UNKNOWN;
+}
+
+static struct ptr_state
+join(struct ptr_state a, struct ptr_state b)
+{
+    if (a.kind == KIND_UNKNOWN) {
+        return b;
+    }
+    if (b.kind == KIND_UNKNOWN || (a.kind == b.kind && a.off == b.off)) {
+        return a;
+    }
+    if (a.kind == KIND_SCALAR && b.kind == KIND_SCALAR) {
+        return a;
+    }
+    return (struct ptr_state){ .kind = KIND_INVALID };
+}
+
+static struct ptr_state
+add_offset(struct ptr_state s, int64_t delta)
+{
+    int64_t off = s.off + delta;
+    if ((s.kind == KIND_DATA || s.kind == KIND_META) && off >= -MAX_PACKET_OFFSET && off <= MAX_PACKET_OFFSET) {
+        s.off = off;
+        return s;
+    }
+    return (struct ptr_state){ .kind = KIND_INVALID };
+}
+
+static int
+access_size(uint8_t opcode)
+{
+    switch (opcode & 0x18) {
+    case EBPF_SIZE_B: return 1;
+    case EBPF_SIZE_H: return 2;
+    case EBPF_SIZE_W: return 4;
+    default: return 8;
+    }
+}
+
+static bool
+reads_r10_as_value(struct ebpf_inst inst)
+{
+    uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+
+    if (cls == EBPF_CLS_STX) {
+        return inst.src == 10;
+    }
+    if (cls != EBPF_CLS_ALU && cls != EBPF_CLS_ALU64 && cls != EBPF_CLS_JMP && cls != EBPF_CLS_JMP32) {
+        return false;
+    }
+    if (inst.opcode == EBPF_OP_CALL || inst.opcode == EBPF_OP_EXIT) {
+        return false;
+    }
+    return inst.dst == 10 || ((inst.opcode & EBPF_SRC_REG) && inst.src == 10);
+}
+
+/*
+ * Find the stxdw that is the only store to each stack slot, in 'slots'
+ * indexed by (offset + UBPF_STACK_SIZE) / 8
+ */
+static void
+find_spill_slots(const struct ubpf_ir *ir, uint32_t *slots)
+{
+    uint32_t pc;
+    int i;
+
+    for (i = 0; i < NUM_SLOTS; i++) {
+        slots[i] = SLOT_UNUSED;
+    }
+    for (pc = 0; pc < ir->num_insts; pc++) {
+        if (!ir->insts[pc].lddw_hi && reads_r10_as_value(ir->insts[pc].inst)) {
+            for (i = 0; i < NUM_SLOTS; i++) {
+                slots[i] = SLOT_SHARED;
+            }
+            return;
+        }
+    }
+
+    for (pc = 0; pc < ir->num_insts; pc++) {
+        struct ebpf_inst inst = ir->insts[pc].inst;
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+        int first, last;
+
+        if (ir->insts[pc].lddw_hi || (cls != EBPF_CLS_ST && cls != EBPF_CLS_STX) || inst.dst != 10) {
+            continue;
+        }
+        first = inst.offset + UBPF_STACK_SIZE;
+        last = first + access_size(inst.opcode) - 1;
+        if (last < 0 || first >= UBPF_STACK_SIZE) {
+            continue;
+        }
+        first = first < 0 ? 0 : first / 8;
+        last = last >= UBPF_STACK_SIZE ? NUM_SLOTS - 1 : last / 8;
+        for (i = first; i <= last; i++) {
+            bool whole = inst.opcode == EBPF_OP_STXDW && inst.offset % 8 == 0;
+            slots[i] = slots[i] == SLOT_UNUSED && whole ? pc : SLOT_SHARED;
+        }
+    }
+}
+
+/* The only store to the slot at r10 + 'offset', or SLOT_SHARED */
+static uint32_t
+slot_store(const uint32_t *slots, int16_t offset)
+{
+    int slot = offset + UBPF_STACK_SIZE;
+
+    if (slot < 0 || slot >= UBPF_STACK_SIZE || slot % 8 != 0 || slots[slot / 8] == SLOT_UNUSED) {
+        return SLOT_SHARED;
+    }
+    return slots[slot / 8];
+}
+
+/* Whether the load 'inst' reads part of a spilled pointer without reloading it whole */
+static bool
+partial_reload(const struct ubpf_ir *ir, const struct ptr_state *states, const uint32_t *slots, struct ebpf_inst inst)
+{
+    int first = inst.offset + UBPF_STACK_SIZE;
+    int last = first + access_size(inst.opcode) - 1;
+    int i;
+
+    if (inst.src != 10 || (inst.opcode == EBPF_OP_LDXDW && slot_store(slots, inst.offset) != SLOT_SHARED)) {
+        return false;
+    }
+    if (last < 0 || first >= UBPF_STACK_SIZE) {
+        return false;
+    }
+    first = first < 0 ? 0 : first / 8;
+    last = last >= UBPF_STACK_SIZE ? NUM_SLOTS - 1 : last / 8;
+    for (i = first; i <= last; i++) {
+        if (slots[i] != SLOT_UNUSED && slots[i] != SLOT_SHARED && is_pointer(states[ir->insts[slots[i]].src_val].kind)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static struct ptr_state
+inst_state(const struct ubpf_ir *ir, const struct ptr_state *states, const uint32_t *slots, uint32_t pc)
+{
+    const struct ubpf_ir_inst *ir_inst = &ir->insts[pc];
+    struct ebpf_inst inst = ir_inst->inst;
+    struct ptr_state dst = states[ir_inst->dst_val];
+    struct ptr_state src = states[ir_inst->src_val];
+    struct ptr_state scalar = { .kind = KIND_SCALAR };
+    uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+    uint32_t store = inst.opcode == EBPF_OP_LDXDW && inst.src == 10 ? slot_store(slots, inst.offset) : SLOT_SHARED;
+
+    if (store != SLOT_SHARED) {
+        struct ptr_state spilled = states[ir->insts[store].src_val];
+        uint32_t block = ir->insts[store].block;
+        if (block == ir_inst->block ? store < pc : ubpf_ir_dominates(ir, block, ir_inst->block)) {
+            return spilled;
+        }
+        return is_pointer(spilled.kind) ? (struct ptr_state){ .kind = KIND_INVALID } : scalar;
+    }
+
+    if (inst.opcode == EBPF_OP_LDXDW && src.kind == KIND_CTX) {
+        switch (inst.offset) {
+        case offsetof(struct ubpf_packet_ctx, data):
+            return (struct ptr_state){ .kind = KIND_DATA };
+        case offsetof(struct ubpf_packet_ctx, data_end):
+            return (struct ptr_state){ .kind = KIND_END };
+        case offsetof(struct ubpf_packet_ctx, data_meta):
+            return (struct ptr_state){ .kind = KIND_META };
+        }
+        return scalar;
+    }
+
+    if (cls != EBPF_CLS_ALU && cls != EBPF_CLS_ALU64) {
+        return scalar;
+    }
+
+    switch (inst.opcode) {
+    case EBPF_OP_MOV64_REG:
+        if (!inst.offset) {
+            return src;
+        }
+        break;
+    case EBPF_OP_MOV_IMM:
+    case EBPF_OP_MOV64_IMM:
+        return scalar;
+    case EBPF_OP_ADD64_IMM:
+        return is_pointer(dst.kind) ? add_offset(dst, inst.imm) : scalar;
+    case EBPF_OP_SUB64_IMM:
+        return is_pointer(dst.kind) ? add_offset(dst, -(int64_t)inst.imm) : scalar;
+    case EBPF_OP_SUB64_REG:
+        /* The distance between two packet pointers, such as the length */
+        if (is_pointer(dst.kind) && is_pointer(src.kind) && dst.kind != KIND_CTX && src.kind != KIND_CTX) {
+            return scalar;
+        }
+        break;
+    }
+
+    if (is_pointer(dst.kind) || ((inst.opcode & EBPF_SRC_REG) && is_pointer(src.kind))) {
+        return (struct ptr_state){ .kind = KIND_INVALID };
+    }
+    return scalar;
+}
+
+static struct ptr_state
+value_state(const struct ubpf_ir *ir, const struct ptr_state *states, const uint32_t *slots, uint32_t v)
+{
+    const struct ubpf_ir_value *value = &ir->values[v];
+    const struct ubpf_ir_block *block;
+    struct ptr_state state = { .kind = KIND_UNKNOWN };
+    uint32_t i;
+
+    switch (value->kind) {
+    case UBPF_IR_VALUE_ARG:
+        state.kind = value->reg == 1 ? KIND_CTX : KIND_SCALAR;
+        return state;
+    case UBPF_IR_VALUE_INST:
+        return inst_state(ir, states, slots, value->def);
+    case UBPF_IR_VALUE_PHI:
+        block = &ir->blocks[value->def];
+        for (i = 0; i < block->num_preds; i++) {
+            uint32_t p = ubpf_ir_pred(ir, value->def, i);
+            if (ubpf_ir_reachable(ir, p)) {
+                state = join(state, states[ir->blocks[p].out[value->reg]]);
+            }
+        }
+        return state;
+    default:
+        state.kind = KIND_SCALAR;
+        return state;
+    }
+}
+
+/*
+ * The range proven on the edge from block 'p' to block 'b' by the
+ * comparison ending 'p', on top of 'in'
+ */
+static struct range
+edge_range(const struct ubpf_ir *ir, const struct ptr_state *states, uint32_t p, uint32_t b, struct range in)
+{
+    const struct ubpf_ir_block *block = &ir->blocks[p];
+    const struct ubpf_ir_inst *ir_inst = &ir->insts[block->end - 1];
+    struct ebpf_inst inst = ir_inst->inst;
+    uint32_t target = block->end + inst.offset;
+    struct ptr_state ptr, end;
+    bool taken, dst_is_ptr;
+
+    if ((inst.opcode & EBPF_CLS_MASK) != EBPF_CLS_JMP || !(inst.opcode & EBPF_SRC_REG) ||
+            inst.opcode == EBPF_OP_CALL || target == block->end) {
+        return in;
+    }
+    taken = ir->blocks[b].start == target;
+
+    /*
+     * Find which operand is known to be below the other on this edge. For
+     * "jgt a, b" that is a on the fallthrough edge and b on the taken one.
+     */
+    switch (inst.opcode) {
+    case EBPF_OP_JGT_REG:
+    case EBPF_OP_JGE_REG:
+        dst_is_ptr = !taken;
+        break;
+    case EBPF_OP_JLT_REG:
+    case EBPF_OP_JLE_REG:
+        dst_is_ptr = taken;
+        break;
+    default:
+        return in;
+    }
+    ptr = states[dst_is_ptr ? ir_inst->dst_val : ir_inst->src_val];
+    end = states[dst_is_ptr ? ir_inst->src_val : ir_inst->dst_val];
+
+    if (ptr.off <= 0) {
+        return in;
+    }
+    if (ptr.kind == KIND_DATA && end.kind == KIND_END && ptr.off > in.data) {
+        in.data = ptr.off;
+    } else if (ptr.kind == KIND_META && end.kind == KIND_DATA && end.off == 0 && ptr.off > in.meta) {
+        in.meta = ptr.off;
+    }
+    return in;
+}
+
+static int
+check_access(struct ebpf_inst inst, uint32_t pc, struct ptr_state base, struct range range, bool store, char **errmsg)
+{
+    int size = access_size(inst.opcode);
+    int64_t start = (int64_t)base.off + inst.offset;
+    int32_t limit;
+
+    switch (base.kind) {
+    case KIND_SCALAR:
+        return 0;
+    case KIND_CTX:
+        if (!store && inst.opcode == EBPF_OP_LDXDW && inst.offset >= 0 &&
+                inst.offset < sizeof(struct ubpf_packet_ctx) && inst.offset % 8 == 0) {
+            return 0;
+        }
+        *errmsg = ubpf_error("invalid context access at PC %u", pc);
+        return -1;
+    case KIND_DATA:
+    case KIND_META:
+        limit = base.kind == KIND_DATA ? range.data : range.meta;
+        if (start >= 0 && start + size <= limit) {
+            return 0;
+        }
+        *errmsg = ubpf_error("packet access at PC %u not proven in bounds: offset %" PRId64 " size %d, %d bytes proven",
+                             pc, start, size, limit);
+        return -1;
+    case KIND_END:
+        *errmsg = ubpf_error("access through data_end at PC %u", pc);
+        return -1;
+    default:
+        *errmsg = ubpf_error("access through a packet pointer with unknown offset at PC %u", pc);
+        return -1;
+    }
+}
+
+int
+ubpf_check_packet_access(const struct ebpf_inst *insts, uint32_t num_insts, char **errmsg)
+{
+    struct ubpf_ir *ir = ubpf_ir_build(insts, num_insts);
+    struct ptr_state *states = NULL;
+    struct range *ranges = NULL;
+    uint32_t slots[NUM_SLOTS];
+    uint32_t i, j, pc;
+    bool changed = true;
+    int result = -1;
+
+    if (!ir ||
+            !(states = calloc(ir->num_values + 1, sizeof(states[0]))) ||
+            !(ranges = calloc(ir->num_blocks + 1, sizeof(ranges[0])))) {
+        *errmsg = ubpf_error("out of memory");
+        goto out;
+    }
+
+    find_spill_slots(ir, slots);
+
+    /* Values only depend on earlier ones, except for phis at loop heads and reloads */
+    while (changed) {
+        changed = false;
+        for (i = 0; i < ir->num_values; i++) {
+            struct ptr_state state = value_state(ir, states, slots, i);
+            if (state.kind != states[i].kind || state.off != states[i].off) {
+                states[i] = state;
+                changed = true;
+            }
+        }
+    }
+
+    /* Proven ranges only shrink from the optimistic start until they are stable */
+    for (i = 0; i < ir->num_blocks; i++) {
+        ranges[i] = (struct range){ RANGE_TOP, RANGE_TOP };
+    }
+    changed = true;
+    while (changed) {
+        changed = false;
+        for (i = 0; i < ir->num_reachable; i++) {
+            uint32_t b = ir->rpo[i];
+            struct range in = { RANGE_TOP, RANGE_TOP };
+
+            if (b == 0) {
+                in = (struct range){ 0, 0 };
+            }
+            for (j = 0; j < ir->blocks[b].num_preds; j++) {
+                uint32_t p = ubpf_ir_pred(ir, b, j);
+                if (!ubpf_ir_reachable(ir, p)) {
+                    continue;
+                }
+                struct range edge = edge_range(ir, states, p, b, ranges[p]);
+                in.data = edge.data < in.data ? edge.data : in.data;
+                in.meta = edge.meta < in.meta ? edge.meta : in.meta;
+            }
+            if (in.data != ranges[b].data || in.meta != ranges[b].meta) {
+                ranges[b] = in;
+                changed = true;
+            }
+        }
+    }
+
+    for (pc = 0; pc < num_insts; pc++) {
+        const struct ubpf_ir_inst *ir_inst = &ir->insts[pc];
+        struct ebpf_inst inst = ir_inst->inst;
+        uint8_t cls = inst.opcode & EBPF_CLS_MASK;
+        struct range range = ranges[ir_inst->block];
+
+        if (ir_inst->lddw_hi || !ubpf_ir_reachable(ir, ir_inst->block)) {
+            continue;
+        }
+
+        if (cls == EBPF_CLS_LDX) {
+            if (partial_reload(ir, states, slots, inst)) {
+                *errmsg = ubpf_error("partial reload of a spilled pointer at PC %u", pc);
+                goto out;
+            }
+            if (check_access(inst, pc, states[ir_inst->src_val], range, false, errmsg) < 0) {
+                goto out;
+            }
+        } else if (cls == EBPF_CLS_ST || cls == EBPF_CLS_STX) {
+            if (cls == EBPF_CLS_STX && is_pointer(states[ir_inst->src_val].kind) &&
+                    (inst.dst != 10 || slot_store(slots, inst.offset) != pc)) {
+                *errmsg = ubpf_error("packet or context pointer stored to memory at PC %u", pc);
+                goto out;
+            }
+            if (check_access(inst, pc, states[ir_inst->dst_val], range, true, errmsg) < 0) {
+                goto out;
+            }
+        }
+    }
+    result = 0;
+
+out:
+    free(states);
+    free(ranges);
+    ubpf_ir_free(ir);
+    return result;
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Sampling profiler for jitted code
+ *
+ * A SIGPROF timer interrupts the process at a fixed rate of CPU time. The
+ * handler looks up the interrupted instruction pointer in the jitted code
+ * of the profiled VMs and, using the retained offsets of each eBPF
+ * instruction in that code, counts a sample for the instruction that was
+ * running. Samples that land in helpers or outside jitted code are not
+ * counted.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include "ubpf_int.h"
+
+#define UBPF_PROFILE_MAX_VMS 64
+
+static struct ubpf_vm *profiled_vms[UBPF_PROFILE_MAX_VMS];
+static struct sigaction old_action;
+static bool running;
+
+/* Instruction of the last range starting at or before 'offset', or -1 */
+static int
+find_pc(const struct ubpf_code_range *ranges, uint32_t num_ranges, uint32_t offset)
+{
+    int lo = 0, hi = num_ranges - 1, found = -1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ranges[mid].offset <= offset) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found < 0 || ranges[found].pc == UBPF_NO_PC ? -1 : (int)ranges[found].pc;
+}
+
+/*
+ * eBPF instruction whose jitted code contains 'ip', or -1 if 'ip' is not in
+ * the body of the VM's jitted program. Safe to call from signal handlers.
+ */
+int
+ubpf_jitted_pc(const struct ubpf_vm *vm, uintptr_t ip)
+{
+    uintptr_t start = (uintptr_t)__atomic_load_n(&vm->jitted, __ATOMIC_ACQUIRE);
+
+    if (!start || !vm->jitted_ranges || ip < start || ip >= start + vm->jitted_size) {
+        return -1;
+    }
+    return find_pc(vm->jitted_ranges, vm->num_jitted_ranges, ip - start);
+}
+
+static uintptr_t
+interrupted_ip(void *context)
+{
+#if defined(__linux__) && defined(__x86_64__)
+    return ((ucontext_t *)context)->uc_mcontext.gregs[REG_RIP];
+#else
+    (void)context;
+    return 0;
+#endif
+}
+
+static void
+handle_sigprof(int sig, siginfo_t *info, void *context)
+{
+    uintptr_t ip = interrupted_ip(context);
+    int i;
+
+    (void)sig;
+    (void)info;
+
+    for (i = 0; i < UBPF_PROFILE_MAX_VMS; i++) {
+        struct ubpf_vm *vm = __atomic_load_n(&profiled_vms[i], __ATOMIC_ACQUIRE);
+        if (!vm) {
+            continue;
+        }
+
+        uintptr_t start = (uintptr_t)__atomic_load_n(&vm->jitted, __ATOMIC_ACQUIRE);
+        if (!start || ip < start || ip >= start + vm->jitted_size) {
+            continue;
+        }
+
+        int pc = ubpf_jitted_pc(vm, ip);
+        if (pc >= 0) {
+            __atomic_fetch_add(&vm->profile[pc], 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+}
+
+int
+ubpf_enable_profiling(struct ubpf_vm *vm)
+{
+    int i;
+
+    if (vm->profile) {
+        return 0;
+    }
+    if (!vm->insts) {
+        return -1;
+    }
+
+    vm->profile = calloc(vm->num_insts, sizeof(vm->profile[0]));
+    if (!vm->profile) {
+        return -1;
+    }
+
+    for (i = 0; i < UBPF_PROFILE_MAX_VMS; i++) {
+        struct ubpf_vm *expected = NULL;
+        if (__atomic_compare_exchange_n(&profiled_vms[i], &expected, vm, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+    }
+
+    free(vm->profile);
+    vm->profile = NULL;
+    return -1;
+}
+
+void
+ubpf_profile_unregister(struct ubpf_vm *vm)
+{
+    int i;
+
+    for (i = 0; i < UBPF_PROFILE_MAX_VMS; i++) {
+        struct ubpf_vm *expected = vm;
+        __atomic_compare_exchange_n(&profiled_vms[i], &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+int
+ubpf_get_profile(const struct ubpf_vm *vm, uint64_t *samples, uint32_t num_samples)
+{
+    uint32_t i;
+
+    if (!vm->profile) {
+        return -1;
+    }
+
+    for (i = 0; i < num_samples && i < vm->num_insts; i++) {
+        samples[i] = __atomic_load_n(&vm->profile[i], __ATOMIC_RELAXED);
+    }
+    return vm->num_insts;
+}
+
+int
+ubpf_profile_start(uint32_t hz)
+{
+#if defined(__linux__) && defined(__x86_64__)
+    struct sigaction action;
+    struct itimerval timer;
+
+    if (running || hz == 0 || hz > 1000000) {
+        return -1;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handle_sigprof;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &old_action) < 0) {
+        return -1;
+    }
+
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) < 0) {
+        sigaction(SIGPROF, &old_action, NULL);
+        return -1;
+    }
+
+    running = true;
+    return 0;
+#else
+    (void)hz;
+    return -1;
+#endif
+}
+
+void
+ubpf_profile_stop(void)
+{
+    struct itimerval timer;
+
+    if (!running) {
+        return;
+    }
+
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &old_action, NULL);
+    running = false;
+}
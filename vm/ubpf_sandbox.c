@@ -0,0 +1,376 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Guard-region sandbox for jitted code
+ *
+ * A sandboxed VM owns a 4 GiB window of address space, aligned to 4 GiB
+ * and surrounded by guard regions larger than any instruction offset.
+ * Everything in it is inaccessible except the eBPF stacks and buffers
+ * handed out by ubpf_sandbox_alloc, each of which ends at a page boundary
+ * followed by inaccessible pages.
+ *
+ * The JIT replaces the upper 32 bits of every address with those of the
+ * window, so an access lands either where the program meant it to go or
+ * somewhere in the window, and never outside it. Accesses that hit an
+ * inaccessible page raise SIGSEGV, which the handler below turns into a
+ * jump to an error exit in the jitted code.
+ *
+ * A masked window is smaller, aligned to its own size and accessible as a
+ * whole, plus one page after it for accesses that start near its end. The
+ * JIT masks complete addresses into it, so nothing ever faults and
+ * allocations need no gaps.
+ *
+ * There is a stack for every stats shard index, evenly spaced, so that
+ * jitted code finds the one of its thread from the thread-local index.
+ * Threads on the shared index take turns on the last stack: they claim it
+ * in ubpf_sandbox_enter and the jitted code releases it on exit.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "ubpf_int.h"
+
+#define WINDOW_SIZE (1ULL << 32)
+/* Larger than the reach of a 16-bit instruction offset */
+#define GUARD_SIZE (64 * 1024)
+/* Inaccessible gap between allocations */
+#define ALLOC_GAP (64 * 1024)
+
+#define MAX_SANDBOXED_VMS 64
+
+static struct ubpf_vm *sandboxed_vms[MAX_SANDBOXED_VMS];
+static struct sigaction old_action;
+
+enum handler_state {
+    HANDLER_NONE,
+    HANDLER_INSTALLING, /* claimed by the thread calling sigaction */
+    HANDLER_INSTALLED,
+};
+
+static int handler_state;
+
+#if defined(__linux__) && defined(__x86_64__)
+
+static void
+handle_sigsegv(int sig, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = context;
+    uintptr_t ip = uc->uc_mcontext.gregs[REG_RIP];
+    uintptr_t addr = (uintptr_t)info->si_addr;
+    int i;
+
+    for (i = 0; i < MAX_SANDBOXED_VMS; i++) {
+        struct ubpf_vm *vm = __atomic_load_n(&sandboxed_vms[i], __ATOMIC_ACQUIRE);
+        if (!vm || !vm->sandbox) {
+            continue;
+        }
+
+        uintptr_t reservation = (uintptr_t)vm->sandbox->reservation;
+        if (addr < reservation || addr >= reservation + vm->sandbox->reservation_size) {
+            continue;
+        }
+
+        int pc = ubpf_jitted_pc(vm, ip);
+        if (pc < 0) {
+            continue;
+        }
+
+        /* Resume at the fault exit, which takes the PC in RCX and the address in RDX */
+        uc->uc_mcontext.gregs[REG_RIP] = (uintptr_t)vm->jitted + vm->sandbox_fault_loc;
+        uc->uc_mcontext.gregs[REG_RCX] = pc;
+        uc->uc_mcontext.gregs[REG_RDX] = addr;
+        return;
+    }
+
+    /* Not a sandbox fault */
+    if (old_action.sa_flags & SA_SIGINFO) {
+        old_action.sa_sigaction(sig, info, context);
+    } else if (old_action.sa_handler != SIG_DFL && old_action.sa_handler != SIG_IGN) {
+        old_action.sa_handler(sig);
+    } else {
+        /* Let the access fault again without us */
+        sigaction(SIGSEGV, &old_action, NULL);
+    }
+}
+
+/*
+ * Install the handler once. Only the thread that claims the installation
+ * calls sigaction, since a second call would save our own handler as the
+ * previous one, and faults outside sandboxes would recurse into it.
+ */
+static int
+install_handler(void)
+{
+    struct sigaction action;
+    int state = HANDLER_NONE;
+
+    while (!__atomic_compare_exchange_n(&handler_state, &state, HANDLER_INSTALLING, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        if (state == HANDLER_INSTALLED) {
+            return 0;
+        }
+        /* Another thread is installing it, or failed to and we try again */
+        state = HANDLER_NONE;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handle_sigsegv;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &old_action) < 0) {
+        __atomic_store_n(&handler_state, HANDLER_NONE, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    __atomic_store_n(&handler_state, HANDLER_INSTALLED, __ATOMIC_RELEASE);
+    return 0;
+}
+
+#else
+
+static int
+install_handler(void)
+{
+    return -1;
+}
+
+#endif
+
+/* Make 'size' bytes accessible, ending at a page boundary, and return them */
+static void *
+sandbox_alloc(struct ubpf_sandbox *sandbox, size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t rounded = (size + 7) & ~(size_t)7;
+    size_t pages = (rounded + page_size - 1) & ~(page_size - 1);
+    size_t window_size = sandbox->mask ? sandbox->mask + 1 : WINDOW_SIZE;
+    size_t gap = sandbox->mask ? 0 : ALLOC_GAP;
+
+    if (pages == 0) {
+        pages = page_size;
+    }
+    if (sandbox->next + pages + gap > window_size) {
+        return NULL;
+    }
+
+    uint8_t *start = sandbox->base + sandbox->next;
+    if (!sandbox->mask && mprotect(start, pages, PROT_READ | PROT_WRITE) < 0) {
+        return NULL;
+    }
+    sandbox->next += pages + gap;
+    return start + pages - rounded;
+}
+
+/* Allocate a stack per stats shard index, 'stack_stride' bytes apart */
+static int
+alloc_stacks(struct ubpf_sandbox *sandbox)
+{
+    uint8_t *stack;
+    int i;
+
+    if (sandbox->mask) {
+        /* Nothing faults in a masked window, so the stacks can be adjacent */
+        sandbox->stacks = sandbox_alloc(sandbox, UBPF_STATS_SHARDS * UBPF_STACK_SIZE);
+        sandbox->stack_stride = UBPF_STACK_SIZE;
+        return sandbox->stacks ? 0 : -1;
+    }
+
+    /* Successive allocations of the same size are equally far apart */
+    for (i = 0; i < UBPF_STATS_SHARDS; i++) {
+        stack = sandbox_alloc(sandbox, UBPF_STACK_SIZE);
+        if (!stack) {
+            return -1;
+        }
+        if (i == 0) {
+            sandbox->stacks = stack;
+        } else if (i == 1) {
+            sandbox->stack_stride = stack - sandbox->stacks;
+        }
+    }
+    return 0;
+}
+
+/* Reserve a masked window of 'size' bytes, aligned to its size, and make it accessible */
+static int
+create_masked_window(struct ubpf_sandbox *sandbox, size_t size)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t reserved = 2 * size;
+    uint8_t *reservation;
+
+    reservation = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reservation == MAP_FAILED) {
+        return -1;
+    }
+
+    sandbox->base = (uint8_t *)(((uintptr_t)reservation + size - 1) & ~(uintptr_t)(size - 1));
+    sandbox->reservation = sandbox->base;
+    sandbox->reservation_size = size + page_size;
+    sandbox->mask = size - 1;
+    if (sandbox->base > reservation) {
+        munmap(reservation, sandbox->base - reservation);
+    }
+    munmap(sandbox->base + sandbox->reservation_size,
+           reservation + reserved - (sandbox->base + sandbox->reservation_size));
+
+    if (mprotect(sandbox->base, sandbox->reservation_size, PROT_READ | PROT_WRITE) < 0) {
+        munmap(sandbox->reservation, sandbox->reservation_size);
+        return -1;
+    }
+    return 0;
+}
+
+int
+ubpf_sandbox_create(struct ubpf_vm *vm, char **errmsg)
+{
+    struct ubpf_sandbox *sandbox;
+    size_t size = 2 * WINDOW_SIZE + 2 * GUARD_SIZE;
+    uint8_t *reservation;
+    int i;
+
+    if (vm->sandbox) {
+        return 0;
+    }
+
+    sandbox = calloc(1, sizeof(*sandbox));
+    if (!sandbox) {
+        *errmsg = ubpf_error("out of memory");
+        return -1;
+    }
+
+    if (vm->sandbox_window) {
+        if (create_masked_window(sandbox, vm->sandbox_window) < 0) {
+            *errmsg = ubpf_error("failed to reserve the sandbox: %s", strerror(errno));
+            free(sandbox);
+            return -1;
+        }
+        goto allocate_stacks;
+    }
+
+    if (install_handler() < 0) {
+        *errmsg = ubpf_error("sandboxing is not supported on this platform");
+        free(sandbox);
+        return -1;
+    }
+
+    reservation = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reservation == MAP_FAILED) {
+        *errmsg = ubpf_error("failed to reserve the sandbox: %s", strerror(errno));
+        free(sandbox);
+        return -1;
+    }
+
+    /* Keep an aligned window and its guard regions, release the rest */
+    sandbox->base = (uint8_t *)(((uintptr_t)reservation + GUARD_SIZE + WINDOW_SIZE - 1) & ~(WINDOW_SIZE - 1));
+    sandbox->reservation = sandbox->base - GUARD_SIZE;
+    sandbox->reservation_size = WINDOW_SIZE + 2 * GUARD_SIZE;
+    if (sandbox->reservation > reservation) {
+        munmap(reservation, sandbox->reservation - reservation);
+    }
+    munmap(sandbox->reservation + sandbox->reservation_size,
+           reservation + size - (sandbox->reservation + sandbox->reservation_size));
+
+    /* Nothing is mapped at offset 0, so null pointers fault */
+    sandbox->next = ALLOC_GAP;
+
+allocate_stacks:
+    if (alloc_stacks(sandbox) < 0) {
+        *errmsg = ubpf_error("failed to allocate the sandbox stacks");
+        munmap(sandbox->reservation, sandbox->reservation_size);
+        free(sandbox);
+        return -1;
+    }
+
+    vm->sandbox = sandbox;
+    for (i = 0; i < MAX_SANDBOXED_VMS; i++) {
+        struct ubpf_vm *expected = NULL;
+        if (__atomic_compare_exchange_n(&sandboxed_vms[i], &expected, vm, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+    }
+
+    *errmsg = ubpf_error("too many sandboxed VMs (max %d)", MAX_SANDBOXED_VMS);
+    ubpf_sandbox_destroy(vm);
+    return -1;
+}
+
+void
+ubpf_sandbox_destroy(struct ubpf_vm *vm)
+{
+    int i;
+
+    for (i = 0; i < MAX_SANDBOXED_VMS; i++) {
+        struct ubpf_vm *expected = vm;
+        __atomic_compare_exchange_n(&sandboxed_vms[i], &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+
+    munmap(vm->sandbox->reservation, vm->sandbox->reservation_size);
+    free(vm->sandbox);
+    vm->sandbox = NULL;
+}
+
+/*
+ * Called by jitted code on entry when the thread has no stats shard index
+ * yet, or the shared one. Returns the top of the thread's stack, or NULL
+ * if another thread is running on the shared stack.
+ */
+uint8_t *
+ubpf_sandbox_enter(const struct ubpf_vm *vm)
+{
+    struct ubpf_sandbox *sandbox = vm->sandbox;
+    int index = ubpf_stats_shard_index();
+
+    if (index == UBPF_STATS_SHARED_SHARD && __atomic_exchange_n(&sandbox->shared_stack_busy, 1, __ATOMIC_ACQUIRE)) {
+        ubpf_report_sandbox_busy(vm);
+        return NULL;
+    }
+    return sandbox->stacks + index * sandbox->stack_stride + UBPF_STACK_SIZE;
+}
+
+void *
+ubpf_sandbox_alloc(struct ubpf_vm *vm, size_t size)
+{
+    char *errmsg;
+
+    if (!vm->sandboxed) {
+        return NULL;
+    }
+    if (!vm->sandbox && ubpf_sandbox_create(vm, &errmsg) < 0) {
+        free(errmsg);
+        return NULL;
+    }
+    return sandbox_alloc(vm->sandbox, size);
+}
+
+int
+ubpf_set_sandbox_window(struct ubpf_vm *vm, size_t size)
+{
+    if (vm->sandbox || size < (64 * 1024) || size > (1 << 30) || (size & (size - 1))) {
+        return -1;
+    }
+
+    vm->sandboxed = true;
+    vm->sandbox_window = size;
+    return 0;
+}
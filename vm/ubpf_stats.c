@@ -0,0 +1,355 @@
+/*
+ * Copyright 2015 Big Switch Networks, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Execution statistics
+ *
+ * Counters are split into cache-line sized shards. The first
+ * UBPF_STATS_SHARDS - 1 threads that run an instrumented program each own
+ * a shard, which they update with plain loads and stores. Any further
+ * threads share the last shard and update it with atomic adds, which are
+ * far slower on x86 even when uncontended. Shards are not reused when
+ * their thread exits.
+ *
+ * Reading the time stamp counter costs more than running a short program,
+ * so only one in every UBPF_STATS_TIMING_PERIOD executions on an owned
+ * shard is timed, picked by the shard's execution count, and the total is
+ * scaled up from those. Jitted code counts the untimed executions inline,
+ * finding its shard through the thread-local shard index.
+ *
+ * Latency histograms use the same shard index, with a separate array so
+ * that the small counters stay dense when histograms are disabled. They
+ * time every execution. Sandboxes pick the stack of a thread by it too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(_M_X64)
+#include <x86intrin.h>
+#endif
+#include "ubpf_int.h"
+
+#if defined(__linux__) && defined(__x86_64__)
+/* In the static TLS block, at the same offset from the thread pointer in every thread */
+static _Thread_local int thread_shard __attribute__((tls_model("initial-exec"))) = -1;
+#else
+static _Thread_local int thread_shard = -1;
+#endif
+static unsigned int next_shard;
+
+uint64_t
+ubpf_cycles(void)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static int
+shard_index(void)
+{
+    if (thread_shard < 0) {
+        unsigned int n = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED);
+        thread_shard = n < UBPF_STATS_SHARED_SHARD ? n : UBPF_STATS_SHARED_SHARD;
+    }
+    return thread_shard;
+}
+
+/* The calling thread's shard index, assigned on first use */
+int
+ubpf_stats_shard_index(void)
+{
+    return shard_index();
+}
+
+/* Offset of the thread's shard index from the thread pointer, for jitted code to read it through FS */
+bool
+ubpf_stats_shard_tls_offset(int32_t *offset)
+{
+#if defined(__linux__) && defined(__x86_64__)
+    uintptr_t tp;
+    intptr_t delta;
+
+    /* The first word of the thread control block points to itself */
+    __asm__("mov %%fs:0, %0" : "=r"(tp));
+    delta = (uintptr_t)&thread_shard - tp;
+    if (delta < INT32_MIN || delta > INT32_MAX) {
+        return false;
+    }
+    *offset = delta;
+    return true;
+#else
+    (void)offset;
+    return false;
+#endif
+}
+
+/* Add to a counter of the shared shard, or of one this thread owns, returning its old value */
+static uint64_t
+add(uint64_t *counter, uint64_t value, bool shared)
+{
+    uint64_t old;
+
+    if (shared) {
+        return __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+    }
+    old = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    __atomic_store_n(counter, old + value, __ATOMIC_RELAXED);
+    return old;
+}
+
+static int
+latency_bucket(uint64_t value)
+{
+    if (value < (1 << UBPF_LATENCY_SUB_BITS)) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (value >> (exponent - UBPF_LATENCY_SUB_BITS)) & ((1 << UBPF_LATENCY_SUB_BITS) - 1);
+    return ((exponent - UBPF_LATENCY_SUB_BITS + 1) << UBPF_LATENCY_SUB_BITS) + sub;
+}
+
+/* Largest value that falls in the bucket */
+static uint64_t
+latency_bucket_limit(int bucket)
+{
+    if (bucket < (1 << UBPF_LATENCY_SUB_BITS)) {
+        return bucket;
+    }
+    int exponent = (bucket >> UBPF_LATENCY_SUB_BITS) + UBPF_LATENCY_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << UBPF_LATENCY_SUB_BITS) - 1);
+    uint64_t width = 1ULL << (exponent - UBPF_LATENCY_SUB_BITS);
+    return (((1ULL << UBPF_LATENCY_SUB_BITS) + sub) << (exponent - UBPF_LATENCY_SUB_BITS)) + (width - 1);
+}
+
+static void
+record_latency(const struct ubpf_vm *vm, int index, uint64_t cycles)
+{
+    struct ubpf_latency_shard *l = &vm->latency[index];
+    struct ubpf_latency_histogram *hist = &l->hist;
+    bool shared = index == UBPF_STATS_SHARED_SHARD;
+    uint64_t max;
+
+    if (add(&l->runs, 1, shared) % vm->latency_sample_period != 0) {
+        return;
+    }
+
+    max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    add(&hist->count, 1, shared);
+    add(&hist->sum, cycles, shared);
+    add(&hist->buckets[latency_bucket(cycles)], 1, shared);
+    if (!shared) {
+        if (cycles > max) {
+            __atomic_store_n(&hist->max, cycles, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    while (cycles > max &&
+           !__atomic_compare_exchange_n(&hist->max, &max, cycles, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/* The time stamp counter if this execution is timed, else 0 */
+uint64_t
+ubpf_stats_start(const struct ubpf_vm *vm)
+{
+    int index = shard_index();
+
+    if (!vm->latency && index != UBPF_STATS_SHARED_SHARD &&
+            __atomic_load_n(&vm->stats[index].executions, __ATOMIC_RELAXED) % UBPF_STATS_TIMING_PERIOD != 0) {
+        return 0;
+    }
+    return ubpf_cycles();
+}
+
+void
+ubpf_stats_record(const struct ubpf_vm *vm, uint64_t start, uint64_t instructions, uint64_t helper_calls,
+                  enum ubpf_error_kind error)
+{
+    int index = shard_index();
+    bool shared = index == UBPF_STATS_SHARED_SHARD;
+    uint64_t cycles = start ? ubpf_cycles() - start : 0;
+
+    if (vm->latency) {
+        record_latency(vm, index, cycles);
+    }
+    if (!vm->stats) {
+        return;
+    }
+
+    struct ubpf_stats_shard *s = &vm->stats[index];
+
+    add(&s->executions, 1, shared);
+    add(&s->instructions, instructions, shared);
+    add(&s->helper_calls, helper_calls, shared);
+    if (start) {
+        add(&s->timed, 1, shared);
+        add(&s->cycles, cycles, shared);
+    }
+    if (error != UBPF_ERROR_NONE) {
+        add(&s->errors[error], 1, shared);
+    }
+}
+
+void
+ubpf_stats_jit_exit(const struct ubpf_vm *vm, uint64_t start, uint64_t helper_calls)
+{
+    ubpf_stats_record(vm, start, 0, helper_calls, UBPF_ERROR_NONE);
+}
+
+void
+ubpf_stats_jit_error(const struct ubpf_vm *vm, enum ubpf_error_kind error)
+{
+    int index = shard_index();
+
+    add(&vm->stats[index].errors[error], 1, index == UBPF_STATS_SHARED_SHARD);
+}
+
+int
+ubpf_enable_stats(struct ubpf_vm *vm)
+{
+    if (vm->stats) {
+        return 0;
+    }
+    if (vm->jitted) {
+        return -1;
+    }
+
+    vm->stats = aligned_alloc(_Alignof(struct ubpf_stats_shard), UBPF_STATS_SHARDS * sizeof(struct ubpf_stats_shard));
+    if (!vm->stats) {
+        return -1;
+    }
+    memset(vm->stats, 0, UBPF_STATS_SHARDS * sizeof(struct ubpf_stats_shard));
+    ubpf_select_interpreter(vm);
+    return 0;
+}
+
+int
+ubpf_get_stats(const struct ubpf_vm *vm, struct ubpf_stats *stats)
+{
+    uint64_t timed = 0, cycles = 0;
+    int i, j;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!vm->stats) {
+        return -1;
+    }
+
+    for (i = 0; i < UBPF_STATS_SHARDS; i++) {
+        struct ubpf_stats_shard *s = &vm->stats[i];
+        stats->executions += __atomic_load_n(&s->executions, __ATOMIC_RELAXED);
+        stats->instructions += __atomic_load_n(&s->instructions, __ATOMIC_RELAXED);
+        stats->helper_calls += __atomic_load_n(&s->helper_calls, __ATOMIC_RELAXED);
+        cycles += __atomic_load_n(&s->cycles, __ATOMIC_RELAXED);
+        timed += __atomic_load_n(&s->timed, __ATOMIC_RELAXED);
+        for (j = 0; j < UBPF_NUM_ERROR_KINDS; j++) {
+            stats->errors[j] += __atomic_load_n(&s->errors[j], __ATOMIC_RELAXED);
+        }
+    }
+
+    /* Scale the time of the timed executions up to all of them */
+    if (timed >= stats->executions) {
+        stats->cycles = cycles;
+    } else if (timed) {
+        stats->cycles = (double)cycles * stats->executions / timed;
+    }
+    return 0;
+}
+
+int
+ubpf_enable_latency_histogram(struct ubpf_vm *vm, uint32_t sample_period)
+{
+    if (vm->jitted || sample_period == 0) {
+        return -1;
+    }
+
+    if (!vm->latency) {
+        vm->latency = aligned_alloc(_Alignof(struct ubpf_latency_shard),
+                                    UBPF_STATS_SHARDS * sizeof(struct ubpf_latency_shard));
+        if (!vm->latency) {
+            return -1;
+        }
+        memset(vm->latency, 0, UBPF_STATS_SHARDS * sizeof(struct ubpf_latency_shard));
+    }
+    vm->latency_sample_period = sample_period;
+    ubpf_select_interpreter(vm);
+    return 0;
+}
+
+int
+ubpf_get_latency_histogram(const struct ubpf_vm *vm, struct ubpf_latency_histogram *hist)
+{
+    int i;
+
+    memset(hist, 0, sizeof(*hist));
+    if (!vm->latency) {
+        return -1;
+    }
+
+    for (i = 0; i < UBPF_STATS_SHARDS; i++) {
+        ubpf_latency_histogram_merge(hist, &vm->latency[i].hist);
+    }
+    return 0;
+}
+
+void
+ubpf_latency_histogram_merge(struct ubpf_latency_histogram *dst, const struct ubpf_latency_histogram *src)
+{
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    int i;
+
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    if (max > dst->max) {
+        dst->max = max;
+    }
+    for (i = 0; i < UBPF_LATENCY_BUCKETS; i++) {
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t
+ubpf_latency_percentile(const struct ubpf_latency_histogram *hist, double percentile)
+{
+    uint64_t rank, seen = 0;
+    int i;
+
+    if (hist->count == 0) {
+        return 0;
+    }
+
+    /* Rank of the sample at the percentile, counting from 1 */
+    rank = (uint64_t)ceil(percentile / 100 * hist->count);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (i = 0; i < UBPF_LATENCY_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t limit = latency_bucket_limit(i);
+            return limit < hist->max ? limit : hist->max;
+        }
+    }
+    return hist->max;
+}
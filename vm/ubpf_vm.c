@@ -21,18 +21,53 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <inttypes.h>
+#include <byteswap.h>
+#include <time.h>
 #include <sys/mman.h>
 #include "ubpf_int.h"
 
-#define MAX_EXT_FUNCS 64
 
 static bool validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_insts, char **errmsg);
-static bool bounds_check(const struct ubpf_vm *vm, void *addr, int size, const char *type, uint16_t cur_pc, void *mem, size_t mem_len, void *stack);
+static bool check_access(const struct ubpf_vm *vm, void *addr, int size, enum ubpf_error_kind kind, uint32_t cur_pc, void *mem, size_t mem_len, void *stack, const struct ubpf_packet_ctx *pkt, struct ubpf_error_info *error);
+
+/* Most recent runtime error on each thread, from the interpreter or jitted code */
+static _Thread_local struct ubpf_error_info last_error;
 
 bool ubpf_toggle_bounds_check(struct ubpf_vm *vm, bool enable)
 {
     bool old = vm->bounds_check_enabled;
     vm->bounds_check_enabled = enable;
+    ubpf_select_interpreter(vm);
+    return old;
+}
+
+bool ubpf_toggle_bounded_loops(struct ubpf_vm *vm, bool enable)
+{
+    bool old = vm->bounded_loops_required;
+    vm->bounded_loops_required = enable;
+    return old;
+}
+
+int ubpf_set_max_insts(struct ubpf_vm *vm, uint32_t max_insts)
+{
+    if (vm->insts || max_insts == 0) {
+        return -1;
+    }
+    vm->max_insts = max_insts;
+    return 0;
+}
+
+bool ubpf_toggle_packet_access(struct ubpf_vm *vm, bool enable)
+{
+    bool old = vm->packet_access;
+    vm->packet_access = enable;
+    return old;
+}
+
+bool ubpf_toggle_sandbox(struct ubpf_vm *vm, bool enable)
+{
+    bool old = vm->sandboxed;
+    vm->sandboxed = enable;
     return old;
 }
 
@@ -64,8 +99,11 @@ ubpf_create(void)
         return NULL;
     }
 
+    vm->max_insts = UBPF_MAX_INSTS;
     vm->bounds_check_enabled = true;
+    ubpf_select_interpreter(vm);
     vm->error_printf = fprintf;
+    vm->error_limit.per_second = UBPF_DEFAULT_ERROR_PRINT_LIMIT;
 
     vm->unwind_stack_extension_index = -1;
     return vm;
@@ -74,12 +112,30 @@ ubpf_create(void)
 void
 ubpf_destroy(struct ubpf_vm *vm)
 {
-    if (vm->jitted) {
+    if (vm->profile) {
+        ubpf_profile_unregister(vm);
+    }
+    if (vm->jitted && !vm->jitted_external) {
         munmap(vm->jitted, vm->jitted_size);
     }
+    if (vm->sandbox) {
+        ubpf_sandbox_destroy(vm);
+    }
+#ifdef UBPF_HAVE_LLVM
+    if (vm->llvm_jit) {
+        ubpf_destroy_llvm(vm);
+    }
+#endif
     free(vm->insts);
+    free(vm->loops);
     free(vm->ext_funcs);
     free(vm->ext_func_names);
+    free(vm->array_maps);
+    free(vm->stats);
+    free(vm->latency);
+    free(vm->jitted_ranges);
+    free(vm->profile);
+    free(vm->helper_sites);
     free(vm);
 }
 
@@ -92,6 +148,33 @@ ubpf_register(struct ubpf_vm *vm, unsigned int idx, const char *name, void *fn)
 
     vm->ext_funcs[idx] = (ext_func)fn;
     vm->ext_func_names[idx] = name;
+    if (vm->array_maps) {
+        vm->array_maps[idx].values = NULL;
+    }
+
+    return 0;
+}
+
+int
+ubpf_register_array_map(struct ubpf_vm *vm, unsigned int idx, const char *name, void *values,
+                        uint32_t value_size, uint32_t max_entries)
+{
+    if (vm->insts || idx >= MAX_EXT_FUNCS || !values || value_size == 0 || value_size > INT32_MAX) {
+        return -1;
+    }
+
+    if (!vm->array_maps) {
+        vm->array_maps = calloc(MAX_EXT_FUNCS, sizeof(*vm->array_maps));
+        if (!vm->array_maps) {
+            return -1;
+        }
+    }
+
+    vm->ext_funcs[idx] = NULL;
+    vm->ext_func_names[idx] = name;
+    vm->array_maps[idx].values = values;
+    vm->array_maps[idx].value_size = value_size;
+    vm->array_maps[idx].max_entries = max_entries;
 
     return 0;
 }
@@ -106,6 +189,66 @@ int ubpf_set_unwind_function_index(struct ubpf_vm *vm, unsigned int idx)
     return 0;
 }
 
+int
+ubpf_register_ctx_field(struct ubpf_vm *vm, uint16_t ctx_offset, uint8_t size, uint16_t native_offset)
+{
+    int i;
+
+    if (vm->insts || vm->num_ctx_fields == UBPF_MAX_CTX_FIELDS) {
+        return -1;
+    }
+    if ((size != 1 && size != 2 && size != 4 && size != 8) ||
+            ctx_offset > INT16_MAX - size || native_offset > INT16_MAX - size) {
+        return -1;
+    }
+    for (i = 0; i < vm->num_ctx_fields; i++) {
+        const struct ubpf_ctx_field *field = &vm->ctx_fields[i];
+        if (ctx_offset < field->ctx_offset + field->size && field->ctx_offset < ctx_offset + size) {
+            return -1;
+        }
+    }
+
+    vm->ctx_fields[vm->num_ctx_fields++] = (struct ubpf_ctx_field){
+        .ctx_offset = ctx_offset, .size = size, .native_offset = native_offset,
+    };
+    return 0;
+}
+
+int
+ubpf_set_jitted(struct ubpf_vm *vm, ubpf_jit_fn fn)
+{
+    if (vm->jitted) {
+        return -1;
+    }
+
+    vm->jitted = fn;
+    vm->jitted_size = 0;
+    vm->jitted_external = true;
+    return 0;
+}
+
+int
+ubpf_set_jit_tier(struct ubpf_vm *vm, enum ubpf_jit_tier tier)
+{
+    if (vm->jitted) {
+        return -1;
+    }
+
+    switch (tier) {
+    case UBPF_JIT_TIER_TEMPLATE:
+        break;
+#ifdef UBPF_HAVE_LLVM
+    case UBPF_JIT_TIER_LLVM:
+        break;
+#endif
+    default:
+        return -1;
+    }
+
+    vm->jit_tier = tier;
+    return 0;
+}
+
 unsigned int
 ubpf_lookup_registered_function(struct ubpf_vm *vm, const char *name)
 {
@@ -138,16 +281,69 @@ ubpf_load(struct ubpf_vm *vm, const void *code, uint32_t code_len, char **errmsg
         return -1;
     }
 
+    if (vm->packet_access) {
+        if (vm->num_ctx_fields > 0) {
+            *errmsg = ubpf_error("context fields cannot be used with packet access");
+            return -1;
+        }
+        if (ubpf_check_packet_access(code, code_len/8, errmsg) < 0) {
+            return -1;
+        }
+    }
+
+    if (ubpf_check_map_keys(vm, code, code_len/8, errmsg) < 0) {
+        return -1;
+    }
+
+    if (ubpf_find_loops(code, code_len/8, &vm->loops, &vm->num_loops) < 0) {
+        *errmsg = ubpf_error("out of memory");
+        return -1;
+    }
+
+    if (vm->bounded_loops_required) {
+        int i;
+        for (i = 0; i < vm->num_loops; i++) {
+            if (vm->loops[i].max_trips == UBPF_LOOP_UNBOUNDED) {
+                *errmsg = ubpf_error("unbounded loop at PC %u", vm->loops[i].latch);
+                goto error;
+            }
+        }
+    }
+
     vm->insts = malloc(code_len);
     if (vm->insts == NULL) {
         *errmsg = ubpf_error("out of memory");
-        return -1;
+        goto error;
     }
 
     memcpy(vm->insts, code, code_len);
+
+    if (vm->num_ctx_fields > 0 &&
+            ubpf_convert_ctx_access(vm, vm->insts, code_len/8, errmsg) < 0) {
+        free(vm->insts);
+        vm->insts = NULL;
+        goto error;
+    }
+
     vm->num_insts = code_len/sizeof(vm->insts[0]);
 
+#ifdef UBPF_HELPER_PROFILE
+    if (ubpf_helper_profile_init(vm) < 0) {
+        *errmsg = ubpf_error("out of memory");
+        free(vm->insts);
+        vm->insts = NULL;
+        vm->num_insts = 0;
+        goto error;
+    }
+#endif
+
     return 0;
+
+error:
+    free(vm->loops);
+    vm->loops = NULL;
+    vm->num_loops = 0;
+    return -1;
 }
 
 static uint32_t
@@ -156,17 +352,187 @@ u32(uint64_t x)
     return x;
 }
 
-int 
+/* MOVSX: the low 'bits' bits of x, sign-extended, or x itself for a plain MOV */
+static uint64_t
+sign_extend(uint64_t x, int16_t bits)
+{
+    switch (bits) {
+    case 8: return (int8_t)x;
+    case 16: return (int16_t)x;
+    case 32: return (int32_t)x;
+    default: return x;
+    }
+}
+
+/* Signed division and modulo by a nonzero divisor, wrapping like the JIT on INT_MIN / -1 */
+static uint64_t
+sdiv64(int64_t a, int64_t b)
+{
+    return b == -1 ? -(uint64_t)a : (uint64_t)(a / b);
+}
+
+static uint64_t
+smod64(int64_t a, int64_t b)
+{
+    return b == -1 ? 0 : (uint64_t)(a % b);
+}
+
+/* Address of the value for the 32-bit key at 'key', or 0 if it is out of range */
+static uint64_t
+array_map_lookup(const struct ubpf_array_map *map, uint64_t key)
+{
+    uint32_t index = *(uint32_t *)(uintptr_t)key;
+    if (index >= map->max_entries) {
+        return 0;
+    }
+    return (uintptr_t)(map->values + (size_t)index * map->value_size);
+}
+
+static void
+record_error(const struct ubpf_error_info *error)
+{
+    last_error = *error;
+}
+
+bool
+ubpf_take_last_error(struct ubpf_error_info *error)
+{
+    *error = last_error;
+    last_error.kind = UBPF_ERROR_NONE;
+    return error->kind != UBPF_ERROR_NONE;
+}
+
+/*
+ * Allow at most vm->error_print_limit messages per second. Racing threads
+ * may let a few more through, which is fine for log throttling.
+ */
+bool
+ubpf_error_print_allowed(const struct ubpf_vm *vm)
+{
+    /* The VM is heap allocated, so updating the counters through it is fine */
+    struct ubpf_error_limit *limit = (struct ubpf_error_limit *)&vm->error_limit;
+    struct timespec ts;
+
+    if (limit->per_second == 0) {
+        return false;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t second = ts.tv_sec;
+    if (__atomic_load_n(&limit->second, __ATOMIC_RELAXED) != second) {
+        __atomic_store_n(&limit->second, second, __ATOMIC_RELAXED);
+        __atomic_store_n(&limit->count, 0, __ATOMIC_RELAXED);
+    }
+    return __atomic_fetch_add(&limit->count, 1, __ATOMIC_RELAXED) < limit->per_second;
+}
+
+static void
+report_div_by_zero(const struct ubpf_vm *vm, uint32_t pc)
+{
+    struct ubpf_error_info error = { .kind = UBPF_ERROR_DIV_BY_ZERO, .pc = pc };
+
+    record_error(&error);
+    if (ubpf_error_print_allowed(vm)) {
+        vm->error_printf(stderr, "uBPF error: division by zero at PC %u\n", pc);
+    }
+}
+
+void
+ubpf_report_div_by_zero(const struct ubpf_vm *vm, uint32_t pc)
+{
+    report_div_by_zero(vm, pc);
+    if (vm->stats) {
+        ubpf_stats_jit_error(vm, UBPF_ERROR_DIV_BY_ZERO);
+    }
+}
+
+static int
+div_by_zero(const struct ubpf_vm *vm, uint32_t pc, struct ubpf_error_info *error)
+{
+    report_div_by_zero(vm, pc);
+    *error = last_error;
+    return -1;
+}
+
+/* Called by jitted code after the SIGSEGV handler found an access to an inaccessible part of the sandbox */
+void
+ubpf_report_sandbox_fault(const struct ubpf_vm *vm, uint32_t pc, uint64_t addr)
+{
+    static const int sizes[] = { [EBPF_SIZE_W >> 3] = 4, [EBPF_SIZE_H >> 3] = 2, [EBPF_SIZE_B >> 3] = 1, [EBPF_SIZE_DW >> 3] = 8 };
+    struct ebpf_inst inst = vm->insts[pc];
+    int cls = inst.opcode & EBPF_CLS_MASK;
+    struct ubpf_error_info error = {
+        .kind = cls == EBPF_CLS_ST || cls == EBPF_CLS_STX ? UBPF_ERROR_OUT_OF_BOUNDS_STORE : UBPF_ERROR_OUT_OF_BOUNDS_LOAD,
+        .pc = pc,
+        .addr = addr,
+        .size = sizes[(inst.opcode & EBPF_SIZE_MASK) >> 3],
+    };
+
+    record_error(&error);
+    if (vm->stats) {
+        ubpf_stats_jit_error(vm, error.kind);
+    }
+    if (ubpf_error_print_allowed(vm)) {
+        const char *type = error.kind == UBPF_ERROR_OUT_OF_BOUNDS_STORE ? "store" : "load";
+        vm->error_printf(stderr, "uBPF error: out of bounds memory %s at PC %u, addr %#"PRIx64", size %u\n",
+                         type, pc, addr, error.size);
+    }
+}
+
+/* Called by ubpf_sandbox_enter when another thread is running on the shared sandbox stack */
+void
+ubpf_report_sandbox_busy(const struct ubpf_vm *vm)
+{
+    struct ubpf_error_info error = { .kind = UBPF_ERROR_SANDBOX_BUSY };
+
+    record_error(&error);
+    if (vm->stats) {
+        ubpf_stats_jit_error(vm, error.kind);
+    }
+    if (ubpf_error_print_allowed(vm)) {
+        vm->error_printf(stderr, "uBPF error: another thread is running on the shared sandbox stack\n");
+    }
+}
+
+void
+ubpf_set_error_print_limit(struct ubpf_vm *vm, uint32_t per_second)
+{
+    vm->error_limit.per_second = per_second;
+}
+
+int
 ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t* bpf_return_value)
 {
-    uint16_t pc = 0;
+    return ubpf_exec_ex(vm, mem, mem_len, bpf_return_value, NULL);
+}
+
+/*
+ * The interpreter loop, specialized by the constant arguments of its
+ * callers below: 'checked' for bounds checks, and 'counting' for counting
+ * retired instructions and helper calls. Each variant carries no tests of
+ * the VM's settings in its loop.
+ */
+static inline __attribute__((always_inline)) int
+interpret(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t *bpf_return_value,
+          struct ubpf_error_info *error, struct ubpf_exec_counts *counts, bool checked, bool counting)
+{
+    uint32_t pc = 0;
     const struct ebpf_inst *insts = vm->insts;
     uint64_t reg[16];
     uint64_t stack[(UBPF_STACK_SIZE+7)/8];
+    uint64_t retired = 0, helper_calls = 0;
+    int rv;
 
-    if (!insts) {
-        /* Code must be loaded before we can execute */
-        return -1;
+    /*
+     * Proven by the loader in packet mode, checked anyway as defense in
+     * depth against a copy taken at entry, since the program can write to
+     * the context
+     */
+    struct ubpf_packet_ctx pkt_bounds;
+    const struct ubpf_packet_ctx *pkt = NULL;
+    if (vm->packet_access && mem_len >= sizeof(pkt_bounds)) {
+        memcpy(&pkt_bounds, mem, sizeof(pkt_bounds));
+        pkt = &pkt_bounds;
     }
 
     reg[1] = (uintptr_t)mem;
@@ -174,8 +540,11 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t* bpf_ret
     reg[10] = (uintptr_t)stack + sizeof(stack);
 
     while (1) {
-        const uint16_t cur_pc = pc;
+        const uint32_t cur_pc = pc;
         struct ebpf_inst inst = insts[pc++];
+        if (counting) {
+            retired++;
+        }
 
         switch (inst.opcode) {
         case EBPF_OP_ADD_IMM:
@@ -203,13 +572,26 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t* bpf_ret
             reg[inst.dst] &= UINT32_MAX;
             break;
         case EBPF_OP_DIV_IMM:
-            reg[inst.dst] = u32(reg[inst.dst]) / u32(inst.imm);
+            if (inst.offset == EBPF_OFFSET_SDIV) {
+                reg[inst.dst] = sdiv64((int32_t)reg[inst.dst], inst.imm);
+            } else {
+                reg[inst.dst] = u32(reg[inst.dst]) / u32(inst.imm);
+            }
             reg[inst.dst] &= UINT32_MAX;
             break;
         case EBPF_OP_DIV_REG:
+            if (inst.offset == EBPF_OFFSET_SDIV) {
+                if (u32(reg[inst.src]) == 0) {
+                    rv = div_by_zero(vm, cur_pc, error);
+                    goto out;
+                }
+                reg[inst.dst] = sdiv64((int32_t)reg[inst.dst], (int32_t)reg[inst.src]);
+                reg[inst.dst] &= UINT32_MAX;
+                break;
+            }
             if (reg[inst.src] == 0) {
-                vm->error_printf(stderr, "uBPF error: division by zero at PC %u\n", cur_pc);
-                return -1;
+                rv = div_by_zero(vm, cur_pc, error);
+                goto out;
             }
             reg[inst.dst] = u32(reg[inst.dst]) / u32(reg[inst.src]);
             reg[inst.dst] &= UINT32_MAX;
@@ -251,13 +633,26 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t* bpf_ret
             reg[inst.dst] &= UINT32_MAX;
             break;
         case EBPF_OP_MOD_IMM:
-            reg[inst.dst] = u32(reg[inst.dst]) % u32(inst.imm);
+            if (inst.offset == EBPF_OFFSET_SDIV) {
+                reg[inst.dst] = smod64((int32_t)reg[inst.dst], inst.imm);
+            } else {
+                reg[inst.dst] = u32(reg[inst.dst]) % u32(inst.imm);
+            }
             reg[inst.dst] &= UINT32_MAX;
             break;
         case EBPF_OP_MOD_REG:
+            if (inst.offset == EBPF_OFFSET_SDIV) {
+                if (u32(reg[inst.src]) == 0) {
+                    rv = div_by_zero(vm, cur_pc, error);
+                    goto out;
+                }
+                reg[inst.dst] = smod64((int32_t)reg[inst.dst], (int32_t)reg[inst.src]);
+                reg[inst.dst] &= UINT32_MAX;
+                break;
+            }
             if (reg[inst.src] == 0) {
-                vm->error_printf(stderr, "uBPF error: division by zero at PC %u\n", cur_pc);
-                return -1;
+                rv = div_by_zero(vm, cur_pc, error);
+                goto out;
             }
             reg[inst.dst] = u32(reg[inst.dst]) % u32(reg[inst.src]);
             break;
@@ -274,7 +669,7 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t* bpf_ret
             reg[inst.dst] &= UINT32_MAX;
             break;
         case EBPF_OP_MOV_REG:
-            reg[inst.dst] = reg[inst.src];
+            reg[inst.dst] = sign_extend(reg[inst.src], inst.offset);
             reg[inst.dst] &= UINT32_MAX;
             break;
         case EBPF_OP_ARSH_IMM:
@@ -325,14 +720,22 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t* bpf_ret
             reg[inst.dst] *= reg[inst.src];
             break;
         case EBPF_OP_DIV64_IMM:
-            reg[inst.dst] /= inst.imm;
+            if (inst.offset == EBPF_OFFSET_SDIV) {
+                reg[inst.dst] = sdiv64(reg[inst.dst], inst.imm);
+            } else {
+                reg[inst.dst] /= inst.imm;
+            }
             break;
         case EBPF_OP_DIV64_REG:
             if (reg[inst.src] == 0) {
-                vm->error_printf(stderr, "uBPF error: division by zero at PC %u\n", cur_pc);
-                return -1;
+                rv = div_by_zero(vm, cur_pc, error);
+                goto out;
+            }
+            if (inst.offset == EBPF_OFFSET_SDIV) {
+                reg[inst.dst] = sdiv64(reg[inst.dst], reg[inst.src]);
+            } else {
+                reg[inst.dst] /= reg[inst.src];
             }
-            reg[inst.dst] /= reg[inst.src];
             break;
         case EBPF_OP_OR64_IMM:
             reg[inst.dst] |= inst.imm;
@@ -362,14 +765,22 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t* bpf_ret
             reg[inst.dst] = -reg[inst.dst];
             break;
         case EBPF_OP_MOD64_IMM:
-            reg[inst.dst] %= inst.imm;
+            if (inst.offset == EBPF_OFFSET_SDIV) {
+                reg[inst.dst] = smod64(reg[inst.dst], inst.imm);
+            } else {
+                reg[inst.dst] %= inst.imm;
+            }
             break;
         case EBPF_OP_MOD64_REG:
             if (reg[inst.src] == 0) {
-                vm->error_printf(stderr, "uBPF error: division by zero at PC %u\n", cur_pc);
-                return -1;
+                rv = div_by_zero(vm, cur_pc, error);
+                goto out;
+            }
+            if (inst.offset == EBPF_OFFSET_SDIV) {
+                reg[inst.dst] = smod64(reg[inst.dst], reg[inst.src]);
+            } else {
+                reg[inst.dst] %= reg[inst.src];
             }
-            reg[inst.dst] %= reg[inst.src];
             break;
         case EBPF_OP_XOR64_IMM:
             reg[inst.dst] ^= inst.imm;
@@ -381,7 +792,7 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t* bpf_ret
             reg[inst.dst] = inst.imm;
             break;
         case EBPF_OP_MOV64_REG:
-            reg[inst.dst] = reg[inst.src];
+            reg[inst.dst] = sign_extend(reg[inst.src], inst.offset);
             break;
         case EBPF_OP_ARSH64_IMM:
             reg[inst.dst] = (int64_t)reg[inst.dst] >> inst.imm;
@@ -389,6 +800,15 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t* bpf_ret
         case EBPF_OP_ARSH64_REG:
             reg[inst.dst] = (int64_t)reg[inst.dst] >> reg[inst.src];
             break;
+        case EBPF_OP_BSWAP:
+            if (inst.imm == 16) {
+                reg[inst.dst] = bswap_16(reg[inst.dst]);
+            } else if (inst.imm == 32) {
+                reg[inst.dst] = bswap_32(reg[inst.dst]);
+            } else if (inst.imm == 64) {
+                reg[inst.dst] = bswap_64(reg[inst.dst]);
+            }
+            break;
 
         /*
          * HACK runtime bounds check
@@ -397,14 +817,16 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t* bpf_ret
          */
 #define BOUNDS_CHECK_LOAD(size) \
     do { \
-        if (!bounds_check(vm, (char *)reg[inst.src] + inst.offset, size, "load", cur_pc, mem, mem_len, stack)) { \
-            return -1; \
+        if (checked && !check_access(vm, (char *)reg[inst.src] + inst.offset, size, UBPF_ERROR_OUT_OF_BOUNDS_LOAD, cur_pc, mem, mem_len, stack, pkt, error)) { \
+            rv = -1; \
+            goto out; \
         } \
     } while (0)
 #define BOUNDS_CHECK_STORE(size) \
     do { \
-        if (!bounds_check(vm, (char *)reg[inst.dst] + inst.offset, size, "store", cur_pc, mem, mem_len, stack)) { \
-            return -1; \
+        if (checked && !check_access(vm, (char *)reg[inst.dst] + inst.offset, size, UBPF_ERROR_OUT_OF_BOUNDS_STORE, cur_pc, mem, mem_len, stack, pkt, error)) { \
+            rv = -1; \
+            goto out; \
         } \
     } while (0)
 
@@ -424,6 +846,18 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t* bpf_ret
             BOUNDS_CHECK_LOAD(8);
             reg[inst.dst] = *(uint64_t *)(uintptr_t)(reg[inst.src] + inst.offset);
             break;
+        case EBPF_OP_LDXSW:
+            BOUNDS_CHECK_LOAD(4);
+            reg[inst.dst] = *(int32_t *)(uintptr_t)(reg[inst.src] + inst.offset);
+            break;
+        case EBPF_OP_LDXSH:
+            BOUNDS_CHECK_LOAD(2);
+            reg[inst.dst] = *(int16_t *)(uintptr_t)(reg[inst.src] + inst.offset);
+            break;
+        case EBPF_OP_LDXSB:
+            BOUNDS_CHECK_LOAD(1);
+            reg[inst.dst] = *(int8_t *)(uintptr_t)(reg[inst.src] + inst.offset);
+            break;
 
         case EBPF_OP_STW:
             BOUNDS_CHECK_STORE(4);
@@ -466,6 +900,9 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t* bpf_ret
         case EBPF_OP_JA:
             pc += inst.offset;
             break;
+        case EBPF_OP_JA32:
+            pc += inst.imm;
+            break;
         case EBPF_OP_JEQ_IMM:
             if (reg[inst.dst] == inst.imm) {
                 pc += inst.offset;
@@ -576,26 +1013,217 @@ ubpf_exec(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t* bpf_ret
                 pc += inst.offset;
             }
             break;
+        case EBPF_OP_JEQ32_IMM:
+            if ((uint32_t)reg[inst.dst] == (uint32_t)inst.imm) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JEQ32_REG:
+            if ((uint32_t)reg[inst.dst] == (uint32_t)reg[inst.src]) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JGT32_IMM:
+            if ((uint32_t)reg[inst.dst] > (uint32_t)inst.imm) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JGT32_REG:
+            if ((uint32_t)reg[inst.dst] > (uint32_t)reg[inst.src]) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JGE32_IMM:
+            if ((uint32_t)reg[inst.dst] >= (uint32_t)inst.imm) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JGE32_REG:
+            if ((uint32_t)reg[inst.dst] >= (uint32_t)reg[inst.src]) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JLT32_IMM:
+            if ((uint32_t)reg[inst.dst] < (uint32_t)inst.imm) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JLT32_REG:
+            if ((uint32_t)reg[inst.dst] < (uint32_t)reg[inst.src]) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JLE32_IMM:
+            if ((uint32_t)reg[inst.dst] <= (uint32_t)inst.imm) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JLE32_REG:
+            if ((uint32_t)reg[inst.dst] <= (uint32_t)reg[inst.src]) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JSET32_IMM:
+            if ((uint32_t)reg[inst.dst] & (uint32_t)inst.imm) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JSET32_REG:
+            if ((uint32_t)reg[inst.dst] & (uint32_t)reg[inst.src]) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JNE32_IMM:
+            if ((uint32_t)reg[inst.dst] != (uint32_t)inst.imm) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JNE32_REG:
+            if ((uint32_t)reg[inst.dst] != (uint32_t)reg[inst.src]) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JSGT32_IMM:
+            if ((int32_t)reg[inst.dst] > inst.imm) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JSGT32_REG:
+            if ((int32_t)reg[inst.dst] > (int32_t)reg[inst.src]) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JSGE32_IMM:
+            if ((int32_t)reg[inst.dst] >= inst.imm) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JSGE32_REG:
+            if ((int32_t)reg[inst.dst] >= (int32_t)reg[inst.src]) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JSLT32_IMM:
+            if ((int32_t)reg[inst.dst] < inst.imm) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JSLT32_REG:
+            if ((int32_t)reg[inst.dst] < (int32_t)reg[inst.src]) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JSLE32_IMM:
+            if ((int32_t)reg[inst.dst] <= inst.imm) {
+                pc += inst.offset;
+            }
+            break;
+        case EBPF_OP_JSLE32_REG:
+            if ((int32_t)reg[inst.dst] <= (int32_t)reg[inst.src]) {
+                pc += inst.offset;
+            }
+            break;
         case EBPF_OP_EXIT:
             *bpf_return_value = reg[0];
-            return 0;
+            rv = 0;
+            goto out;
         case EBPF_OP_CALL:
+            if (vm->array_maps && vm->array_maps[inst.imm].values) {
+                if (checked && !check_access(vm, (char *)reg[2], 4, UBPF_ERROR_OUT_OF_BOUNDS_LOAD, cur_pc, mem, mem_len, stack, pkt, error)) {
+                    rv = -1;
+                    goto out;
+                }
+                reg[0] = array_map_lookup(&vm->array_maps[inst.imm], reg[2]);
+                break;
+            }
+#ifdef UBPF_HELPER_PROFILE
+            reg[0] = ubpf_profile_helper(reg[1], reg[2], reg[3], reg[4], reg[5], &vm->helper_sites[cur_pc]);
+#else
             reg[0] = vm->ext_funcs[inst.imm](reg[1], reg[2], reg[3], reg[4], reg[5]);
+#endif
+            if (counting) {
+                helper_calls++;
+            }
             // Unwind the stack if unwind extension returns success.
             if (inst.imm == vm->unwind_stack_extension_index && reg[0] == 0) {
                 *bpf_return_value = reg[0];
-                return 0;
+                rv = 0;
+                goto out;
             }
             break;
         }
     }
+
+out:
+    if (counting) {
+        counts->instructions = retired;
+        counts->helper_calls = helper_calls;
+    }
+    return rv;
+}
+
+#define INTERPRETER(name, checked, counting) \
+    static int \
+    name(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t *bpf_return_value, \
+         struct ubpf_error_info *error, struct ubpf_exec_counts *counts) \
+    { \
+        return interpret(vm, mem, mem_len, bpf_return_value, error, counts, checked, counting); \
+    }
+
+INTERPRETER(interpret_checked, true, false)
+INTERPRETER(interpret_unchecked, false, false)
+INTERPRETER(interpret_checked_counting, true, true)
+INTERPRETER(interpret_unchecked_counting, false, true)
+
+/* Pick the interpreter loop for the VM's current settings */
+void
+ubpf_select_interpreter(struct ubpf_vm *vm)
+{
+    if (ubpf_instrumented(vm)) {
+        vm->interpret = vm->bounds_check_enabled ? interpret_checked_counting : interpret_unchecked_counting;
+    } else {
+        vm->interpret = vm->bounds_check_enabled ? interpret_checked : interpret_unchecked;
+    }
+}
+
+int
+ubpf_exec_ex(const struct ubpf_vm *vm, void *mem, size_t mem_len, uint64_t *bpf_return_value,
+             struct ubpf_error_info *error)
+{
+    struct ubpf_error_info local_error;
+    struct ubpf_exec_counts counts = { 0 };
+    uint64_t start = 0;
+    int rv;
+
+    if (!error) {
+        error = &local_error;
+    }
+    error->kind = UBPF_ERROR_NONE;
+
+    if (ubpf_instrumented(vm)) {
+        start = ubpf_stats_start(vm);
+    }
+
+    if (!vm->insts) {
+        /* Code must be loaded before we can execute */
+        error->kind = UBPF_ERROR_NO_CODE;
+        record_error(error);
+        rv = -1;
+    } else {
+        rv = vm->interpret(vm, mem, mem_len, bpf_return_value, error, &counts);
+    }
+
+    if (ubpf_instrumented(vm)) {
+        ubpf_stats_record(vm, start, counts.instructions, counts.helper_calls, error->kind);
+    }
+    return rv;
 }
 
 static bool
 validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_insts, char **errmsg)
 {
-    if (num_insts >= UBPF_MAX_INSTS) {
-        *errmsg = ubpf_error("too many instructions (max %u)", UBPF_MAX_INSTS);
+    if (num_insts >= vm->max_insts) {
+        *errmsg = ubpf_error("too many instructions (max %u)", vm->max_insts);
         return false;
     }
 
@@ -611,7 +1239,6 @@ validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_i
         case EBPF_OP_SUB_REG:
         case EBPF_OP_MUL_IMM:
         case EBPF_OP_MUL_REG:
-        case EBPF_OP_DIV_REG:
         case EBPF_OP_OR_IMM:
         case EBPF_OP_OR_REG:
         case EBPF_OP_AND_IMM:
@@ -621,17 +1248,35 @@ validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_i
         case EBPF_OP_RSH_IMM:
         case EBPF_OP_RSH_REG:
         case EBPF_OP_NEG:
-        case EBPF_OP_MOD_REG:
         case EBPF_OP_XOR_IMM:
         case EBPF_OP_XOR_REG:
         case EBPF_OP_MOV_IMM:
-        case EBPF_OP_MOV_REG:
         case EBPF_OP_ARSH_IMM:
         case EBPF_OP_ARSH_REG:
             break;
 
+        case EBPF_OP_MOV_REG:
+        case EBPF_OP_MOV64_REG:
+            if (inst.offset != 0 && inst.offset != 8 && inst.offset != 16 &&
+                    !(inst.offset == 32 && inst.opcode == EBPF_OP_MOV64_REG)) {
+                *errmsg = ubpf_error("invalid movsx offset at PC %d", i);
+                return false;
+            }
+            break;
+
+        case EBPF_OP_DIV_REG:
+        case EBPF_OP_MOD_REG:
+        case EBPF_OP_DIV64_REG:
+        case EBPF_OP_MOD64_REG:
+            if (inst.offset != 0 && inst.offset != EBPF_OFFSET_SDIV) {
+                *errmsg = ubpf_error("invalid division offset at PC %d", i);
+                return false;
+            }
+            break;
+
         case EBPF_OP_LE:
         case EBPF_OP_BE:
+        case EBPF_OP_BSWAP:
             if (inst.imm != 16 && inst.imm != 32 && inst.imm != 64) {
                 *errmsg = ubpf_error("invalid endian immediate at PC %d", i);
                 return false;
@@ -644,7 +1289,6 @@ validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_i
         case EBPF_OP_SUB64_REG:
         case EBPF_OP_MUL64_IMM:
         case EBPF_OP_MUL64_REG:
-        case EBPF_OP_DIV64_REG:
         case EBPF_OP_OR64_IMM:
         case EBPF_OP_OR64_REG:
         case EBPF_OP_AND64_IMM:
@@ -654,11 +1298,9 @@ validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_i
         case EBPF_OP_RSH64_IMM:
         case EBPF_OP_RSH64_REG:
         case EBPF_OP_NEG64:
-        case EBPF_OP_MOD64_REG:
         case EBPF_OP_XOR64_IMM:
         case EBPF_OP_XOR64_REG:
         case EBPF_OP_MOV64_IMM:
-        case EBPF_OP_MOV64_REG:
         case EBPF_OP_ARSH64_IMM:
         case EBPF_OP_ARSH64_REG:
             break;
@@ -667,6 +1309,9 @@ validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_i
         case EBPF_OP_LDXH:
         case EBPF_OP_LDXB:
         case EBPF_OP_LDXDW:
+        case EBPF_OP_LDXSW:
+        case EBPF_OP_LDXSH:
+        case EBPF_OP_LDXSB:
             break;
 
         case EBPF_OP_STW:
@@ -689,6 +1334,7 @@ validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_i
             break;
 
         case EBPF_OP_JA:
+        case EBPF_OP_JA32:
         case EBPF_OP_JEQ_REG:
         case EBPF_OP_JEQ_IMM:
         case EBPF_OP_JGT_REG:
@@ -711,11 +1357,33 @@ validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_i
         case EBPF_OP_JSLT_REG:
         case EBPF_OP_JSLE_IMM:
         case EBPF_OP_JSLE_REG:
-            if (inst.offset == -1) {
+        case EBPF_OP_JEQ32_REG:
+        case EBPF_OP_JEQ32_IMM:
+        case EBPF_OP_JGT32_REG:
+        case EBPF_OP_JGT32_IMM:
+        case EBPF_OP_JGE32_REG:
+        case EBPF_OP_JGE32_IMM:
+        case EBPF_OP_JLT32_REG:
+        case EBPF_OP_JLT32_IMM:
+        case EBPF_OP_JLE32_REG:
+        case EBPF_OP_JLE32_IMM:
+        case EBPF_OP_JSET32_REG:
+        case EBPF_OP_JSET32_IMM:
+        case EBPF_OP_JNE32_REG:
+        case EBPF_OP_JNE32_IMM:
+        case EBPF_OP_JSGT32_REG:
+        case EBPF_OP_JSGT32_IMM:
+        case EBPF_OP_JSGE32_REG:
+        case EBPF_OP_JSGE32_IMM:
+        case EBPF_OP_JSLT32_REG:
+        case EBPF_OP_JSLT32_IMM:
+        case EBPF_OP_JSLE32_REG:
+        case EBPF_OP_JSLE32_IMM:
+            if (ebpf_jump_offset(inst) == -1) {
                 *errmsg = ubpf_error("infinite loop at PC %d", i);
                 return false;
             }
-            int new_pc = i + 1 + inst.offset;
+            int64_t new_pc = (int64_t)i + 1 + ebpf_jump_offset(inst);
             if (new_pc < 0 || new_pc >= num_insts) {
                 *errmsg = ubpf_error("jump out of bounds at PC %d", i);
                 return false;
@@ -730,7 +1398,7 @@ validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_i
                 *errmsg = ubpf_error("invalid call immediate at PC %d", i);
                 return false;
             }
-            if (!vm->ext_funcs[inst.imm]) {
+            if (!vm->ext_funcs[inst.imm] && !ubpf_array_map(vm, inst.imm)) {
                 *errmsg = ubpf_error("call to nonexistent function %u at PC %d", inst.imm, i);
                 return false;
             }
@@ -747,6 +1415,10 @@ validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_i
                 *errmsg = ubpf_error("division by zero at PC %d", i);
                 return false;
             }
+            if (inst.offset != 0 && inst.offset != EBPF_OFFSET_SDIV) {
+                *errmsg = ubpf_error("invalid division offset at PC %d", i);
+                return false;
+            }
             break;
 
         default:
@@ -768,20 +1440,62 @@ validate(const struct ubpf_vm *vm, const struct ebpf_inst *insts, uint32_t num_i
     return true;
 }
 
-static bool
-bounds_check(const struct ubpf_vm *vm, void *addr, int size, const char *type, uint16_t cur_pc, void *mem, size_t mem_len, void *stack)
+bool
+ubpf_bounds_check(const struct ubpf_vm *vm, void *addr, int size, enum ubpf_error_kind kind, uint32_t cur_pc, void *mem, size_t mem_len, void *stack, const struct ubpf_packet_ctx *pkt, struct ubpf_error_info *error)
 {
     if (!vm->bounds_check_enabled)
         return true;
+    return check_access(vm, addr, size, kind, cur_pc, mem, mem_len, stack, pkt, error);
+}
+
+static __attribute__((noinline)) bool
+out_of_bounds(const struct ubpf_vm *vm, void *addr, int size, enum ubpf_error_kind kind, uint32_t cur_pc, void *mem, size_t mem_len, void *stack, struct ubpf_error_info *error)
+{
+    error->kind = kind;
+    error->pc = cur_pc;
+    error->addr = (uintptr_t)addr;
+    error->size = size;
+    record_error(error);
+    if (ubpf_error_print_allowed(vm)) {
+        const char *type = kind == UBPF_ERROR_OUT_OF_BOUNDS_STORE ? "store" : "load";
+        vm->error_printf(stderr, "uBPF error: out of bounds memory %s at PC %u, addr %p, size %d\nmem %p/%zd stack %p/%d\n", type, cur_pc, addr, size, mem, mem_len, stack, UBPF_STACK_SIZE);
+    }
+    return false;
+}
+
+/* Whether [addr, addr + size) lies within the values of one array map */
+static __attribute__((noinline)) bool
+array_map_access(const struct ubpf_vm *vm, void *addr, int size)
+{
+    int i;
+    for (i = 0; i < MAX_EXT_FUNCS; i++) {
+        const struct ubpf_array_map *map = &vm->array_maps[i];
+        uint8_t *end = map->values + (size_t)map->value_size * map->max_entries;
+        if (map->values && (uint8_t *)addr >= map->values && (uint8_t *)addr + size <= end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Inlined into the interpreter, with the error path out of line */
+static inline bool
+check_access(const struct ubpf_vm *vm, void *addr, int size, enum ubpf_error_kind kind, uint32_t cur_pc, void *mem, size_t mem_len, void *stack, const struct ubpf_packet_ctx *pkt, struct ubpf_error_info *error)
+{
     if (mem && (addr >= mem && ((char*)addr + size) <= ((char*)mem + mem_len))) {
         /* Context access */
         return true;
+    } else if (pkt && addr >= pkt->data_meta && ((char*)addr + size) <= (char*)pkt->data_end) {
+        /* Packet access */
+        return true;
     } else if (addr >= stack && ((char*)addr + size) <= ((char*)stack + UBPF_STACK_SIZE)) {
         /* Stack access */
         return true;
+    } else if (vm->array_maps && array_map_access(vm, addr, size)) {
+        /* Map value access */
+        return true;
     } else {
-        vm->error_printf(stderr, "uBPF error: out of bounds memory %s at PC %u, addr %p, size %d\nmem %p/%zd stack %p/%d\n", type, cur_pc, addr, size, mem, mem_len, stack, UBPF_STACK_SIZE);
-        return false;
+        return out_of_bounds(vm, addr, size, kind, cur_pc, mem, mem_len, stack, error);
     }
 }
 